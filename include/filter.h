@@ -0,0 +1,311 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifndef RBH_FILTER_H
+#define RBH_FILTER_H
+
+/** @file
+ * A few helpers shared by the filter matcher and the filter compiler
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+#include "robinhood/filter.h"
+#include "robinhood/statx.h"
+#include "robinhood/value.h"
+
+/*----------------------------------------------------------------------------*
+ |                                 integers                                   |
+ *----------------------------------------------------------------------------*/
+
+/* An integer of any type, split into a sign and a magnitude to be compared
+ * with integers of other types without overflowing
+ */
+struct integer {
+    bool negative;
+    uint64_t magnitude;
+};
+
+static inline struct integer
+integer_from_signed(int64_t value)
+{
+    if (value < 0)
+        return (struct integer){
+            .negative = true,
+            .magnitude = (uint64_t)0 - (uint64_t)value,
+        };
+
+    return (struct integer){
+        .magnitude = value,
+    };
+}
+
+static inline struct integer
+integer_from_unsigned(uint64_t value)
+{
+    return (struct integer){
+        .magnitude = value,
+    };
+}
+
+/**
+ * Convert a value to an integer
+ *
+ * @param value     the value to convert
+ * @param integer   where to store the conversion of \p value
+ *
+ * @return          true if \p value is an integer, false otherwise
+ */
+static inline bool
+integer_from_value(const struct rbh_value *value, struct integer *integer)
+{
+    switch (value->type) {
+    case RBH_VT_INT32:
+        *integer = integer_from_signed(value->int32);
+        return true;
+    case RBH_VT_UINT32:
+        *integer = integer_from_unsigned(value->uint32);
+        return true;
+    case RBH_VT_INT64:
+        *integer = integer_from_signed(value->int64);
+        return true;
+    case RBH_VT_UINT64:
+        *integer = integer_from_unsigned(value->uint64);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* The bits of an integer, as if it was a 64 bit two's complement integer */
+static inline uint64_t
+integer_bits(struct integer integer)
+{
+    return integer.negative ? (uint64_t)0 - integer.magnitude
+                            : integer.magnitude;
+}
+
+static inline int
+integer_compare(struct integer first, struct integer second)
+{
+    int result;
+
+    if (first.negative != second.negative)
+        return first.negative ? -1 : 1;
+
+    result = first.magnitude < second.magnitude ? -1
+           : first.magnitude > second.magnitude ? 1 : 0;
+    return first.negative ? -result : result;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  fields                                    |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Fetch the value of a statx field
+ *
+ * @param statxbuf  the statx buffer to fetch the field from
+ * @param field     the RBH_STATX_* field to fetch (exactly one)
+ * @param value     where to store the value of \p field
+ *
+ * Every field is represented as an integer, either a RBH_VT_UINT32, a
+ * RBH_VT_INT64 or a RBH_VT_UINT64.
+ */
+static inline void
+statx_field(const struct rbh_statx *statxbuf, uint32_t field,
+            struct rbh_value *value)
+{
+    switch (field) {
+    case RBH_STATX_TYPE:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_mode & S_IFMT;
+        break;
+    case RBH_STATX_MODE:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_mode & ~S_IFMT;
+        break;
+    case RBH_STATX_NLINK:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_nlink;
+        break;
+    case RBH_STATX_UID:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_uid;
+        break;
+    case RBH_STATX_GID:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_gid;
+        break;
+    case RBH_STATX_ATIME_SEC:
+        value->type = RBH_VT_INT64;
+        value->int64 = statxbuf->stx_atime.tv_sec;
+        break;
+    case RBH_STATX_MTIME_SEC:
+        value->type = RBH_VT_INT64;
+        value->int64 = statxbuf->stx_mtime.tv_sec;
+        break;
+    case RBH_STATX_CTIME_SEC:
+        value->type = RBH_VT_INT64;
+        value->int64 = statxbuf->stx_ctime.tv_sec;
+        break;
+    case RBH_STATX_BTIME_SEC:
+        value->type = RBH_VT_INT64;
+        value->int64 = statxbuf->stx_btime.tv_sec;
+        break;
+    case RBH_STATX_ATIME_NSEC:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_atime.tv_nsec;
+        break;
+    case RBH_STATX_MTIME_NSEC:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_mtime.tv_nsec;
+        break;
+    case RBH_STATX_CTIME_NSEC:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_ctime.tv_nsec;
+        break;
+    case RBH_STATX_BTIME_NSEC:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_btime.tv_nsec;
+        break;
+    case RBH_STATX_INO:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = statxbuf->stx_ino;
+        break;
+    case RBH_STATX_SIZE:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = statxbuf->stx_size;
+        break;
+    case RBH_STATX_BLOCKS:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = statxbuf->stx_blocks;
+        break;
+    case RBH_STATX_MNT_ID:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = statxbuf->stx_mnt_id;
+        break;
+    case RBH_STATX_BLKSIZE:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_blksize;
+        break;
+    case RBH_STATX_ATTRIBUTES:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = statxbuf->stx_attributes;
+        break;
+    case RBH_STATX_RDEV_MAJOR:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_rdev_major;
+        break;
+    case RBH_STATX_RDEV_MINOR:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_rdev_minor;
+        break;
+    case RBH_STATX_DEV_MAJOR:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_dev_major;
+        break;
+    case RBH_STATX_DEV_MINOR:
+        value->type = RBH_VT_UINT32;
+        value->uint32 = statxbuf->stx_dev_minor;
+        break;
+    default:
+        /* rbh_filter_validate() prevents this */
+        __builtin_unreachable();
+    }
+}
+
+/*----------------------------------------------------------------------------*
+ |                                operators                                   |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Compile a regex value
+ *
+ * @param regex     the regex to compile
+ * @param value     a RBH_VT_REGEX value
+ *
+ * @return          0 on success, -1 on error and errno is set appropriately
+ *
+ * @error ENOMEM    there was not enough memory available
+ * @error EINVAL    \p value is not a valid POSIX extended regex
+ */
+static inline int
+regex_compile(regex_t *regex, const struct rbh_value *value)
+{
+    int cflags = REG_EXTENDED | REG_NOSUB;
+    int rc;
+
+    assert(value->type == RBH_VT_REGEX);
+    if (value->regex.options & RBH_RO_CASE_INSENSITIVE)
+        cflags |= REG_ICASE;
+
+    rc = regcomp(regex, value->regex.string, cflags);
+    switch (rc) {
+    case 0:
+        return 0;
+    case REG_ESPACE:
+        errno = ENOMEM;
+        return -1;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+/* Whether the result of a comparison satisfies an ordering operator */
+static inline bool
+ordering_matches(enum rbh_filter_operator op, int result)
+{
+    switch (op) {
+    case RBH_FOP_EQUAL:
+        return result == 0;
+    case RBH_FOP_STRICTLY_LOWER:
+        return result < 0;
+    case RBH_FOP_LOWER_OR_EQUAL:
+        return result <= 0;
+    case RBH_FOP_STRICTLY_GREATER:
+        return result > 0;
+    case RBH_FOP_GREATER_OR_EQUAL:
+        return result >= 0;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+/* Whether the bits of an integer satisfy a bitwise operator */
+static inline bool
+bits_match(enum rbh_filter_operator op, uint64_t bits, uint64_t mask)
+{
+    switch (op) {
+    case RBH_FOP_BITS_ANY_SET:
+        return (bits & mask) != 0;
+    case RBH_FOP_BITS_ALL_SET:
+        return (bits & mask) == mask;
+    case RBH_FOP_BITS_ANY_CLEAR:
+        return (bits & mask) != mask;
+    case RBH_FOP_BITS_ALL_CLEAR:
+        return (bits & mask) == 0;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+/* The outcome of evaluating a filter against a partially known fsentry */
+enum match {
+    MATCH_FALSE,
+    MATCH_TRUE,
+    MATCH_UNKNOWN,
+};
+
+#endif
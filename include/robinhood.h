@@ -18,11 +18,13 @@
 #include "robinhood/plugin.h"
 #include "robinhood/plugins/backend.h"
 #include "robinhood/queue.h"
+#include "robinhood/report.h"
 #include "robinhood/ring.h"
 #include "robinhood/ringr.h"
 #include "robinhood/sstack.h"
 #include "robinhood/stack.h"
 #include "robinhood/statx.h"
+#include "robinhood/sync.h"
 #include "robinhood/uri.h"
 #include "robinhood/value.h"
 
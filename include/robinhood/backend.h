@@ -36,6 +36,7 @@
 #include "robinhood/fsentry.h"
 #include "robinhood/fsevent.h"
 #include "robinhood/iterator.h"
+#include "robinhood/report.h"
 
 /**
  * Calls to a backend's methods may set errno to \c RBH_BACKEND_ERROR if they
@@ -194,6 +195,11 @@ struct rbh_backend_operations {
             const struct rbh_filter *filter,
             const struct rbh_filter_options *options
             );
+    struct rbh_mut_iterator *(*report)(
+            void *backend,
+            const struct rbh_filter *filter,
+            const struct rbh_report *report
+            );
     int (*get_attribute)(
             void *backend,
             const char *attr_name,
@@ -489,6 +495,55 @@ rbh_backend_filter(struct rbh_backend *backend, const struct rbh_filter *filter,
     return backend->ops->filter(backend, filter, options);
 }
 
+/**
+ * Generic backend "report" operation
+ *
+ * This function is meant only to be called from rbh_backend_report() for
+ * backends that do not implement the report operation. It fetches the
+ * fsentries that match \p filter with rbh_backend_filter() (only projecting
+ * the fields \p report needs) and aggregates them client-side.
+ */
+struct rbh_mut_iterator *
+rbh_generic_backend_report(struct rbh_backend *backend,
+                           const struct rbh_filter *filter,
+                           const struct rbh_report *report);
+
+/**
+ * Aggregate the fsentries that match a set of criteria
+ *
+ * @param backend   the backend from which to aggregate fsentries
+ * @param filter    a set of criteria that the aggregated fsentries must match
+ * @param report    how to group and summarize fsentries (cf.
+ *                  robinhood/report.h)
+ *
+ * @return          an iterator over mutable struct rbh_report_row on success,
+ *                  NULL on error and errno is set appropriately
+ *
+ * @error EINVAL    \p report is invalid
+ * @error ENOMEM    there was not enough memory available
+ * @error ENOTSUP   \p backend supports neither reporting nor filtering
+ *                  fsentries
+ * @error EOVERFLOW the sum of a group does not fit in an int64_t
+ *
+ * Fsentries are counted as rbh_backend_filter() would return them: an inode
+ * with several links is aggregated once per link.
+ *
+ * Backends that can aggregate fsentries themselves save transferring and
+ * decoding every matching fsentry. The others fall back on
+ * rbh_generic_backend_report().
+ *
+ * This function may fail and set errno to any error number specifically
+ * documented by \p backend.
+ */
+static inline struct rbh_mut_iterator *
+rbh_backend_report(struct rbh_backend *backend, const struct rbh_filter *filter,
+                   const struct rbh_report *report)
+{
+    if (backend->ops->report == NULL)
+        return rbh_generic_backend_report(backend, filter, report);
+    return backend->ops->report(backend, filter, report);
+}
+
 /**
  * Retrieve specific attributes from a backend
  *
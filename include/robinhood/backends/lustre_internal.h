@@ -0,0 +1,158 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifndef RBH_LUSTRE_INTERNAL_H
+#define RBH_LUSTRE_INTERNAL_H
+
+/**
+ * @file
+ *
+ * Internal header which exposes the parts of the lustre backend that do not
+ * need a mounted Lustre filesystem, so that they can be tested on their own.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "robinhood/backend.h"
+#include "robinhood/itertools.h"
+#include "robinhood/sstack.h"
+#include "robinhood/value.h"
+
+/*----------------------------------------------------------------------------*
+ |                                   layout                                   |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * The maximum number of pairs lustre_layout_from_lov() fills
+ */
+#define LUSTRE_LAYOUT_MAX_PAIRS 13
+
+/**
+ * Decode a Lustre layout into namespace xattrs
+ *
+ * @param lov       the raw layout of an entry (the value of its "lustre.lov"
+ *                  xattr, or what LL_IOC_LOV_GETSTRIPE returns for a
+ *                  directory)
+ * @param size      the size of \p lov in bytes
+ * @param mode      the mode of the entry
+ * @param pairs     an array of at least LUSTRE_LAYOUT_MAX_PAIRS pairs to fill
+ * @param values    the stack where to allocate the values of \p pairs
+ *
+ * @return          the number of filled \p pairs on success, -1 on error and
+ *                  errno is set appropriately
+ *
+ * @error EINVAL    \p lov is truncated or otherwise malformed
+ * @error ENOTSUP   \p lov is a kind of layout this function does not decode
+ *                  (e.g. a foreign layout)
+ * @error ENOMEM    there was not enough memory available
+ *
+ * The pairs are the same as liblustreapi would yield: "flags", "magic" and
+ * "gen" (regular files only), "mirror_count" (composite layouts only), and one
+ * sequence per attribute of the components of the layout: "stripe_count",
+ * "stripe_size", "pattern", "comp_flags", "pool", "mirror_id", "begin" and
+ * "end" (the last 3 for composite layouts only), and "ost" (except for
+ * directories).
+ *
+ * Decoding a layout this way does not issue any request to the filesystem.
+ */
+int
+lustre_layout_from_lov(const void *lov, size_t size, uint16_t mode,
+                       struct rbh_value_pair *pairs,
+                       struct rbh_sstack *values);
+
+/*----------------------------------------------------------------------------*
+ |                                 changelog                                  |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Iterate over the records of a raw dump of a changelog
+ *
+ * @param dump      concatenated changelog records, as llapi_changelog_recv()
+ *                  returns them (with any extension they carry)
+ * @param size      the size of \p dump in bytes
+ *
+ * @return          an iterator of `const struct changelog_rec *' on success,
+ *                  NULL on error and errno is set appropriately
+ *
+ * @error ENOMEM    there was not enough memory available
+ *
+ * \p dump must remain valid until the returned iterator is destroyed. A record
+ * is valid until the next call to rbh_iter_next(). The iterator fails with
+ * EINVAL when it reaches a truncated record.
+ */
+struct rbh_iterator *
+lustre_changelog_dump_records(const void *dump, size_t size);
+
+/**
+ * Convert changelog records into partial fsevents
+ *
+ * @param records       an iterator of `const struct changelog_rec *'
+ * @param batch_size    the maximum number of records to convert at once
+ * @param consumed      where to store the index of the last record whose
+ *                      fsevents were all yielded (may be NULL)
+ *
+ * @return              an iterator of `const struct rbh_fsevent *' on success,
+ *                      NULL on error and errno is set appropriately
+ *
+ * @error EINVAL        \p batch_size is 0 or too big
+ * @error ENOMEM        there was not enough memory available
+ *
+ * The returned iterator takes ownership of \p records. Records are read by
+ * batches of \p batch_size: redundant fsevents of a batch are merged, and
+ * refreshing an entry that is deleted later in the batch is skipped.
+ */
+struct rbh_iterator *
+lustre_changelog_fsevents(struct rbh_iterator *records, size_t batch_size,
+                          uint64_t *consumed);
+
+/*----------------------------------------------------------------------------*
+ |                                   enrich                                   |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * The argument of rbh_backend_get_attribute() for the "lustre" attribute
+ */
+struct lustre_attribute_arg {
+    /** a file descriptor of the entry */
+    int fd;
+    /** the mode of the entry */
+    uint16_t mode;
+    /** the stack where to allocate the values of the attributes */
+    struct rbh_sstack *values;
+};
+
+/**
+ * The maximum number of pairs the "lustre" attribute fills
+ *
+ * That is: 2 for HSM, the layout, and 5 for MDT information.
+ */
+#define LUSTRE_ATTRIBUTE_MAX_PAIRS (2 + LUSTRE_LAYOUT_MAX_PAIRS + 5)
+
+/**
+ * Fetch the "lustre" attribute of fsentries with a pool of threads
+ *
+ * @param backend       the backend whose "lustre" attribute to fetch
+ * @param root          the root of \p backend
+ * @param fsentries     an iterator of `const struct rbh_fsentry *' to enrich
+ * @param nb_threads    the number of threads to fetch attributes with
+ *
+ * @return              an iterator of `struct rbh_fsevent *' on success (in
+ *                      which case it owns \p fsentries), NULL on error and
+ *                      errno is set appropriately
+ *
+ * @error EINVAL        \p nb_threads is 0
+ * @error ENOMEM        there was not enough memory available
+ *
+ * This is the implementation of rbh_lustre_enrich_new(), which does not
+ * depend on \p backend being a lustre backend.
+ */
+struct rbh_mut_iterator *
+lustre_enrich_new(struct rbh_backend *backend, const char *root,
+                  struct rbh_iterator *fsentries, size_t nb_threads);
+
+#endif
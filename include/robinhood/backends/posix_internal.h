@@ -16,6 +16,8 @@
  *
  * For now, the only available overload is through ns_xattrs_callback
  * posix_iterator field, which may add extended attributes to the namespace.
+ * The same callback must be registered in the posix_backend structure for
+ * walkers that do not rely on a posix_iterator (cf. posix_walker_new()).
  */
 
 #include <fts.h>
@@ -34,19 +36,67 @@ struct posix_iterator {
      * Callback for managing and filling namespace xattrs
      *
      * @param fd        file descriptor of the entry
+     * @param id        the ID of the entry if it was already computed, NULL
+     *                  otherwise
      * @param mode      mode of file examined
+     * @param requested the namespace xattrs to fill (NULL, or a map with a
+     *                  count of 0, means every xattr), the callback may skip
+     *                  the computation of those it is not asked for
+     * @param inode_xattrs          the inode xattrs of the entry if all of
+     *                              them were listed, NULL otherwise
+     * @param inode_xattrs_count    the number of pairs in \p inode_xattrs
      * @param pairs     list of rbh_value_pairs to fill
      * @param values    stack that will contain every rbh_value of
      *                  \p pairs
      *
      * @return          number of filled \p pairs
      */
-    int (*ns_xattrs_callback)(const int fd, const uint16_t mode,
+    int (*ns_xattrs_callback)(const int fd, const struct rbh_id *id,
+                              const uint16_t mode,
+                              const struct rbh_value_map *requested,
                               struct rbh_value_pair *inode_xattrs,
                               ssize_t *inode_xattrs_count,
                               struct rbh_value_pair *pairs,
                               struct rbh_sstack *values);
 
+    /**
+     * The fields to fill in the fsentries (NULL means every field)
+     *
+     * The iterator owns it (cf. posix_projection_clone()).
+     */
+    struct rbh_filter_projection *projection;
+
+    /**
+     * The filter fsentries must match (NULL means every fsentry matches)
+     *
+     * The iterator owns it.
+     */
+    struct rbh_filter_program *program;
+
+    /**
+     * The filter that selects the directories not to descend into (NULL
+     * means every directory is walked)
+     *
+     * The iterator owns it.
+     */
+    struct rbh_filter_program *prune;
+
+    /**
+     * The program posix_fsentry_new() may use to skip fetching fields of
+     * fsentries that do not match (either \c program, or NULL when \c prune
+     * needs those fields, cf. posix_prune_needs_lazy_fields())
+     */
+    const struct rbh_filter_program *early_program;
+
+    /** The depth of the directories not to descend into */
+    unsigned int max_depth;
+
+    /**
+     * Directories whose ctime is older than this are unchanged (0 means
+     * every directory changed, cf. RBH_PBO_UNCHANGED_BEFORE)
+     */
+    int64_t unchanged_before;
+
     int statx_sync_type;
     size_t prefix_len;
     FTS *fts_handle;
@@ -56,6 +106,373 @@ struct posix_iterator {
 struct posix_iterator *
 posix_iterator_new(const char *root, const char *entry, int statx_sync_type);
 
+/*----------------------------------------------------------------------------*
+ |                              posix_projection                              |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Make a standalone copy of a projection, widened to the fields a filter needs
+ *
+ * @param projection    the projection to copy
+ * @param filter        the filter the fsentries will be matched against (may
+ *                      be NULL)
+ * @param prune         the filter directories are pruned with (may be NULL)
+ *
+ * @return              a pointer to a newly allocated projection that does not
+ *                      share any data with \p projection and which must be
+ *                      released with free(), NULL on error and errno is set
+ *                      appropriately
+ *
+ * @error ENOMEM        there was not enough memory available
+ *
+ * If \p filter or \p prune read extended attributes, every extended attribute
+ * of the matching kind is fetched, regardless of the ones \p projection names.
+ */
+struct rbh_filter_projection *
+posix_projection_clone(const struct rbh_filter_projection *projection,
+                       const struct rbh_filter *filter,
+                       const struct rbh_filter *prune);
+
+/**
+ * Tell whether a prune filter reads fields that posix_fsentry_new() only
+ * fetches for fsentries that may match their filter
+ *
+ * @param prune         the filter directories are pruned with (may be NULL)
+ *
+ * @return              true if \p prune reads the ID, the symlink, or the
+ *                      extended attributes of fsentries, false otherwise
+ *
+ * When this is true, posix_fsentry_new() must not be given a program to skip
+ * fetching those fields, otherwise directories that do not match the filter
+ * could not be pruned reliably.
+ */
+bool
+posix_prune_needs_lazy_fields(const struct rbh_filter *prune);
+
+/**
+ * Compute the mask to use with rbh_statx() to fill the fsentries of a
+ * projection
+ *
+ * @param projection    the projection to fill (may be NULL)
+ *
+ * @return              the RBH_STATX_* fields to ask rbh_statx() for
+ *
+ * RBH_STATX_TYPE is always part of the mask, as walking a filesystem requires
+ * to know which entries are directories.
+ */
+uint32_t
+posix_projection_statx_mask(const struct rbh_filter_projection *projection);
+
+/*----------------------------------------------------------------------------*
+ |                               posix_fsentry                                |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Build an fsentry out of a file designated by a path relative to a directory
+ *
+ * @param dirfd                 file descriptor of the directory \p accpath is
+ *                              relative to (may be AT_FDCWD)
+ * @param accpath               path to use to open the file
+ * @param path                  value of the "path" namespace xattr
+ * @param name                  name of the fsentry
+ * @param parent_id             ID of the parent of the fsentry (may be NULL)
+ * @param id                    a pointer to the ID of the fsentry, if it is
+ *                              already known, to NULL otherwise
+ * @param statx_sync_type       the AT_RBH_STATX_* flag to use with rbh_statx()
+ * @param projection            the fields to fill in the fsentry (NULL means
+ *                              every field)
+ * @param program               the filter the fsentry is expected to match
+ *                              (may be NULL)
+ * @param ns_xattrs_callback    the callback used to add extended attributes
+ *                              to the namespace (may be NULL)
+ *
+ * @return                      a pointer to a newly allocated fsentry on
+ *                              success (in which case \p id points to the ID
+ *                              of the fsentry, which the caller must free),
+ *                              NULL on error and errno is set appropriately
+ *
+ * @error ESTALE    the file could not be opened, or its metadata could not be
+ *                  retrieved (an error message is printed on stderr)
+ * @error ENOMEM    there was not enough memory available
+ *
+ * Only the system calls needed to fill the fields of \p projection are made:
+ * symlinks are not read unless RBH_FP_SYMLINK is set, inode xattrs are not
+ * listed unless RBH_FP_INODE_XATTRS is set (and only the ones named in
+ * \p projection are fetched, if any), \p ns_xattrs_callback is not called
+ * unless RBH_FP_NAMESPACE_XATTRS is set, and so on. The ID of directories, the
+ * ID of the parent, the name, the type of the file and the "path" namespace
+ * xattr are always filled, as they are either cheap or required to walk a
+ * filesystem.
+ *
+ * When \p id points at NULL and the ID of the fsentry is not computed, it
+ * still points at NULL on return.
+ *
+ * \p program is tried as soon as the metadata of the file is known: if it
+ * already rules the fsentry out, none of the fields above that are only filled
+ * on demand are. The fsentry is returned nonetheless, so that directories can
+ * still be walked; it is up to the caller to match it against \p program and
+ * discard it.
+ *
+ * This function uses per-thread buffers which may be released with
+ * posix_free_thread_buffers().
+ */
+struct rbh_fsentry *
+posix_fsentry_new(int dirfd, const char *accpath, const char *path,
+                  const char *name, const struct rbh_id *parent_id,
+                  struct rbh_id **id, int statx_sync_type,
+                  const struct rbh_filter_projection *projection,
+                  const struct rbh_filter_program *program,
+                  int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                            const uint16_t,
+                                            const struct rbh_value_map *,
+                                            struct rbh_value_pair *,
+                                            ssize_t *,
+                                            struct rbh_value_pair *,
+                                            struct rbh_sstack *));
+
+/**
+ * Build an fsentry out of an open file descriptor
+ *
+ * @param fd                    a file descriptor of the file (it is not
+ *                              closed)
+ * @param statxbuf              the result of a call to rbh_statx() on \p fd if
+ *                              it was already made, NULL otherwise
+ *
+ * The other parameters, the return value and errors are the same as
+ * posix_fsentry_new()'s, except that \p path, \p name and \p parent_id may
+ * all be NULL for a file that was not reached through its parent (the fsentry
+ * then has no "path" namespace xattr, no name and no parent ID).
+ */
+struct rbh_fsentry *
+posix_fsentry_from_fd(int fd, const struct rbh_statx *statxbuf,
+                      const char *path, const char *name,
+                      const struct rbh_id *parent_id, struct rbh_id **id,
+                      int statx_sync_type,
+                      const struct rbh_filter_projection *projection,
+                      const struct rbh_filter_program *program,
+                      int (*ns_xattrs_callback)(const int,
+                                                const struct rbh_id *,
+                                                const uint16_t,
+                                                const struct rbh_value_map *,
+                                                struct rbh_value_pair *,
+                                                ssize_t *,
+                                                struct rbh_value_pair *,
+                                                struct rbh_sstack *));
+
+/**
+ * Tell whether the namespace of a directory did not change since a given time
+ *
+ * @param fsentry           the fsentry to check
+ * @param unchanged_before  the time of the previous scan (0 means none)
+ *
+ * @return                  true if \p fsentry is a directory whose ctime is
+ *                          older than \p unchanged_before, false otherwise
+ */
+bool
+posix_fsentry_is_unchanged(const struct rbh_fsentry *fsentry,
+                           int64_t unchanged_before);
+
+/**
+ * Add the RBH_NS_XATTR_UNCHANGED namespace xattr to an fsentry
+ *
+ * @param fsentry   the fsentry to mark
+ *
+ * @return          a pointer to a newly allocated copy of \p fsentry with
+ *                  the RBH_NS_XATTR_UNCHANGED namespace xattr set to true on
+ *                  success (in which case \p fsentry is freed), NULL on error
+ *                  and errno is set appropriately
+ *
+ * @error ENOMEM    there was not enough memory available
+ */
+struct rbh_fsentry *
+posix_fsentry_mark_unchanged(struct rbh_fsentry *fsentry);
+
+/**
+ * Release the per-thread buffers posix_fsentry_new() and
+ * posix_fsentry_from_fd() use
+ *
+ * This must be called by threads other than the main one, right before they
+ * exit.
+ */
+void
+posix_free_thread_buffers(void);
+
+/*----------------------------------------------------------------------------*
+ |                                posix_walker                                |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Create an iterator over the fsentries under \p root and \p entry, which
+ * spreads the reading of directories over a pool of threads
+ *
+ * @param root                  the root of the backend
+ * @param entry                 the entry to start walking from, relative to
+ *                              \p root (NULL for \p root itself)
+ * @param statx_sync_type       the AT_RBH_STATX_* flag to use with rbh_statx()
+ * @param nb_threads            the number of worker threads to use
+ * @param nb_partitions         the number of partitions to split the workers
+ *                              into (0 or 1 means the workers are not split)
+ * @param dir_partition         a callback that tells which partition a
+ *                              directory belongs to, given a file descriptor
+ *                              of its parent and its ID (it returns -1 if it
+ *                              cannot tell, may be NULL if there is only one
+ *                              partition)
+ * @param open_by_handle        whether to open directories through their file
+ *                              handle rather than their path, when the
+ *                              process is allowed to
+ * @param projection            the fields to fill in the fsentries (NULL means
+ *                              every field)
+ * @param filter                the filter the fsentries must match (NULL
+ *                              means every fsentry matches)
+ * @param prune                 the filter that selects the directories not to
+ *                              descend into (NULL means every directory is
+ *                              walked)
+ * @param max_depth             the depth of the directories not to descend
+ *                              into (\p entry is at depth 0)
+ * @param unchanged_before      the time of a previous scan, 0 for a full scan
+ *                              (cf. RBH_PBO_UNCHANGED_BEFORE)
+ * @param ns_xattrs_callback    the callback used to add extended attributes
+ *                              to the namespace (may be NULL)
+ *
+ * @return                      a pointer to a newly allocated iterator on
+ *                              success, NULL on error and errno is set
+ *                              appropriately
+ *
+ * Directories are always yielded before their content, but no other ordering
+ * guarantee is made. Directories that do not match \p filter are still
+ * walked, unless they are pruned.
+ *
+ * When \p entry is NULL, the root of the walk is named "" and its parent ID is
+ * empty, as is expected of the root of a backend.
+ *
+ * When the workers are split into partitions, worker i belongs to partition
+ * `i % nb_partitions', directories are read by the workers of the partition
+ * \p dir_partition assigns them to (modulo \p nb_partitions), and workers
+ * never read directories of other partitions: a partition whose directories
+ * are all read idles, even if others still have work queued. There are never
+ * more partitions than workers.
+ */
+struct rbh_mut_iterator *
+posix_walker_new(const char *root, const char *entry, int statx_sync_type,
+                 unsigned int nb_threads, unsigned int nb_partitions,
+                 int (*dir_partition)(int, const struct rbh_id *),
+                 bool open_by_handle,
+                 const struct rbh_filter_projection *projection,
+                 const struct rbh_filter *filter,
+                 const struct rbh_filter *prune, unsigned int max_depth,
+                 int64_t unchanged_before,
+                 int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                           const uint16_t,
+                                           const struct rbh_value_map *,
+                                           struct rbh_value_pair *,
+                                           ssize_t *,
+                                           struct rbh_value_pair *,
+                                           struct rbh_sstack *));
+
+/*----------------------------------------------------------------------------*
+ |                                posix_rescan                                |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Open a file through its ID
+ *
+ * @param mount_fd  a file descriptor of any file on the filesystem of the file
+ *                  to open
+ * @param id        the ID of the file to open
+ *
+ * @return          a file descriptor on success, -1 on error and errno is set
+ *                  appropriately
+ *
+ * @error ESTALE    the file no longer exists
+ * @error ENOMEM    there was not enough memory available
+ *
+ * Symlinks and sockets are opened with O_PATH set, other files are opened
+ * read-only. Refer to open_by_handle_at(2) for the other errors.
+ */
+int
+posix_open_by_id(int mount_fd, const struct rbh_id *id);
+
+/**
+ * Create an iterator over the fsentries of files designated by their ID
+ *
+ * @param root                  the root of the backend
+ * @param ids                   an iterator over the IDs (`const struct rbh_id
+ *                              *') of the files to fetch
+ * @param statx_sync_type       the AT_RBH_STATX_* flag to use with rbh_statx()
+ * @param projection            the fields to fill in the fsentries (NULL means
+ *                              every field)
+ * @param ns_xattrs_callback    the callback used to add extended attributes
+ *                              to the namespace (may be NULL)
+ *
+ * @return                      a pointer to a newly allocated iterator on
+ *                              success (in which case it owns \p ids), NULL
+ *                              on error and errno is set appropriately
+ *
+ * @error ENOMEM                there was not enough memory available
+ *
+ * Files are opened with open_by_handle_at(2), which requires the
+ * CAP_DAC_READ_SEARCH capability, and without resolving any path. Hence, the
+ * fsentries have neither a name, a parent ID, nor a "path" namespace xattr.
+ * Files that no longer exist are skipped.
+ */
+struct rbh_mut_iterator *
+posix_rescan_new(const char *root, struct rbh_iterator *ids,
+                 int statx_sync_type,
+                 const struct rbh_filter_projection *projection,
+                 int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                           const uint16_t,
+                                           const struct rbh_value_map *,
+                                           struct rbh_value_pair *,
+                                           ssize_t *,
+                                           struct rbh_value_pair *,
+                                           struct rbh_sstack *));
+
+/*----------------------------------------------------------------------------*
+ |                                 posix_sort                                 |
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Widen a projection to the fields needed to sort fsentries
+ *
+ * @param projection    the projection to widen
+ * @param items         the sorting criteria
+ * @param count         the number of elements in \p items
+ *
+ * @return              0 on success, -1 on error and errno is set appropriately
+ *
+ * @error EINVAL        one of the fields of \p items is not valid
+ *
+ * Sorting on an extended attribute sets the count of the matching map of
+ * \p projection to 0, so that every extended attribute of this kind is
+ * fetched. \p projection is not made to point at any new data.
+ */
+int
+posix_sort_projection(struct rbh_filter_projection *projection,
+                      const struct rbh_filter_sort *items, size_t count);
+
+/**
+ * Create an iterator which applies the skip, limit and sort options of a
+ * filter to the fsentries of another iterator
+ *
+ * @param fsentries     an iterator over fsentries, whose fields must include
+ *                      those named in the sort options of \p options
+ *                      (cf. posix_sort_projection())
+ * @param options       the options to apply, their projection is ignored
+ *
+ * @return              a pointer to a newly allocated iterator on success (in
+ *                      which case it owns \p fsentries), NULL on error and
+ *                      errno is set appropriately
+ *
+ * @error ENOMEM        there was not enough memory available
+ *
+ * With a small enough limit, only the `skip + limit' first fsentries are ever
+ * held in memory. Otherwise, sorted runs of fsentries are spilled to temporary
+ * files (cf. tmpfile()) and merged back together.
+ */
+struct rbh_mut_iterator *
+posix_sort_iter_new(struct rbh_mut_iterator *fsentries,
+                    const struct rbh_filter_options *options);
+
 /*----------------------------------------------------------------------------*
  |                              posix_operations                              |
  *----------------------------------------------------------------------------*/
@@ -87,8 +504,22 @@ posix_backend_destroy(void *backend);
 struct posix_backend {
     struct rbh_backend backend;
     struct posix_iterator *(*iter_new)(const char *, const char *, int);
+    int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                              const uint16_t,
+                              const struct rbh_value_map *,
+                              struct rbh_value_pair *, ssize_t *,
+                              struct rbh_value_pair *, struct rbh_sstack *);
     char *root;
     int statx_sync_type;
+    unsigned int walker_threads;
+    /* How to split walker threads, cf. posix_walker_new() */
+    unsigned int walker_partitions;
+    int (*dir_partition)(int, const struct rbh_id *);
+    /* Open directories by handle, cf. posix_walker_new() */
+    bool open_by_handle;
+    const struct rbh_filter *prune;
+    unsigned int max_depth;
+    int64_t unchanged_before;
 };
 
 #endif
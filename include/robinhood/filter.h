@@ -453,4 +453,172 @@ rbh_filter_validate(const struct rbh_filter *filter);
 struct rbh_filter *
 rbh_filter_clone(const struct rbh_filter *filter);
 
+/**
+ * Collect the fields a filter needs to be evaluated
+ *
+ * @param filter        the filter to inspect
+ * @param fsentry_mask  a pointer to a bitmask of enum rbh_fsentry_property,
+ *                      which the properties \p filter reads are OR-ed with
+ * @param statx_mask    a pointer to a bitmask of RBH_STATX_* fields, which the
+ *                      statx fields \p filter reads are OR-ed with
+ *
+ * \p filter must be valid (cf. rbh_filter_validate()).
+ */
+void
+rbh_filter_fields(const struct rbh_filter *filter, unsigned int *fsentry_mask,
+                  uint32_t *statx_mask);
+
+/**
+ * An opaque structure to evaluate a filter against fsentries
+ *
+ * Evaluating a filter in-process is useful to backends that cannot do it
+ * natively, like the POSIX backend.
+ */
+struct rbh_filter_matcher;
+
+/**
+ * Prepare a filter to be evaluated against fsentries
+ *
+ * @param filter    the filter to evaluate (it is copied, the caller may free it
+ *                  as soon as this function returns)
+ *
+ * @return          a pointer to a newly allocated struct rbh_filter_matcher on
+ *                  success, NULL on error and errno is set appropriately
+ *
+ * @error EINVAL    \p filter is invalid, or it contains a regex that cannot be
+ *                  compiled
+ * @error ENOMEM    there was not enough memory available
+ *
+ * Regexes are compiled once and for all, as POSIX extended regular
+ * expressions.
+ */
+struct rbh_filter_matcher *
+rbh_filter_matcher_new(const struct rbh_filter *filter);
+
+/**
+ * Evaluate a filter against an fsentry
+ *
+ * @param matcher   the filter to evaluate
+ * @param fsentry   the fsentry to evaluate the filter against
+ * @param pending   a bitmask of enum rbh_fsentry_property, the properties
+ *                  that are not filled in \p fsentry, but may be later on
+ *
+ * @return          1 if \p fsentry matches the filter, 0 if it does not, -1 if
+ *                  it cannot be decided without knowing the properties of
+ *                  \p fsentry in \p pending, and errno is set to EAGAIN
+ *
+ * The semantics of the evaluation mimic the ones of the mongo backend:
+ *   - a comparison on a field that \p fsentry does not have never matches,
+ *     and so its negation always does;
+ *   - integers of different types are compared by value, other types of
+ *     values are only comparable with values of the same type;
+ *   - comparing a sequence to a value that is not a sequence matches if any
+ *     of its elements matches;
+ *   - the fields of an xattr whose value is a map are designated with dots
+ *     (eg. "a.b" is the field "b" of the xattr "a"), unless an xattr has a
+ *     name that contains dots itself.
+ *
+ * \p pending allows evaluating a filter on a partially filled fsentry, and
+ * skip retrieving the rest of it when the outcome is already known.
+ */
+int
+rbh_filter_matcher_match(const struct rbh_filter_matcher *matcher,
+                         const struct rbh_fsentry *fsentry,
+                         unsigned int pending);
+
+/**
+ * Free a struct rbh_filter_matcher
+ *
+ * @param matcher   the matcher to free (may be NULL)
+ */
+void
+rbh_filter_matcher_destroy(struct rbh_filter_matcher *matcher);
+
+/**
+ * An opaque structure which holds a filter compiled to be evaluated against
+ * many fsentries
+ */
+struct rbh_filter_program;
+
+/**
+ * Compile a filter into a program to evaluate against fsentries
+ *
+ * @param filter    the filter to compile (it is copied, the caller may free it
+ *                  as soon as this function returns)
+ *
+ * @return          a pointer to a newly allocated struct rbh_filter_program on
+ *                  success, NULL on error and errno is set appropriately
+ *
+ * @error EINVAL    \p filter is invalid, or it contains a regex that cannot be
+ *                  compiled
+ * @error ENOMEM    there was not enough memory available
+ *
+ * The program is a flat array of instructions specialised for the most common
+ * comparisons (on statx fields, names and symlinks), which reuses the code of
+ * struct rbh_filter_matcher for the others. The operands of RBH_FOP_IN are
+ * sorted to be looked up with a binary search, and the operands of
+ * RBH_FOP_AND and RBH_FOP_OR are reordered so that the cheapest ones (those
+ * that only read statx fields) are evaluated first.
+ *
+ * A program evaluates to the same results as a struct rbh_filter_matcher built
+ * out of the same filter.
+ */
+struct rbh_filter_program *
+rbh_filter_compile(const struct rbh_filter *filter);
+
+/**
+ * Evaluate a compiled filter against an fsentry
+ *
+ * @param program   the compiled filter to evaluate
+ * @param fsentry   the fsentry to evaluate the filter against
+ * @param pending   a bitmask of enum rbh_fsentry_property, the properties
+ *                  that are not filled in \p fsentry, but may be later on
+ *
+ * @return          1 if \p fsentry matches the filter, 0 if it does not, -1 if
+ *                  it cannot be decided without knowing the properties of
+ *                  \p fsentry in \p pending, and errno is set to EAGAIN
+ *
+ * cf. rbh_filter_matcher_match()
+ */
+int
+rbh_filter_program_match(const struct rbh_filter_program *program,
+                         const struct rbh_fsentry *fsentry,
+                         unsigned int pending);
+
+/**
+ * Free a struct rbh_filter_program
+ *
+ * @param program   the program to free (may be NULL)
+ */
+void
+rbh_filter_program_destroy(struct rbh_filter_program *program);
+
+struct rbh_filter_sort;
+
+/**
+ * Compare two fsentries according to a sequence of sorting options
+ *
+ * @param first     the first fsentry to compare
+ * @param second    the second fsentry to compare
+ * @param items     the sorting options (cf. struct rbh_filter_sort in
+ *                  robinhood/backend.h)
+ * @param count     the number of elements in \p items
+ *
+ * @return          an integer lower than, equal to, or greater than 0 if
+ *                  \p first respectively sorts before, at the same rank as, or
+ *                  after \p second
+ *
+ * The ordering mimics the one of the mongo backend: fsentries that lack a
+ * field sort first (in ascending order), then values are ordered by type
+ * (integers, strings, maps, sequences, binaries, booleans, and regexes), and
+ * by value within a type. Sequences and maps are compared element by element.
+ *
+ * The fields of \p items must be valid, as they would be in a filter (cf.
+ * rbh_filter_validate()).
+ */
+int
+rbh_fsentry_compare(const struct rbh_fsentry *first,
+                    const struct rbh_fsentry *second,
+                    const struct rbh_filter_sort *items, size_t count);
+
 #endif
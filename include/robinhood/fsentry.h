@@ -105,6 +105,16 @@ enum rbh_fsentry_property {
 };
 #define RBH_FP_ALL            0x007f
 
+/**
+ * Namespace xattr a scan sets (to true) on the directories it did not walk in
+ * full, because no entry was created, deleted or renamed in them since a
+ * previous scan (cf. RBH_PBO_UNCHANGED_BEFORE)
+ *
+ * It is only meant for the consumer of the scan: rbh_sync strips it from the
+ * fsevents it applies.
+ */
+#define RBH_NS_XATTR_UNCHANGED "rbh-unchanged"
+
 /**
  * Create an fsentry in a single memory allocation
  *
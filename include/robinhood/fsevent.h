@@ -9,6 +9,7 @@
 #define ROBINHOOD_FSEVENT_H
 
 #include "robinhood/fsentry.h"
+#include "robinhood/iterator.h"
 
 /**
  * Types of fsevent
@@ -196,4 +197,36 @@ rbh_fsevent_ns_xattr_new(const struct rbh_id *id,
                          const struct rbh_value_map *xattrs,
                          const struct rbh_id *parent_id, const char *name);
 
+/**
+ * Merge redundant fsevents
+ *
+ * @param fsevents  an iterator over fsevents
+ * @param merged    a counter to increment by the number of fsevents that
+ *                  are merged into others, or dropped (may be NULL)
+ *
+ * @return          a pointer to a newly allocated iterator that yields
+ *                  fsevents with the same outcome as those of \p fsevents,
+ *                  on success; NULL on error and errno is set appropriately
+ *
+ * @error ENOMEM    there was not enough memory available
+ *
+ * Only consecutive fsevents on the same ID are merged, and only if the order
+ * in which they apply does not matter to the result:
+ *   - an RBH_FET_UPSERT followed by RBH_FET_UPSERTs and inode RBH_FET_XATTRs
+ *     becomes a single RBH_FET_UPSERT;
+ *   - consecutive inode RBH_FET_XATTRs become a single one, and so do
+ *     consecutive namespace RBH_FET_XATTRs on the same link;
+ *   - an RBH_FET_DELETE drops the fsevents that come right before it.
+ *
+ * When two fsevents update the same field (or xattr), the last one wins.
+ *
+ * The fsevents of \p iterator are copied: the fsevents yielded by the returned
+ * iterator are valid until it is destroyed, or yields another fsevent.
+ *
+ * \p fsevents should not be used anymore after a successful call to this
+ * function, the returned iterator destroys it.
+ */
+struct rbh_iterator *
+rbh_fsevent_coalesce(struct rbh_iterator *fsevents, size_t *merged);
+
 #endif
@@ -207,4 +207,32 @@ rbh_iter_ring(struct rbh_ring *ring, size_t element_size);
 struct rbh_mut_iterator *
 rbh_mut_iter_ring(struct rbh_ring *ring, size_t element_size);
 
+/**
+ * Read elements ahead of a mutable iterator, in a background thread
+ *
+ * @param iterator  the mutable iterator to read from
+ * @param count     the number of elements to read ahead (at least)
+ *
+ * @return          a pointer to a newly allocated struct rbh_mut_iterator
+ *                  that yields the same elements as \p iterator, in the same
+ *                  order, on success; NULL on error and errno is set
+ *                  appropriately
+ *
+ * @error EINVAL    \p count is 0
+ * @error ENOMEM    there was not enough memory available
+ * @error EAGAIN    the background thread could not be created
+ *
+ * \p iterator is only used by the background thread, which stops at the first
+ * error \p iterator reports (be it ENODATA): the returned iterator keeps on
+ * failing with the same error once every element read before it was yielded.
+ *
+ * Elements that were read ahead but not yielded when the returned iterator is
+ * destroyed are freed with free().
+ *
+ * \p iterator should not be used anymore after a successful call to this
+ * function.
+ */
+struct rbh_mut_iterator *
+rbh_mut_iter_prefetch(struct rbh_mut_iterator *iterator, size_t count);
+
 #endif
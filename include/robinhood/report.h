@@ -0,0 +1,149 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifndef ROBINHOOD_REPORT_H
+#define ROBINHOOD_REPORT_H
+
+/**
+ * @file
+ *
+ * Reports aggregate the fsentries that match a filter into a few rows
+ *
+ * Fsentries are grouped by the values of a set of fields (the keys of a row),
+ * and every group is summarized by a set of accumulators (the values of a row).
+ * For example, "the total size of regular files per uid" is a report with a
+ * single group field (the uid) and a single output (the sum of the sizes).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "robinhood/filter.h"
+#include "robinhood/value.h"
+
+/**
+ * The ways a report can summarize a group of fsentries
+ */
+enum rbh_report_accumulator {
+    /** The number of fsentries in the group (as an RBH_VT_UINT64) */
+    RBH_RA_COUNT,
+    /** The sum of the integer values of a field (as an RBH_VT_INT64) */
+    RBH_RA_SUM,
+    /** The lowest value of a field */
+    RBH_RA_MIN,
+    /** The highest value of a field */
+    RBH_RA_MAX,
+};
+
+/**
+ * A field a report groups fsentries by
+ */
+struct rbh_report_group {
+    /** The field to group fsentries by */
+    struct rbh_filter_field field;
+    /**
+     * Histogram buckets (optional)
+     *
+     * If \c count is not 0, fsentries are not grouped by the value of
+     * \c field, but by the greatest of \c boundaries that is lower than or
+     * equal to it (as an RBH_VT_INT64). Fsentries whose value is lower than
+     * every boundary, or which lack the field, are grouped under a missing key.
+     *
+     * \c boundaries must be sorted in strictly increasing order.
+     */
+    struct {
+        const int64_t *boundaries;
+        size_t count;
+    } buckets;
+};
+
+/**
+ * A value computed for each row of a report
+ */
+struct rbh_report_output {
+    /** How to summarize the fsentries of a group */
+    enum rbh_report_accumulator accumulator;
+    /** The field to summarize (ignored for RBH_RA_COUNT) */
+    struct rbh_filter_field field;
+};
+
+/**
+ * The description of a report
+ */
+struct rbh_report {
+    /** The fields to group fsentries by (there is a single group if empty) */
+    struct {
+        const struct rbh_report_group *items;
+        size_t count;
+    } groups;
+    /** The values to compute for each group */
+    struct {
+        const struct rbh_report_output *items;
+        size_t count;
+    } outputs;
+};
+
+/**
+ * A row of a report
+ *
+ * Rows are sorted by keys, in ascending order (missing keys first, then
+ * following the ordering of rbh_fsentry_compare()).
+ */
+struct rbh_report_row {
+    /**
+     * One key per group field of the report, in the same order
+     *
+     * A key is NULL if the fsentries of the row lack the field.
+     */
+    const struct rbh_value * const *keys;
+    /**
+     * One value per output of the report, in the same order
+     *
+     * A value is NULL if none of the fsentries of the row has the field
+     * (RBH_RA_MIN and RBH_RA_MAX only).
+     */
+    const struct rbh_value * const *values;
+};
+
+/**
+ * Check a report is valid
+ *
+ * @param report    the report to check
+ *
+ * @return          0 if \p report is valid, -1 otherwise and errno is set to
+ *                  EINVAL
+ *
+ * A report is valid if its fields are valid (as they would be in a filter, cf.
+ * rbh_filter_validate()), its accumulators are known, and the boundaries of
+ * its buckets are sorted in strictly increasing order.
+ */
+int
+rbh_report_validate(const struct rbh_report *report);
+
+/**
+ * Create a report row
+ *
+ * @param keys          the keys of the row (elements may be NULL)
+ * @param key_count     the number of elements in \p keys
+ * @param values        the values of the row (elements may be NULL)
+ * @param value_count   the number of elements in \p values
+ *
+ * @return              a pointer to a newly allocated struct rbh_report_row
+ *                      that does not share any data with \p keys and
+ *                      \p values on success, NULL on error and errno is set
+ *                      appropriately
+ *
+ * @error EINVAL        one of the keys or values has an invalid type
+ * @error ENOMEM        there was not enough memory available
+ *
+ * The returned row can be freed with a single call to free().
+ */
+struct rbh_report_row *
+rbh_report_row_new(const struct rbh_value * const *keys, size_t key_count,
+                   const struct rbh_value * const *values, size_t value_count);
+
+#endif
@@ -94,4 +94,18 @@ int
 rbh_statx(int dirfd, const char *restrict pathname, int flags,
           unsigned int mask, struct rbh_statx *restrict statxbuf);
 
+/**
+ * Convert the mask of a struct statx filled by the kernel into a mask of
+ * RBH_STATX_* values
+ *
+ * @param mask  the stx_mask field of a struct statx
+ *
+ * @return      the mask rbh_statx() would have set
+ *
+ * This is only useful to callers that issue statx requests without
+ * rbh_statx() (eg. through io_uring).
+ */
+uint32_t
+rbh_statx_mask_from_statx(uint32_t mask);
+
 #endif
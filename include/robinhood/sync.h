@@ -0,0 +1,198 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifndef ROBINHOOD_SYNC_H
+#define ROBINHOOD_SYNC_H
+
+/**
+ * @file
+ *
+ * Pipelined synchronization of a backend into another
+ *
+ * A sync reads fsentries from a source backend and turns them into fsevents
+ * that are applied to a destination backend. The work is split in stages
+ * that each run in their own threads and are connected by bounded queues:
+ *
+ *     walk --> enrich --> convert --> apply
+ *
+ *   - walk: a single thread reads fsentries from rbh_backend_filter();
+ *   - enrich: (optional) several threads run a user provided callback on
+ *             each fsentry;
+ *   - convert: several threads turn fsentries into RBH_FET_UPSERT and
+ *              RBH_FET_LINK fsevents (RBH_NS_XATTR_UNCHANGED is left out);
+ *   - apply: a single thread gathers fsevents in batches and feeds them to
+ *            rbh_backend_update().
+ *
+ * A stage that outruns the next one blocks when its output queue is full,
+ * which bounds the memory a sync can use.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "robinhood/backend.h"
+#include "robinhood/filter.h"
+#include "robinhood/fsentry.h"
+
+/**
+ * Options of a sync
+ *
+ * Zero-initialized fields select a sensible default.
+ */
+struct rbh_sync_options {
+    /** The fsentries of the source backend to synchronize (NULL means all) */
+    const struct rbh_filter *filter;
+    /** Options of the rbh_backend_filter() call on the source backend */
+    struct rbh_filter_options filter_options;
+    /**
+     * A callback to enrich each fsentry before it is converted (may be NULL)
+     *
+     * @param fsentry   a pointer to the fsentry to enrich
+     * @param arg       the `enrich_arg' field of the options
+     *
+     * @return          0 on success, -1 on error and errno is set
+     *                  appropriately
+     *
+     * To replace an fsentry, the callback stores the new one in \p fsentry and
+     * frees the old one. On error, \p fsentry must be left untouched.
+     *
+     * This callback is run concurrently by `enrich_threads' threads.
+     */
+    int (*enrich)(struct rbh_fsentry **fsentry, void *arg);
+    /** The argument passed to `enrich' */
+    void *enrich_arg;
+    /** The number of threads running `enrich' (defaults to 1) */
+    size_t enrich_threads;
+    /** The number of threads converting fsentries (defaults to 1) */
+    size_t convert_threads;
+    /** The minimum number of items each queue can hold */
+    size_t queue_size;
+    /** The maximum number of fsevents per rbh_backend_update() */
+    size_t batch_size;
+};
+
+/**
+ * Stages of a sync
+ */
+enum rbh_sync_stage {
+    RBH_SS_WALK,
+    RBH_SS_ENRICH,
+    RBH_SS_CONVERT,
+    RBH_SS_APPLY,
+};
+
+#define RBH_SS_COUNT (RBH_SS_APPLY + 1)
+
+/**
+ * Statistics of a stage
+ *
+ * Time is cumulated over all the threads of the stage.
+ */
+struct rbh_sync_stage_stats {
+    /** The number of threads of the stage (0 if the stage is skipped) */
+    size_t threads;
+    /** The number of items the stage processed */
+    uint64_t items;
+    /** The time spent processing items (in nanoseconds) */
+    uint64_t busy_ns;
+    /** The time spent waiting for input (in nanoseconds) */
+    uint64_t starved_ns;
+    /** The time spent waiting for room in the output queue (in nanoseconds) */
+    uint64_t blocked_ns;
+};
+
+/**
+ * Statistics of a queue
+ */
+struct rbh_sync_queue_stats {
+    /** The number of items the queue can hold (0 if it is not used) */
+    size_t capacity;
+    /** The number of items currently in the queue */
+    size_t count;
+    /** The highest number of items the queue ever held */
+    size_t peak;
+};
+
+/**
+ * Statistics of a sync
+ */
+struct rbh_sync_stats {
+    /** Indexed by enum rbh_sync_stage */
+    struct rbh_sync_stage_stats stages[RBH_SS_COUNT];
+    /**
+     * The input queue of each stage, indexed by enum rbh_sync_stage
+     *
+     * The walk stage has no input queue.
+     */
+    struct rbh_sync_queue_stats queues[RBH_SS_COUNT];
+    /** The time elapsed since the sync started (in nanoseconds) */
+    uint64_t elapsed_ns;
+    /** The number of fsevents rbh_backend_update() reported as applied */
+    uint64_t applied;
+};
+
+struct rbh_sync;
+
+/**
+ * Start synchronizing a backend into another
+ *
+ * @param source        the backend to read fsentries from
+ * @param destination   the backend to apply fsevents to
+ * @param options       the options of the sync (may be NULL)
+ *
+ * @return              a pointer to a newly allocated struct rbh_sync on
+ *                      success, NULL on error and errno is set appropriately
+ *
+ * @error ENOMEM        there was not enough memory available
+ *
+ * This function may also fail and set errno for any of the errors specified
+ * for rbh_backend_filter() and pthread_create().
+ *
+ * Both backends must outlive the returned sync. No other thread should use
+ * \p destination while it is running.
+ */
+struct rbh_sync *
+rbh_sync_new(struct rbh_backend *source, struct rbh_backend *destination,
+             const struct rbh_sync_options *options);
+
+/**
+ * Collect statistics about a sync
+ *
+ * @param sync  the sync to inspect
+ * @param stats where to store the statistics of \p sync
+ *
+ * This function can be called at any time, including while \p sync runs.
+ */
+void
+rbh_sync_stats(struct rbh_sync *sync, struct rbh_sync_stats *stats);
+
+/**
+ * Wait for a sync to complete
+ *
+ * @param sync  the sync to wait for
+ *
+ * @return      the number of fsevents rbh_backend_update() reported as applied
+ *              on success, -1 on error and errno is set appropriately
+ *
+ * The error reported is the first one any stage of \p sync ran into, the sync
+ * stops as soon as one occurs.
+ */
+ssize_t
+rbh_sync_wait(struct rbh_sync *sync);
+
+/**
+ * Free a sync
+ *
+ * @param sync  the sync to free
+ *
+ * If \p sync is still running, it is interrupted first.
+ */
+void
+rbh_sync_destroy(struct rbh_sync *sync);
+
+#endif
@@ -92,4 +92,55 @@ int
 value_map_copy(struct rbh_value_map *dest, const struct rbh_value_map *src,
                char **buffer, size_t *bufsize);
 
+/**
+ * Look up a field in a map
+ *
+ * @param map       the map to look into
+ * @param key       the key of the field to look up, dots designate the fields
+ *                  of nested maps (eg. "a.b" is the field "b" of the map
+ *                  stored under the key "a")
+ *
+ * @return          a pointer to the value of the field, NULL if there is none
+ *                  (or if the field exists but has no value)
+ *
+ * Keys of \p map that contain dots themselves are supported too.
+ */
+const struct rbh_value *
+value_map_lookup(const struct rbh_value_map *map, const char *key);
+
+/**
+ * Order two values the way the mongo backend does
+ *
+ * @param first     the first value to compare
+ * @param second    the second value to compare
+ *
+ * @return          an integer lower than, equal to, or greater than 0 if
+ *                  \p first respectively sorts before, at the same rank as, or
+ *                  after \p second
+ *
+ * Values are ordered by type first (cf. rbh_fsentry_compare()).
+ */
+int
+value_order(const struct rbh_value *first, const struct rbh_value *second);
+
+struct rbh_filter_field;
+struct rbh_fsentry;
+
+/**
+ * Fetch the value of a field of an fsentry
+ *
+ * @param fsentry   the fsentry to fetch the field from
+ * @param field     the field to fetch (it must be valid, as it would be in a
+ *                  filter)
+ * @param value     where to store the value of \p field
+ *
+ * @return          true if \p fsentry has \p field, false otherwise
+ *
+ * On success, \p value may point at data owned by \p fsentry.
+ */
+bool
+fsentry_field_value(const struct rbh_fsentry *fsentry,
+                    const struct rbh_filter_field *field,
+                    struct rbh_value *value);
+
 #endif
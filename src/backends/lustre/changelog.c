@@ -0,0 +1,990 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/limits.h>
+
+#include <lustre/lustreapi.h>
+#include <lustre/lustre_user.h>
+
+#include "robinhood/backends/lustre.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/id.h"
+#include "robinhood/statx.h"
+
+/*----------------------------------------------------------------------------*
+ |                          changelog dump records                            |
+ *----------------------------------------------------------------------------*/
+
+struct dump_iterator {
+    struct rbh_iterator iterator;
+
+    const char *dump;
+    size_t size;
+    size_t offset;
+
+    /* An aligned copy of the current record */
+    struct changelog_rec *record;
+    size_t capacity;
+};
+
+static const void *
+dump_iter_next(void *iterator)
+{
+    struct dump_iterator *dump = iterator;
+    struct changelog_rec header;
+    uint64_t extra_flags = 0;
+    size_t remaining;
+    size_t size;
+
+    remaining = dump->size - dump->offset;
+    if (remaining == 0) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    if (remaining < sizeof(header))
+        goto out_einval;
+    memcpy(&header, dump->dump + dump->offset, sizeof(header));
+
+    if (header.cr_flags & CLF_EXTRA_FLAGS) {
+        size = changelog_rec_offset(header.cr_flags
+                                  & (CLF_VERSION | CLF_RENAME | CLF_JOBID),
+                                    CLFE_INVALID);
+        if (remaining < size + sizeof(extra_flags))
+            goto out_einval;
+        memcpy(&extra_flags, dump->dump + dump->offset + size,
+               sizeof(extra_flags));
+    }
+
+    size = changelog_rec_offset(header.cr_flags & CLF_SUPPORTED,
+                                extra_flags & CLFE_SUPPORTED)
+         + header.cr_namelen;
+    if (remaining < size)
+        goto out_einval;
+
+    /* Leave room for a terminating null byte after the name */
+    if (size + 1 > dump->capacity) {
+        void *tmp = realloc(dump->record, size + 1);
+
+        if (tmp == NULL)
+            return NULL;
+        dump->record = tmp;
+        dump->capacity = size + 1;
+    }
+
+    memcpy(dump->record, dump->dump + dump->offset, size);
+    ((char *)dump->record)[size] = '\0';
+    dump->offset += size;
+
+    return dump->record;
+
+out_einval:
+    errno = EINVAL;
+    return NULL;
+}
+
+static void
+dump_iter_destroy(void *iterator)
+{
+    struct dump_iterator *dump = iterator;
+
+    free(dump->record);
+    free(dump);
+}
+
+static const struct rbh_iterator_operations DUMP_ITER_OPS = {
+    .next = dump_iter_next,
+    .destroy = dump_iter_destroy,
+};
+
+static const struct rbh_iterator DUMP_ITERATOR = {
+    .ops = &DUMP_ITER_OPS,
+};
+
+struct rbh_iterator *
+lustre_changelog_dump_records(const void *dump, size_t size)
+{
+    struct dump_iterator *iterator;
+
+    iterator = malloc(sizeof(*iterator));
+    if (iterator == NULL)
+        return NULL;
+
+    iterator->iterator = DUMP_ITERATOR;
+    iterator->dump = dump;
+    iterator->size = size;
+    iterator->offset = 0;
+    iterator->record = NULL;
+    iterator->capacity = 0;
+
+    return &iterator->iterator;
+}
+
+/*----------------------------------------------------------------------------*
+ |                               llapi records                                |
+ *----------------------------------------------------------------------------*/
+
+struct llapi_iterator {
+    struct rbh_iterator iterator;
+
+    void *reader;
+    struct changelog_rec *record;
+};
+
+static const void *
+llapi_iter_next(void *iterator)
+{
+    struct llapi_iterator *llapi = iterator;
+    int rc;
+
+    if (llapi->record != NULL)
+        llapi_changelog_free(&llapi->record);
+
+    rc = llapi_changelog_recv(llapi->reader, &llapi->record);
+    if (rc) {
+        /* 1 means the end of the changelog was reached */
+        errno = rc == 1 ? ENODATA : -rc;
+        llapi->record = NULL;
+        return NULL;
+    }
+
+    return llapi->record;
+}
+
+static void
+llapi_iter_destroy(void *iterator)
+{
+    struct llapi_iterator *llapi = iterator;
+
+    if (llapi->record != NULL)
+        llapi_changelog_free(&llapi->record);
+    llapi_changelog_fini(&llapi->reader);
+    free(llapi);
+}
+
+static const struct rbh_iterator_operations LLAPI_ITER_OPS = {
+    .next = llapi_iter_next,
+    .destroy = llapi_iter_destroy,
+};
+
+static const struct rbh_iterator LLAPI_ITERATOR = {
+    .ops = &LLAPI_ITER_OPS,
+};
+
+static struct rbh_iterator *
+llapi_changelog_records(const char *mdtname)
+{
+    struct llapi_iterator *iterator;
+    int save_errno;
+    int rc;
+
+    iterator = malloc(sizeof(*iterator));
+    if (iterator == NULL)
+        return NULL;
+
+    /* Do not block at the end of the changelog */
+    rc = llapi_changelog_start(&iterator->reader,
+                               CHANGELOG_FLAG_JOBID
+                             | CHANGELOG_FLAG_EXTRA_FLAGS,
+                               mdtname, 0);
+    if (rc) {
+        errno = -rc;
+        goto out_free_iterator;
+    }
+
+    /* Records of xattr changes should tell which xattr changed */
+    rc = llapi_changelog_set_xflags(iterator->reader,
+                                    CHANGELOG_EXTRA_FLAG_XATTR);
+    if (rc) {
+        errno = -rc;
+        goto out_fini;
+    }
+
+    iterator->iterator = LLAPI_ITERATOR;
+    iterator->record = NULL;
+
+    return &iterator->iterator;
+
+out_fini:
+    save_errno = errno;
+    llapi_changelog_fini(&iterator->reader);
+    errno = save_errno;
+out_free_iterator:
+    save_errno = errno;
+    free(iterator);
+    errno = save_errno;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                          records to fsevents                               |
+ *----------------------------------------------------------------------------*/
+
+/* A rename that overwrites its target yields the most fsevents */
+#define CHANGELOG_MAX_EVENTS 7
+
+/* The statx fields a change to the entries of a directory updates */
+#define DIRECTORY_STATX (RBH_STATX_MTIME | RBH_STATX_CTIME | RBH_STATX_NLINK)
+/* The statx fields writing to a file updates */
+#define DATA_STATX (RBH_STATX_MTIME | RBH_STATX_CTIME | RBH_STATX_SIZE \
+                  | RBH_STATX_BLOCKS)
+/* The statx fields setattr() can update */
+#define SETATTR_STATX (RBH_STATX_MODE | RBH_STATX_UID | RBH_STATX_GID \
+                     | RBH_STATX_ATIME | DATA_STATX)
+
+#define NO_EVENT SIZE_MAX
+
+/* An fsevent, before it is built */
+struct changelog_event {
+    enum rbh_fsevent_type type;
+    struct lu_fid fid;
+    /* RBH_FET_LINK, RBH_FET_UNLINK */
+    struct lu_fid parent_fid;
+    char *name;
+    /* RBH_FET_UPSERT */
+    uint32_t statx;
+    bool symlink;
+    /* RBH_FET_XATTR: the xattr to refresh, NULL means all of them */
+    char *xattr;
+    bool lustre;
+
+    /* The index of the record the event comes from */
+    uint64_t index;
+    /* The previous event of the batch on the same fid (or NO_EVENT) */
+    size_t previous;
+    bool dropped;
+};
+
+/* The last event of the batch on a fid */
+struct fid_slot {
+    struct lu_fid fid;
+    size_t last;
+};
+
+struct changelog_iterator {
+    struct rbh_iterator iterator;
+
+    struct rbh_iterator *records;
+    uint64_t *consumed;
+
+    /* The maximum number of records per batch */
+    size_t batch_size;
+    /* The number of records in the current batch */
+    size_t records_count;
+    /* The index of the last record of the current batch */
+    uint64_t last;
+
+    struct changelog_event *events;
+    size_t count;
+    /* The next event to yield */
+    size_t index;
+
+    /* An open addressing hash table of the fids of the batch */
+    struct fid_slot *slots;
+    size_t slots_count;
+
+    struct rbh_fsevent *fsevent;
+    bool exhausted;
+};
+
+static const struct lu_fid ZERO_FID;
+
+static bool
+fid_is_null(const struct lu_fid *fid)
+{
+    return memcmp(fid, &ZERO_FID, sizeof(*fid)) == 0;
+}
+
+static size_t
+fid_hash(const struct lu_fid *fid)
+{
+    /* FNV-1a */
+    const unsigned char *bytes = (const unsigned char *)fid;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < sizeof(*fid); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static struct fid_slot *
+changelog_slot(struct changelog_iterator *changelog, const struct lu_fid *fid)
+{
+    size_t mask = changelog->slots_count - 1;
+    size_t i = fid_hash(fid) & mask;
+
+    /* There are always more slots than events, hence a free slot */
+    while (changelog->slots[i].last != NO_EVENT) {
+        if (memcmp(&changelog->slots[i].fid, fid, sizeof(*fid)) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return &changelog->slots[i];
+}
+
+static struct changelog_event *
+changelog_push(struct changelog_iterator *changelog, enum rbh_fsevent_type type,
+               const struct lu_fid *fid, uint64_t index)
+{
+    struct changelog_event *event = &changelog->events[changelog->count];
+    struct fid_slot *slot = changelog_slot(changelog, fid);
+
+    assert(changelog->count < changelog->batch_size * CHANGELOG_MAX_EVENTS);
+
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->fid = *fid;
+    event->index = index;
+    event->previous = slot->last;
+
+    slot->fid = *fid;
+    slot->last = changelog->count++;
+    return event;
+}
+
+static int
+changelog_push_link(struct changelog_iterator *changelog,
+                    enum rbh_fsevent_type type, const struct lu_fid *fid,
+                    const struct lu_fid *parent_fid, const char *name,
+                    size_t length, uint64_t index)
+{
+    struct changelog_event *event;
+    char *copy;
+
+    copy = strndup(name, length);
+    if (copy == NULL)
+        return -1;
+
+    event = changelog_push(changelog, type, fid, index);
+    event->parent_fid = *parent_fid;
+    event->name = copy;
+    return 0;
+}
+
+/* Refreshing the same fields twice in a batch is pointless: every fsevent of
+ * a batch is built after all its records were read, hence after the changes
+ * they record happened.
+ */
+static void
+changelog_push_upsert(struct changelog_iterator *changelog,
+                      const struct lu_fid *fid, uint32_t statx, bool symlink,
+                      uint64_t index)
+{
+    struct changelog_event *event;
+    struct fid_slot *slot;
+
+    slot = changelog_slot(changelog, fid);
+    for (size_t i = slot->last; i != NO_EVENT;
+         i = changelog->events[i].previous) {
+        event = &changelog->events[i];
+        if (event->type == RBH_FET_UPSERT && !event->dropped) {
+            event->statx |= statx;
+            event->symlink |= symlink;
+            return;
+        }
+    }
+
+    event = changelog_push(changelog, RBH_FET_UPSERT, fid, index);
+    event->statx = statx;
+    event->symlink = symlink;
+}
+
+static bool
+xattr_equal(const char *x, const char *y)
+{
+    if (x == NULL || y == NULL)
+        return x == y;
+    return strcmp(x, y) == 0;
+}
+
+static int
+changelog_push_xattr(struct changelog_iterator *changelog,
+                     const struct lu_fid *fid, const char *xattr, bool lustre,
+                     uint64_t index)
+{
+    struct changelog_event *event;
+    struct fid_slot *slot;
+    char *copy = NULL;
+
+    slot = changelog_slot(changelog, fid);
+    for (size_t i = slot->last; i != NO_EVENT;
+         i = changelog->events[i].previous) {
+        event = &changelog->events[i];
+        if (event->type == RBH_FET_XATTR && !event->dropped
+         && event->lustre == lustre && xattr_equal(event->xattr, xattr))
+            return 0;
+    }
+
+    if (xattr != NULL) {
+        copy = strndup(xattr, XATTR_NAME_MAX);
+        if (copy == NULL)
+            return -1;
+    }
+
+    event = changelog_push(changelog, RBH_FET_XATTR, fid, index);
+    event->xattr = copy;
+    event->lustre = lustre;
+    return 0;
+}
+
+/* Refreshing an entry that is deleted later in the batch would only fail */
+static void
+changelog_push_delete(struct changelog_iterator *changelog,
+                      const struct lu_fid *fid, uint64_t index)
+{
+    struct changelog_event *event;
+
+    event = changelog_push(changelog, RBH_FET_DELETE, fid, index);
+    for (size_t i = event->previous; i != NO_EVENT;
+         i = changelog->events[i].previous) {
+        event = &changelog->events[i];
+        if (event->type == RBH_FET_UPSERT || event->type == RBH_FET_XATTR)
+            event->dropped = true;
+    }
+}
+
+static int
+changelog_push_record(struct changelog_iterator *changelog,
+                      const struct changelog_rec *record)
+{
+    const uint16_t flags = record->cr_flags & CLF_FLAGMASK;
+    const char *name = changelog_rec_name(record);
+    const uint64_t index = record->cr_index;
+    /* Fields of records are packed, copy fids to keep them aligned */
+    const struct lu_fid tfid = record->cr_tfid;
+    const struct lu_fid pfid = record->cr_pfid;
+    struct changelog_ext_rename *rename;
+    struct lu_fid spfid;
+    struct lu_fid sfid;
+    uint64_t extra_flags = 0;
+    const char *xattr = NULL;
+
+    switch (record->cr_type) {
+    case CL_CREATE:
+    case CL_MKDIR:
+    case CL_HARDLINK:
+    case CL_SOFTLINK:
+    case CL_MKNOD:
+        if (changelog_push_link(changelog, RBH_FET_LINK, &tfid, &pfid, name,
+                                record->cr_namelen, index))
+            return -1;
+        changelog_push_upsert(changelog, &tfid, RBH_STATX_ALL,
+                              record->cr_type == CL_SOFTLINK, index);
+        changelog_push_upsert(changelog, &pfid, DIRECTORY_STATX, false, index);
+        /* New files and directories get a layout */
+        if (record->cr_type == CL_CREATE || record->cr_type == CL_MKDIR)
+            return changelog_push_xattr(changelog, &tfid, NULL, true, index);
+        return 0;
+    case CL_UNLINK:
+    case CL_RMDIR:
+        if (changelog_push_link(changelog, RBH_FET_UNLINK, &tfid, &pfid, name,
+                                record->cr_namelen, index))
+            return -1;
+        if (record->cr_type == CL_RMDIR || flags & CLF_UNLINK_LAST)
+            changelog_push_delete(changelog, &tfid, index);
+        else
+            changelog_push_upsert(changelog, &tfid,
+                                  RBH_STATX_NLINK | RBH_STATX_CTIME, false,
+                                  index);
+        changelog_push_upsert(changelog, &pfid, DIRECTORY_STATX, false, index);
+        return 0;
+    case CL_RENAME:
+        if (!(record->cr_flags & CLF_RENAME))
+            break;
+        rename = changelog_rec_rename(record);
+        sfid = rename->cr_sfid;
+        spfid = rename->cr_spfid;
+
+        /* The target of the rename existed and was overwritten */
+        if (!fid_is_null(&tfid)) {
+            if (changelog_push_link(changelog, RBH_FET_UNLINK, &tfid, &pfid,
+                                    name, record->cr_namelen, index))
+                return -1;
+            if (flags & CLF_RENAME_LAST)
+                changelog_push_delete(changelog, &tfid, index);
+            else
+                changelog_push_upsert(changelog, &tfid,
+                                      RBH_STATX_NLINK | RBH_STATX_CTIME,
+                                      false, index);
+        }
+
+        if (changelog_push_link(changelog, RBH_FET_UNLINK, &sfid, &spfid,
+                                changelog_rec_sname(record),
+                                changelog_rec_snamelen(record), index)
+         || changelog_push_link(changelog, RBH_FET_LINK, &sfid, &pfid, name,
+                                record->cr_namelen, index))
+            return -1;
+        changelog_push_upsert(changelog, &sfid, RBH_STATX_CTIME, false, index);
+        changelog_push_upsert(changelog, &spfid, DIRECTORY_STATX, false,
+                              index);
+        changelog_push_upsert(changelog, &pfid, DIRECTORY_STATX, false, index);
+        return 0;
+    case CL_MIGRATE:
+        /* A migrated entry gets a new fid, the old one is the source */
+        if (!(record->cr_flags & CLF_RENAME))
+            break;
+        rename = changelog_rec_rename(record);
+        sfid = rename->cr_sfid;
+        spfid = rename->cr_spfid;
+
+        if (changelog_push_link(changelog, RBH_FET_UNLINK, &sfid, &spfid,
+                                changelog_rec_sname(record),
+                                changelog_rec_snamelen(record), index))
+            return -1;
+        changelog_push_delete(changelog, &sfid, index);
+        if (changelog_push_link(changelog, RBH_FET_LINK, &tfid, &pfid, name,
+                                record->cr_namelen, index))
+            return -1;
+        changelog_push_upsert(changelog, &tfid, RBH_STATX_ALL, false, index);
+        return changelog_push_xattr(changelog, &tfid, NULL, true, index);
+    case CL_SETATTR:
+        changelog_push_upsert(changelog, &tfid, SETATTR_STATX, false, index);
+        return 0;
+    case CL_MTIME:
+    case CL_TRUNC:
+    case CL_CLOSE:
+        changelog_push_upsert(changelog, &tfid, DATA_STATX, false, index);
+        return 0;
+    case CL_CTIME:
+        changelog_push_upsert(changelog, &tfid, RBH_STATX_CTIME, false, index);
+        return 0;
+    case CL_ATIME:
+        changelog_push_upsert(changelog, &tfid, RBH_STATX_ATIME, false, index);
+        return 0;
+    case CL_SETXATTR:
+        if (record->cr_flags & CLF_EXTRA_FLAGS)
+            extra_flags = changelog_rec_extra_flags(record)->cr_extra_flags;
+        /* Without the name of the xattr, refresh all of them */
+        if (extra_flags & CLFE_XATTR)
+            xattr = changelog_rec_xattr(record)->cr_xattr;
+        return changelog_push_xattr(changelog, &tfid, xattr, false, index);
+    case CL_LAYOUT:
+    case CL_HSM:
+    case CL_FLRW:
+    case CL_RESYNC:
+        return changelog_push_xattr(changelog, &tfid, NULL, true, index);
+    default:
+        /* Other records (marks, opens, ...) do not change the namespace */
+        return 0;
+    }
+
+    /* A rename record without its rename extension */
+    errno = EINVAL;
+    return -1;
+}
+
+static void
+changelog_reset(struct changelog_iterator *changelog)
+{
+    for (size_t i = 0; i < changelog->count; i++) {
+        free(changelog->events[i].name);
+        free(changelog->events[i].xattr);
+    }
+
+    for (size_t i = 0; i < changelog->slots_count; i++)
+        changelog->slots[i].last = NO_EVENT;
+
+    changelog->records_count = 0;
+    changelog->count = 0;
+    changelog->index = 0;
+}
+
+static int
+changelog_fill(struct changelog_iterator *changelog)
+{
+    while (changelog->records_count < changelog->batch_size) {
+        const struct changelog_rec *record;
+
+        record = rbh_iter_next(changelog->records);
+        if (record == NULL) {
+            if (errno != ENODATA)
+                return -1;
+            changelog->exhausted = true;
+            break;
+        }
+
+        if (changelog_push_record(changelog, record))
+            return -1;
+
+        changelog->records_count++;
+        changelog->last = record->cr_index;
+    }
+
+    return 0;
+}
+
+static void
+changelog_consume(struct changelog_iterator *changelog, uint64_t index)
+{
+    if (changelog->consumed != NULL && *changelog->consumed < index)
+        *changelog->consumed = index;
+}
+
+static struct rbh_fsevent *
+event2fsevent(const struct changelog_event *event)
+{
+    const struct rbh_value XATTRS_ALL = {
+        .type = RBH_VT_SEQUENCE,
+    };
+    const struct rbh_value TRUE = {
+        .type = RBH_VT_BOOLEAN,
+        .boolean = true,
+    };
+    const struct rbh_value xattr_name = {
+        .type = RBH_VT_STRING,
+        .string = event->xattr,
+    };
+    const struct rbh_value xattr_names = {
+        .type = RBH_VT_SEQUENCE,
+        .sequence = {
+            .values = &xattr_name,
+            .count = 1,
+        },
+    };
+    const struct rbh_value statx = {
+        .type = RBH_VT_UINT32,
+        .uint32 = event->statx,
+    };
+    struct rbh_value_pair hints[2];
+    struct rbh_value enrich = {
+        .type = RBH_VT_MAP,
+        .map = {
+            .pairs = hints,
+            .count = 0,
+        },
+    };
+    const struct rbh_value_pair pair = {
+        .key = RBH_LUSTRE_ENRICH,
+        .value = &enrich,
+    };
+    const struct rbh_value_map xattrs = {
+        .pairs = &pair,
+        .count = 1,
+    };
+    struct rbh_id *parent_id = NULL;
+    struct rbh_fsevent *fsevent;
+    struct rbh_id *id;
+    int save_errno;
+
+    id = rbh_id_from_lu_fid(&event->fid);
+    if (id == NULL)
+        return NULL;
+
+    switch (event->type) {
+    case RBH_FET_UPSERT:
+        hints[enrich.map.count].key = "statx";
+        hints[enrich.map.count++].value = &statx;
+        if (event->symlink) {
+            hints[enrich.map.count].key = "symlink";
+            hints[enrich.map.count++].value = &TRUE;
+        }
+        fsevent = rbh_fsevent_upsert_new(id, &xattrs, NULL, NULL);
+        break;
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        parent_id = rbh_id_from_lu_fid(&event->parent_fid);
+        if (parent_id == NULL) {
+            fsevent = NULL;
+            break;
+        }
+
+        if (event->type == RBH_FET_UNLINK) {
+            fsevent = rbh_fsevent_unlink_new(id, parent_id, event->name);
+            break;
+        }
+
+        hints[enrich.map.count].key = "path";
+        hints[enrich.map.count++].value = &TRUE;
+        fsevent = rbh_fsevent_link_new(id, &xattrs, parent_id, event->name);
+        break;
+    case RBH_FET_DELETE:
+        fsevent = rbh_fsevent_delete_new(id);
+        break;
+    case RBH_FET_XATTR:
+        if (event->lustre) {
+            hints[enrich.map.count].key = "lustre";
+            hints[enrich.map.count++].value = &TRUE;
+        } else {
+            hints[enrich.map.count].key = "xattrs";
+            hints[enrich.map.count++].value =
+                event->xattr ? &xattr_names : &XATTRS_ALL;
+        }
+        fsevent = rbh_fsevent_xattr_new(id, &xattrs);
+        break;
+    default:
+        __builtin_unreachable();
+    }
+
+    save_errno = errno;
+    free(parent_id);
+    free(id);
+    errno = save_errno;
+    return fsevent;
+}
+
+static const void *
+changelog_iter_next(void *iterator)
+{
+    struct changelog_iterator *changelog = iterator;
+
+    free(changelog->fsevent);
+    changelog->fsevent = NULL;
+
+    while (true) {
+        while (changelog->index < changelog->count) {
+            const struct changelog_event *event =
+                &changelog->events[changelog->index];
+
+            if (event->dropped) {
+                changelog->index++;
+                continue;
+            }
+
+            changelog->fsevent = event2fsevent(event);
+            if (changelog->fsevent == NULL)
+                return NULL;
+            changelog->index++;
+
+            /* The events of a record are contiguous */
+            changelog_consume(changelog, event->index - 1);
+            return changelog->fsevent;
+        }
+
+        if (changelog->records_count > 0)
+            changelog_consume(changelog, changelog->last);
+
+        if (changelog->exhausted) {
+            errno = ENODATA;
+            return NULL;
+        }
+
+        changelog_reset(changelog);
+        if (changelog_fill(changelog))
+            return NULL;
+    }
+}
+
+static void
+changelog_iter_destroy(void *iterator)
+{
+    struct changelog_iterator *changelog = iterator;
+
+    changelog_reset(changelog);
+    rbh_iter_destroy(changelog->records);
+    free(changelog->fsevent);
+    free(changelog->slots);
+    free(changelog->events);
+    free(changelog);
+}
+
+static const struct rbh_iterator_operations CHANGELOG_ITER_OPS = {
+    .next = changelog_iter_next,
+    .destroy = changelog_iter_destroy,
+};
+
+static const struct rbh_iterator CHANGELOG_ITERATOR = {
+    .ops = &CHANGELOG_ITER_OPS,
+};
+
+struct rbh_iterator *
+lustre_changelog_fsevents(struct rbh_iterator *records, size_t batch_size,
+                          uint64_t *consumed)
+{
+    struct changelog_iterator *changelog;
+    size_t capacity;
+    int save_errno;
+
+    if (batch_size == 0 || batch_size > SIZE_MAX / CHANGELOG_MAX_EVENTS / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+    capacity = batch_size * CHANGELOG_MAX_EVENTS;
+
+    changelog = malloc(sizeof(*changelog));
+    if (changelog == NULL)
+        return NULL;
+
+    changelog->events = reallocarray(NULL, capacity,
+                                     sizeof(*changelog->events));
+    if (changelog->events == NULL)
+        goto out_free_changelog;
+
+    /* Keep the hash table at most half full */
+    changelog->slots_count = 1;
+    while (changelog->slots_count < 2 * capacity)
+        changelog->slots_count <<= 1;
+
+    changelog->slots = reallocarray(NULL, changelog->slots_count,
+                                    sizeof(*changelog->slots));
+    if (changelog->slots == NULL)
+        goto out_free_events;
+
+    changelog->iterator = CHANGELOG_ITERATOR;
+    changelog->records = records;
+    changelog->consumed = consumed;
+    changelog->batch_size = batch_size;
+    changelog->last = 0;
+    changelog->fsevent = NULL;
+    changelog->exhausted = false;
+    changelog->count = 0;
+    changelog_reset(changelog);
+
+    return &changelog->iterator;
+
+out_free_events:
+    save_errno = errno;
+    free(changelog->events);
+    errno = save_errno;
+out_free_changelog:
+    save_errno = errno;
+    free(changelog);
+    errno = save_errno;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                              lustre changelog                              |
+ *----------------------------------------------------------------------------*/
+
+struct lustre_changelog {
+    struct rbh_iterator iterator;
+
+    struct rbh_iterator *fsevents;
+    char *mdtname;
+    char *reader;
+    /* The index of the last record whose fsevents were all yielded */
+    uint64_t consumed;
+    /* The index of the last record cleared from the changelog */
+    uint64_t cleared;
+};
+
+static const void *
+lustre_changelog_iter_next(void *iterator)
+{
+    struct lustre_changelog *changelog = iterator;
+
+    return rbh_iter_next(changelog->fsevents);
+}
+
+static void
+lustre_changelog_iter_destroy(void *iterator)
+{
+    struct lustre_changelog *changelog = iterator;
+
+    rbh_iter_destroy(changelog->fsevents);
+    free(changelog->mdtname);
+    free(changelog->reader);
+    free(changelog);
+}
+
+static const struct rbh_iterator_operations LUSTRE_CHANGELOG_ITER_OPS = {
+    .next = lustre_changelog_iter_next,
+    .destroy = lustre_changelog_iter_destroy,
+};
+
+static const struct rbh_iterator LUSTRE_CHANGELOG_ITERATOR = {
+    .ops = &LUSTRE_CHANGELOG_ITER_OPS,
+};
+
+struct rbh_iterator *
+rbh_lustre_changelog_new(const char *mdtname, const char *reader,
+                         size_t batch_size)
+{
+    struct lustre_changelog *changelog;
+    struct rbh_iterator *records;
+    int save_errno;
+
+    if (mdtname == NULL || reader == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    changelog = malloc(sizeof(*changelog));
+    if (changelog == NULL)
+        return NULL;
+
+    changelog->mdtname = strdup(mdtname);
+    if (changelog->mdtname == NULL)
+        goto out_free_changelog;
+
+    changelog->reader = strdup(reader);
+    if (changelog->reader == NULL)
+        goto out_free_mdtname;
+
+    records = llapi_changelog_records(mdtname);
+    if (records == NULL)
+        goto out_free_reader;
+
+    changelog->consumed = 0;
+    changelog->cleared = 0;
+    changelog->fsevents = lustre_changelog_fsevents(records, batch_size,
+                                                    &changelog->consumed);
+    if (changelog->fsevents == NULL) {
+        save_errno = errno;
+        rbh_iter_destroy(records);
+        errno = save_errno;
+        goto out_free_reader;
+    }
+
+    changelog->iterator = LUSTRE_CHANGELOG_ITERATOR;
+    return &changelog->iterator;
+
+out_free_reader:
+    save_errno = errno;
+    free(changelog->reader);
+    errno = save_errno;
+out_free_mdtname:
+    save_errno = errno;
+    free(changelog->mdtname);
+    errno = save_errno;
+out_free_changelog:
+    save_errno = errno;
+    free(changelog);
+    errno = save_errno;
+    return NULL;
+}
+
+int
+rbh_lustre_changelog_ack(struct rbh_iterator *iterator)
+{
+    struct lustre_changelog *changelog = (struct lustre_changelog *)iterator;
+    int rc;
+
+    if (iterator->ops != &LUSTRE_CHANGELOG_ITER_OPS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (changelog->consumed <= changelog->cleared)
+        return 0;
+
+    rc = llapi_changelog_clear(changelog->mdtname, changelog->reader,
+                               changelog->consumed);
+    if (rc) {
+        errno = -rc;
+        return -1;
+    }
+
+    changelog->cleared = changelog->consumed;
+    return 0;
+}
@@ -0,0 +1,449 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "robinhood/backends/lustre.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/backends/posix_internal.h"
+#include "robinhood/fsentry.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/statx.h"
+
+/* Fetch the Lustre attributes of fsentries apart from the walk that yields
+ * them
+ *
+ * Workers pull fsentries from the input iterator, open them through their ID,
+ * call rbh_backend_get_attribute("lustre") on them, and queue the result as an
+ * xattr fsevent. The consumer pops fsevents from that queue, in no particular
+ * order.
+ */
+
+#define ENRICH_QUEUE_SIZE (1 << 10)
+
+struct enrich_item {
+    struct rbh_fsevent *fsevent;
+    int error;
+};
+
+struct lustre_enrich {
+    struct rbh_mut_iterator iterator;
+    struct rbh_backend *backend;
+    int mount_fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    /* Everything below is protected by `lock' */
+    struct rbh_iterator *fsentries;
+    bool exhausted;
+    bool stop;
+
+    struct enrich_item items[ENRICH_QUEUE_SIZE];
+    size_t first_item;
+    size_t item_count;
+    size_t running;
+
+    size_t nb_threads;
+    pthread_t threads[];
+};
+
+/**
+ * Queue an fsevent (or an error, if \p fsevent is NULL) for the consumer
+ *
+ * Returns false if the iterator is being destroyed, in which case \p fsevent
+ * is freed.
+ */
+static bool
+enrich_emit(struct lustre_enrich *enrich, struct rbh_fsevent *fsevent,
+            int error)
+{
+    struct enrich_item *item;
+
+    pthread_mutex_lock(&enrich->lock);
+    while (!enrich->stop && enrich->item_count == ENRICH_QUEUE_SIZE)
+        pthread_cond_wait(&enrich->not_full, &enrich->lock);
+
+    if (enrich->stop) {
+        pthread_mutex_unlock(&enrich->lock);
+        free(fsevent);
+        return false;
+    }
+
+    item = &enrich->items[
+        (enrich->first_item + enrich->item_count++) % ENRICH_QUEUE_SIZE
+        ];
+    item->fsevent = fsevent;
+    item->error = error;
+
+    pthread_cond_signal(&enrich->not_empty);
+    pthread_mutex_unlock(&enrich->lock);
+    return true;
+}
+
+/**
+ * Copy the next fsentry to enrich
+ *
+ * Returns NULL once there is nothing left to enrich (errno is set to ENODATA),
+ * or on error.
+ */
+static struct rbh_fsentry *
+enrich_next_fsentry(struct lustre_enrich *enrich)
+{
+    const struct rbh_fsentry *fsentry;
+    struct rbh_fsentry *copy = NULL;
+    int save_errno = ENODATA;
+
+    pthread_mutex_lock(&enrich->lock);
+    if (enrich->stop || enrich->exhausted)
+        goto out_unlock;
+
+    fsentry = rbh_iter_next(enrich->fsentries);
+    if (fsentry == NULL) {
+        save_errno = errno;
+        /* Input iterators are not expected to recover from errors */
+        enrich->exhausted = true;
+        goto out_unlock;
+    }
+
+    if (!(fsentry->mask & RBH_FP_ID)) {
+        save_errno = EINVAL;
+        goto out_unlock;
+    }
+
+    /* `fsentry' is only valid until the next call to rbh_iter_next() */
+    copy = rbh_fsentry_new(
+            &fsentry->id,
+            fsentry->mask & RBH_FP_PARENT_ID ? &fsentry->parent_id : NULL,
+            fsentry->mask & RBH_FP_NAME ? fsentry->name : NULL,
+            fsentry->mask & RBH_FP_STATX ? fsentry->statx : NULL,
+            NULL, NULL, NULL
+            );
+    save_errno = errno;
+
+out_unlock:
+    pthread_mutex_unlock(&enrich->lock);
+    errno = save_errno;
+    return copy;
+}
+
+/**
+ * Fetch the "lustre" attribute of an fsentry
+ *
+ * Returns 0 and sets \p fsevent to NULL if \p fsentry has no such attribute.
+ */
+static int
+enrich_fsentry(struct lustre_enrich *enrich, const struct rbh_fsentry *fsentry,
+               struct rbh_value_pair *pairs, struct rbh_sstack *values,
+               struct rbh_fsevent **fsevent)
+{
+    struct lustre_attribute_arg arg = {
+        .values = values,
+    };
+    struct rbh_value_map xattrs;
+    int save_errno;
+    int count;
+
+    *fsevent = NULL;
+    arg.fd = posix_open_by_id(enrich->mount_fd, &fsentry->id);
+    if (arg.fd < 0)
+        return -1;
+
+    if (fsentry->mask & RBH_FP_STATX
+     && fsentry->statx->stx_mask & RBH_STATX_TYPE) {
+        arg.mode = fsentry->statx->stx_mode;
+    } else {
+        struct stat statbuf;
+
+        if (fstat(arg.fd, &statbuf)) {
+            save_errno = errno;
+            close(arg.fd);
+            errno = save_errno;
+            return -1;
+        }
+        arg.mode = statbuf.st_mode;
+    }
+
+    count = rbh_backend_get_attribute(enrich->backend, "lustre", &arg, pairs);
+    save_errno = errno;
+    /* Ignore errors on close */
+    close(arg.fd);
+    if (count < 0) {
+        errno = save_errno;
+        return -1;
+    }
+
+    if (count == 0)
+        return 0;
+
+    xattrs.pairs = pairs;
+    xattrs.count = count;
+
+    /* Merge the attributes where a walk would have stored them, if possible */
+    if (fsentry->mask & RBH_FP_PARENT_ID && fsentry->mask & RBH_FP_NAME)
+        *fsevent = rbh_fsevent_ns_xattr_new(&fsentry->id, &xattrs,
+                                            &fsentry->parent_id,
+                                            fsentry->name);
+    else
+        *fsevent = rbh_fsevent_xattr_new(&fsentry->id, &xattrs);
+
+    return *fsevent == NULL ? -1 : 0;
+}
+
+static void
+sstack_clear(struct rbh_sstack *sstack)
+{
+    size_t readable;
+
+    while (true) {
+        int rc;
+
+        rbh_sstack_peek(sstack, &readable);
+        if (readable == 0)
+            break;
+
+        rc = rbh_sstack_pop(sstack, readable);
+        assert(rc == 0);
+    }
+}
+
+static void *
+enrich_work(void *arg)
+{
+    struct rbh_value_pair pairs[LUSTRE_ATTRIBUTE_MAX_PAIRS];
+    struct lustre_enrich *enrich = arg;
+    struct rbh_sstack *values;
+
+    /* The layout of a widely striped file takes a lot of values */
+    values = rbh_sstack_new(1 << 16);
+    if (values == NULL) {
+        enrich_emit(enrich, NULL, errno);
+        goto out_stop;
+    }
+
+    while (true) {
+        struct rbh_fsevent *fsevent;
+        struct rbh_fsentry *fsentry;
+        int save_errno;
+        int rc;
+
+        fsentry = enrich_next_fsentry(enrich);
+        if (fsentry == NULL) {
+            if (errno == ENODATA)
+                break;
+            if (!enrich_emit(enrich, NULL, errno))
+                break;
+            continue;
+        }
+
+        rc = enrich_fsentry(enrich, fsentry, pairs, values, &fsevent);
+        save_errno = errno;
+        free(fsentry);
+        sstack_clear(values);
+
+        if (rc == 0 && fsevent == NULL)
+            /* There is nothing to merge */
+            continue;
+
+        if (rc && (save_errno == ESTALE || save_errno == ENOENT))
+            /* The entry was deleted since it was walked */
+            continue;
+
+        if (!enrich_emit(enrich, fsevent, save_errno))
+            break;
+    }
+
+    rbh_sstack_destroy(values);
+
+out_stop:
+    pthread_mutex_lock(&enrich->lock);
+    if (--enrich->running == 0)
+        pthread_cond_broadcast(&enrich->not_empty);
+    pthread_mutex_unlock(&enrich->lock);
+    return NULL;
+}
+
+static void *
+lustre_enrich_iter_next(void *iterator)
+{
+    struct lustre_enrich *enrich = iterator;
+    struct enrich_item item;
+
+    pthread_mutex_lock(&enrich->lock);
+    while (enrich->item_count == 0 && enrich->running > 0)
+        pthread_cond_wait(&enrich->not_empty, &enrich->lock);
+
+    if (enrich->item_count == 0) {
+        pthread_mutex_unlock(&enrich->lock);
+        errno = ENODATA;
+        return NULL;
+    }
+
+    item = enrich->items[enrich->first_item];
+    enrich->first_item = (enrich->first_item + 1) % ENRICH_QUEUE_SIZE;
+    enrich->item_count--;
+    pthread_cond_signal(&enrich->not_full);
+    pthread_mutex_unlock(&enrich->lock);
+
+    if (item.fsevent == NULL)
+        errno = item.error;
+    return item.fsevent;
+}
+
+static void
+lustre_enrich_stop(struct lustre_enrich *enrich, size_t nb_threads)
+{
+    pthread_mutex_lock(&enrich->lock);
+    enrich->stop = true;
+    pthread_cond_broadcast(&enrich->not_full);
+    pthread_mutex_unlock(&enrich->lock);
+
+    for (size_t i = 0; i < nb_threads; i++)
+        pthread_join(enrich->threads[i], NULL);
+}
+
+static void
+lustre_enrich_free(struct lustre_enrich *enrich)
+{
+    for (size_t i = 0; i < enrich->item_count; i++)
+        free(enrich->items[
+            (enrich->first_item + i) % ENRICH_QUEUE_SIZE
+            ].fsevent);
+
+    pthread_cond_destroy(&enrich->not_full);
+    pthread_cond_destroy(&enrich->not_empty);
+    pthread_mutex_destroy(&enrich->lock);
+    close(enrich->mount_fd);
+    free(enrich);
+}
+
+static void
+lustre_enrich_iter_destroy(void *iterator)
+{
+    struct lustre_enrich *enrich = iterator;
+
+    lustre_enrich_stop(enrich, enrich->nb_threads);
+    rbh_iter_destroy(enrich->fsentries);
+    lustre_enrich_free(enrich);
+}
+
+static const struct rbh_mut_iterator_operations LUSTRE_ENRICH_ITER_OPS = {
+    .next = lustre_enrich_iter_next,
+    .destroy = lustre_enrich_iter_destroy,
+};
+
+static const struct rbh_mut_iterator LUSTRE_ENRICH_ITER = {
+    .ops = &LUSTRE_ENRICH_ITER_OPS,
+};
+
+struct rbh_mut_iterator *
+lustre_enrich_new(struct rbh_backend *backend, const char *root,
+                  struct rbh_iterator *fsentries, size_t nb_threads)
+{
+    struct lustre_enrich *enrich;
+    int save_errno;
+    int rc;
+
+    if (nb_threads == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    enrich = malloc(sizeof(*enrich) + nb_threads * sizeof(*enrich->threads));
+    if (enrich == NULL)
+        return NULL;
+
+    enrich->mount_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (enrich->mount_fd < 0)
+        goto out_free_enrich;
+
+    rc = pthread_mutex_init(&enrich->lock, NULL);
+    if (rc) {
+        errno = rc;
+        goto out_close_mount_fd;
+    }
+
+    rc = pthread_cond_init(&enrich->not_empty, NULL);
+    if (rc) {
+        errno = rc;
+        goto out_destroy_lock;
+    }
+
+    rc = pthread_cond_init(&enrich->not_full, NULL);
+    if (rc) {
+        errno = rc;
+        goto out_destroy_not_empty;
+    }
+
+    enrich->iterator = LUSTRE_ENRICH_ITER;
+    enrich->backend = backend;
+    enrich->fsentries = fsentries;
+    enrich->exhausted = false;
+    enrich->stop = false;
+    enrich->first_item = 0;
+    enrich->item_count = 0;
+    enrich->running = nb_threads;
+    enrich->nb_threads = nb_threads;
+
+    for (size_t i = 0; i < nb_threads; i++) {
+        rc = pthread_create(&enrich->threads[i], NULL, enrich_work, enrich);
+        if (rc) {
+            /* The threads that were not started will never stop running */
+            pthread_mutex_lock(&enrich->lock);
+            enrich->running -= nb_threads - i;
+            pthread_mutex_unlock(&enrich->lock);
+
+            lustre_enrich_stop(enrich, i);
+            /* The caller keeps ownership of `fsentries' */
+            lustre_enrich_free(enrich);
+            errno = rc;
+            return NULL;
+        }
+    }
+
+    return &enrich->iterator;
+
+out_destroy_not_empty:
+    pthread_cond_destroy(&enrich->not_empty);
+out_destroy_lock:
+    pthread_mutex_destroy(&enrich->lock);
+out_close_mount_fd:
+    save_errno = errno;
+    close(enrich->mount_fd);
+    errno = save_errno;
+out_free_enrich:
+    save_errno = errno;
+    free(enrich);
+    errno = save_errno;
+    return NULL;
+}
+
+struct rbh_mut_iterator *
+rbh_lustre_enrich_new(struct rbh_backend *backend,
+                      struct rbh_iterator *fsentries, size_t nb_threads)
+{
+    struct posix_backend *lustre = (struct posix_backend *)backend;
+
+    if (backend->id != RBH_BI_LUSTRE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return lustre_enrich_new(backend, lustre->root, fsentries, nb_threads);
+}
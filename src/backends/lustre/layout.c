@@ -0,0 +1,509 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <lustre/lustreapi.h>
+#include <lustre/lustre_user.h>
+
+#include "robinhood/backends/lustre_internal.h"
+
+/* Layouts are stored in little endian, liblustreapi swabs them as needed */
+
+struct lov_component {
+    const char *objects;
+    uint16_t object_count;
+    uint64_t stripe_count;
+    uint64_t stripe_size;
+    uint64_t pattern;
+    uint32_t flags;
+    uint32_t mirror_id;
+    uint64_t begin;
+    uint64_t end;
+    char pool[LOV_MAXPOOLNAME + 1];
+};
+
+/* Mimic the conversions of llapi_layout_get_by_xattr() */
+static uint64_t
+llapi_pattern(uint32_t pattern)
+{
+    switch (pattern) {
+    case LOV_PATTERN_RAID0:
+        return LLAPI_LAYOUT_RAID0;
+#ifdef LOV_PATTERN_OVERSTRIPING
+    case LOV_PATTERN_RAID0 | LOV_PATTERN_OVERSTRIPING:
+        return LLAPI_LAYOUT_OVERSTRIPING;
+#endif
+    case LOV_PATTERN_MDT:
+        return LLAPI_LAYOUT_MDT;
+    }
+    return pattern;
+}
+
+static uint64_t
+llapi_stripe_count(uint16_t stripe_count)
+{
+    switch (stripe_count) {
+    case 0:
+        return LLAPI_LAYOUT_DEFAULT;
+    case (uint16_t)LOV_ALL_STRIPES:
+        return LLAPI_LAYOUT_WIDE;
+    }
+    return stripe_count;
+}
+
+/**
+ * Decode a plain layout (a struct lov_user_md_v1 or v3)
+ *
+ * @param buf       the layout to decode
+ * @param size      the size of \p buf in bytes
+ * @param component the component to fill
+ * @param gen       where to store the layout generation (may be NULL)
+ *
+ * @return          0 on success, -1 on error and errno is set appropriately
+ *
+ * @error EINVAL    \p buf is truncated
+ * @error ENOTSUP   \p buf is not a plain layout
+ *
+ * \p component points at \p buf, not at a copy of its objects.
+ */
+static int
+lov_md_decode(const char *buf, size_t size, struct lov_component *component,
+              uint32_t *gen)
+{
+    struct lov_user_md_v3 lum;
+    size_t header_size;
+    size_t available;
+    uint32_t pattern;
+
+    if (size < sizeof(struct lov_user_md_v1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* A struct lov_user_md_v1 is a prefix of a struct lov_user_md_v3 */
+    memcpy(&lum, buf, size < sizeof(lum) ? size : sizeof(lum));
+
+    switch (le32toh(lum.lmm_magic)) {
+    case LOV_USER_MAGIC_V1:
+        header_size = sizeof(struct lov_user_md_v1);
+        component->pool[0] = '\0';
+        break;
+    case LOV_USER_MAGIC_V3:
+    case LOV_USER_MAGIC_SPECIFIC:
+        header_size = sizeof(lum);
+        if (size < header_size) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(component->pool, lum.lmm_pool_name, LOV_MAXPOOLNAME);
+        component->pool[LOV_MAXPOOLNAME] = '\0';
+        break;
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    pattern = le32toh(lum.lmm_pattern);
+    component->pattern = llapi_pattern(pattern);
+    component->stripe_size = le32toh(lum.lmm_stripe_size) ? :
+                             LLAPI_LAYOUT_DEFAULT;
+    component->stripe_count =
+        llapi_stripe_count(le16toh(lum.lmm_stripe_count));
+    if (gen != NULL)
+        *gen = le16toh(lum.lmm_layout_gen);
+
+    /* Released files and directories have a stripe count, but no object */
+    available = (size - header_size) / sizeof(struct lov_user_ost_data_v1);
+    component->objects = buf + header_size;
+    component->object_count = pattern & LOV_PATTERN_F_RELEASED ? 0 :
+                              le16toh(lum.lmm_stripe_count);
+    if (component->object_count > available)
+        component->object_count = available;
+
+    return 0;
+}
+
+/**
+ * Decode a composite layout (a struct lov_comp_md_v1)
+ *
+ * @param buf           the layout to decode
+ * @param size          the size of \p buf in bytes
+ * @param components    where to store a newly allocated array of components
+ * @param count         where to store the number of elements of \p components
+ * @param flags         where to store the flags of the layout
+ * @param mirror_count  where to store the number of mirrors of the layout
+ * @param gen           where to store the layout generation
+ *
+ * @return              0 on success, -1 on error and errno is set
+ *                      appropriately
+ */
+static int
+lov_comp_md_decode(const char *buf, size_t size,
+                   struct lov_component **components, uint16_t *count,
+                   uint32_t *flags, uint32_t *mirror_count, uint32_t *gen)
+{
+    struct lov_comp_md_v1 lcm;
+    int save_errno;
+
+    if (size < sizeof(lcm)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&lcm, buf, sizeof(lcm));
+
+    *count = le16toh(lcm.lcm_entry_count);
+    *flags = le16toh(lcm.lcm_flags);
+    *mirror_count = le16toh(lcm.lcm_mirror_count) + 1;
+    *gen = le32toh(lcm.lcm_layout_gen);
+
+    if ((size - sizeof(lcm)) / sizeof(struct lov_comp_md_entry_v1) < *count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *components = calloc(*count ? : 1, sizeof(**components));
+    if (*components == NULL)
+        return -1;
+
+    for (uint16_t i = 0; i < *count; i++) {
+        struct lov_component *component = &(*components)[i];
+        struct lov_comp_md_entry_v1 lcme;
+        uint32_t offset;
+        uint32_t length;
+
+        memcpy(&lcme, buf + sizeof(lcm) + i * sizeof(lcme), sizeof(lcme));
+        offset = le32toh(lcme.lcme_offset);
+        length = le32toh(lcme.lcme_size);
+        if (offset > size || length > size - offset) {
+            errno = EINVAL;
+            goto out_free_components;
+        }
+
+        if (lov_md_decode(buf + offset, length, component, NULL))
+            goto out_free_components;
+
+        component->flags = le32toh(lcme.lcme_flags);
+        component->mirror_id = mirror_id_of(le32toh(lcme.lcme_id));
+        component->begin = le64toh(lcme.lcme_extent.e_start);
+        component->end = le64toh(lcme.lcme_extent.e_end);
+    }
+
+    return 0;
+
+out_free_components:
+    save_errno = errno;
+    free(*components);
+    errno = save_errno;
+    return -1;
+}
+
+/* Pad strings so that the values pushed after them remain aligned */
+static const char *
+push_string(struct rbh_sstack *values, const char *string)
+{
+    const size_t alignment = alignof(struct rbh_value);
+    size_t length = strlen(string) + 1;
+    char *copy;
+
+    copy = rbh_sstack_push(values, NULL,
+                           (length + alignment - 1) & ~(alignment - 1));
+    if (copy == NULL)
+        return NULL;
+
+    return memcpy(copy, string, length);
+}
+
+static int
+fill_pair(const char *key, const struct rbh_value *value,
+          struct rbh_value_pair *pair, struct rbh_sstack *values)
+{
+    pair->key = key;
+    pair->value = rbh_sstack_push(values, value, sizeof(*value));
+    return pair->value == NULL ? -1 : 0;
+}
+
+static int
+fill_uint32_pair(const char *key, uint32_t integer,
+                 struct rbh_value_pair *pair, struct rbh_sstack *values)
+{
+    const struct rbh_value value = {
+        .type = RBH_VT_UINT32,
+        .uint32 = integer,
+    };
+
+    return fill_pair(key, &value, pair, values);
+}
+
+static int
+fill_sequence_pair(const char *key, const struct rbh_value *items,
+                   size_t count, struct rbh_value_pair *pair,
+                   struct rbh_sstack *values)
+{
+    const struct rbh_value value = {
+        .type = RBH_VT_SEQUENCE,
+        .sequence = {
+            .values = rbh_sstack_push(values, items, count * sizeof(*items)),
+            .count = count,
+        },
+    };
+
+    if (value.sequence.values == NULL)
+        return -1;
+
+    return fill_pair(key, &value, pair, values);
+}
+
+static const char *
+magic2str(uint32_t magic)
+{
+    switch (magic) {
+    case LOV_USER_MAGIC_V1:
+        return "LOV_USER_MAGIC_V1";
+    case LOV_USER_MAGIC_COMP_V1:
+        return "LOV_USER_MAGIC_COMP_V1";
+#ifdef HAVE_LOV_USER_MAGIC_SEL
+    case LOV_USER_MAGIC_SEL:
+        return "LOV_USER_MAGIC_SEL";
+#endif
+    case LOV_USER_MAGIC_V3:
+        return "LOV_USER_MAGIC_V3";
+    case LOV_USER_MAGIC_SPECIFIC:
+        return "LOV_USER_MAGIC_SPECIFIC";
+    }
+    __builtin_unreachable();
+}
+
+enum component_attribute {
+    CA_STRIPE_COUNT,
+    CA_STRIPE_SIZE,
+    CA_PATTERN,
+    CA_COMP_FLAGS,
+    CA_POOL,
+    CA_MIRROR_ID,
+    CA_BEGIN,
+    CA_END,
+    CA_COUNT,
+};
+
+static const char * const COMPONENT_KEYS[] = {
+    [CA_STRIPE_COUNT] = "stripe_count",
+    [CA_STRIPE_SIZE] = "stripe_size",
+    [CA_PATTERN] = "pattern",
+    [CA_COMP_FLAGS] = "comp_flags",
+    [CA_POOL] = "pool",
+    [CA_MIRROR_ID] = "mirror_id",
+    [CA_BEGIN] = "begin",
+    [CA_END] = "end",
+};
+
+static struct rbh_value
+uint64_value(uint64_t integer)
+{
+    const struct rbh_value value = {
+        .type = RBH_VT_UINT64,
+        .uint64 = integer,
+    };
+
+    return value;
+}
+
+static struct rbh_value
+uint32_value(uint32_t integer)
+{
+    const struct rbh_value value = {
+        .type = RBH_VT_UINT32,
+        .uint32 = integer,
+    };
+
+    return value;
+}
+
+/**
+ * Fill the per-component sequences of a layout
+ *
+ * @return          the number of filled \p pairs on success, -1 on error and
+ *                  errno is set appropriately
+ */
+static int
+fill_components(const struct lov_component *components, uint16_t count,
+                bool composite, uint16_t mode, struct rbh_value_pair *pairs,
+                struct rbh_sstack *values)
+{
+    const size_t nb_attributes = composite ? CA_COUNT : CA_MIRROR_ID;
+    struct rbh_value *items;
+    struct rbh_value *osts;
+    size_t ost_count = 0;
+    int subcount = 0;
+    int save_errno;
+
+    for (uint16_t i = 0; i < count; i++) {
+        /* Uninstantiated components are summed up by a single -1 */
+        if (!composite || components[i].flags == LCME_FL_INIT)
+            ost_count += components[i].object_count;
+        else
+            ost_count += 1;
+    }
+
+    items = reallocarray(NULL, nb_attributes * count + ost_count ? : 1,
+                         sizeof(*items));
+    if (items == NULL)
+        return -1;
+    osts = &items[nb_attributes * count];
+    ost_count = 0;
+
+    for (uint16_t i = 0; i < count; i++) {
+        const struct lov_component *component = &components[i];
+        struct rbh_value pool = {
+            .type = RBH_VT_STRING,
+            .string = push_string(values, component->pool),
+        };
+
+        if (pool.string == NULL)
+            goto out_free_items;
+
+        items[CA_STRIPE_COUNT * count + i] =
+            uint64_value(component->stripe_count);
+        items[CA_STRIPE_SIZE * count + i] =
+            uint64_value(component->stripe_size);
+        items[CA_PATTERN * count + i] = uint64_value(component->pattern);
+        items[CA_COMP_FLAGS * count + i] = uint32_value(component->flags);
+        items[CA_POOL * count + i] = pool;
+        if (composite) {
+            items[CA_MIRROR_ID * count + i] =
+                uint32_value(component->mirror_id);
+            items[CA_BEGIN * count + i] = uint64_value(component->begin);
+            items[CA_END * count + i] = uint64_value(component->end);
+        }
+
+        if (composite && component->flags != LCME_FL_INIT) {
+            osts[ost_count++] = uint64_value(-1);
+            continue;
+        }
+
+        for (uint16_t j = 0; j < component->object_count; j++) {
+            struct lov_user_ost_data_v1 object;
+
+            memcpy(&object, component->objects + j * sizeof(object),
+                   sizeof(object));
+            osts[ost_count++] = uint64_value(le32toh(object.l_ost_idx));
+        }
+    }
+
+    for (size_t i = 0; i < nb_attributes; i++) {
+        if (fill_sequence_pair(COMPONENT_KEYS[i], &items[i * count], count,
+                               &pairs[subcount++], values))
+            goto out_free_items;
+    }
+
+    if (!S_ISDIR(mode)
+     && fill_sequence_pair("ost", osts, ost_count, &pairs[subcount++], values))
+        goto out_free_items;
+
+    free(items);
+    return subcount;
+
+out_free_items:
+    save_errno = errno;
+    free(items);
+    errno = save_errno;
+    return -1;
+}
+
+int
+lustre_layout_from_lov(const void *lov, size_t size, uint16_t mode,
+                       struct rbh_value_pair *pairs,
+                       struct rbh_sstack *values)
+{
+    struct lov_component *components;
+    struct lov_component component = { 0 };
+    uint32_t mirror_count = 0;
+    bool composite = false;
+    uint32_t flags = 0;
+    uint16_t count = 1;
+    int subcount = 0;
+    int save_errno;
+    uint32_t magic;
+    uint32_t gen;
+    int rc;
+
+    if (size < sizeof(magic)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&magic, lov, sizeof(magic));
+    magic = le32toh(magic);
+
+    switch (magic) {
+    case LOV_USER_MAGIC_V1:
+    case LOV_USER_MAGIC_V3:
+    case LOV_USER_MAGIC_SPECIFIC:
+        if (lov_md_decode(lov, size, &component, &gen))
+            return -1;
+        components = &component;
+        break;
+    case LOV_USER_MAGIC_COMP_V1:
+#ifdef HAVE_LOV_USER_MAGIC_SEL
+    case LOV_USER_MAGIC_SEL:
+#endif
+        if (lov_comp_md_decode(lov, size, &components, &count, &flags,
+                               &mirror_count, &gen))
+            return -1;
+        composite = true;
+        break;
+    default:
+        /* Foreign layouts in particular */
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (fill_uint32_pair("flags", flags, &pairs[subcount++], values))
+        goto out_free_components;
+
+    if (S_ISREG(mode)) {
+        const struct rbh_value magic_value = {
+            .type = RBH_VT_STRING,
+            .string = push_string(values, magic2str(magic)),
+        };
+
+        if (magic_value.string == NULL
+         || fill_pair("magic", &magic_value, &pairs[subcount++], values)
+         || fill_uint32_pair("gen", gen, &pairs[subcount++], values))
+            goto out_free_components;
+    }
+
+    if (composite && fill_uint32_pair("mirror_count", mirror_count,
+                                      &pairs[subcount++], values))
+        goto out_free_components;
+
+    rc = fill_components(components, count, composite, mode,
+                         &pairs[subcount], values);
+    if (rc < 0)
+        goto out_free_components;
+    subcount += rc;
+
+    if (composite)
+        free(components);
+    return subcount;
+
+out_free_components:
+    save_errno = errno;
+    if (composite)
+        free(components);
+    errno = save_errno;
+    return -1;
+}
@@ -2,7 +2,10 @@
 # include "config.h"
 #endif
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -16,6 +19,8 @@
 #include "robinhood/backends/posix.h"
 #include "robinhood/backends/posix_internal.h"
 #include "robinhood/backends/lustre.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/id.h"
 
 #ifndef HAVE_LUSTRE_FILE_HANDLE
 /* This structure is not defined before 2.15, so we define it to retrieve the
@@ -44,6 +49,7 @@ struct iterator_data {
 
 static __thread struct rbh_value_pair *_inode_xattrs;
 static __thread ssize_t *_inode_xattrs_count;
+static __thread const struct rbh_id *_id;
 static __thread struct rbh_sstack *_values;
 static __thread uint16_t mode;
 
@@ -145,10 +151,19 @@ static int
 xattrs_get_fid(int fd, struct rbh_value_pair *pairs)
 {
     size_t handle_size = sizeof(struct lustre_file_handle);
-    static struct file_handle *handle;
+    static __thread struct file_handle *handle;
     int mount_id;
     int rc;
 
+    /* The ID of the entry was built from its file handle, which holds its fid
+     * already (cf. rbh_id_from_lu_fid())
+     */
+    if (_id != NULL && _id->size == LUSTRE_ID_SIZE) {
+        rc = fill_binary_pair("fid", rbh_lu_fid_from_id(_id),
+                              sizeof(struct lu_fid), pairs);
+        return rc ? : 1;
+    }
+
     if (handle == NULL) {
         /* Per-thread initialization of `handle' */
         handle = malloc(sizeof(*handle) + handle_size);
@@ -582,7 +597,6 @@ xattrs_get_magic_and_gen(int fd, struct rbh_value_pair *pairs)
 {
     char buffer[XATTR_VALUE_MAX_VFS_SIZE];
     const char *lov_buf = NULL;
-    int save_errno;
 
     if (_inode_xattrs != NULL) {
         for (int i = 0; i < *_inode_xattrs_count; ++i) {
@@ -598,12 +612,8 @@ xattrs_get_magic_and_gen(int fd, struct rbh_value_pair *pairs)
         ssize_t length = XATTR_VALUE_MAX_VFS_SIZE;
 
         length = fgetxattr(fd, XATTR_LUSTRE_LOV, buffer, length);
-        if (length == -1) {
-            save_errno = errno;
-            free(buffer);
-            errno = save_errno;
+        if (length == -1)
             return -1;
-        }
 
         lov_buf = buffer;
     }
@@ -645,7 +655,7 @@ xattrs_get_dir_data_striping(int fd)
 }
 
 /**
- * Record a file's layout attributes:
+ * Record a file's layout attributes, as liblustreapi decodes them:
  *  - main flags
  *  - magic number and layout generation if the file is regular
  *  - mirror_count if the file is composite
@@ -667,7 +677,7 @@ xattrs_get_dir_data_striping(int fd)
  * @return          number of filled \p pairs
  */
 static int
-xattrs_get_layout(int fd, struct rbh_value_pair *pairs)
+xattrs_get_layout_by_llapi(int fd, struct rbh_value_pair *pairs)
 {
     struct iterator_data data = { .comp_index = 0 };
     struct llapi_layout *layout;
@@ -766,6 +776,88 @@ err:
     return rc ? rc : subcount;
 }
 
+/**
+ * Find the raw layout of the current entry among its inode xattrs
+ *
+ * @return          the value of the "lustre.lov" (or "trusted.lov") xattr of
+ *                  the entry, or NULL if its inode xattrs were not all listed
+ */
+static const struct rbh_value *
+inode_xattrs_get_lov(void)
+{
+    if (_inode_xattrs == NULL)
+        return NULL;
+
+    for (int i = 0; i < *_inode_xattrs_count; ++i) {
+        const struct rbh_value *value = _inode_xattrs[i].value;
+
+        if (value == NULL || value->type != RBH_VT_BINARY)
+            continue;
+
+        if (!strcmp(_inode_xattrs[i].key, XATTR_LUSTRE_LOV)
+         || !strcmp(_inode_xattrs[i].key, "trusted.lov"))
+            return value;
+    }
+
+    return NULL;
+}
+
+/**
+ * Record a file's layout attributes (cf. xattrs_get_layout_by_llapi())
+ *
+ * @param fd        file descriptor to check
+ * @param pairs     list of pairs to fill
+ *
+ * @return          number of filled \p pairs
+ *
+ * The layout is decoded from the "lustre.lov" xattr of the entry, which is
+ * reused if it was already fetched along with the other inode xattrs. Only
+ * the layouts lustre_layout_from_lov() does not know about, and entries
+ * without such an xattr, are left to liblustreapi, which queries the MDS
+ * again.
+ */
+static int
+xattrs_get_layout(int fd, struct rbh_value_pair *pairs)
+{
+    char buffer[XATTR_VALUE_MAX_VFS_SIZE];
+    const struct rbh_value *lov;
+    const void *data = buffer;
+    ssize_t size;
+    int rc;
+
+    if (S_ISLNK(mode))
+        return 0;
+
+    if (S_ISDIR(mode)) {
+        /* The default striping of a directory is not in an xattr, and the
+         * ioctl does not tell how much of the buffer it filled: rely on the
+         * buffer being zeroed beforehand.
+         */
+        memset(buffer, 0, sizeof(buffer));
+        if (ioctl(fd, LL_IOC_LOV_GETSTRIPE, (void *)buffer))
+            return errno == ENODATA ? 0 : -1;
+        size = sizeof(buffer);
+    } else if ((lov = inode_xattrs_get_lov()) != NULL) {
+        data = lov->binary.data;
+        size = lov->binary.size;
+    } else {
+        size = fgetxattr(fd, XATTR_LUSTRE_LOV, buffer, sizeof(buffer));
+        /* Entries without a layout of their own (those created with
+         * O_LOV_DELAY_CREATE for instance) get the default layout from
+         * liblustreapi
+         */
+        if (size == -1)
+            return errno == ENODATA ? xattrs_get_layout_by_llapi(fd, pairs)
+                                    : -1;
+    }
+
+    rc = lustre_layout_from_lov(data, size, mode, pairs, _values);
+    if (rc == -1 && errno == ENOTSUP)
+        return xattrs_get_layout_by_llapi(fd, pairs);
+
+    return rc;
+}
+
 static int
 xattrs_get_mdt_info(int fd, struct rbh_value_pair *pairs)
 {
@@ -871,7 +963,7 @@ free_lum:
 }
 
 static int
-_get_attrs(const int fd, const uint16_t entry_mode,
+_get_attrs(const int fd, const struct rbh_id *id, const uint16_t entry_mode,
            int (*attrs_funcs[])(int, struct rbh_value_pair *),
            int nb_attrs_funcs,
            struct rbh_value_pair *inode_xattrs,
@@ -885,6 +977,7 @@ _get_attrs(const int fd, const uint16_t entry_mode,
     _inode_xattrs_count = inode_xattrs_count;
     _inode_xattrs = inode_xattrs;
     mode = entry_mode;
+    _id = id;
     _values = values;
 
     for (int i = 0; i < nb_attrs_funcs; ++i) {
@@ -907,24 +1000,75 @@ lustre_get_attrs(const int fd, const uint16_t mode,
         xattrs_get_hsm, xattrs_get_layout, xattrs_get_mdt_info
     };
 
-    return _get_attrs(fd, mode, xattrs_funcs,
+    return _get_attrs(fd, NULL, mode, xattrs_funcs,
                       sizeof(xattrs_funcs) / sizeof(xattrs_funcs[0]),
                       NULL, NULL, pairs, values);
 }
 
+/* The namespace xattrs each of the xattrs_get_*() functions fills */
+static const char * const FID_XATTRS[] = {
+    "fid", NULL
+};
+static const char * const HSM_XATTRS[] = {
+    "hsm_state", "hsm_archive_id", NULL
+};
+static const char * const LAYOUT_XATTRS[] = {
+    "flags", "magic", "gen", "mirror_count", "stripe_count", "stripe_size",
+    "pattern", "comp_flags", "pool", "mirror_id", "begin", "end", "ost", NULL
+};
+static const char * const MDT_INFO_XATTRS[] = {
+    "child_mdt_idx", "mdt_hash", "mdt_hash_flags", "mdt_count", "mdt_index",
+    NULL
+};
+
+/**
+ * Check whether any of a list of namespace xattrs is requested
+ *
+ * @param requested the namespace xattrs to fill (NULL, or a map with a count
+ *                  of 0, means every xattr)
+ * @param keys      a NULL terminated list of namespace xattrs
+ *
+ * @return          true if any of \p keys is in \p requested, false otherwise
+ */
+static bool
+is_requested(const struct rbh_value_map *requested, const char * const *keys)
+{
+    if (requested == NULL || requested->count == 0)
+        return true;
+
+    for (const char * const *key = keys; *key != NULL; key++) {
+        for (size_t i = 0; i < requested->count; i++) {
+            if (strcmp(requested->pairs[i].key, *key) == 0)
+                return true;
+        }
+    }
+
+    return false;
+}
+
 static int
-lustre_ns_xattrs_callback(const int fd, const uint16_t mode,
+lustre_ns_xattrs_callback(const int fd, const struct rbh_id *id,
+                          const uint16_t mode,
+                          const struct rbh_value_map *requested,
                           struct rbh_value_pair *inode_xattrs,
                           ssize_t *inode_xattrs_count,
                           struct rbh_value_pair *pairs,
                           struct rbh_sstack *values)
 {
-    int (*xattrs_funcs[])(int, struct rbh_value_pair *) = {
-        xattrs_get_fid, xattrs_get_hsm, xattrs_get_layout, xattrs_get_mdt_info
-    };
-
-    return _get_attrs(fd, mode, xattrs_funcs,
-                      sizeof(xattrs_funcs) / sizeof(xattrs_funcs[0]),
+    int (*xattrs_funcs[4])(int, struct rbh_value_pair *);
+    int nb_xattrs_funcs = 0;
+
+    /* Layout decoding in particular is expensive, skip it if possible */
+    if (is_requested(requested, FID_XATTRS))
+        xattrs_funcs[nb_xattrs_funcs++] = xattrs_get_fid;
+    if (is_requested(requested, HSM_XATTRS))
+        xattrs_funcs[nb_xattrs_funcs++] = xattrs_get_hsm;
+    if (is_requested(requested, LAYOUT_XATTRS))
+        xattrs_funcs[nb_xattrs_funcs++] = xattrs_get_layout;
+    if (is_requested(requested, MDT_INFO_XATTRS))
+        xattrs_funcs[nb_xattrs_funcs++] = xattrs_get_mdt_info;
+
+    return _get_attrs(fd, id, mode, xattrs_funcs, nb_xattrs_funcs,
                       inode_xattrs, inode_xattrs_count, pairs, values);
 }
 
@@ -932,12 +1076,7 @@ static int
 lustre_backend_get_attribute(void *backend, const char *attr_name,
                              void *_arg, struct rbh_value_pair *data)
 {
-    struct arg_t {
-        int fd;
-        uint16_t mode;
-        struct rbh_sstack *values;
-    };
-    struct arg_t *arg = (struct arg_t *)_arg;
+    struct lustre_attribute_arg *arg = _arg;
 
     (void)backend;
 
@@ -961,9 +1100,124 @@ lustre_iterator_new(const char *root, const char *entry, int statx_sync_type)
     return lustre_iter;
 }
 
+/* The MDT of a directory, cf. posix_walker_new() */
+static int
+lustre_dir_partition(int fd, const struct rbh_id *id)
+{
+    int mdt_index;
+    int rc;
+
+    if (id == NULL || id->size != LUSTRE_ID_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* This is a lookup in the FLD cache of the client, not a request */
+    rc = llapi_get_mdt_index_by_fid(fd, rbh_lu_fid_from_id(id), &mdt_index);
+    if (rc) {
+        errno = -rc;
+        return -1;
+    }
+
+    return mdt_index;
+}
+
+    /*--------------------------------------------------------------------*
+     |                            get_option()                            |
+     *--------------------------------------------------------------------*/
+
+static int
+lustre_get_threads_per_mdt(struct posix_backend *lustre, void *data,
+                           size_t *data_size)
+{
+    unsigned int threads_per_mdt = 0;
+
+    if (lustre->dir_partition == lustre_dir_partition)
+        threads_per_mdt = lustre->walker_threads / lustre->walker_partitions;
+
+    if (*data_size < sizeof(threads_per_mdt)) {
+        *data_size = sizeof(threads_per_mdt);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &threads_per_mdt, sizeof(threads_per_mdt));
+    *data_size = sizeof(threads_per_mdt);
+    return 0;
+}
+
+static int
+lustre_backend_get_option(void *backend, unsigned int option, void *data,
+                          size_t *data_size)
+{
+    struct posix_backend *lustre = backend;
+
+    switch (option) {
+    case RBH_LBO_THREADS_PER_MDT:
+        return lustre_get_threads_per_mdt(lustre, data, data_size);
+    }
+
+    return posix_backend_get_option(backend, option, data, data_size);
+}
+
+    /*--------------------------------------------------------------------*
+     |                            set_option()                            |
+     *--------------------------------------------------------------------*/
+
+static int
+lustre_set_threads_per_mdt(struct posix_backend *lustre, const void *data,
+                           size_t data_size)
+{
+    unsigned int threads_per_mdt;
+    int mdt_count;
+    int rc;
+
+    if (data_size != sizeof(threads_per_mdt)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&threads_per_mdt, data, sizeof(threads_per_mdt));
+
+    if (threads_per_mdt == 0) {
+        lustre->walker_threads = 0;
+        lustre->walker_partitions = 1;
+        lustre->dir_partition = NULL;
+        return 0;
+    }
+
+    rc = llapi_get_obd_count(lustre->root, &mdt_count, 1);
+    if (rc) {
+        errno = -rc;
+        return -1;
+    }
+
+    if (mdt_count <= 0 || threads_per_mdt > UINT_MAX / mdt_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lustre->walker_threads = threads_per_mdt * mdt_count;
+    lustre->walker_partitions = mdt_count;
+    lustre->dir_partition = lustre_dir_partition;
+    return 0;
+}
+
+static int
+lustre_backend_set_option(void *backend, unsigned int option,
+                          const void *data, size_t data_size)
+{
+    struct posix_backend *lustre = backend;
+
+    switch (option) {
+    case RBH_LBO_THREADS_PER_MDT:
+        return lustre_set_threads_per_mdt(lustre, data, data_size);
+    }
+
+    return posix_backend_set_option(backend, option, data, data_size);
+}
+
 static const struct rbh_backend_operations LUSTRE_BACKEND_OPS = {
-    .get_option = posix_backend_get_option,
-    .set_option = posix_backend_set_option,
+    .get_option = lustre_backend_get_option,
+    .set_option = lustre_backend_set_option,
     .branch = posix_backend_branch,
     .root = posix_root,
     .filter = posix_backend_filter,
@@ -981,9 +1235,27 @@ rbh_lustre_backend_new(const char *path)
         return NULL;
 
     lustre->iter_new = lustre_iterator_new;
+    lustre->ns_xattrs_callback = lustre_ns_xattrs_callback;
+    /* Resolving paths is expensive on the MDS, FIDs are not */
+    lustre->open_by_handle = true;
     lustre->backend.id = RBH_BI_LUSTRE;
     lustre->backend.name = RBH_LUSTRE_BACKEND_NAME;
     lustre->backend.ops = &LUSTRE_BACKEND_OPS;
 
     return &lustre->backend;
 }
+
+struct rbh_mut_iterator *
+rbh_lustre_rescan(struct rbh_backend *backend, struct rbh_iterator *fids,
+                  const struct rbh_filter_projection *projection)
+{
+    struct posix_backend *lustre = (struct posix_backend *)backend;
+
+    if (backend->id != RBH_BI_LUSTRE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return posix_rescan_new(lustre->root, fids, lustre->statx_sync_type,
+                            projection, lustre->ns_xattrs_callback);
+}
@@ -10,6 +10,10 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <sys/stat.h>
 
 #include "robinhood/fsentry.h"
@@ -22,6 +26,16 @@
  |                            fsentry_from_bson()                             |
  *----------------------------------------------------------------------------*/
 
+/* fsentry_from_bson() makes two passes over a document: the first one computes
+ * the size of the fsentry to allocate, the second one decodes the document
+ * directly in it.
+ *
+ * Decoding a map or a sequence requires knowing how many elements it holds
+ * upfront. The first pass records those counts (in the order the second pass
+ * needs them) so that the second pass does not have to iterate over each map
+ * and sequence twice.
+ */
+
     /*--------------------------------------------------------------------*
      |                         bson_iter_count()                          |
      *--------------------------------------------------------------------*/
@@ -62,22 +76,178 @@ bson_iter_count(bson_iter_t *iter)
     return count;
 }
 
+#define ITEM_COUNTS_ONSTACK 256
+
+/* The number of elements of the maps and sequences of a document, in the order
+ * they are decoded.
+ *
+ * Only the first ITEM_COUNTS_ONSTACK maps and sequences are recorded, the
+ * elements of the following ones are counted when they are decoded.
+ */
+struct item_counts {
+    uint32_t items[ITEM_COUNTS_ONSTACK];
+    size_t count;
+    size_t index;
+};
+
+/* Reserve a slot for the map or sequence about to be sized */
+static size_t
+item_counts_reserve(struct item_counts *counts)
+{
+    if (counts->count == ITEM_COUNTS_ONSTACK)
+        return ITEM_COUNTS_ONSTACK;
+    return counts->count++;
+}
+
+static void
+item_counts_set(struct item_counts *counts, size_t slot, size_t count)
+{
+    if (slot < ITEM_COUNTS_ONSTACK)
+        counts->items[slot] = count;
+}
+
+/* Get the number of elements of the map or sequence `iter' points at */
+static size_t
+item_counts_next(struct item_counts *counts, const bson_iter_t *iter)
+{
+    bson_iter_t subiter;
+
+    if (counts != NULL && counts->index < counts->count)
+        return counts->items[counts->index++];
+
+    bson_iter_recurse(iter, &subiter);
+    return bson_iter_count(&subiter);
+}
+
+    /*--------------------------------------------------------------------*
+     |                         bson_buffer_copy()                         |
+     *--------------------------------------------------------------------*/
+
+/* Decoded values do not point at the BSON document they were decoded from,
+ * every string and binary is copied in the buffer they are decoded to.
+ */
+static const char *
+bson_buffer_copy(const char *data, size_t size, char **buffer, size_t *bufsize)
+{
+    char *copy;
+
+    copy = aligned_memalloc(alignof(*copy), size, buffer, bufsize);
+    if (copy == NULL)
+        return NULL;
+
+    if (size > 0)
+        memcpy(copy, data, size);
+    return copy;
+}
+
+    /*--------------------------------------------------------------------*
+     |                     bson_iter_rbh_value_size()                     |
+     *--------------------------------------------------------------------*/
+
+/* The functions in this section compute how much memory decoding a value
+ * requires. They follow the allocations of the decoding functions, but they
+ * assume the worst case for alignment paddings, so that the result does not
+ * depend on the address the decoding starts at.
+ */
+
+static size_t
+bson_iter_rbh_value_size(const bson_iter_t *iter, struct item_counts *counts);
+
+static size_t
+bson_iter_rbh_value_map_size(bson_iter_t *iter, struct item_counts *counts)
+{
+    size_t slot = item_counts_reserve(counts);
+    size_t count = 0;
+    size_t size = 0;
+
+    while (bson_iter_next(iter)) {
+        if (!bson_type_is_supported(bson_iter_type(iter)))
+            continue;
+
+        size += strlen(bson_iter_key(iter)) + 1;
+        size += bson_iter_rbh_value_size(iter, counts);
+        count++;
+    }
+    item_counts_set(counts, slot, count);
+
+    /* map->pairs */
+    size += alignof(struct rbh_value_pair) - 1;
+    size += count * sizeof(struct rbh_value_pair);
+
+    /* map->pairs[*].value */
+    size += alignof(struct rbh_value) - 1;
+    size += count * sizeof(struct rbh_value);
+
+    return size;
+}
+
+static size_t
+bson_iter_rbh_value_sequence_size(bson_iter_t *iter,
+                                  struct item_counts *counts)
+{
+    size_t slot = item_counts_reserve(counts);
+    size_t count = 0;
+    size_t size = 0;
+
+    while (bson_iter_next(iter)) {
+        if (!bson_type_is_supported(bson_iter_type(iter)))
+            continue;
+
+        size += bson_iter_rbh_value_size(iter, counts);
+        count++;
+    }
+    item_counts_set(counts, slot, count);
+
+    /* value->sequence.values */
+    size += alignof(struct rbh_value) - 1;
+    size += count * sizeof(struct rbh_value);
+
+    return size;
+}
+
+static size_t
+bson_iter_rbh_value_size(const bson_iter_t *iter, struct item_counts *counts)
+{
+    bson_iter_t subiter;
+    uint32_t length;
+
+    switch (bson_iter_type(iter)) {
+    case BSON_TYPE_UTF8:
+        bson_iter_utf8(iter, &length);
+        return length + 1;
+    case BSON_TYPE_DOCUMENT:
+        bson_iter_recurse(iter, &subiter);
+        return bson_iter_rbh_value_map_size(&subiter, counts);
+    case BSON_TYPE_ARRAY:
+        bson_iter_recurse(iter, &subiter);
+        return bson_iter_rbh_value_sequence_size(&subiter, counts);
+    case BSON_TYPE_BINARY:
+        bson_iter_binary(iter, NULL, &length, NULL);
+        return length;
+    default:
+        return 0;
+    }
+}
+
     /*--------------------------------------------------------------------*
      |                     bson_iter_rbh_value_map()                      |
      *--------------------------------------------------------------------*/
 
 static bool
-bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
-                    char **buffer, size_t *bufsize);
+_bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
+                     struct item_counts *counts, char **buffer,
+                     size_t *bufsize);
 
 static bool
 bson_iter_rbh_value_map(bson_iter_t *iter, struct rbh_value_map *map,
-                        size_t count, char **buffer, size_t *bufsize)
+                        size_t count, struct item_counts *counts,
+                        char **buffer, size_t *bufsize)
 {
     struct rbh_value_pair *pairs;
     struct rbh_value *values;
     size_t size = *bufsize;
     char *data = *buffer;
+    size_t i = 0;
 
     pairs = aligned_memalloc(alignof(*pairs), count * sizeof(*pairs), &data,
                              &size);
@@ -91,22 +261,33 @@ bson_iter_rbh_value_map(bson_iter_t *iter, struct rbh_value_map *map,
 
     map->pairs = pairs;
     while (bson_iter_next(iter)) {
-        if (!bson_iter_rbh_value(iter, values, &data, &size)) {
-            if (errno == ENOTSUP)
-                /* Ignore */
-                continue;
+        const char *key = bson_iter_key(iter);
+
+        if (!bson_type_is_supported(bson_iter_type(iter)))
+            /* Ignore */
+            continue;
+
+        if (i == count)
+            goto out_einval;
+
+        if (!_bson_iter_rbh_value(iter, &values[i], counts, &data, &size))
             return false;
-        }
 
-        pairs->key = bson_iter_key(iter);
-        pairs->value = values++;
-        pairs++;
+        pairs[i].key = bson_buffer_copy(key, strlen(key) + 1, &data, &size);
+        if (pairs[i].key == NULL)
+            return false;
+        pairs[i].value = &values[i];
+        i++;
     }
-    map->count = count;
+    map->count = i;
 
     *buffer = data;
     *bufsize = size;
     return true;
+
+out_einval:
+    errno = EINVAL;
+    return false;
 }
 
     /*--------------------------------------------------------------------*
@@ -115,11 +296,13 @@ bson_iter_rbh_value_map(bson_iter_t *iter, struct rbh_value_map *map,
 
 static bool
 bson_iter_rbh_value_sequence(bson_iter_t *iter, struct rbh_value *value,
-                             size_t count, char **buffer, size_t *bufsize)
+                             size_t count, struct item_counts *counts,
+                             char **buffer, size_t *bufsize)
 {
     struct rbh_value *values;
     size_t size = *bufsize;
     char *data = *buffer;
+    size_t i = 0;
 
     value->type = RBH_VT_SEQUENCE;
     values = aligned_memalloc(alignof(*values), count * sizeof(*values), &data,
@@ -129,56 +312,71 @@ bson_iter_rbh_value_sequence(bson_iter_t *iter, struct rbh_value *value,
 
     value->sequence.values = values;
     while (bson_iter_next(iter)) {
-        if (!bson_iter_rbh_value(iter, values, &data, &size)) {
-            if (errno == ENOTSUP)
-                /* Ignore */
-                continue;
+        if (!bson_type_is_supported(bson_iter_type(iter)))
+            /* Ignore */
+            continue;
+
+        if (i == count)
+            goto out_einval;
+
+        if (!_bson_iter_rbh_value(iter, &values[i], counts, &data, &size))
             return false;
-        }
-        values++;
+        i++;
     }
-    value->sequence.count = count;
+    value->sequence.count = i;
 
     *buffer = data;
     *bufsize = size;
     return true;
+
+out_einval:
+    errno = EINVAL;
+    return false;
 }
 
 static bool
-bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
-                    char **buffer, size_t *bufsize)
+_bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
+                     struct item_counts *counts, char **buffer,
+                     size_t *bufsize)
 {
-    bson_iter_t subiter, tmp;
+    bson_iter_t subiter;
     const uint8_t *data;
+    const char *string;
     uint32_t size;
+    size_t count;
 
     switch (bson_iter_type(iter)) {
     case BSON_TYPE_UTF8:
         value->type = RBH_VT_STRING;
-        value->string = bson_iter_utf8(iter, NULL);
+        string = bson_iter_utf8(iter, &size);
+        value->string = bson_buffer_copy(string, size + 1, buffer, bufsize);
+        if (value->string == NULL)
+            return false;
         break;
     case BSON_TYPE_DOCUMENT:
         value->type = RBH_VT_MAP;
-        bson_iter_recurse(iter, &tmp);
+        count = item_counts_next(counts, iter);
         bson_iter_recurse(iter, &subiter);
-        if (!bson_iter_rbh_value_map(&subiter, &value->map,
-                                     bson_iter_count(&tmp), buffer, bufsize))
+        if (!bson_iter_rbh_value_map(&subiter, &value->map, count, counts,
+                                     buffer, bufsize))
             return false;
         break;
     case BSON_TYPE_ARRAY:
         value->type = RBH_VT_SEQUENCE;
-        bson_iter_recurse(iter, &tmp);
+        count = item_counts_next(counts, iter);
         bson_iter_recurse(iter, &subiter);
         /* We cannot pass just `&value->sequence' as it is an unnamed struct */
-        if (!bson_iter_rbh_value_sequence(&subiter, value,
-                                          bson_iter_count(&tmp), buffer,
-                                          bufsize))
+        if (!bson_iter_rbh_value_sequence(&subiter, value, count, counts,
+                                          buffer, bufsize))
             return false;
         break;
     case BSON_TYPE_BINARY:
         value->type = RBH_VT_BINARY;
         bson_iter_binary(iter, NULL, &size, &data);
-        value->binary.data = (const char *)data;
+        value->binary.data = bson_buffer_copy((const char *)data, size, buffer,
+                                              bufsize);
+        if (value->binary.data == NULL)
+            return false;
         value->binary.size = size;
         break;
     case BSON_TYPE_BOOL:
@@ -210,6 +408,13 @@ bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
     return true;
 }
 
+bool
+bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
+                    char **buffer, size_t *bufsize)
+{
+    return _bson_iter_rbh_value(iter, value, NULL, buffer, bufsize);
+}
+
     /*--------------------------------------------------------------------*
      |                         bson_iter_statx()                          |
      *--------------------------------------------------------------------*/
@@ -790,16 +995,20 @@ _bson_iter_binary(bson_iter_t *iter, bson_subtype_t *subtype,
 }
 
 static bool
-bson_iter_rbh_id(bson_iter_t *iter, struct rbh_id *id)
+bson_iter_rbh_id(bson_iter_t *iter, struct rbh_id *id, char **buffer,
+                 size_t *bufsize)
 {
     bson_subtype_t subtype;
+    const char *data;
 
-    _bson_iter_binary(iter, &subtype, &id->data, &id->size);
+    _bson_iter_binary(iter, &subtype, &data, &id->size);
     if (subtype != BSON_SUBTYPE_BINARY) {
         errno = EINVAL;
         return false;
     }
-    return true;
+
+    id->data = bson_buffer_copy(data, id->size, buffer, bufsize);
+    return id->data != NULL;
 }
 
 enum namespace_token {
@@ -831,14 +1040,15 @@ namespace_tokenizer(const char *key)
 
 static bool
 bson_iter_namespace(bson_iter_t *iter, struct rbh_fsentry *fsentry,
-                    char **buffer, size_t *bufsize)
+                    struct item_counts *counts, char **buffer, size_t *bufsize)
 {
     size_t size = *bufsize;
     char *data = *buffer;
 
     while (bson_iter_next(iter)) {
+        const char *string;
         bson_iter_t subiter;
-        bson_iter_t tmp;
+        uint32_t length;
 
         switch (namespace_tokenizer(bson_iter_key(iter))) {
         case NT_UNKNOWN:
@@ -847,7 +1057,7 @@ bson_iter_namespace(bson_iter_t *iter, struct rbh_fsentry *fsentry,
             if (!BSON_ITER_HOLDS_NULL(iter) && !BSON_ITER_HOLDS_BINARY(iter))
                 goto out_einval;
 
-            if (!bson_iter_rbh_id(iter, &fsentry->parent_id))
+            if (!bson_iter_rbh_id(iter, &fsentry->parent_id, &data, &size))
                 return false;
             fsentry->mask |= RBH_FP_PARENT_ID;
             break;
@@ -855,7 +1065,10 @@ bson_iter_namespace(bson_iter_t *iter, struct rbh_fsentry *fsentry,
             if (!BSON_ITER_HOLDS_UTF8(iter))
                 goto out_einval;
 
-            fsentry->name = bson_iter_utf8(iter, NULL);
+            string = bson_iter_utf8(iter, &length);
+            fsentry->name = bson_buffer_copy(string, length + 1, &data, &size);
+            if (fsentry->name == NULL)
+                return false;
             fsentry->mask |= RBH_FP_NAME;
             break;
         case NT_XATTRS:
@@ -863,9 +1076,9 @@ bson_iter_namespace(bson_iter_t *iter, struct rbh_fsentry *fsentry,
                 goto out_einval;
             bson_iter_recurse(iter, &subiter);
 
-            bson_iter_recurse(iter, &tmp);
             if (!bson_iter_rbh_value_map(&subiter, &fsentry->xattrs.ns,
-                                         bson_iter_count(&tmp), &data, &size))
+                                         item_counts_next(counts, iter),
+                                         counts, &data, &size))
                 return false;
             fsentry->mask |= RBH_FP_NAMESPACE_XATTRS;
             break;
@@ -924,18 +1137,19 @@ fsentry_tokenizer(const char *key)
 
 static bool
 bson_iter_fsentry(bson_iter_t *iter, struct rbh_fsentry *fsentry,
-                  struct rbh_statx *statxbuf, const char **symlink, char **buffer,
-                  size_t *bufsize)
+                  size_t symlink_size, struct item_counts *counts,
+                  char **buffer, size_t *bufsize)
 {
     size_t size = *bufsize;
     char *data = *buffer;
 
     fsentry->mask = 0;
-    *symlink = NULL;
 
     while (bson_iter_next(iter)) {
+        struct rbh_statx *statxbuf;
+        const char *symlink;
         bson_iter_t subiter;
-        bson_iter_t tmp;
+        uint32_t length;
 
         switch (fsentry_tokenizer(bson_iter_key(iter))) {
         case FT_UNKNOWN:
@@ -944,7 +1158,7 @@ bson_iter_fsentry(bson_iter_t *iter, struct rbh_fsentry *fsentry,
             if (!BSON_ITER_HOLDS_BINARY(iter))
                 goto out_einval;
 
-            if (!bson_iter_rbh_id(iter, &fsentry->id))
+            if (!bson_iter_rbh_id(iter, &fsentry->id, &data, &size))
                 return false;
             fsentry->mask |= RBH_FP_ID;
             break;
@@ -953,23 +1167,29 @@ bson_iter_fsentry(bson_iter_t *iter, struct rbh_fsentry *fsentry,
                 goto out_einval;
             bson_iter_recurse(iter, &subiter);
 
-            if (!bson_iter_namespace(&subiter, fsentry, &data, &size))
+            if (!bson_iter_namespace(&subiter, fsentry, counts, &data,
+                                     &size))
                 return false;
             break;
         case FT_SYMLINK:
             if (!BSON_ITER_HOLDS_UTF8(iter))
                 goto out_einval;
 
-            *symlink = bson_iter_utf8(iter, NULL);
+            /* fsentry->symlink is a flexible array, room was made for it */
+            symlink = bson_iter_utf8(iter, &length);
+            if (length + 1 > symlink_size)
+                goto out_einval;
+            memcpy(fsentry->symlink, symlink, length + 1);
+            fsentry->mask |= RBH_FP_SYMLINK;
             break;
         case FT_XATTRS:
             if (!BSON_ITER_HOLDS_DOCUMENT(iter))
                 goto out_einval;
             bson_iter_recurse(iter, &subiter);
 
-            bson_iter_recurse(iter, &tmp);
             if (!bson_iter_rbh_value_map(&subiter, &fsentry->xattrs.inode,
-                                         bson_iter_count(&tmp), &data, &size))
+                                         item_counts_next(counts, iter),
+                                         counts, &data, &size))
                 return false;
             fsentry->mask |= RBH_FP_INODE_XATTRS;
             break;
@@ -978,6 +1198,11 @@ bson_iter_fsentry(bson_iter_t *iter, struct rbh_fsentry *fsentry,
                 goto out_einval;
             bson_iter_recurse(iter, &subiter);
 
+            statxbuf = aligned_memalloc(alignof(*statxbuf), sizeof(*statxbuf),
+                                        &data, &size);
+            if (statxbuf == NULL)
+                return false;
+
             if (!bson_iter_statx(&subiter, statxbuf))
                 return false;
             fsentry->statx = statxbuf;
@@ -995,44 +1220,73 @@ out_einval:
     return false;
 }
 
-static struct rbh_fsentry *
-fsentry_almost_clone(const struct rbh_fsentry *fsentry, const char *symlink)
+/* Compute the size of the buffer bson_iter_fsentry() requires (excluding the
+ * symlink, whose size is stored in `symlink_size')
+ */
+static size_t
+bson_iter_fsentry_size(bson_iter_t *iter, size_t *symlink_size,
+                       struct item_counts *counts)
 {
-    struct {
-        bool id:1;
-        bool parent:1;
-        bool name:1;
-        bool statx:1;
-        bool namespace_xattrs:1;
-        bool inode_xattrs:1;
-    } has = {
-        .id = fsentry->mask & RBH_FP_ID,
-        .parent = fsentry->mask & RBH_FP_PARENT_ID,
-        .name = fsentry->mask & RBH_FP_NAME,
-        .statx = fsentry->mask & RBH_FP_STATX,
-        .namespace_xattrs = fsentry->mask & RBH_FP_NAMESPACE_XATTRS,
-        .inode_xattrs = fsentry->mask & RBH_FP_INODE_XATTRS,
-    };
-
-    return rbh_fsentry_new(has.id ? &fsentry->id : NULL,
-                           has.parent ? &fsentry->parent_id : NULL,
-                           has.name ? fsentry->name : NULL,
-                           has.statx ? fsentry->statx : NULL,
-                           has.namespace_xattrs ? &fsentry->xattrs.ns : NULL,
-                           has.inode_xattrs ? &fsentry->xattrs.inode : NULL,
-                           symlink);
+    bson_iter_t subiter;
+    uint32_t length;
+    size_t size = 0;
+
+    *symlink_size = 0;
+
+    while (bson_iter_next(iter)) {
+        switch (fsentry_tokenizer(bson_iter_key(iter))) {
+        case FT_UNKNOWN:
+            break;
+        case FT_ID:
+            size += bson_iter_rbh_value_size(iter, counts);
+            break;
+        case FT_NAMESPACE:
+            if (!BSON_ITER_HOLDS_DOCUMENT(iter))
+                break;
+            bson_iter_recurse(iter, &subiter);
+
+            while (bson_iter_next(&subiter)) {
+                switch (namespace_tokenizer(bson_iter_key(&subiter))) {
+                case NT_UNKNOWN:
+                    break;
+                case NT_PARENT:
+                case NT_NAME:
+                case NT_XATTRS:
+                    size += bson_iter_rbh_value_size(&subiter, counts);
+                    break;
+                }
+            }
+            break;
+        case FT_SYMLINK:
+            if (!BSON_ITER_HOLDS_UTF8(iter))
+                break;
+
+            bson_iter_utf8(iter, &length);
+            if (length + 1 > *symlink_size)
+                *symlink_size = length + 1;
+            break;
+        case FT_XATTRS:
+            size += bson_iter_rbh_value_size(iter, counts);
+            break;
+        case FT_STATX:
+            size += alignof(struct rbh_statx) - 1;
+            size += sizeof(struct rbh_statx);
+            break;
+        }
+    }
+
+    return size;
 }
 
 struct rbh_fsentry *
 fsentry_from_bson(const bson_t *bson)
 {
-    struct rbh_fsentry fsentry;
-    struct rbh_statx statxbuf;
-    const char *symlink;
+    struct rbh_fsentry *fsentry;
+    struct item_counts counts;
+    size_t symlink_size;
     bson_iter_t iter;
-    char tmp[4096]; /* TODO: figure out a better size than the arbitrary 4096 */
-    size_t bufsize = sizeof(tmp);
-    char *buffer = tmp;
+    size_t bufsize;
+    char *buffer;
 
     if (!bson_iter_init(&iter, bson)) {
         /* XXX: libbson is not quite clear on why this would happen, the code
@@ -1042,13 +1296,30 @@ fsentry_from_bson(const bson_t *bson)
         return NULL;
     }
 
-    if (!bson_iter_fsentry(&iter, &fsentry, &statxbuf, &symlink, &buffer,
-                           &bufsize))
-        /* FIXME: while it is nice to try to parse most fsentries without
-         *        allocating any memory using the "on stack" buffer `tmp', there
-         *        should be a fallback for when that fails.
-         */
+    /* Size the fsentry first, and decode `bson' directly in it */
+    counts.count = counts.index = 0;
+    bufsize = bson_iter_fsentry_size(&iter, &symlink_size, &counts);
+
+    fsentry = malloc(sizeof(*fsentry) + symlink_size + bufsize);
+    if (fsentry == NULL)
         return NULL;
+    buffer = fsentry->symlink + symlink_size;
+
+    bson_iter_init(&iter, bson);
+    if (!bson_iter_fsentry(&iter, fsentry, symlink_size, &counts, &buffer,
+                           &bufsize))
+        goto out_free;
+
+    if ((fsentry->mask & RBH_FP_SYMLINK) && (fsentry->mask & RBH_FP_STATX)
+     && (fsentry->statx->stx_mask & RBH_STATX_TYPE)
+     && !S_ISLNK(fsentry->statx->stx_mode)) {
+        errno = EINVAL;
+        goto out_free;
+    }
+
+    return fsentry;
 
-    return fsentry_almost_clone(&fsentry, symlink);
+out_free:
+    free(fsentry);
+    return NULL;
 }
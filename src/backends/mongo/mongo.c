@@ -10,8 +10,12 @@
 #endif
 
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 
+#include <sys/stat.h>
+
 /* This backend uses libmongoc, from the "mongo-c-driver" project to interact
  * with a MongoDB database.
  *
@@ -85,10 +89,85 @@ static const char *UINT8_TO_STR[256] = {
     "248", "249", "250", "251", "252", "253", "254", "255"
 };
 
+static bool
+fsentry_property_is_namespace(enum rbh_fsentry_property property)
+{
+    return property == RBH_FP_PARENT_ID || property == RBH_FP_NAME
+        || property == RBH_FP_NAMESPACE_XATTRS;
+}
+
+static bool
+filter_uses_namespace(const struct rbh_filter *filter)
+{
+    if (filter == NULL)
+        return false;
+
+    if (rbh_is_comparison_operator(filter->op))
+        return fsentry_property_is_namespace(filter->compare.field.fsentry);
+
+    for (size_t i = 0; i < filter->logical.count; i++) {
+        if (filter_uses_namespace(filter->logical.filters[i]))
+            return true;
+    }
+    return false;
+}
+
+static bool
+sorts_use_namespace(const struct rbh_filter_sort *items, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (fsentry_property_is_namespace(items[i].field.fsentry))
+            return true;
+    }
+    return false;
+}
+
+/* {$match: {$or: [{_id: <ancestor>}, {"ns.ancestors": <ancestor>}]}} */
+static bool
+bson_append_ancestor_match(bson_t *bson, const char *key,
+                           const struct rbh_id *ancestor)
+{
+    bson_t document;
+    bson_t match;
+    bson_t array;
+    bson_t or;
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+        && BSON_APPEND_DOCUMENT_BEGIN(&document, "$match", &match)
+        && BSON_APPEND_ARRAY_BEGIN(&match, "$or", &array)
+        && BSON_APPEND_DOCUMENT_BEGIN(&array, "0", &or)
+        && BSON_APPEND_RBH_ID(&or, MFF_ID, ancestor)
+        && bson_append_document_end(&array, &or)
+        && BSON_APPEND_DOCUMENT_BEGIN(&array, "1", &or)
+        && BSON_APPEND_RBH_ID(&or, MFF_NAMESPACE "." MFF_ANCESTORS, ancestor)
+        && bson_append_document_end(&array, &or)
+        && bson_append_array_end(&match, &array)
+        && bson_append_document_end(&document, &match)
+        && bson_append_document_end(bson, &document);
+}
+
+/* Entries store their links in an array ("ns") which has to be unwound so
+ * that each link yields its own fsentry. Unwinding the whole collection first
+ * is expensive, and it prevents MongoDB from using indexes for the stages
+ * that come after the $unwind.
+ *
+ * When a stage does not reference namespace fields, it gives the same result
+ * whether it runs before or after the $unwind: $match and $sort stages are
+ * then moved ahead of it.
+ *
+ * If `ancestor' is not NULL, only the links under it (and those of `ancestor'
+ * itself) are selected. Entries are selected before the $unwind, and their
+ * links after it.
+ */
 static bson_t *
-bson_pipeline_from_filter_and_options(const struct rbh_filter *filter,
+bson_pipeline_from_filter_and_options(const struct rbh_id *ancestor,
+                                      const struct rbh_filter *filter,
                                       const struct rbh_filter_options *options)
 {
+    bool match_first = !filter_uses_namespace(filter);
+    bool sort_first = match_first
+                   && !sorts_use_namespace(options->sort.items,
+                                           options->sort.count);
     bson_t *pipeline;
     uint8_t i = 0;
     bson_t array;
@@ -102,13 +181,27 @@ bson_pipeline_from_filter_and_options(const struct rbh_filter *filter,
     pipeline = bson_new();
 
     if (BSON_APPEND_ARRAY_BEGIN(pipeline, "pipeline", &array)
+     && (ancestor == NULL
+      || bson_append_ancestor_match(&array, UINT8_TO_STR[i++], ancestor))
+     && (!match_first
+      || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_RBH_FILTER(&stage, "$match", filter)
+       && bson_append_document_end(&array, &stage)))
+     && (!sort_first || options->sort.count == 0
+      || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_RBH_FILTER_SORTS(&stage, "$sort", options->sort.items,
+                                       options->sort.count)
+       && bson_append_document_end(&array, &stage)))
      && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
      && BSON_APPEND_UTF8(&stage, "$unwind", "$" MFF_NAMESPACE)
      && bson_append_document_end(&array, &stage)
-     && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
-     && BSON_APPEND_RBH_FILTER(&stage, "$match", filter)
-     && bson_append_document_end(&array, &stage)
-     && (options->sort.count == 0
+     && (ancestor == NULL
+      || bson_append_ancestor_match(&array, UINT8_TO_STR[i++], ancestor))
+     && (match_first
+      || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_RBH_FILTER(&stage, "$match", filter)
+       && bson_append_document_end(&array, &stage)))
+     && (sort_first || options->sort.count == 0
       || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
        && BSON_APPEND_RBH_FILTER_SORTS(&stage, "$sort", options->sort.items,
                                        options->sort.count)
@@ -133,6 +226,127 @@ bson_pipeline_from_filter_and_options(const struct rbh_filter *filter,
     return NULL;
 }
 
+/*----------------------------------------------------------------------------*
+ |                                 mongo_pool                                 |
+ *----------------------------------------------------------------------------*/
+
+/* A reference counted pool of clients, shared by a backend and its branches */
+struct mongo_pool {
+    mongoc_client_pool_t *clients;
+    char *db;
+    size_t refcount;
+};
+
+static struct mongo_pool *
+mongo_pool_new(const mongoc_uri_t *uri)
+{
+    struct mongo_pool *pool;
+    const char *db;
+    int save_errno;
+
+    db = mongoc_uri_get_database(uri);
+    if (db == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = malloc(sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+
+    pool->db = strdup(db);
+    if (pool->db == NULL) {
+        save_errno = errno;
+        goto out_free_pool;
+    }
+
+    pool->clients = mongoc_client_pool_new(uri);
+    if (pool->clients == NULL) {
+        save_errno = ENOMEM;
+        goto out_free_db;
+    }
+
+#if MONGOC_CHECK_VERSION(1, 4, 0)
+    if (!mongoc_client_pool_set_error_api(pool->clients,
+                                          MONGOC_ERROR_API_VERSION_2)) {
+        /* Should never happen */
+        mongoc_client_pool_destroy(pool->clients);
+        save_errno = EINVAL;
+        goto out_free_db;
+    }
+#endif
+
+    pool->refcount = 1;
+    return pool;
+
+out_free_db:
+    free(pool->db);
+out_free_pool:
+    free(pool);
+    errno = save_errno;
+    return NULL;
+}
+
+static struct mongo_pool *
+mongo_pool_ref(struct mongo_pool *pool)
+{
+    __atomic_add_fetch(&pool->refcount, 1, __ATOMIC_RELAXED);
+    return pool;
+}
+
+static void
+mongo_pool_unref(struct mongo_pool *pool)
+{
+    if (__atomic_sub_fetch(&pool->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    mongoc_client_pool_destroy(pool->clients);
+    free(pool->db);
+    free(pool);
+}
+
+/* A client to perform an operation with, and its "entries" collection */
+struct mongo_handle {
+    mongoc_client_t *client;
+    mongoc_collection_t *entries;
+    /* Whether `client' was checked out of a pool */
+    bool pooled;
+};
+
+/* Check a client out of `pool', without blocking if `wait' is false */
+static int
+mongo_pool_checkout(struct mongo_pool *pool, struct mongo_handle *handle,
+                    bool wait)
+{
+    handle->client = wait ? mongoc_client_pool_pop(pool->clients)
+                          : mongoc_client_pool_try_pop(pool->clients);
+    if (handle->client == NULL) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    handle->entries = mongoc_client_get_collection(handle->client, pool->db,
+                                                   "entries");
+    if (handle->entries == NULL) {
+        mongoc_client_pool_push(pool->clients, handle->client);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    handle->pooled = true;
+    return 0;
+}
+
+static void
+mongo_pool_checkin(struct mongo_pool *pool, struct mongo_handle *handle)
+{
+    if (!handle->pooled)
+        return;
+
+    mongoc_collection_destroy(handle->entries);
+    mongoc_client_pool_push(pool->clients, handle->client);
+}
+
 /*----------------------------------------------------------------------------*
  |                               mongo_iterator                               |
  *----------------------------------------------------------------------------*/
@@ -140,12 +354,14 @@ bson_pipeline_from_filter_and_options(const struct rbh_filter *filter,
 struct mongo_iterator {
     struct rbh_mut_iterator iterator;
     mongoc_cursor_t *cursor;
+    /* The client `cursor' uses is checked back in on destruction */
+    struct mongo_pool *pool;
+    struct mongo_handle handle;
 };
 
-static void *
-mongo_iter_next(void *iterator)
+static const bson_t *
+mongo_iter_next_bson(struct mongo_iterator *mongo_iter)
 {
-    struct mongo_iterator *mongo_iter = iterator;
     bson_error_t error;
     const bson_t *doc;
 
@@ -155,7 +371,7 @@ mongo_iter_next(void *iterator)
     }
 
     if (mongoc_cursor_next(mongo_iter->cursor, &doc))
-        return fsentry_from_bson(doc);
+        return doc;
 
     if (!mongoc_cursor_error(mongo_iter->cursor, &error)) {
         errno = ENODATA;
@@ -178,12 +394,28 @@ mongo_iter_next(void *iterator)
     return NULL;
 }
 
+static void *
+mongo_iter_next(void *iterator)
+{
+    const bson_t *doc;
+
+    doc = mongo_iter_next_bson(iterator);
+    if (doc == NULL)
+        return NULL;
+
+    return fsentry_from_bson(doc);
+}
+
 static void
 mongo_iter_destroy(void *iterator)
 {
     struct mongo_iterator *mongo_iter = iterator;
 
     mongoc_cursor_destroy(mongo_iter->cursor);
+    if (mongo_iter->pool) {
+        mongo_pool_checkin(mongo_iter->pool, &mongo_iter->handle);
+        mongo_pool_unref(mongo_iter->pool);
+    }
     free(mongo_iter);
 }
 
@@ -196,8 +428,19 @@ static const struct rbh_mut_iterator MONGO_ITER = {
     .ops = &MONGO_ITER_OPS,
 };
 
+static void
+mongo_iterator_init(struct mongo_iterator *mongo_iter, mongoc_cursor_t *cursor,
+                    struct mongo_pool *pool, const struct mongo_handle *handle)
+{
+    mongo_iter->iterator = MONGO_ITER;
+    mongo_iter->cursor = cursor;
+    mongo_iter->pool = handle->pooled ? mongo_pool_ref(pool) : NULL;
+    mongo_iter->handle = *handle;
+}
+
 static struct mongo_iterator *
-mongo_iterator_new(mongoc_cursor_t *cursor)
+mongo_iterator_new(mongoc_cursor_t *cursor, struct mongo_pool *pool,
+                   const struct mongo_handle *handle)
 {
     struct mongo_iterator *mongo_iter;
 
@@ -205,9 +448,7 @@ mongo_iterator_new(mongoc_cursor_t *cursor)
     if (mongo_iter == NULL)
         return NULL;
 
-    mongo_iter->iterator = MONGO_ITER;
-    mongo_iter->cursor = cursor;
-
+    mongo_iterator_init(mongo_iter, cursor, pool, handle);
     return mongo_iter;
 }
 
@@ -217,10 +458,105 @@ mongo_iterator_new(mongoc_cursor_t *cursor)
 
 struct mongo_backend {
     struct rbh_backend backend;
+    /* NULL for the branches of a pooled backend */
     mongoc_client_t *client;
     mongoc_collection_t *entries;
+    /* Created on first use, unless the backend is pooled */
+    struct mongo_pool *pool;
+    /* cf. RBH_MBO_POOLED */
+    bool pooled;
+    /* cf. RBH_MBO_BULK_* */
+    struct {
+        size_t max_count;
+        size_t max_size;
+        unsigned int in_flight;
+    } bulk;
+    /* cf. RBH_MBO_UPDATE_PROGRESS */
+    size_t progress;
+    /* cf. RBH_MBO_INDEXED_XATTRS */
+    struct {
+        char **names;
+        size_t count;
+    } indexed_xattrs;
+    /* cf. RBH_MBO_ANCESTORS */
+    bool ancestors;
+    /* cf. RBH_MBO_CURSOR_* */
+    struct {
+        size_t batch_size;
+        size_t prefetch;
+    } cursor;
 };
 
+static struct mongo_pool *
+mongo_backend_pool(struct mongo_backend *mongo)
+{
+    if (mongo->pool == NULL)
+        mongo->pool = mongo_pool_new(mongoc_client_get_uri(mongo->client));
+    return mongo->pool;
+}
+
+/* Pooled backends check a client out of their pool, others use their own */
+static int
+mongo_checkout(struct mongo_backend *mongo, struct mongo_handle *handle,
+               bool wait)
+{
+    if (mongo->pooled)
+        return mongo_pool_checkout(mongo->pool, handle, wait);
+
+    handle->client = mongo->client;
+    handle->entries = mongo->entries;
+    handle->pooled = false;
+    return 0;
+}
+
+/* Iterators that prefetch fsentries read their cursor from another thread: if
+ * the backend is not pooled, they need a client of their own
+ */
+static int
+mongo_checkout_cursor(struct mongo_backend *mongo, struct mongo_handle *handle)
+{
+    if (mongo->cursor.prefetch == 0 || mongo->pooled)
+        return mongo_checkout(mongo, handle, true);
+
+    if (mongo_backend_pool(mongo) == NULL)
+        return -1;
+    return mongo_pool_checkout(mongo->pool, handle, true);
+}
+
+/* Wrap a cursor of fsentries in an iterator, or release it on error */
+static struct rbh_mut_iterator *
+mongo_cursor_iterator(struct mongo_backend *mongo, mongoc_cursor_t *cursor,
+                      struct mongo_handle *handle)
+{
+    struct mongo_iterator *mongo_iter;
+    struct rbh_mut_iterator *iter;
+    int save_errno;
+
+    if (mongo->cursor.batch_size)
+        mongoc_cursor_set_batch_size(cursor, mongo->cursor.batch_size);
+
+    mongo_iter = mongo_iterator_new(cursor, mongo->pool, handle);
+    if (mongo_iter == NULL) {
+        save_errno = errno;
+        mongoc_cursor_destroy(cursor);
+        mongo_pool_checkin(mongo->pool, handle);
+        errno = save_errno;
+        return NULL;
+    }
+
+    if (mongo->cursor.prefetch == 0)
+        return &mongo_iter->iterator;
+
+    iter = rbh_mut_iter_prefetch(&mongo_iter->iterator,
+                                 mongo->cursor.prefetch);
+    if (iter == NULL) {
+        save_errno = errno;
+        mongo_iter_destroy(mongo_iter);
+        errno = save_errno;
+    }
+    return iter;
+}
+
 static int
 mongo_get_option(void *backend, unsigned int option, void *data,
                  size_t *data_size);
@@ -229,6 +565,9 @@ static int
 mongo_set_option(void *backend, unsigned int option, const void *data,
                  size_t data_size);
 
+static int
+mongo_set_ancestors_complete(struct mongo_handle *handle, bool complete);
+
     /*--------------------------------------------------------------------*
      |                               update                               |
      *--------------------------------------------------------------------*/
@@ -261,23 +600,40 @@ _mongoc_collection_create_bulk_operation(
 #endif
 }
 
+#if MONGOC_CHECK_VERSION(1, 7, 0)
+/* > returns false if passed invalid arguments */
+static bool
+bulk_operation_error(const bson_error_t *error)
+{
+    snprintf(rbh_backend_error, sizeof(rbh_backend_error), "mongoc: %s",
+             error->message);
+    errno = RBH_BACKEND_ERROR;
+    return false;
+}
+#endif
+
 static bool
 _mongoc_bulk_operation_update_one(mongoc_bulk_operation_t *bulk,
                                   const bson_t *selector, const bson_t *update,
                                   bool upsert)
 {
 #if MONGOC_CHECK_VERSION(1, 7, 0)
+    bson_error_t error;
+    bool success;
     bson_t opts;
 
     bson_init(&opts);
     if (!BSON_APPEND_BOOL(&opts, "upsert", upsert)) {
+        bson_destroy(&opts);
         errno = ENOBUFS;
-        return NULL;
+        return false;
     }
 
-    /* TODO: handle errors */
-    return mongoc_bulk_operation_update_one_with_opts(bulk, selector, update,
-                                                      &opts, NULL);
+    success = mongoc_bulk_operation_update_one_with_opts(bulk, selector,
+                                                         update, &opts,
+                                                         &error);
+    bson_destroy(&opts);
+    return success || bulk_operation_error(&error);
 #else
     mongoc_bulk_operation_update_one(bulk, selector, update, upsert);
     return true;
@@ -289,15 +645,33 @@ _mongoc_bulk_operation_remove_one(mongoc_bulk_operation_t *bulk,
                                   const bson_t *selector)
 {
 #if MONGOC_CHECK_VERSION(1, 7, 0)
-    /* TODO: handle errors */
+    bson_error_t error;
+
     return mongoc_bulk_operation_remove_one_with_opts(bulk, selector, NULL,
-                                                      NULL);
+                                                      &error)
+        || bulk_operation_error(&error);
 #else
     mongoc_bulk_operation_remove_one(bulk, selector);
     return true;
 #endif
 }
 
+static bool
+_mongoc_bulk_operation_update_many(mongoc_bulk_operation_t *bulk,
+                                   const bson_t *selector, const bson_t *update)
+{
+#if MONGOC_CHECK_VERSION(1, 7, 0)
+    bson_error_t error;
+
+    return mongoc_bulk_operation_update_many_with_opts(bulk, selector, update,
+                                                       NULL, &error)
+        || bulk_operation_error(&error);
+#else
+    mongoc_bulk_operation_update(bulk, selector, update, false);
+    return true;
+#endif
+}
+
 static bson_t *
 bson_selector_from_fsevent(const struct rbh_fsevent *fsevent)
 {
@@ -328,11 +702,11 @@ out_bson_destroy:
 
 static bool
 mongo_bulk_append_fsevent(mongoc_bulk_operation_t *bulk,
-                          const struct rbh_fsevent *fsevent);
+                          const struct rbh_fsevent *fsevent, size_t *size);
 
 static bool
 mongo_bulk_append_unlink_from_link(mongoc_bulk_operation_t *bulk,
-                                   const struct rbh_fsevent *link)
+                                   const struct rbh_fsevent *link, size_t *size)
 {
     const struct rbh_fsevent unlink = {
         .type = RBH_FET_UNLINK,
@@ -346,28 +720,31 @@ mongo_bulk_append_unlink_from_link(mongoc_bulk_operation_t *bulk,
         },
     };
 
-    return mongo_bulk_append_fsevent(bulk, &unlink);
+    return mongo_bulk_append_fsevent(bulk, &unlink, size);
 }
 
+/* `size' is increased by the size of the documents appended to `bulk' */
 static bool
 mongo_bulk_append_fsevent(mongoc_bulk_operation_t *bulk,
-                          const struct rbh_fsevent *fsevent)
+                          const struct rbh_fsevent *fsevent, size_t *size)
 {
     bool upsert = false;
     bson_t *selector;
     bson_t *update;
+    int save_errno;
     bool success;
 
     selector = bson_selector_from_fsevent(fsevent);
     if (selector == NULL)
         return false;
+    *size += selector->len;
 
     switch (fsevent->type) {
     case RBH_FET_DELETE:
         success = _mongoc_bulk_operation_remove_one(bulk, selector);
         break;
     case RBH_FET_LINK:
-        success = mongo_bulk_append_unlink_from_link(bulk, fsevent);
+        success = mongo_bulk_append_unlink_from_link(bulk, fsevent, size);
         if (!success)
             break;
         __attribute__((fallthrough));
@@ -383,101 +760,549 @@ mongo_bulk_append_fsevent(mongoc_bulk_operation_t *bulk,
             errno = save_errno;
             return false;
         }
+        *size += update->len;
 
         success = _mongoc_bulk_operation_update_one(bulk, selector, update,
                                                     upsert);
         bson_destroy(update);
     }
+    save_errno = errno;
     bson_destroy(selector);
+    errno = save_errno;
 
-    if (!success)
-        /* > returns false if passed invalid arguments */
-        errno = EINVAL;
     return success;
 }
 
-static ssize_t
-mongo_bulk_init_from_fsevents(mongoc_bulk_operation_t *bulk,
-                              struct rbh_iterator *fsevents)
+/* When a directory is linked somewhere else, the ancestors of the links under
+ * it change: they are forgotten until rbh_mongo_backend_fix_ancestors() runs.
+ *
+ * (Links are always created without ancestors, those of the directory itself
+ * need not be forgotten.)
+ */
+static bool
+mongo_bulk_append_forget_descendants(mongoc_bulk_operation_t *bulk,
+                                     const struct rbh_id *directory,
+                                     size_t *size)
 {
-    int save_errno = errno;
-    size_t count = 0;
-
-    do {
-        const struct rbh_fsevent *fsevent;
-
-        errno = 0;
-        fsevent = rbh_iter_next(fsevents);
-        if (fsevent == NULL) {
-            if (errno == ENODATA)
-                break;
-            return -1;
-        }
+    bson_t *selector;
+    bson_t *update;
+    int save_errno;
+    bool success;
 
-        if (!mongo_bulk_append_fsevent(bulk, fsevent))
-            return -1;
-        count++;
-    } while (true);
+    selector = BCON_NEW(MFF_NAMESPACE "." MFF_ANCESTORS,
+                        BCON_BIN(BSON_SUBTYPE_BINARY,
+                                 (const uint8_t *)directory->data,
+                                 directory->size));
+    update = BCON_NEW("$unset", "{",
+                          MFF_NAMESPACE ".$[]." MFF_ANCESTORS, BCON_UTF8(""),
+                      "}");
+    *size += selector->len + update->len;
 
+    success = _mongoc_bulk_operation_update_many(bulk, selector, update);
+    save_errno = errno;
+    bson_destroy(update);
+    bson_destroy(selector);
     errno = save_errno;
-    return count;
+    return success;
 }
 
-static ssize_t
-mongo_backend_update(void *backend, struct rbh_iterator *fsevents)
+static bool
+id_equal(const struct rbh_id *first, const struct rbh_id *second)
 {
-    struct mongo_backend *mongo = backend;
-    mongoc_bulk_operation_t *bulk;
-    bson_error_t error;
-    ssize_t count;
-    bson_t reply;
-    uint32_t rc;
+    return first->size == second->size
+        && memcmp(first->data, second->data, first->size) == 0;
+}
 
-    bulk = _mongoc_collection_create_bulk_operation(mongo->entries, false,
-                                                    NULL);
-    if (bulk == NULL) {
-        /* XXX: from libmongoc's documentation:
-         *      > "Errors are propagated when executing the bulk operation"
-         *
-         * We will just assume any error here is related to memory allocation.
-         */
-        errno = ENOMEM;
-        return -1;
-    }
+/* The type of the entry a LINK fsevent refers to is not part of the fsevent.
+ * It is taken from an UPSERT of the same entry right before the LINK (cf.
+ * rbh_sync()), or right after it (cf. lustre changelogs). Entries of an
+ * unknown type may be directories.
+ */
+struct link_tracker {
+    /* The previous fsevent, if it is an UPSERT that sets a type */
+    struct rbh_id *upsert;
+    mode_t type;
+    /* The previous fsevent, if it is a LINK to an entry of an unknown type */
+    struct rbh_id *link;
+};
 
-    count = mongo_bulk_init_from_fsevents(bulk, fsevents);
-    if (count <= 0) {
-        int save_errno = errno;
+static void
+link_tracker_init(struct link_tracker *tracker)
+{
+    tracker->upsert = NULL;
+    tracker->link = NULL;
+}
 
-        /* Executing an empty bulk operation is considered an error by mongoc,
-         * which is why we return early in this case too
-         */
-        mongoc_bulk_operation_destroy(bulk);
-        errno = save_errno;
-        return count;
-    }
+/* Forget the descendants of the pending link, if any */
+static bool
+link_tracker_flush(struct link_tracker *tracker,
+                   mongoc_bulk_operation_t *bulk, size_t *size)
+{
+    struct rbh_id *link = tracker->link;
+    int save_errno;
+    bool success;
 
-    rc = mongoc_bulk_operation_execute(bulk, &reply, &error);
-    mongoc_bulk_operation_destroy(bulk);
-    if (!rc) {
-        int errnum = RBH_BACKEND_ERROR;
+    if (link == NULL)
+        return true;
 
-        snprintf(rbh_backend_error, sizeof(rbh_backend_error), "mongoc: %s",
-                 error.message);
-#if MONGOC_CHECK_VERSION(1, 11, 0)
-        if (mongoc_error_has_label(&reply, "TransientTransactionError"))
-            errnum = EAGAIN;
-#endif
-        bson_destroy(&reply);
-        errno = errnum;
-        return -1;
-    }
-    bson_destroy(&reply);
+    tracker->link = NULL;
+    success = mongo_bulk_append_forget_descendants(bulk, link, size);
+    save_errno = errno;
+    free(link);
+    errno = save_errno;
+    return success;
+}
 
-    return count;
+static void
+link_tracker_fini(struct link_tracker *tracker)
+{
+    free(tracker->upsert);
+    free(tracker->link);
 }
 
-    /*--------------------------------------------------------------------*
+static mode_t
+fsevent_upsert_type(const struct rbh_fsevent *fsevent)
+{
+    if (fsevent->type != RBH_FET_UPSERT || fsevent->upsert.statx == NULL
+     || !(fsevent->upsert.statx->stx_mask & RBH_STATX_TYPE))
+        return 0;
+
+    return fsevent->upsert.statx->stx_mode & S_IFMT;
+}
+
+/* Forget the descendants of the directories `fsevent' links (if need be) */
+static bool
+link_tracker_track(struct link_tracker *tracker,
+                   mongoc_bulk_operation_t *bulk,
+                   const struct rbh_fsevent *fsevent, size_t *size)
+{
+    mode_t type = fsevent_upsert_type(fsevent);
+
+    if (tracker->link && type && id_equal(tracker->link, &fsevent->id)
+     && !S_ISDIR(type)) {
+        free(tracker->link);
+        tracker->link = NULL;
+    }
+
+    if (!link_tracker_flush(tracker, bulk, size))
+        return false;
+
+    if (fsevent->type == RBH_FET_LINK) {
+        if (tracker->upsert == NULL
+         || !id_equal(tracker->upsert, &fsevent->id)) {
+            tracker->link = rbh_id_new(fsevent->id.data, fsevent->id.size);
+            if (tracker->link == NULL)
+                return false;
+        } else if (S_ISDIR(tracker->type)
+                && !mongo_bulk_append_forget_descendants(bulk, &fsevent->id,
+                                                         size)) {
+            return false;
+        }
+    }
+
+    free(tracker->upsert);
+    tracker->upsert = NULL;
+    if (type) {
+        tracker->upsert = rbh_id_new(fsevent->id.data, fsevent->id.size);
+        if (tracker->upsert == NULL)
+            return false;
+        tracker->type = type;
+    }
+    return true;
+}
+
+/* A bulk write, and the fsevents it applies */
+struct mongo_bulk {
+    struct mongo_handle handle;
+    mongoc_bulk_operation_t *bulk;
+    bool background;
+    pthread_t thread;
+
+    /* The position of its first and last fsevents in the iterator */
+    size_t first;
+    size_t last;
+    size_t count;
+    size_t size;
+
+    int error;
+    char message[sizeof(rbh_backend_error)];
+};
+
+/* Bulk writes may only execute in the background with a pooled client: pending
+ * bulk writes keep their client until they are waited for, so when the pool is
+ * exhausted, a pooled backend waits for one of them (hence `wait').
+ */
+static int
+mongo_bulk_init(struct mongo_backend *mongo, struct mongo_bulk *bulk,
+                size_t first, bool wait)
+{
+    struct mongo_pool *pool;
+
+    if (mongo->bulk.in_flight > 0 && !mongo->pooled) {
+        pool = mongo_backend_pool(mongo);
+        if (pool == NULL)
+            return -1;
+
+        /* Fall back to the backend's own client if the pool is exhausted */
+        if (mongo_pool_checkout(pool, &bulk->handle, false)
+         && (errno != EWOULDBLOCK
+          || mongo_checkout(mongo, &bulk->handle, true)))
+            return -1;
+    } else if (mongo_checkout(mongo, &bulk->handle, wait)) {
+        return -1;
+    }
+
+    bulk->bulk = _mongoc_collection_create_bulk_operation(
+            bulk->handle.entries, false, NULL
+            );
+    if (bulk->bulk == NULL) {
+        /* XXX: from libmongoc's documentation:
+         *      > "Errors are propagated when executing the bulk operation"
+         *
+         * We will just assume any error here is related to memory allocation.
+         */
+        mongo_pool_checkin(mongo->pool, &bulk->handle);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    bulk->background = false;
+    bulk->first = first;
+    bulk->last = first;
+    bulk->count = 0;
+    bulk->size = 0;
+    bulk->error = 0;
+    return 0;
+}
+
+static void
+mongo_bulk_fini(struct mongo_backend *mongo, struct mongo_bulk *bulk)
+{
+    mongoc_bulk_operation_destroy(bulk->bulk);
+    mongo_pool_checkin(mongo->pool, &bulk->handle);
+}
+
+static bool
+mongo_bulk_is_full(struct mongo_backend *mongo, struct mongo_bulk *bulk)
+{
+    return (mongo->bulk.max_count && bulk->count >= mongo->bulk.max_count)
+        || (mongo->bulk.max_size && bulk->size >= mongo->bulk.max_size);
+}
+
+static void *
+mongo_bulk_execute(void *arg)
+{
+    struct mongo_bulk *bulk = arg;
+    bson_error_t error;
+    bson_t reply;
+
+    if (mongoc_bulk_operation_execute(bulk->bulk, &reply, &error)) {
+        bson_destroy(&reply);
+        return NULL;
+    }
+
+    snprintf(bulk->message, sizeof(bulk->message), "mongoc: %s",
+             error.message);
+    bulk->error = RBH_BACKEND_ERROR;
+#if MONGOC_CHECK_VERSION(1, 11, 0)
+    if (mongoc_error_has_label(&reply, "TransientTransactionError"))
+        bulk->error = EAGAIN;
+#endif
+    bson_destroy(&reply);
+    return NULL;
+}
+
+static void
+mongo_bulk_submit(struct mongo_backend *mongo, struct mongo_bulk *bulk)
+{
+    /* Only bulk writes with a client of their own execute in the background,
+     * and only if a thread can be spawned for them.
+     */
+    bulk->background = mongo->bulk.in_flight > 0 && bulk->handle.pooled
+        && pthread_create(&bulk->thread, NULL, mongo_bulk_execute, bulk) == 0;
+    if (!bulk->background)
+        mongo_bulk_execute(bulk);
+}
+
+/* Bulk writes are unordered. The fsevents about an entry always go to the same
+ * lane, and the bulk writes of a lane execute one after the other, so that
+ * those fsevents apply in order. Up to `mongo->bulk.in_flight' lanes execute a
+ * bulk write in the background at once, while the calling thread converts the
+ * next fsevents.
+ *
+ * Apart from fsevents, the only writes are those that forget the ancestors of
+ * links (cf. mongo_bulk_append_forget_descendants()): rbh_backend_update()
+ * never sets ancestors, so the order they apply in does not matter.
+ */
+struct mongo_lane {
+    struct mongo_bulk bulks[2];
+    /* The bulk write being filled, and the one executing (NULL if none) */
+    struct mongo_bulk *filling;
+    struct mongo_bulk *executing;
+    /* cf. RBH_MBO_ANCESTORS */
+    struct link_tracker tracker;
+};
+
+struct mongo_update {
+    struct mongo_backend *mongo;
+    struct mongo_lane *lanes;
+    size_t count;
+
+    /* The number of bulk writes being filled, or executing */
+    size_t filling;
+    size_t executing;
+
+    /* The position of the first fsevent that may not have been applied */
+    size_t progress;
+    /* The error of the first bulk write that failed */
+    int error;
+    /* Whether the ancestors were marked incomplete */
+    bool links;
+};
+
+static int
+mongo_update_init(struct mongo_update *update, struct mongo_backend *mongo)
+{
+    update->count = mongo->bulk.in_flight ? mongo->bulk.in_flight : 1;
+    update->lanes = calloc(update->count, sizeof(*update->lanes));
+    if (update->lanes == NULL)
+        return -1;
+
+    for (size_t i = 0; i < update->count; i++)
+        link_tracker_init(&update->lanes[i].tracker);
+
+    update->mongo = mongo;
+    update->filling = 0;
+    update->executing = 0;
+    update->progress = SIZE_MAX;
+    update->error = 0;
+    update->links = false;
+    return 0;
+}
+
+/* FNV-1a */
+static struct mongo_lane *
+mongo_update_lane(struct mongo_update *update, const struct rbh_id *id)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < id->size; i++) {
+        hash ^= (unsigned char)id->data[i];
+        hash *= 0x100000001b3;
+    }
+
+    return &update->lanes[hash % update->count];
+}
+
+/* Wait for the bulk write a lane executes, and account for its outcome */
+static void
+mongo_update_wait(struct mongo_update *update, struct mongo_lane *lane)
+{
+    struct mongo_bulk *bulk = lane->executing;
+
+    if (bulk == NULL)
+        return;
+
+    if (bulk->background)
+        pthread_join(bulk->thread, NULL);
+
+    if (bulk->error) {
+        if (update->error == 0) {
+            snprintf(rbh_backend_error, sizeof(rbh_backend_error),
+                     "%s (%zu fsevents from %zu to %zu)", bulk->message,
+                     bulk->count, bulk->first, bulk->last);
+            update->error = bulk->error;
+        }
+        if (bulk->first < update->progress)
+            update->progress = bulk->first;
+    }
+
+    mongo_bulk_fini(update->mongo, bulk);
+    lane->executing = NULL;
+    update->executing--;
+}
+
+/* Execute the bulk write a lane fills, once its previous one completed */
+static int
+mongo_update_submit(struct mongo_update *update, struct mongo_lane *lane)
+{
+    struct mongo_bulk *bulk = lane->filling;
+
+    if (!link_tracker_flush(&lane->tracker, bulk->bulk, &bulk->size))
+        return -1;
+
+    mongo_update_wait(update, lane);
+    lane->filling = NULL;
+    update->filling--;
+    lane->executing = bulk;
+    update->executing++;
+    mongo_bulk_submit(update->mongo, bulk);
+    return 0;
+}
+
+/* Start a new bulk write in a lane, its first fsevent is the `first'th one.
+ *
+ * When the pool of a pooled backend is exhausted, the clients of other bulk
+ * writes must be released first: if none executes, one of those being filled
+ * is executed early.
+ */
+static int
+mongo_update_open(struct mongo_update *update, struct mongo_lane *lane,
+                  size_t first)
+{
+    struct mongo_bulk *bulk = lane->executing == &lane->bulks[0] ?
+        &lane->bulks[1] : &lane->bulks[0];
+
+    while (mongo_bulk_init(update->mongo, bulk, first,
+                           update->filling == 0 && update->executing == 0)) {
+        struct mongo_lane *other = NULL;
+
+        if (errno != EWOULDBLOCK)
+            return -1;
+
+        for (size_t i = 0; i < update->count; i++) {
+            if (update->lanes[i].executing) {
+                other = &update->lanes[i];
+                break;
+            }
+            if (update->lanes[i].filling && other == NULL)
+                other = &update->lanes[i];
+        }
+        assert(other != NULL);
+
+        if (other->executing)
+            mongo_update_wait(update, other);
+        else if (mongo_update_submit(update, other))
+            return -1;
+    }
+
+    lane->filling = bulk;
+    update->filling++;
+    return 0;
+}
+
+/* Apply an fsevent, it is the `index'th one.
+ *
+ * Bulk writes are only started for an fsevent: executing an empty bulk
+ * operation is considered an error by mongoc.
+ */
+static int
+mongo_update_apply(struct mongo_update *update,
+                   const struct rbh_fsevent *fsevent, size_t index)
+{
+    struct mongo_lane *lane = mongo_update_lane(update, &fsevent->id);
+    struct mongo_backend *mongo = update->mongo;
+    struct mongo_bulk *bulk;
+
+    if (lane->filling == NULL && mongo_update_open(update, lane, index))
+        return -1;
+
+    bulk = lane->filling;
+
+    /* Links are created without ancestors: they are marked incomplete before
+     * the first one is (the client of the bulk write is idle until then)
+     */
+    if (fsevent->type == RBH_FET_LINK && !update->links) {
+        if (mongo_set_ancestors_complete(&bulk->handle, false))
+            return -1;
+        update->links = true;
+    }
+
+    if (!mongo_bulk_append_fsevent(bulk->bulk, fsevent, &bulk->size))
+        return -1;
+
+    if (mongo->ancestors
+     && !link_tracker_track(&lane->tracker, bulk->bulk, fsevent, &bulk->size))
+        return -1;
+
+    bulk->last = index;
+    bulk->count++;
+
+    return mongo_bulk_is_full(mongo, bulk) ? mongo_update_submit(update, lane)
+                                           : 0;
+}
+
+/* Execute the bulk writes still being filled (unless `discard' is set), wait
+ * for every bulk write, and release the lanes.
+ *
+ * Returns the error that prevented a bulk write from executing, if any.
+ */
+static int
+mongo_update_fini(struct mongo_update *update, bool discard)
+{
+    int error = 0;
+
+    for (size_t i = 0; i < update->count; i++) {
+        struct mongo_lane *lane = &update->lanes[i];
+
+        if (lane->filling == NULL)
+            continue;
+
+        if (!discard && error == 0) {
+            if (mongo_update_submit(update, lane) == 0)
+                continue;
+            error = errno;
+        }
+
+        if (lane->filling->first < update->progress)
+            update->progress = lane->filling->first;
+        mongo_bulk_fini(update->mongo, lane->filling);
+        lane->filling = NULL;
+        update->filling--;
+    }
+
+    for (size_t i = 0; i < update->count; i++) {
+        mongo_update_wait(update, &update->lanes[i]);
+        link_tracker_fini(&update->lanes[i].tracker);
+    }
+    free(update->lanes);
+    return error;
+}
+
+static ssize_t
+mongo_backend_update(void *backend, struct rbh_iterator *fsevents)
+{
+    struct mongo_backend *mongo = backend;
+    struct mongo_update update;
+    int fill_error = 0;
+    size_t count = 0;
+
+    mongo->progress = 0;
+    if (mongo_update_init(&update, mongo))
+        return -1;
+
+    while (update.error == 0) {
+        const struct rbh_fsevent *fsevent;
+
+        errno = 0;
+        fsevent = rbh_iter_next(fsevents);
+        if (fsevent == NULL) {
+            if (errno != ENODATA)
+                fill_error = errno;
+            break;
+        }
+
+        if (mongo_update_apply(&update, fsevent, count)) {
+            fill_error = errno;
+            break;
+        }
+        count++;
+    }
+
+    if (fill_error)
+        mongo_update_fini(&update, true);
+    else
+        fill_error = mongo_update_fini(&update, update.error != 0);
+
+    mongo->progress = update.progress < count ? update.progress : count;
+    if (update.error || fill_error) {
+        errno = update.error ? update.error : fill_error;
+        return -1;
+    }
+    return count;
+}
+
+    /*--------------------------------------------------------------------*
      |                                root                                |
      *--------------------------------------------------------------------*/
 
@@ -506,12 +1331,14 @@ mongo_root(void *backend, const struct rbh_filter_projection *projection)
      |                               filter                               |
      *--------------------------------------------------------------------*/
 
+/* Only select the links under `ancestor', unless it is NULL */
 static struct rbh_mut_iterator *
-mongo_backend_filter(void *backend, const struct rbh_filter *filter,
-                     const struct rbh_filter_options *options)
+_mongo_backend_filter(struct mongo_backend *mongo,
+                      const struct rbh_id *ancestor,
+                      const struct rbh_filter *filter,
+                      const struct rbh_filter_options *options)
 {
-    struct mongo_backend *mongo = backend;
-    struct mongo_iterator *mongo_iter;
+    struct mongo_handle handle;
     mongoc_cursor_t *cursor;
     bson_t *pipeline;
     bson_t *opts;
@@ -519,68 +1346,601 @@ mongo_backend_filter(void *backend, const struct rbh_filter *filter,
     if (rbh_filter_validate(filter))
         return NULL;
 
-    pipeline = bson_pipeline_from_filter_and_options(filter, options);
+    pipeline = bson_pipeline_from_filter_and_options(ancestor, filter,
+                                                     options);
     if (pipeline == NULL)
         return NULL;
 
+    if (mongo_checkout_cursor(mongo, &handle)) {
+        int save_errno = errno;
+
+        bson_destroy(pipeline);
+        errno = save_errno;
+        return NULL;
+    }
+
     opts = options->sort.count > 0 ? BCON_NEW("allowDiskUse", BCON_BOOL(true))
                                    : NULL;
-    cursor = mongoc_collection_aggregate(mongo->entries, MONGOC_QUERY_NONE,
+    cursor = mongoc_collection_aggregate(handle.entries, MONGOC_QUERY_NONE,
                                          pipeline, opts, NULL);
     bson_destroy(opts);
     bson_destroy(pipeline);
     if (cursor == NULL) {
+        mongo_pool_checkin(mongo->pool, &handle);
         errno = EINVAL;
         return NULL;
     }
 
-    mongo_iter = mongo_iterator_new(cursor);
-    if (mongo_iter == NULL) {
-        int save_errno = errno;
-
-        mongoc_cursor_destroy(cursor);
-        errno = save_errno;
-        return NULL;
-    }
+    return mongo_cursor_iterator(mongo, cursor, &handle);
+}
 
-    return &mongo_iter->iterator;
+static struct rbh_mut_iterator *
+mongo_backend_filter(void *backend, const struct rbh_filter *filter,
+                     const struct rbh_filter_options *options)
+{
+    return _mongo_backend_filter(backend, NULL, filter, options);
 }
 
     /*--------------------------------------------------------------------*
-     |                              destroy                               |
+     |                               report                               |
      *--------------------------------------------------------------------*/
 
-static void
-mongo_backend_destroy(void *backend)
-{
-    struct mongo_backend *mongo = backend;
+#define REPORT_PATH_ONSTACK_LENGTH 128
 
-    mongoc_collection_destroy(mongo->entries);
-    mongoc_client_destroy(mongo->client);
-    free(mongo);
-}
+/* Append the aggregation expression that refers to `field' (ie. "$<path>") */
+static bool
+bson_append_field_path(bson_t *bson, const char *key,
+                       const struct rbh_filter_field *field)
+{
+    char onstack[REPORT_PATH_ONSTACK_LENGTH];
+    char *buffer = onstack;
+    const char *path;
+    char *expression;
+    bool success;
 
-static struct rbh_backend *
-mongo_backend_branch(void *backend, const struct rbh_id *id);
+    path = field2str(field, &buffer, sizeof(onstack));
+    if (path == NULL)
+        return false;
 
-static const struct rbh_backend_operations MONGO_BACKEND_OPS = {
-    .get_option = mongo_get_option,
-    .set_option = mongo_set_option,
-    .branch = mongo_backend_branch,
-    .root = mongo_root,
-    .update = mongo_backend_update,
-    .filter = mongo_backend_filter,
-    .destroy = mongo_backend_destroy,
-};
+    if (asprintf(&expression, "$%s", path) < 0) {
+        if (buffer != onstack)
+            free(buffer);
+        return false;
+    }
+    if (buffer != onstack)
+        free(buffer);
 
-    /*--------------------------------------------------------------------*
-     |                             gc_filter                              |
-     *--------------------------------------------------------------------*/
+    success = BSON_APPEND_UTF8(bson, key, expression);
+    free(expression);
+    return success;
+}
 
-static bson_t *
-bson_from_options(const struct rbh_filter_options *options)
+/* {$switch: {branches: [{case: {$gte: [<path>, b]}, then: b}, ...],
+ *            default: null}}
+ *
+ * Branches are evaluated in order, hence the reverse iteration over
+ * boundaries.
+ */
+static bool
+bson_append_report_buckets(bson_t *bson, const char *key,
+                           const struct rbh_report_group *group)
 {
-    bson_t *bson;
+    bson_t document, switch_, branches, branch, condition, operands;
+
+    if (!(BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+       && BSON_APPEND_DOCUMENT_BEGIN(&document, "$switch", &switch_)
+       && BSON_APPEND_ARRAY_BEGIN(&switch_, "branches", &branches)))
+        return false;
+
+    for (size_t i = 0; i < group->buckets.count; i++) {
+        int64_t boundary = group->buckets.boundaries[group->buckets.count - 1
+                                                     - i];
+        const char *index;
+        char buffer[16];
+
+        /* There may be more than 256 boundaries */
+        bson_uint32_to_string(i, &index, buffer, sizeof(buffer));
+        if (!(BSON_APPEND_DOCUMENT_BEGIN(&branches, index, &branch)
+           && BSON_APPEND_DOCUMENT_BEGIN(&branch, "case", &condition)
+           && BSON_APPEND_ARRAY_BEGIN(&condition, "$gte", &operands)
+           && bson_append_field_path(&operands, "0", &group->field)
+           && BSON_APPEND_INT64(&operands, "1", boundary)
+           && bson_append_array_end(&condition, &operands)
+           && bson_append_document_end(&branch, &condition)
+           && BSON_APPEND_INT64(&branch, "then", boundary)
+           && bson_append_document_end(&branches, &branch)))
+            return false;
+    }
+
+    return bson_append_array_end(&switch_, &branches)
+        && BSON_APPEND_NULL(&switch_, "default")
+        && bson_append_document_end(&document, &switch_)
+        && bson_append_document_end(bson, &document);
+}
+
+/* Missing fields are mapped to null, so that they form a group of their own */
+static bool
+bson_append_report_key(bson_t *bson, const char *key,
+                       const struct rbh_report_group *group)
+{
+    bson_t document, operands;
+
+    if (group->buckets.count > 0)
+        return bson_append_report_buckets(bson, key, group);
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+        && BSON_APPEND_ARRAY_BEGIN(&document, "$ifNull", &operands)
+        && bson_append_field_path(&operands, "0", &group->field)
+        && BSON_APPEND_NULL(&operands, "1")
+        && bson_append_array_end(&document, &operands)
+        && bson_append_document_end(bson, &document);
+}
+
+static bool
+bson_append_report_output(bson_t *bson, const char *key,
+                          const struct rbh_report_output *output)
+{
+    bson_t document;
+
+    if (!BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document))
+        return false;
+
+    switch (output->accumulator) {
+    case RBH_RA_COUNT:
+        if (!BSON_APPEND_INT32(&document, "$sum", 1))
+            return false;
+        break;
+    case RBH_RA_SUM:
+        if (!bson_append_field_path(&document, "$sum", &output->field))
+            return false;
+        break;
+    case RBH_RA_MIN:
+        if (!bson_append_field_path(&document, "$min", &output->field))
+            return false;
+        break;
+    case RBH_RA_MAX:
+        if (!bson_append_field_path(&document, "$max", &output->field))
+            return false;
+        break;
+    }
+
+    return bson_append_document_end(bson, &document);
+}
+
+/* {_id: {"0": <key>, ...}, "0": <output>, ...} */
+static bool
+bson_append_report_group(bson_t *bson, const char *key,
+                         const struct rbh_report *report)
+{
+    bson_t document, id;
+
+    if (!BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document))
+        return false;
+
+    if (report->groups.count == 0) {
+        if (!BSON_APPEND_NULL(&document, "_id"))
+            return false;
+    } else {
+        if (!BSON_APPEND_DOCUMENT_BEGIN(&document, "_id", &id))
+            return false;
+
+        for (size_t i = 0; i < report->groups.count; i++) {
+            if (!bson_append_report_key(&id, UINT8_TO_STR[i],
+                                        &report->groups.items[i]))
+                return false;
+        }
+
+        if (!bson_append_document_end(&document, &id))
+            return false;
+    }
+
+    for (size_t i = 0; i < report->outputs.count; i++) {
+        if (!bson_append_report_output(&document, UINT8_TO_STR[i],
+                                       &report->outputs.items[i]))
+            return false;
+    }
+
+    return bson_append_document_end(bson, &document);
+}
+
+/* The $match stage is placed as in bson_pipeline_from_filter_and_options();
+ * the $unwind stage is kept so that each link of an inode is accounted for.
+ */
+static bson_t *
+bson_pipeline_from_report(const struct rbh_filter *filter,
+                          const struct rbh_report *report)
+{
+    bool match_first = !filter_uses_namespace(filter);
+    bson_t *pipeline;
+    uint8_t i = 0;
+    bson_t array;
+    bson_t stage;
+    bson_t sort;
+
+    pipeline = bson_new();
+
+    if (BSON_APPEND_ARRAY_BEGIN(pipeline, "pipeline", &array)
+     && (!match_first
+      || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_RBH_FILTER(&stage, "$match", filter)
+       && bson_append_document_end(&array, &stage)))
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+     && BSON_APPEND_UTF8(&stage, "$unwind", "$" MFF_NAMESPACE)
+     && bson_append_document_end(&array, &stage)
+     && (match_first
+      || (BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_RBH_FILTER(&stage, "$match", filter)
+       && bson_append_document_end(&array, &stage)))
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+     && bson_append_report_group(&stage, "$group", report)
+     && bson_append_document_end(&array, &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+     && BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sort", &sort)
+     && BSON_APPEND_INT32(&sort, "_id", 1)
+     && bson_append_document_end(&stage, &sort)
+     && bson_append_document_end(&array, &stage)
+     && bson_append_array_end(pipeline, &array))
+        return pipeline;
+
+    bson_destroy(pipeline);
+    errno = ENOBUFS;
+    return NULL;
+}
+
+struct mongo_report_iterator {
+    struct mongo_iterator mongo;
+
+    size_t key_count;
+    size_t output_count;
+    enum rbh_report_accumulator accumulators[];
+};
+
+/* Decode the value `iter' points at, a BSON null is a missing value */
+static bool
+bson_iter_report_value(bson_iter_t *iter, const struct rbh_value **pvalue,
+                       struct rbh_value *value, char **buffer, size_t *bufsize)
+{
+    if (BSON_ITER_HOLDS_NULL(iter)) {
+        *pvalue = NULL;
+        return true;
+    }
+
+    if (!bson_iter_rbh_value(iter, value, buffer, bufsize))
+        return false;
+
+    *pvalue = value;
+    return true;
+}
+
+/* MongoDB turns sums that do not fit in a 64 bits integer into doubles, those
+ * are only valid if they hold an integer that fits in an int64_t.
+ */
+static bool
+bson_iter_report_sum(bson_iter_t *iter, const struct rbh_value **pvalue,
+                     struct rbh_value *value)
+{
+    double sum = bson_iter_double(iter);
+
+    /* NaNs fail both comparisons */
+    if (!(sum >= -0x1p63 && sum < 0x1p63)) {
+        errno = isnan(sum) ? EINVAL : EOVERFLOW;
+        return false;
+    }
+
+    if ((double)(int64_t)sum != sum) {
+        errno = EINVAL;
+        return false;
+    }
+
+    value->type = RBH_VT_INT64;
+    value->int64 = sum;
+    *pvalue = value;
+    return true;
+}
+
+/* Counts are RBH_VT_UINT64s and sums RBH_VT_INT64s, whatever integer type
+ * MongoDB picked to store them.
+ */
+static int
+report_value_normalize(struct rbh_value *value,
+                       enum rbh_report_accumulator accumulator)
+{
+    int64_t integer;
+
+    switch (value->type) {
+    case RBH_VT_INT32:
+        integer = value->int32;
+        break;
+    case RBH_VT_INT64:
+        integer = value->int64;
+        break;
+    default:
+        if (accumulator == RBH_RA_COUNT || accumulator == RBH_RA_SUM) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    switch (accumulator) {
+    case RBH_RA_COUNT:
+        value->type = RBH_VT_UINT64;
+        value->uint64 = integer;
+        break;
+    case RBH_RA_SUM:
+        value->type = RBH_VT_INT64;
+        value->int64 = integer;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* Decode a row in `buffer', which only needs to outlive the call */
+static struct rbh_report_row *
+_report_row_from_bson(struct mongo_report_iterator *report_iter,
+                      const bson_t *document, char *buffer, size_t bufsize)
+{
+    const struct rbh_value *keys[report_iter->key_count];
+    const struct rbh_value *values[report_iter->output_count];
+    struct rbh_value key_values[report_iter->key_count];
+    struct rbh_value value_values[report_iter->output_count];
+    bson_iter_t iter;
+    bson_iter_t id;
+
+    for (size_t i = 0; i < report_iter->key_count; i++)
+        keys[i] = NULL;
+    for (size_t i = 0; i < report_iter->output_count; i++)
+        values[i] = NULL;
+
+    if (!bson_iter_init(&iter, document))
+        goto out_einval;
+
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+        char *end;
+        size_t i;
+
+        if (strcmp(key, "_id") == 0) {
+            if (!BSON_ITER_HOLDS_DOCUMENT(&iter))
+                /* There is no group field */
+                continue;
+
+            if (!bson_iter_recurse(&iter, &id))
+                goto out_einval;
+
+            while (bson_iter_next(&id)) {
+                i = strtoul(bson_iter_key(&id), &end, 10);
+                if (*end != '\0' || i >= report_iter->key_count)
+                    goto out_einval;
+
+                if (!bson_iter_report_value(&id, &keys[i], &key_values[i],
+                                            &buffer, &bufsize))
+                    return NULL;
+            }
+            continue;
+        }
+
+        i = strtoul(key, &end, 10);
+        if (*end != '\0' || i >= report_iter->output_count)
+            goto out_einval;
+
+        if (BSON_ITER_HOLDS_DOUBLE(&iter)
+         && (report_iter->accumulators[i] == RBH_RA_COUNT
+          || report_iter->accumulators[i] == RBH_RA_SUM)) {
+            if (!bson_iter_report_sum(&iter, &values[i], &value_values[i]))
+                return NULL;
+        } else if (!bson_iter_report_value(&iter, &values[i],
+                                           &value_values[i], &buffer,
+                                           &bufsize)) {
+            return NULL;
+        }
+
+        if (values[i] != NULL
+         && report_value_normalize(&value_values[i],
+                                   report_iter->accumulators[i]))
+            return NULL;
+    }
+
+    return rbh_report_row_new(keys, report_iter->key_count, values,
+                              report_iter->output_count);
+
+out_einval:
+    errno = EINVAL;
+    return NULL;
+}
+
+#define REPORT_ROW_ONSTACK_SIZE 4096
+
+static struct rbh_report_row *
+report_row_from_bson(struct mongo_report_iterator *report_iter,
+                     const bson_t *document)
+{
+    char onstack[REPORT_ROW_ONSTACK_SIZE];
+    struct rbh_report_row *row;
+    int save_errno;
+    size_t bufsize;
+    char *buffer;
+
+    row = _report_row_from_bson(report_iter, document, onstack,
+                                sizeof(onstack));
+    if (row != NULL || errno != ENOBUFS)
+        return row;
+
+    /* Decoded values take more room than their BSON encoding (keys, strings
+     * and binaries are copied as is, but every value is a struct rbh_value):
+     * start from the size of the document, and grow as needed.
+     */
+    bufsize = sizeof(onstack);
+    while (bufsize < document->len)
+        bufsize *= 2;
+
+    do {
+        bufsize *= 2;
+        buffer = malloc(bufsize);
+        if (buffer == NULL)
+            return NULL;
+
+        row = _report_row_from_bson(report_iter, document, buffer, bufsize);
+        save_errno = errno;
+        free(buffer);
+    } while (row == NULL && save_errno == ENOBUFS);
+
+    errno = save_errno;
+    return row;
+}
+
+static void *
+mongo_report_iter_next(void *iterator)
+{
+    struct mongo_report_iterator *report_iter = iterator;
+    const bson_t *doc;
+
+    doc = mongo_iter_next_bson(&report_iter->mongo);
+    if (doc == NULL)
+        return NULL;
+
+    return report_row_from_bson(report_iter, doc);
+}
+
+static const struct rbh_mut_iterator_operations MONGO_REPORT_ITER_OPS = {
+    .next = mongo_report_iter_next,
+    .destroy = mongo_iter_destroy,
+};
+
+static struct mongo_report_iterator *
+mongo_report_iterator_new(mongoc_cursor_t *cursor, struct mongo_pool *pool,
+                          const struct mongo_handle *handle,
+                          const struct rbh_report *report)
+{
+    struct mongo_report_iterator *report_iter;
+
+    report_iter = malloc(sizeof(*report_iter)
+                       + report->outputs.count
+                       * sizeof(*report_iter->accumulators));
+    if (report_iter == NULL)
+        return NULL;
+
+    mongo_iterator_init(&report_iter->mongo, cursor, pool, handle);
+    report_iter->mongo.iterator.ops = &MONGO_REPORT_ITER_OPS;
+    report_iter->key_count = report->groups.count;
+    report_iter->output_count = report->outputs.count;
+    for (size_t i = 0; i < report->outputs.count; i++)
+        report_iter->accumulators[i] = report->outputs.items[i].accumulator;
+
+    return report_iter;
+}
+
+static struct rbh_mut_iterator *
+mongo_backend_report(void *backend, const struct rbh_filter *filter,
+                     const struct rbh_report *report)
+{
+    struct mongo_report_iterator *report_iter;
+    struct mongo_backend *mongo = backend;
+    struct mongo_handle handle;
+    mongoc_cursor_t *cursor;
+    bson_t *pipeline;
+    bson_t *opts;
+
+    if (rbh_filter_validate(filter) || rbh_report_validate(report))
+        return NULL;
+
+    /* Keys and outputs are indexed with UINT8_TO_STR */
+    if (report->groups.count > 256 || report->outputs.count > 256) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    pipeline = bson_pipeline_from_report(filter, report);
+    if (pipeline == NULL)
+        return NULL;
+
+    if (mongo_checkout(mongo, &handle, true)) {
+        int save_errno = errno;
+
+        bson_destroy(pipeline);
+        errno = save_errno;
+        return NULL;
+    }
+
+    /* There may be too many groups to fit in memory */
+    opts = BCON_NEW("allowDiskUse", BCON_BOOL(true));
+    cursor = mongoc_collection_aggregate(handle.entries, MONGOC_QUERY_NONE,
+                                         pipeline, opts, NULL);
+    bson_destroy(opts);
+    bson_destroy(pipeline);
+    if (cursor == NULL) {
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    report_iter = mongo_report_iterator_new(cursor, mongo->pool, &handle,
+                                            report);
+    if (report_iter == NULL) {
+        int save_errno = errno;
+
+        mongoc_cursor_destroy(cursor);
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = save_errno;
+        return NULL;
+    }
+
+    return &report_iter->mongo.iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                              destroy                               |
+     *--------------------------------------------------------------------*/
+
+static void
+mongo_indexed_xattrs_free(struct mongo_backend *mongo)
+{
+    for (size_t i = 0; i < mongo->indexed_xattrs.count; i++)
+        free(mongo->indexed_xattrs.names[i]);
+    free(mongo->indexed_xattrs.names);
+    mongo->indexed_xattrs.names = NULL;
+    mongo->indexed_xattrs.count = 0;
+}
+
+static void
+mongo_backend_destroy(void *backend)
+{
+    struct mongo_backend *mongo = backend;
+
+    mongo_indexed_xattrs_free(mongo);
+    if (mongo->pool)
+        mongo_pool_unref(mongo->pool);
+    if (mongo->client) {
+        mongoc_collection_destroy(mongo->entries);
+        mongoc_client_destroy(mongo->client);
+    }
+    free(mongo);
+}
+
+static struct rbh_backend *
+mongo_backend_branch(void *backend, const struct rbh_id *id);
+
+static const struct rbh_backend_operations MONGO_BACKEND_OPS = {
+    .get_option = mongo_get_option,
+    .set_option = mongo_set_option,
+    .branch = mongo_backend_branch,
+    .root = mongo_root,
+    .update = mongo_backend_update,
+    .filter = mongo_backend_filter,
+    .report = mongo_backend_report,
+    .destroy = mongo_backend_destroy,
+};
+
+    /*--------------------------------------------------------------------*
+     |                             gc_filter                              |
+     *--------------------------------------------------------------------*/
+
+static bson_t *
+bson_from_options(const struct rbh_filter_options *options)
+{
+    bson_t *bson;
 
     if (options->skip > INT64_MAX || options->limit > INT64_MAX) {
         errno = ENOTSUP;
@@ -635,7 +1995,7 @@ mongo_gc_backend_filter(void *backend, const struct rbh_filter *filter_,
         RBH_FP_PARENT_ID | RBH_FP_NAME | RBH_FP_NAMESPACE_XATTRS;
     struct rbh_filter_options options = *options_;
     struct mongo_backend *mongo = backend;
-    struct mongo_iterator *mongo_iter;
+    struct mongo_handle handle;
     mongoc_cursor_t *cursor;
     bson_t *filter;
     bson_t *opts;
@@ -658,24 +2018,26 @@ mongo_gc_backend_filter(void *backend, const struct rbh_filter *filter_,
         return NULL;
     }
 
-    cursor = mongoc_collection_find_with_opts(mongo->entries, filter, opts,
-                                              NULL);
+    if (mongo_checkout_cursor(mongo, &handle)) {
+        int save_errno = errno;
+
+        bson_destroy(filter);
+        bson_destroy(opts);
+        errno = save_errno;
+        return NULL;
+    }
+
+    cursor = mongoc_collection_find_with_opts(handle.entries, filter, opts,
+                                              NULL);
     bson_destroy(filter);
     bson_destroy(opts);
     if (cursor == NULL) {
+        mongo_pool_checkin(mongo->pool, &handle);
         errno = EINVAL;
         return NULL;
     }
 
-    mongo_iter = mongo_iterator_new(cursor);
-    if (mongo_iter == NULL) {
-        int save_errno = errno;
-
-        mongoc_cursor_destroy(cursor);
-        errno = save_errno;
-    }
-
-    return &mongo_iter->iterator;
+    return mongo_cursor_iterator(mongo, cursor, &handle);
 }
 
 static const struct rbh_backend_operations MONGO_GC_BACKEND_OPS = {
@@ -687,6 +2049,362 @@ static const struct rbh_backend_operations MONGO_GC_BACKEND_OPS = {
     .destroy = mongo_backend_destroy,
 };
 
+    /*--------------------------------------------------------------------*
+     |                              indexes                               |
+     *--------------------------------------------------------------------*/
+
+/* Run a command against the database of the "entries" collection */
+static int
+mongo_handle_command(struct mongo_handle *handle, const bson_t *command,
+                     bson_t *reply)
+{
+    bson_error_t error;
+
+    if (!mongoc_collection_command_simple(handle->entries, command, NULL,
+                                          reply, &error)) {
+        snprintf(rbh_backend_error, sizeof(rbh_backend_error), "mongoc: %s",
+                 error.message);
+        bson_destroy(reply);
+        errno = RBH_BACKEND_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+mongo_command(struct mongo_backend *mongo, const bson_t *command,
+              bson_t *reply)
+{
+    struct mongo_handle handle;
+    int save_errno;
+    int rc;
+
+    if (mongo_checkout(mongo, &handle, true))
+        return -1;
+
+    rc = mongo_handle_command(&handle, command, reply);
+    save_errno = errno;
+    mongo_pool_checkin(mongo->pool, &handle);
+    errno = save_errno;
+    return rc;
+}
+
+/* The indexes the queries of the backend rely on (up to 2 fields each) */
+static const char *const INDEXES[][2] = {
+    /* rbh_backend_fsentry_from_path(), branches */
+    { MFF_NAMESPACE "." MFF_PARENT_ID, MFF_NAMESPACE "." MFF_NAME },
+    { MFF_NAMESPACE "." MFF_NAME },
+    { MFF_STATX "." MFF_STATX_TYPE },
+    { MFF_STATX "." MFF_STATX_SIZE },
+    { MFF_STATX "." MFF_STATX_ATIME "." MFF_STATX_TIMESTAMP_SEC },
+    { MFF_STATX "." MFF_STATX_CTIME "." MFF_STATX_TIMESTAMP_SEC },
+    { MFF_STATX "." MFF_STATX_MTIME "." MFF_STATX_TIMESTAMP_SEC },
+};
+
+/* cf. RBH_MBO_ANCESTORS */
+static const char *const ANCESTORS_INDEX = MFF_NAMESPACE "." MFF_ANCESTORS;
+
+/* Append {key: {field: 1, ...}, name: "field_1_..."} to an array */
+static bool
+bson_append_index(bson_t *array, const char *key, const char *const *fields,
+                  size_t count)
+{
+    bson_t document;
+    bson_t keys;
+    size_t size = 0;
+    char *cursor;
+    char *name;
+    bool success;
+
+    for (size_t i = 0; i < count; i++)
+        size += strlen(fields[i]) + strlen("_1_");
+
+    name = malloc(size);
+    if (name == NULL)
+        return false;
+
+    /* Mimic the names MongoDB generates */
+    cursor = name;
+    for (size_t i = 0; i < count; i++)
+        cursor += sprintf(cursor, "%s%s_1", i ? "_" : "", fields[i]);
+
+    success = BSON_APPEND_DOCUMENT_BEGIN(array, key, &document)
+           && BSON_APPEND_DOCUMENT_BEGIN(&document, "key", &keys);
+    for (size_t i = 0; success && i < count; i++)
+        success = BSON_APPEND_INT32(&keys, fields[i], 1);
+    success = success
+           && bson_append_document_end(&document, &keys)
+           && BSON_APPEND_UTF8(&document, "name", name)
+           && bson_append_document_end(array, &document);
+
+    free(name);
+    return success;
+}
+
+#define INDEX_XATTR_ONSTACK_LENGTH 128
+
+static bool
+bson_append_xattr_index(bson_t *array, const char *key, const char *xattr)
+{
+    char onstack[INDEX_XATTR_ONSTACK_LENGTH];
+    char *field = onstack;
+    size_t size;
+    bool success;
+
+    size = strlen(MFF_XATTRS ".") + strlen(xattr) + 1;
+    if (size > sizeof(onstack)) {
+        field = malloc(size);
+        if (field == NULL)
+            return false;
+    }
+    strcat(strcpy(field, MFF_XATTRS "."), xattr);
+
+    success = bson_append_index(array, key, (const char *const *)&field, 1);
+    if (field != onstack)
+        free(field);
+    return success;
+}
+
+/* Create the default indexes, the one on the ancestors of links if
+ * `ancestors' is set, and those on `xattrs'
+ */
+static int
+mongo_create_indexes(struct mongo_backend *mongo, bool ancestors,
+                     char *const *xattrs, size_t xattrs_count)
+{
+    bson_t *command = bson_new();
+    size_t count = 0;
+    bson_t indexes;
+    bson_t reply;
+    int save_errno;
+    int rc;
+
+    if (!BSON_APPEND_UTF8(command, "createIndexes", "entries")
+     || !BSON_APPEND_ARRAY_BEGIN(command, "indexes", &indexes))
+        goto out_bson_destroy;
+
+    for (size_t i = 0; i < sizeof(INDEXES) / sizeof(*INDEXES); i++) {
+        if (!bson_append_index(&indexes, UINT8_TO_STR[count++], INDEXES[i],
+                               INDEXES[i][1] ? 2 : 1))
+            goto out_bson_destroy;
+    }
+
+    if (ancestors
+     && !bson_append_index(&indexes, UINT8_TO_STR[count++], &ANCESTORS_INDEX,
+                           1))
+        goto out_bson_destroy;
+
+    for (size_t i = 0; i < xattrs_count; i++) {
+        const char *key;
+        char buffer[16];
+
+        bson_uint32_to_string(count++, &key, buffer, sizeof(buffer));
+        if (!bson_append_xattr_index(&indexes, key, xattrs[i]))
+            goto out_bson_destroy;
+    }
+
+    if (!bson_append_array_end(command, &indexes))
+        goto out_bson_destroy;
+
+    /* Indexes that already exist are left as is */
+    rc = mongo_command(mongo, command, &reply);
+    save_errno = errno;
+    if (rc == 0)
+        bson_destroy(&reply);
+    bson_destroy(command);
+    errno = save_errno;
+    return rc;
+
+out_bson_destroy:
+    bson_destroy(command);
+    errno = ENOBUFS;
+    return -1;
+}
+
+    /*--------------------------------------------------------------------*
+     |                             ancestors                              |
+     *--------------------------------------------------------------------*/
+
+/* Run an aggregation, and copy its first document in `reply' (which is left
+ * empty if there is none)
+ */
+static int
+mongo_aggregate_one(struct mongo_backend *mongo, const bson_t *pipeline,
+                    bson_t *reply)
+{
+    struct mongo_iterator *mongo_iter;
+    struct mongo_handle handle;
+    mongoc_cursor_t *cursor;
+    const bson_t *document;
+    int save_errno;
+    int rc = 0;
+
+    if (mongo_checkout(mongo, &handle, true))
+        return -1;
+
+    cursor = mongoc_collection_aggregate(handle.entries, MONGOC_QUERY_NONE,
+                                         pipeline, NULL, NULL);
+    if (cursor == NULL) {
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = EINVAL;
+        return -1;
+    }
+
+    mongo_iter = mongo_iterator_new(cursor, mongo->pool, &handle);
+    if (mongo_iter == NULL) {
+        save_errno = errno;
+        mongoc_cursor_destroy(cursor);
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = save_errno;
+        return -1;
+    }
+
+    document = mongo_iter_next_bson(mongo_iter);
+    if (document != NULL)
+        bson_copy_to(document, reply);
+    else if (errno == ENODATA)
+        bson_init(reply);
+    else
+        rc = -1;
+
+    save_errno = errno;
+    mongo_iter_destroy(mongo_iter);
+    errno = save_errno;
+    return rc;
+}
+
+/* Whether the ancestors of every link are known is recorded in the "info"
+ * collection, as {_id: "ancestors", complete: <bool>}: rbh_backend_update()
+ * unsets it, and rbh_mongo_backend_fix_ancestors() sets it.
+ */
+static int
+mongo_set_ancestors_complete(struct mongo_handle *handle, bool complete)
+{
+    bson_t *command;
+    bson_t reply;
+    int rc;
+
+    command = BCON_NEW("update", BCON_UTF8(MONGO_INFO_COLLECTION),
+                       "updates", "[", "{",
+                           "q", "{", "_id", BCON_UTF8(MII_ANCESTORS), "}",
+                           "u", "{", "$set", "{",
+                               MII_ANCESTORS_COMPLETE, BCON_BOOL(complete),
+                           "}", "}",
+                           "upsert", BCON_BOOL(true),
+                       "}", "]");
+    rc = mongo_handle_command(handle, command, &reply);
+    bson_destroy(command);
+    if (rc)
+        return -1;
+
+    if (bson_has_field(&reply, "writeErrors")) {
+        snprintf(rbh_backend_error, sizeof(rbh_backend_error),
+                 "mongo: could not update the %s document of the %s collection",
+                 MII_ANCESTORS, MONGO_INFO_COLLECTION);
+        rc = -1;
+    }
+    bson_destroy(&reply);
+    if (rc)
+        errno = RBH_BACKEND_ERROR;
+    return rc;
+}
+
+static int
+mongo_get_ancestors_complete(struct mongo_backend *mongo, bool *complete)
+{
+    bson_iter_t iter;
+    bson_iter_t child;
+    bson_t *command;
+    bson_t reply;
+    int rc;
+
+    command = BCON_NEW("find", BCON_UTF8(MONGO_INFO_COLLECTION),
+                       "filter", "{", "_id", BCON_UTF8(MII_ANCESTORS), "}",
+                       "limit", BCON_INT64(1));
+    rc = mongo_command(mongo, command, &reply);
+    bson_destroy(command);
+    if (rc)
+        return -1;
+
+    /* The document does not exist until rbh_mongo_backend_fix_ancestors() */
+    *complete = bson_iter_init(&iter, &reply)
+             && bson_iter_find_descendant(
+                     &iter, "cursor.firstBatch.0." MII_ANCESTORS_COMPLETE,
+                     &child
+                     )
+             && BSON_ITER_HOLDS_BOOL(&child) && bson_iter_bool(&child);
+    bson_destroy(&reply);
+    return 0;
+}
+
+/* {key: {ns: {$elemMatch: {ancestors: null}}}} */
+static bool
+bson_append_unknown_ancestors(bson_t *bson, const char *key)
+{
+    bson_t elem_match;
+    bson_t namespace;
+    bson_t document;
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+        && BSON_APPEND_DOCUMENT_BEGIN(&document, MFF_NAMESPACE, &namespace)
+        && BSON_APPEND_DOCUMENT_BEGIN(&namespace, "$elemMatch", &elem_match)
+        && BSON_APPEND_NULL(&elem_match, MFF_ANCESTORS)
+        && bson_append_document_end(&namespace, &elem_match)
+        && bson_append_document_end(&document, &namespace)
+        && bson_append_document_end(bson, &document);
+}
+
+/* Count the links whose ancestors are unknown
+ *
+ * [{$match: {ns: {$elemMatch: {ancestors: null}}}}, {$unwind: "$ns"},
+ *  {$match: {"ns.ancestors": null}}, {$count: "count"}]
+ */
+static ssize_t
+mongo_count_unknown_ancestors(struct mongo_backend *mongo)
+{
+    bson_t *pipeline = bson_new();
+    ssize_t count = 0;
+    bson_iter_t iter;
+    uint8_t i = 0;
+    bson_t reply;
+    bson_t array;
+    bson_t stage;
+    bson_t match;
+    int rc;
+
+    if (!(BSON_APPEND_ARRAY_BEGIN(pipeline, "pipeline", &array)
+       && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && bson_append_unknown_ancestors(&stage, "$match")
+       && bson_append_document_end(&array, &stage)
+       && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_UTF8(&stage, "$unwind", "$" MFF_NAMESPACE)
+       && bson_append_document_end(&array, &stage)
+       && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &match)
+       && BSON_APPEND_NULL(&match, MFF_NAMESPACE "." MFF_ANCESTORS)
+       && bson_append_document_end(&stage, &match)
+       && bson_append_document_end(&array, &stage)
+       && BSON_APPEND_DOCUMENT_BEGIN(&array, UINT8_TO_STR[i], &stage) && ++i
+       && BSON_APPEND_UTF8(&stage, "$count", "count")
+       && bson_append_document_end(&array, &stage)
+       && bson_append_array_end(pipeline, &array))) {
+        bson_destroy(pipeline);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    rc = mongo_aggregate_one(mongo, pipeline, &reply);
+    bson_destroy(pipeline);
+    if (rc)
+        return -1;
+
+    /* $count yields no document at all if there is nothing to count */
+    if (bson_iter_init_find(&iter, &reply, "count"))
+        count = bson_iter_as_int64(&iter);
+    bson_destroy(&reply);
+    return count;
+}
+
     /*--------------------------------------------------------------------*
      |                             get_option                             |
      *--------------------------------------------------------------------*/
@@ -706,6 +2424,85 @@ mongo_get_gc_option(struct mongo_backend *mongo, void *data, size_t *data_size)
     return 0;
 }
 
+static int
+mongo_get_size_option(size_t value, void *data, size_t *data_size)
+{
+    if (*data_size < sizeof(value)) {
+        *data_size = sizeof(value);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &value, sizeof(value));
+    *data_size = sizeof(value);
+    return 0;
+}
+
+static int
+mongo_get_in_flight_option(struct mongo_backend *mongo, void *data,
+                           size_t *data_size)
+{
+    unsigned int in_flight = mongo->bulk.in_flight;
+
+    if (*data_size < sizeof(in_flight)) {
+        *data_size = sizeof(in_flight);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &in_flight, sizeof(in_flight));
+    *data_size = sizeof(in_flight);
+    return 0;
+}
+
+static int
+mongo_get_pooled_option(struct mongo_backend *mongo, void *data,
+                        size_t *data_size)
+{
+    bool pooled = mongo->pooled;
+
+    if (*data_size < sizeof(pooled)) {
+        *data_size = sizeof(pooled);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &pooled, sizeof(pooled));
+    *data_size = sizeof(pooled);
+    return 0;
+}
+
+static int
+mongo_get_ancestors_option(struct mongo_backend *mongo, void *data,
+                           size_t *data_size)
+{
+    bool ancestors = mongo->ancestors;
+
+    if (*data_size < sizeof(ancestors)) {
+        *data_size = sizeof(ancestors);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &ancestors, sizeof(ancestors));
+    *data_size = sizeof(ancestors);
+    return 0;
+}
+
+static int
+mongo_get_indexed_xattrs_option(struct mongo_backend *mongo, void *data,
+                                size_t *data_size)
+{
+    size_t size = mongo->indexed_xattrs.count * sizeof(char *);
+
+    if (*data_size < size) {
+        *data_size = size;
+        errno = EOVERFLOW;
+        return -1;
+    }
+    /* memcpy()'s arguments must be valid pointers, even for a size of 0 */
+    if (size)
+        memcpy(data, mongo->indexed_xattrs.names, size);
+    *data_size = size;
+    return 0;
+}
+
 static int
 mongo_get_option(void *backend, unsigned int option, void *data,
                  size_t *data_size)
@@ -715,6 +2512,25 @@ mongo_get_option(void *backend, unsigned int option, void *data,
     switch (option) {
     case RBH_GBO_GC:
         return mongo_get_gc_option(mongo, data, data_size);
+    case RBH_MBO_BULK_MAX_COUNT:
+        return mongo_get_size_option(mongo->bulk.max_count, data, data_size);
+    case RBH_MBO_BULK_MAX_SIZE:
+        return mongo_get_size_option(mongo->bulk.max_size, data, data_size);
+    case RBH_MBO_BULKS_IN_FLIGHT:
+        return mongo_get_in_flight_option(mongo, data, data_size);
+    case RBH_MBO_UPDATE_PROGRESS:
+        return mongo_get_size_option(mongo->progress, data, data_size);
+    case RBH_MBO_POOLED:
+        return mongo_get_pooled_option(mongo, data, data_size);
+    case RBH_MBO_INDEXED_XATTRS:
+        return mongo_get_indexed_xattrs_option(mongo, data, data_size);
+    case RBH_MBO_ANCESTORS:
+        return mongo_get_ancestors_option(mongo, data, data_size);
+    case RBH_MBO_CURSOR_BATCH_SIZE:
+        return mongo_get_size_option(mongo->cursor.batch_size, data,
+                                     data_size);
+    case RBH_MBO_CURSOR_PREFETCH:
+        return mongo_get_size_option(mongo->cursor.prefetch, data, data_size);
     }
 
     errno = ENOPROTOOPT;
@@ -742,37 +2558,192 @@ mongo_set_gc_option(struct mongo_backend *mongo, const void *data,
 }
 
 static int
-mongo_set_option(void *backend, unsigned int option, const void *data,
-                 size_t data_size)
+mongo_set_size_option(size_t *value, const void *data, size_t data_size)
 {
-    struct mongo_backend *mongo = backend;
-
-    switch (option) {
-    case RBH_GBO_GC:
-        return mongo_set_gc_option(mongo, data, data_size);
+    if (data_size != sizeof(*value)) {
+        errno = EINVAL;
+        return -1;
     }
-
-    errno = ENOPROTOOPT;
-    return -1;
+    memcpy(value, data, sizeof(*value));
+    return 0;
 }
 
-    /*--------------------------------------------------------------------*
-     |                               branch                               |
-     *--------------------------------------------------------------------*/
+static int
+mongo_set_in_flight_option(struct mongo_backend *mongo, const void *data,
+                           size_t data_size)
+{
+    unsigned int in_flight;
 
-struct mongo_branch_backend {
-    struct mongo_backend mongo;
-    struct rbh_id id;
-};
+    if (data_size != sizeof(in_flight)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&in_flight, data, sizeof(in_flight));
 
-        /*------------------------------------------------------------*
-         |                        branch-root                         |
-         *------------------------------------------------------------*/
+    mongo->bulk.in_flight = in_flight;
+    return 0;
+}
 
-static struct rbh_fsentry *
-mongo_branch_root(void *backend, const struct rbh_filter_projection *projection)
+static int
+mongo_set_pooled_option(struct mongo_backend *mongo, const void *data,
+                        size_t data_size)
 {
-    struct mongo_branch_backend *branch = backend;
+    bool pooled;
+
+    if (data_size != sizeof(pooled)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&pooled, data, sizeof(pooled));
+
+    if (pooled && mongo_backend_pool(mongo) == NULL)
+        return -1;
+
+    mongo->pooled = pooled;
+    return 0;
+}
+
+static int
+mongo_set_indexed_xattrs_option(struct mongo_backend *mongo, const void *data,
+                                size_t data_size)
+{
+    const char *const *xattrs = data;
+    size_t count = data_size / sizeof(*xattrs);
+    char **names;
+    int save_errno;
+
+    if (data_size % sizeof(*xattrs)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    names = reallocarray(NULL, count, sizeof(*names));
+    if (names == NULL && count > 0)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        names[i] = strdup(xattrs[i]);
+        if (names[i] == NULL) {
+            save_errno = errno;
+            while (i--)
+                free(names[i]);
+            free(names);
+            errno = save_errno;
+            return -1;
+        }
+    }
+
+    /* The names are only recorded once their indexes exist */
+    if (mongo_create_indexes(mongo, mongo->ancestors, names, count)) {
+        save_errno = errno;
+        for (size_t i = 0; i < count; i++)
+            free(names[i]);
+        free(names);
+        errno = save_errno;
+        return -1;
+    }
+
+    mongo_indexed_xattrs_free(mongo);
+    mongo->indexed_xattrs.names = names;
+    mongo->indexed_xattrs.count = count;
+    return 0;
+}
+
+static int
+mongo_set_batch_size_option(struct mongo_backend *mongo, const void *data,
+                            size_t data_size)
+{
+    size_t batch_size;
+
+    if (mongo_set_size_option(&batch_size, data, data_size))
+        return -1;
+
+    /* mongoc_cursor_set_batch_size() takes a uint32_t */
+    if (batch_size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mongo->cursor.batch_size = batch_size;
+    return 0;
+}
+
+static int
+mongo_set_ancestors_option(struct mongo_backend *mongo, const void *data,
+                           size_t data_size)
+{
+    bool ancestors;
+
+    if (data_size != sizeof(ancestors)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&ancestors, data, sizeof(ancestors));
+
+    /* The index is left as is when the option is unset, and the option keeps
+     * its previous value if the index cannot be created
+     */
+    if (ancestors
+     && mongo_create_indexes(mongo, true, mongo->indexed_xattrs.names,
+                             mongo->indexed_xattrs.count))
+        return -1;
+
+    mongo->ancestors = ancestors;
+    return 0;
+}
+
+static int
+mongo_set_option(void *backend, unsigned int option, const void *data,
+                 size_t data_size)
+{
+    struct mongo_backend *mongo = backend;
+
+    switch (option) {
+    case RBH_GBO_GC:
+        return mongo_set_gc_option(mongo, data, data_size);
+    case RBH_MBO_BULK_MAX_COUNT:
+        return mongo_set_size_option(&mongo->bulk.max_count, data, data_size);
+    case RBH_MBO_BULK_MAX_SIZE:
+        return mongo_set_size_option(&mongo->bulk.max_size, data, data_size);
+    case RBH_MBO_BULKS_IN_FLIGHT:
+        return mongo_set_in_flight_option(mongo, data, data_size);
+    case RBH_MBO_UPDATE_PROGRESS:
+        /* Read-only */
+        errno = EINVAL;
+        return -1;
+    case RBH_MBO_POOLED:
+        return mongo_set_pooled_option(mongo, data, data_size);
+    case RBH_MBO_INDEXED_XATTRS:
+        return mongo_set_indexed_xattrs_option(mongo, data, data_size);
+    case RBH_MBO_ANCESTORS:
+        return mongo_set_ancestors_option(mongo, data, data_size);
+    case RBH_MBO_CURSOR_BATCH_SIZE:
+        return mongo_set_batch_size_option(mongo, data, data_size);
+    case RBH_MBO_CURSOR_PREFETCH:
+        return mongo_set_size_option(&mongo->cursor.prefetch, data, data_size);
+    }
+
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+    /*--------------------------------------------------------------------*
+     |                               branch                               |
+     *--------------------------------------------------------------------*/
+
+struct mongo_branch_backend {
+    struct mongo_backend mongo;
+    struct rbh_id id;
+};
+
+        /*------------------------------------------------------------*
+         |                        branch-root                         |
+         *------------------------------------------------------------*/
+
+static struct rbh_fsentry *
+mongo_branch_root(void *backend, const struct rbh_filter_projection *projection)
+{
+    struct mongo_branch_backend *branch = backend;
     const struct rbh_filter id_filter = {
         .op = RBH_FOP_EQUAL,
         .compare = {
@@ -788,14 +2759,21 @@ mongo_branch_root(void *backend, const struct rbh_filter_projection *projection)
             },
         },
     };
-    const struct rbh_backend_operations *ops = branch->mongo.backend.ops;
-    struct rbh_fsentry *root;
+    struct mongo_backend mongo;
+
+    /* A pool created on the copy below would never be released */
+    if (branch->mongo.cursor.prefetch && !branch->mongo.pooled
+     && mongo_backend_pool(&branch->mongo) == NULL)
+        return NULL;
 
-    /* To avoid the infinite recursion root -> branch_filter -> root -> ... */
-    branch->mongo.backend.ops = &MONGO_BACKEND_OPS;
-    root = rbh_backend_filter_one(backend, &id_filter, projection);
-    branch->mongo.backend.ops = ops;
-    return root;
+    /* To avoid the infinite recursion root -> branch_filter -> root -> ...
+     *
+     * A copy of the backend is used so that a pooled branch remains safe to
+     * use from several threads.
+     */
+    mongo = branch->mongo;
+    mongo.backend.ops = &MONGO_BACKEND_OPS;
+    return rbh_backend_filter_one(&mongo.backend, &id_filter, projection);
 }
 
         /*------------------------------------------------------------*
@@ -1119,90 +3097,495 @@ branch_iter_destroy(void *iterator)
     free(iter);
 }
 
-static const struct rbh_mut_iterator_operations BRANCH_ITER_OPS = {
-    .next    = branch_iter_next,
-    .destroy = branch_iter_destroy,
+static const struct rbh_mut_iterator_operations BRANCH_ITER_OPS = {
+    .next    = branch_iter_next,
+    .destroy = branch_iter_destroy,
+};
+
+static const struct rbh_mut_iterator BRANCH_ITERATOR = {
+    .ops = &BRANCH_ITER_OPS,
+};
+
+/* Unlike rbh_backend_filter_one(), this function is about applying a filter to
+ * a specific entry (identified by its ID) and see if it matches.
+ */
+static struct rbh_mut_iterator *
+filter_one(void *backend, const struct rbh_id *id,
+           const struct rbh_filter *filter,
+           const struct rbh_filter_options *options)
+{
+    const struct rbh_filter id_filter = {
+        .op = RBH_FOP_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_ID,
+            },
+            .value = {
+                .type = RBH_VT_BINARY,
+                .binary = {
+                    .data = id->data,
+                    .size = id->size,
+                },
+            },
+        },
+    };
+    const struct rbh_filter *filters[2] = {
+        &id_filter,
+        filter,
+    };
+    const struct rbh_filter and_filter = {
+        .op = RBH_FOP_AND,
+        .logical = {
+            .count = 2,
+            .filters = filters,
+        },
+    };
+
+    return mongo_backend_filter(backend, &and_filter, options);
+}
+
+#define VALUE_RING_SIZE (1 << 14) /* 16MB */
+#define ID_RING_SIZE (1 << 14) /* 16MB */
+
+struct rbh_mut_iterator *
+generic_branch_backend_filter(void *backend, const struct rbh_filter *filter,
+                              const struct rbh_filter_options *options)
+{
+    const struct rbh_filter_projection ID_ONLY = {
+        .fsentry_mask = RBH_FP_ID,
+    };
+    struct branch_iterator *iter;
+    int save_errno = errno;
+
+    /* The recursive traversal of the branch prevents a few features from
+     * working out of the box.
+     */
+    if (options->skip || options->limit || options->sort.count) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    iter = malloc(sizeof(*iter));
+    if (iter == NULL)
+        return NULL;
+
+    iter->directory = rbh_backend_root(backend, &ID_ONLY);
+    if (iter->directory == NULL) {
+        save_errno = errno;
+        goto out_free_iter;
+    }
+
+    assert(iter->directory->mask & RBH_FP_ID);
+    iter->fsentries = filter_one(backend, &iter->directory->id,
+                                 filter, options);
+    if (iter->fsentries == NULL) {
+        save_errno = errno;
+        goto out_free_directory;
+    }
+
+    errno = 0;
+    iter->filter = filter ? rbh_filter_clone(filter) : NULL;
+    if (iter->filter == NULL && errno != 0) {
+        save_errno = errno;
+        goto out_destroy_fsentries;
+    }
+    errno = save_errno;
+
+    iter->values[0] = rbh_ringr_new(VALUE_RING_SIZE);
+    if (iter->values[0] == NULL) {
+        save_errno = errno;
+        goto out_free_filter;
+    }
+
+    iter->values[1] = rbh_ringr_dup(iter->values[0]);
+    if (iter->values[1] == NULL) {
+        save_errno = errno;
+        goto out_free_first_values_ringr;
+    }
+
+    iter->ids[0] = rbh_ringr_new(ID_RING_SIZE);
+    if (iter->ids[0] == NULL) {
+        save_errno = errno;
+        goto out_free_second_values_ringr;
+    }
+
+    iter->ids[1] = rbh_ringr_dup(iter->ids[0]);
+    if (iter->ids[1] == NULL) {
+        save_errno = errno;
+        goto out_free_first_ids_ringr;
+    }
+
+    iter->options = *options;
+    iter->backend = backend;
+    iter->iterator = BRANCH_ITERATOR;
+
+    /* Setup `iter->value' for the first run of branch_next_fsentries() */
+    iter->directories = rbh_mut_iter_array(NULL, 0, 0); /* Empty iterator */
+    iter->value.type = RBH_VT_BINARY;
+    iter->value.binary.data = NULL;
+
+    return &iter->iterator;
+
+out_free_first_ids_ringr:
+    rbh_ringr_destroy(iter->ids[0]);
+out_free_second_values_ringr:
+    rbh_ringr_destroy(iter->values[1]);
+out_free_first_values_ringr:
+    rbh_ringr_destroy(iter->values[0]);
+out_free_filter:
+    free(iter->filter);
+out_destroy_fsentries:
+    rbh_mut_iter_destroy(iter->fsentries);
+out_free_directory:
+    free(iter->directory);
+out_free_iter:
+    free(iter);
+    errno = save_errno;
+    return NULL;
+}
+
+        /*------------------------------------------------------------*
+         |                        branch-graph                        |
+         *------------------------------------------------------------*/
+
+/* generic_branch_backend_filter() discovers a branch one level at a time, and
+ * each level costs at least one round-trip to the server. On deep trees, that
+ * latency dominates.
+ *
+ * Instead, the directories of the branch are first collected in a single
+ * $graphLookup query. The children of those directories are then fetched with
+ * $in queries on their parent ID, in batches whose size adapts to how long the
+ * server takes to answer them.
+ *
+ * $graphLookup is bound by the memory limits of aggregation stages and by the
+ * maximum size of a document: if the branch is too large for it, the query
+ * fails, and the level by level traversal is used instead.
+ */
+
+/* [{$match: {_id: <root>}},
+ *  {$graphLookup: {from: "entries", startWith: "$_id",
+ *                  connectFromField: "_id", connectToField: "ns.parent",
+ *                  as: "directories",
+ *                  restrictSearchWithMatch: {"statx.type": S_IFDIR}}},
+ *  {$project: {_id: 0, directories: "$directories._id"}}]
+ */
+static bson_t *
+bson_pipeline_branch_directories(const struct rbh_id *root)
+{
+    bson_t match, lookup, restriction, project;
+    bson_t *pipeline;
+    bson_t array;
+    bson_t stage;
+
+    pipeline = bson_new();
+
+    if (BSON_APPEND_ARRAY_BEGIN(pipeline, "pipeline", &array)
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, "0", &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &match)
+     && BSON_APPEND_RBH_ID(&match, MFF_ID, root)
+     && bson_append_document_end(&stage, &match)
+     && bson_append_document_end(&array, &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, "1", &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&stage, "$graphLookup", &lookup)
+     && BSON_APPEND_UTF8(&lookup, "from", "entries")
+     && BSON_APPEND_UTF8(&lookup, "startWith", "$" MFF_ID)
+     && BSON_APPEND_UTF8(&lookup, "connectFromField", MFF_ID)
+     && BSON_APPEND_UTF8(&lookup, "connectToField",
+                         MFF_NAMESPACE "." MFF_PARENT_ID)
+     && BSON_APPEND_UTF8(&lookup, "as", "directories")
+     && BSON_APPEND_DOCUMENT_BEGIN(&lookup, "restrictSearchWithMatch",
+                                   &restriction)
+     && BSON_APPEND_INT32(&restriction, MFF_STATX "." MFF_STATX_TYPE, S_IFDIR)
+     && bson_append_document_end(&lookup, &restriction)
+     && bson_append_document_end(&stage, &lookup)
+     && bson_append_document_end(&array, &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&array, "2", &stage)
+     && BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &project)
+     && BSON_APPEND_INT32(&project, MFF_ID, 0)
+     && BSON_APPEND_UTF8(&project, "directories", "$directories." MFF_ID)
+     && bson_append_document_end(&stage, &project)
+     && bson_append_document_end(&array, &stage)
+     && bson_append_array_end(pipeline, &array))
+        return pipeline;
+
+    bson_destroy(pipeline);
+    errno = ENOBUFS;
+    return NULL;
+}
+
+/* Decode {directories: [<id>, ...]} into an array of RBH_VT_BINARY values,
+ * `root' first.
+ *
+ * The values and the data they point at are allocated at once.
+ */
+static struct rbh_value *
+branch_directories_from_bson(const bson_t *document, const struct rbh_id *root,
+                             size_t *count)
+{
+    struct rbh_value *directories;
+    size_t size = root->size;
+    bson_iter_t array;
+    bson_iter_t iter;
+    size_t n = 1;
+    char *data;
+
+    if (!bson_iter_init_find(&iter, document, "directories")
+     || !BSON_ITER_HOLDS_ARRAY(&iter))
+        goto out_einval;
+
+    bson_iter_recurse(&iter, &array);
+    while (bson_iter_next(&array)) {
+        uint32_t length;
+
+        if (!BSON_ITER_HOLDS_BINARY(&array))
+            goto out_einval;
+
+        bson_iter_binary(&array, NULL, &length, NULL);
+        size += length;
+        n++;
+    }
+
+    directories = malloc(n * sizeof(*directories) + size);
+    if (directories == NULL)
+        return NULL;
+    data = (char *)&directories[n];
+
+    directories[0].type = RBH_VT_BINARY;
+    directories[0].binary.data = data;
+    directories[0].binary.size = root->size;
+    data = mempcpy(data, root->data, root->size);
+
+    n = 1;
+    bson_iter_recurse(&iter, &array);
+    while (bson_iter_next(&array)) {
+        const uint8_t *binary;
+        uint32_t length;
+
+        bson_iter_binary(&array, NULL, &length, &binary);
+        directories[n].type = RBH_VT_BINARY;
+        directories[n].binary.data = data;
+        directories[n].binary.size = length;
+        data = mempcpy(data, binary, length);
+        n++;
+    }
+
+    *count = n;
+    return directories;
+
+out_einval:
+    errno = EINVAL;
+    return NULL;
+}
+
+/* Collect the IDs of `root' and of every directory under it */
+static struct rbh_value *
+branch_directories(struct mongo_backend *mongo, const struct rbh_id *root,
+                   size_t *count)
+{
+    struct mongo_iterator *mongo_iter;
+    struct rbh_value *directories;
+    struct mongo_handle handle;
+    mongoc_cursor_t *cursor;
+    const bson_t *document;
+    bson_t *pipeline;
+    int save_errno;
+
+    pipeline = bson_pipeline_branch_directories(root);
+    if (pipeline == NULL)
+        return NULL;
+
+    if (mongo_checkout(mongo, &handle, true)) {
+        save_errno = errno;
+        bson_destroy(pipeline);
+        errno = save_errno;
+        return NULL;
+    }
+
+    cursor = mongoc_collection_aggregate(handle.entries, MONGOC_QUERY_NONE,
+                                         pipeline, NULL, NULL);
+    bson_destroy(pipeline);
+    if (cursor == NULL) {
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mongo_iter = mongo_iterator_new(cursor, mongo->pool, &handle);
+    if (mongo_iter == NULL) {
+        save_errno = errno;
+        mongoc_cursor_destroy(cursor);
+        mongo_pool_checkin(mongo->pool, &handle);
+        errno = save_errno;
+        return NULL;
+    }
+
+    document = mongo_iter_next_bson(mongo_iter);
+    if (document == NULL) {
+        /* `root' does not exist, or the query failed */
+        directories = NULL;
+        goto out_destroy_iter;
+    }
+
+    directories = branch_directories_from_bson(document, root, count);
+
+out_destroy_iter:
+    save_errno = errno;
+    mongo_iter_destroy(mongo_iter);
+    errno = save_errno;
+    return directories;
+}
+
+/* The number of parent IDs of the $in queries starts at BRANCH_BATCH_INITIAL.
+ *
+ * It doubles whenever a full batch is answered in less than half of
+ * BRANCH_BATCH_LATENCY, and it halves whenever a batch takes longer than that.
+ */
+#define BRANCH_BATCH_MIN        (1 << 6)
+#define BRANCH_BATCH_INITIAL    (1 << 10)
+#define BRANCH_BATCH_MAX        (1 << 16)
+#define BRANCH_BATCH_LATENCY    100000 /* microseconds */
+
+struct branch_graph_iterator {
+    struct rbh_mut_iterator iterator;
+
+    struct rbh_backend *backend;
+    struct rbh_filter *filter;
+    struct rbh_filter_options options;
+
+    /* The ID of the root of the branch, and of every directory under it */
+    struct rbh_value *directories;
+    size_t count;
+    size_t index;
+
+    struct rbh_mut_iterator *fsentries;
+    struct {
+        /* The maximum number of parent IDs per query */
+        size_t size;
+        /* The number of parent IDs of the current query */
+        size_t count;
+        /* When the current query was issued, -1 once it was answered */
+        int64_t start;
+    } batch;
+};
+
+static void
+branch_batch_adapt(struct branch_graph_iterator *iter)
+{
+    int64_t latency = bson_get_monotonic_time() - iter->batch.start;
+
+    if (latency > BRANCH_BATCH_LATENCY) {
+        if (iter->batch.size > BRANCH_BATCH_MIN)
+            iter->batch.size /= 2;
+    } else if (latency < BRANCH_BATCH_LATENCY / 2
+            && iter->batch.count == iter->batch.size) {
+        if (iter->batch.size < BRANCH_BATCH_MAX)
+            iter->batch.size *= 2;
+    }
+    iter->batch.start = -1;
+}
+
+static struct rbh_mut_iterator *
+branch_graph_next_fsentries(struct branch_graph_iterator *iter)
+{
+    struct rbh_mut_iterator *fsentries;
+    size_t count;
+
+    if (iter->index == iter->count) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    count = iter->count - iter->index;
+    if (count > iter->batch.size)
+        count = iter->batch.size;
+
+    fsentries = _filter_child_fsentries(iter->backend, count,
+                                        &iter->directories[iter->index],
+                                        iter->filter, &iter->options);
+    if (fsentries == NULL)
+        return NULL;
+
+    iter->index += count;
+    iter->batch.count = count;
+    /* Cursors are lazy: the query is only sent with the first call to next */
+    iter->batch.start = bson_get_monotonic_time();
+    return fsentries;
+}
+
+static void *
+branch_graph_iter_next(void *iterator)
+{
+    struct branch_graph_iterator *iter = iterator;
+    struct rbh_fsentry *fsentry;
+
+    while (true) {
+        if (iter->fsentries == NULL) {
+            iter->fsentries = branch_graph_next_fsentries(iter);
+            if (iter->fsentries == NULL)
+                return NULL;
+        }
+
+        fsentry = rbh_mut_iter_next(iter->fsentries);
+        if (iter->batch.start >= 0)
+            branch_batch_adapt(iter);
+        if (fsentry != NULL)
+            return fsentry;
+
+        assert(errno);
+        if (errno != ENODATA)
+            return NULL;
+
+        rbh_mut_iter_destroy(iter->fsentries);
+        iter->fsentries = NULL;
+    }
+}
+
+static void
+branch_graph_iter_destroy(void *iterator)
+{
+    struct branch_graph_iterator *iter = iterator;
+
+    if (iter->fsentries)
+        rbh_mut_iter_destroy(iter->fsentries);
+    free(iter->directories);
+    free(iter->filter);
+    free(iter);
+}
+
+static const struct rbh_mut_iterator_operations BRANCH_GRAPH_ITER_OPS = {
+    .next    = branch_graph_iter_next,
+    .destroy = branch_graph_iter_destroy,
 };
 
-static const struct rbh_mut_iterator BRANCH_ITERATOR = {
-    .ops = &BRANCH_ITER_OPS,
+static const struct rbh_mut_iterator BRANCH_GRAPH_ITERATOR = {
+    .ops = &BRANCH_GRAPH_ITER_OPS,
 };
 
-/* Unlike rbh_backend_filter_one(), this function is about applying a filter to
- * a specific entry (identified by its ID) and see if it matches.
- */
 static struct rbh_mut_iterator *
-filter_one(void *backend, const struct rbh_id *id,
-           const struct rbh_filter *filter,
-           const struct rbh_filter_options *options)
-{
-    const struct rbh_filter id_filter = {
-        .op = RBH_FOP_EQUAL,
-        .compare = {
-            .field = {
-                .fsentry = RBH_FP_ID,
-            },
-            .value = {
-                .type = RBH_VT_BINARY,
-                .binary = {
-                    .data = id->data,
-                    .size = id->size,
-                },
-            },
-        },
-    };
-    const struct rbh_filter *filters[2] = {
-        &id_filter,
-        filter,
-    };
-    const struct rbh_filter and_filter = {
-        .op = RBH_FOP_AND,
-        .logical = {
-            .count = 2,
-            .filters = filters,
-        },
-    };
-
-    return mongo_backend_filter(backend, &and_filter, options);
-}
-
-#define VALUE_RING_SIZE (1 << 14) /* 16MB */
-#define ID_RING_SIZE (1 << 14) /* 16MB */
-
-struct rbh_mut_iterator *
-generic_branch_backend_filter(void *backend, const struct rbh_filter *filter,
-                              const struct rbh_filter_options *options)
+branch_graph_filter(struct mongo_branch_backend *branch,
+                    const struct rbh_filter *filter,
+                    const struct rbh_filter_options *options)
 {
-    const struct rbh_filter_projection ID_ONLY = {
-        .fsentry_mask = RBH_FP_ID,
-    };
-    struct branch_iterator *iter;
+    struct branch_graph_iterator *iter;
     int save_errno = errno;
 
-    /* The recursive traversal of the branch prevents a few features from
-     * working out of the box.
-     */
-    if (options->skip || options->limit || options->sort.count) {
-        errno = ENOTSUP;
-        return NULL;
-    }
-
     iter = malloc(sizeof(*iter));
     if (iter == NULL)
         return NULL;
 
-    iter->directory = rbh_backend_root(backend, &ID_ONLY);
-    if (iter->directory == NULL) {
+    iter->directories = branch_directories(&branch->mongo, &branch->id,
+                                           &iter->count);
+    if (iter->directories == NULL) {
         save_errno = errno;
         goto out_free_iter;
     }
 
-    assert(iter->directory->mask & RBH_FP_ID);
-    iter->fsentries = filter_one(backend, &iter->directory->id,
-                                 filter, options);
+    /* The root of the branch is a match of its own */
+    iter->fsentries = filter_one(&branch->mongo.backend, &branch->id, filter,
+                                 options);
     if (iter->fsentries == NULL) {
         save_errno = errno;
-        goto out_free_directory;
+        goto out_free_directories;
     }
 
     errno = 0;
@@ -1213,64 +3596,64 @@ generic_branch_backend_filter(void *backend, const struct rbh_filter *filter,
     }
     errno = save_errno;
 
-    iter->values[0] = rbh_ringr_new(VALUE_RING_SIZE);
-    if (iter->values[0] == NULL) {
-        save_errno = errno;
-        goto out_free_filter;
-    }
-
-    iter->values[1] = rbh_ringr_dup(iter->values[0]);
-    if (iter->values[1] == NULL) {
-        save_errno = errno;
-        goto out_free_first_values_ringr;
-    }
-
-    iter->ids[0] = rbh_ringr_new(ID_RING_SIZE);
-    if (iter->ids[0] == NULL) {
-        save_errno = errno;
-        goto out_free_second_values_ringr;
-    }
-
-    iter->ids[1] = rbh_ringr_dup(iter->ids[0]);
-    if (iter->ids[1] == NULL) {
-        save_errno = errno;
-        goto out_free_first_ids_ringr;
-    }
-
+    iter->iterator = BRANCH_GRAPH_ITERATOR;
+    iter->backend = &branch->mongo.backend;
     iter->options = *options;
-    iter->backend = backend;
-    iter->iterator = BRANCH_ITERATOR;
-
-    /* Setup `iter->value' for the first run of branch_next_fsentries() */
-    iter->directories = rbh_mut_iter_array(NULL, 0, 0); /* Empty iterator */
-    iter->value.type = RBH_VT_BINARY;
-    iter->value.binary.data = NULL;
+    iter->index = 0;
+    iter->batch.size = BRANCH_BATCH_INITIAL;
+    iter->batch.count = 0;
+    iter->batch.start = -1;
 
     return &iter->iterator;
 
-out_free_first_ids_ringr:
-    rbh_ringr_destroy(iter->ids[0]);
-out_free_second_values_ringr:
-    rbh_ringr_destroy(iter->values[1]);
-out_free_first_values_ringr:
-    rbh_ringr_destroy(iter->values[0]);
-out_free_filter:
-    free(iter->filter);
 out_destroy_fsentries:
     rbh_mut_iter_destroy(iter->fsentries);
-out_free_directory:
-    free(iter->directory);
+out_free_directories:
+    free(iter->directories);
 out_free_iter:
     free(iter);
     errno = save_errno;
     return NULL;
 }
 
+static struct rbh_mut_iterator *
+mongo_branch_backend_filter(void *backend, const struct rbh_filter *filter,
+                            const struct rbh_filter_options *options)
+{
+    struct mongo_branch_backend *branch = backend;
+    struct rbh_mut_iterator *iter;
+
+    /* If the ancestors of every link are known, a single query is enough */
+    if (branch->mongo.ancestors) {
+        bool complete;
+
+        if (mongo_get_ancestors_complete(&branch->mongo, &complete))
+            return NULL;
+        if (complete)
+            return _mongo_backend_filter(&branch->mongo, &branch->id, filter,
+                                         options);
+    }
+
+    if (options->skip || options->limit || options->sort.count) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    iter = branch_graph_filter(backend, filter, options);
+    if (iter != NULL || errno == ENOMEM)
+        return iter;
+
+    /* The branch is too large for $graphLookup (or it does not exist, in which
+     * case generic_branch_backend_filter() reports the error)
+     */
+    return generic_branch_backend_filter(backend, filter, options);
+}
+
 static const struct rbh_backend_operations MONGO_BRANCH_BACKEND_OPS = {
     .branch = mongo_backend_branch,
     .root = mongo_branch_root,
     .update = mongo_backend_update,
-    .filter = generic_branch_backend_filter,
+    .filter = mongo_branch_backend_filter,
     .destroy = mongo_backend_destroy,
 };
 
@@ -1316,6 +3699,17 @@ mongo_backend_init_from_uri(struct mongo_backend *mongo,
         return -1;
     }
 
+    mongo->bulk.max_count = 0;
+    mongo->bulk.max_size = 0;
+    mongo->bulk.in_flight = 0;
+    mongo->pool = NULL;
+    mongo->pooled = false;
+    mongo->progress = 0;
+    mongo->indexed_xattrs.names = NULL;
+    mongo->indexed_xattrs.count = 0;
+    mongo->ancestors = false;
+    mongo->cursor.batch_size = 0;
+    mongo->cursor.prefetch = 0;
     return 0;
 }
 
@@ -1333,8 +3727,18 @@ mongo_backend_branch(void *backend, const struct rbh_id *id)
         return NULL;
     data = (char *)branch + sizeof(*branch);
 
-    if (mongo_backend_init_from_uri(&branch->mongo,
-                                    mongoc_client_get_uri(mongo->client))) {
+    if (mongo->pooled) {
+        /* Share the pool rather than open yet another client */
+        branch->mongo.client = NULL;
+        branch->mongo.entries = NULL;
+        branch->mongo.pool = mongo_pool_ref(mongo->pool);
+        branch->mongo.pooled = true;
+        branch->mongo.progress = 0;
+        branch->mongo.indexed_xattrs.names = NULL;
+        branch->mongo.indexed_xattrs.count = 0;
+    } else if (mongo_backend_init_from_uri(
+                &branch->mongo, mongoc_client_get_uri(mongo->client)
+                )) {
         int save_errno = errno;
 
         free(branch);
@@ -1344,6 +3748,11 @@ mongo_backend_branch(void *backend, const struct rbh_id *id)
 
     rbh_id_copy(&branch->id, id, &data, &data_size);
     branch->mongo.backend = MONGO_BRANCH_BACKEND;
+    branch->mongo.bulk.max_count = mongo->bulk.max_count;
+    branch->mongo.bulk.max_size = mongo->bulk.max_size;
+    branch->mongo.bulk.in_flight = mongo->bulk.in_flight;
+    branch->mongo.ancestors = mongo->ancestors;
+    branch->mongo.cursor = mongo->cursor;
 
     return &branch->mongo.backend;
 }
@@ -1409,3 +3818,337 @@ rbh_mongo_backend_new(const char *fsname)
 
     return &mongo->backend;
 }
+
+/*----------------------------------------------------------------------------*
+ |                        rbh_mongo_backend_explain()                         |
+ *----------------------------------------------------------------------------*/
+
+static bson_t *
+bson_explain_from_filter_and_options(const struct rbh_filter *filter,
+                                     const struct rbh_filter_options *options)
+{
+    bson_t *pipeline;
+    bson_t *command;
+    bson_t explain;
+    bson_t cursor;
+
+    pipeline = bson_pipeline_from_filter_and_options(NULL, filter, options);
+    if (pipeline == NULL)
+        return NULL;
+
+    command = bson_new();
+    if (BSON_APPEND_DOCUMENT_BEGIN(command, "explain", &explain)
+     && BSON_APPEND_UTF8(&explain, "aggregate", "entries")
+     && bson_concat(&explain, pipeline)
+     && (options->sort.count == 0
+      || BSON_APPEND_BOOL(&explain, "allowDiskUse", true))
+     && BSON_APPEND_DOCUMENT_BEGIN(&explain, "cursor", &cursor)
+     && bson_append_document_end(&explain, &cursor)
+     && bson_append_document_end(command, &explain)
+     && BSON_APPEND_UTF8(command, "verbosity", "queryPlanner")) {
+        bson_destroy(pipeline);
+        return command;
+    }
+
+    bson_destroy(command);
+    bson_destroy(pipeline);
+    errno = ENOBUFS;
+    return NULL;
+}
+
+/* Where the winning plan may be, depending on the version of MongoDB, and on
+ * whether the whole pipeline could be pushed down to the query layer.
+ */
+static const char *const WINNING_PLAN_PATHS[] = {
+    "queryPlanner.winningPlan",
+    "stages.0.$cursor.queryPlanner.winningPlan",
+};
+
+static char *
+json_from_explain(const bson_t *reply)
+{
+    const bson_t *plan = reply;
+    bson_t document;
+    char *json;
+    char *copy;
+
+    for (size_t i = 0; i < sizeof(WINNING_PLAN_PATHS) / sizeof(char *); i++) {
+        bson_iter_t descendant;
+        const uint8_t *data;
+        bson_iter_t iter;
+        uint32_t length;
+
+        if (!bson_iter_init(&iter, reply)
+         || !bson_iter_find_descendant(&iter, WINNING_PLAN_PATHS[i],
+                                       &descendant)
+         || !BSON_ITER_HOLDS_DOCUMENT(&descendant))
+            continue;
+
+        bson_iter_document(&descendant, &length, &data);
+        if (bson_init_static(&document, data, length)) {
+            plan = &document;
+            break;
+        }
+    }
+
+    /* Otherwise, return the whole reply */
+    json = bson_as_relaxed_extended_json(plan, NULL);
+    if (json == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    copy = strdup(json);
+    bson_free(json);
+    return copy;
+}
+
+char *
+rbh_mongo_backend_explain(struct rbh_backend *backend,
+                          const struct rbh_filter *filter,
+                          const struct rbh_filter_options *options)
+{
+    struct mongo_backend *mongo = (struct mongo_backend *)backend;
+    bson_t *command;
+    bson_t reply;
+    int save_errno;
+    char *json;
+
+    if (backend->id != RBH_BI_MONGO) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend->ops != &MONGO_BACKEND_OPS) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    if (rbh_filter_validate(filter))
+        return NULL;
+
+    command = bson_explain_from_filter_and_options(filter, options);
+    if (command == NULL)
+        return NULL;
+
+    if (mongo_command(mongo, command, &reply)) {
+        save_errno = errno;
+        bson_destroy(command);
+        errno = save_errno;
+        return NULL;
+    }
+    bson_destroy(command);
+
+    json = json_from_explain(&reply);
+    save_errno = errno;
+    bson_destroy(&reply);
+    errno = save_errno;
+    return json;
+}
+
+/*----------------------------------------------------------------------------*
+ |                     rbh_mongo_backend_fix_ancestors()                      |
+ *----------------------------------------------------------------------------*/
+
+/* The ID of the parent of the root */
+static const uint8_t NO_PARENT_ID[1];
+
+/* [{$match: {ns: {$elemMatch: {ancestors: null}}}},
+ *  {$lookup: {from: "entries", localField: "ns.parent", foreignField: "_id",
+ *             as: "parents"}},
+ *  {$project: {ns: {$map: {input: "$ns", as: "link", in: {
+ *      $mergeObjects: ["$$link", {ancestors: <the link's ancestors>}]
+ *  }}}}},
+ *  {$merge: {into: "entries", on: "_id", whenMatched: "merge",
+ *            whenNotMatched: "discard"}}]
+ *
+ * The ancestors of a link are:
+ *   - the ones it already has, if any;
+ *   - none if it is the link of the root;
+ *   - those of its parent followed by its parent, if those are known;
+ *   - left unknown otherwise ($$REMOVE).
+ *
+ * Directories only have one link, hence the use of the parent's first link.
+ */
+static bson_t *
+bson_pipeline_fix_ancestors(void)
+{
+    return BCON_NEW("pipeline", "[",
+        "{", "$match", "{",
+            MFF_NAMESPACE, "{", "$elemMatch", "{",
+                MFF_ANCESTORS, BCON_NULL,
+            "}", "}",
+        "}", "}",
+        "{", "$lookup", "{",
+            "from", BCON_UTF8("entries"),
+            "localField", BCON_UTF8(MFF_NAMESPACE "." MFF_PARENT_ID),
+            "foreignField", BCON_UTF8(MFF_ID),
+            "as", BCON_UTF8("parents"),
+        "}", "}",
+        "{", "$project", "{", MFF_NAMESPACE, "{", "$map", "{",
+            "input", BCON_UTF8("$" MFF_NAMESPACE),
+            "as", BCON_UTF8("link"),
+            "in", "{", "$mergeObjects", "[",
+                BCON_UTF8("$$link"),
+                "{", MFF_ANCESTORS, "{", "$switch", "{",
+                    "branches", "[",
+                        "{",
+                            "case", "{", "$isArray", "[",
+                                BCON_UTF8("$$link." MFF_ANCESTORS),
+                            "]", "}",
+                            "then", BCON_UTF8("$$link." MFF_ANCESTORS),
+                        "}",
+                        "{",
+                            "case", "{", "$eq", "[",
+                                "{", "$ifNull", "[",
+                                    BCON_UTF8("$$link." MFF_PARENT_ID),
+                                    BCON_BIN(BSON_SUBTYPE_BINARY, NO_PARENT_ID,
+                                             0),
+                                "]", "}",
+                                BCON_BIN(BSON_SUBTYPE_BINARY, NO_PARENT_ID, 0),
+                            "]", "}",
+                            "then", "{", "$literal", "[", "]", "}",
+                        "}",
+                    "]",
+                    "default", "{", "$let", "{",
+                        "vars", "{", "parent", "{", "$arrayElemAt", "[",
+                            "{", "$filter", "{",
+                                "input", BCON_UTF8("$parents"),
+                                "cond", "{", "$eq", "[",
+                                    BCON_UTF8("$$this." MFF_ID),
+                                    BCON_UTF8("$$link." MFF_PARENT_ID),
+                                "]", "}",
+                            "}", "}",
+                            BCON_INT32(0),
+                        "]", "}", "}",
+                        "in", "{", "$let", "{",
+                            "vars", "{", "ancestors", "{", "$arrayElemAt", "[",
+                                BCON_UTF8("$$parent." MFF_NAMESPACE "."
+                                          MFF_ANCESTORS),
+                                BCON_INT32(0),
+                            "]", "}", "}",
+                            "in", "{", "$cond", "[",
+                                "{", "$isArray", "[",
+                                    BCON_UTF8("$$ancestors"),
+                                "]", "}",
+                                "{", "$concatArrays", "[",
+                                    BCON_UTF8("$$ancestors"),
+                                    "[", BCON_UTF8("$$parent." MFF_ID), "]",
+                                "]", "}",
+                                BCON_UTF8("$$REMOVE"),
+                            "]", "}",
+                        "}", "}",
+                    "}", "}",
+                "}", "}", "}",
+            "]", "}",
+        "}", "}", "}", "}",
+        "{", "$merge", "{",
+            "into", BCON_UTF8("entries"),
+            "on", BCON_UTF8(MFF_ID),
+            "whenMatched", BCON_UTF8("merge"),
+            "whenNotMatched", BCON_UTF8("discard"),
+        "}", "}",
+    "]");
+}
+
+/* Each pass computes the ancestors of the links whose parent's ancestors were
+ * known before it: it takes as many passes as the tree has levels. A pass that
+ * leaves as many links with unknown ancestors as before did not change
+ * anything, and neither would the next ones.
+ */
+static ssize_t
+mongo_fix_ancestors(struct mongo_backend *mongo, ssize_t unknown)
+{
+    bson_t *pipeline;
+    int save_errno;
+
+    pipeline = bson_pipeline_fix_ancestors();
+    while (true) {
+        bson_t reply;
+        ssize_t count;
+
+        if (mongo_aggregate_one(mongo, pipeline, &reply))
+            goto out_destroy_pipeline;
+        bson_destroy(&reply);
+
+        count = mongo_count_unknown_ancestors(mongo);
+        if (count < 0)
+            goto out_destroy_pipeline;
+
+        /* The remaining links are not under the root (yet?) */
+        if (count == 0 || count >= unknown) {
+            unknown = count;
+            break;
+        }
+        unknown = count;
+    }
+
+    bson_destroy(pipeline);
+    return unknown;
+
+out_destroy_pipeline:
+    save_errno = errno;
+    bson_destroy(pipeline);
+    errno = save_errno;
+    return -1;
+}
+
+ssize_t
+rbh_mongo_backend_fix_ancestors(struct rbh_backend *backend)
+{
+    struct mongo_backend *mongo = (struct mongo_backend *)backend;
+    struct mongo_handle handle;
+    ssize_t unknown;
+    int save_errno;
+    int rc;
+
+    if (backend->id != RBH_BI_MONGO) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (backend->ops != &MONGO_BACKEND_OPS) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    unknown = mongo_count_unknown_ancestors(mongo);
+    if (unknown > 0)
+        unknown = mongo_fix_ancestors(mongo, unknown);
+    if (unknown != 0)
+        return unknown;
+
+    /* Branches may now select their entries with a single query */
+    if (mongo_checkout(mongo, &handle, true))
+        return -1;
+
+    rc = mongo_set_ancestors_complete(&handle, true);
+    save_errno = errno;
+    mongo_pool_checkin(mongo->pool, &handle);
+    errno = save_errno;
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*
+ |                     rbh_mongo_backend_create_indexes()                     |
+ *----------------------------------------------------------------------------*/
+
+int
+rbh_mongo_backend_create_indexes(struct rbh_backend *backend)
+{
+    struct mongo_backend *mongo = (struct mongo_backend *)backend;
+
+    if (backend->id != RBH_BI_MONGO) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (backend->ops != &MONGO_BACKEND_OPS) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return mongo_create_indexes(mongo, mongo->ancestors,
+                                mongo->indexed_xattrs.names,
+                                mongo->indexed_xattrs.count);
+}
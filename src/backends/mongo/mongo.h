@@ -37,6 +37,7 @@ struct rbh_value_map;
  *             <key>: <value> (RBH_VALUE)
  *             ...
  *         }
+ *         ancestors: [<root's ID>, ..., fsentry.parent_id] (ARRAY, optional)
  *     }, ...]
  *
  *     symlink: fsentry.symlink (UTF8)
@@ -96,6 +97,9 @@ struct rbh_value_map;
  *
  * Note that when they are fetched _from_ the database, the "ns" field is
  * unwinded so that we do not have to unwind it ourselves.
+ *
+ * The "ancestors" of a link are only maintained if RBH_MBO_ANCESTORS is set. A
+ * link whose ancestors are not known (yet) lacks the field.
  */
 
     /*--------------------------------------------------------------------*
@@ -109,6 +113,7 @@ struct rbh_value_map;
 #define MFF_NAMESPACE               "ns"
 #define MFF_PARENT_ID               "parent"
 #define MFF_NAME                    "name"
+#define MFF_ANCESTORS               "ancestors"
 
 /* xattrs (inode & namespace) */
 #define MFF_XATTRS                  "xattrs"
@@ -157,6 +162,26 @@ struct rbh_value_map;
 #define MFF_STATX_RDEV              "rdev"
 #define MFF_STATX_DEV               "dev"
 
+    /*--------------------------------------------------------------------*
+     |                          Mongo Info Items                          |
+     *--------------------------------------------------------------------*/
+
+/* The "info" collection holds documents about the backend as a whole:
+ *
+ * {
+ *     _id: "ancestors",
+ *     complete: <bool>
+ * }
+ *
+ * "complete" is true if every link in the "entries" collection has its
+ * ancestors, false (or missing) otherwise (cf. RBH_MBO_ANCESTORS).
+ */
+
+#define MONGO_INFO_COLLECTION       "info"
+
+#define MII_ANCESTORS               "ancestors"
+#define MII_ANCESTORS_COMPLETE      "complete"
+
 const char *subdoc2str(const uint32_t subdoc);
 
 const char *attr2str(const uint32_t attr);
@@ -272,4 +297,26 @@ bson_append_rbh_value_map(bson_t *bson, const char *key, size_t key_length,
 #define BSON_APPEND_RBH_VALUE_MAP(bson, key, map) \
     bson_append_rbh_value_map(bson, key, strlen(key), map)
 
+/**
+ * Decode the value \p iter points at
+ *
+ * @param iter      an iterator on the BSON value to decode
+ * @param value     where to store the decoded value
+ * @param buffer    a pointer to a buffer to store the data \p value points at
+ * @param bufsize   a pointer to the size of \p buffer
+ *
+ * @return          true on success, false on error and errno is set
+ *                  appropriately
+ *
+ * @error ENOBUFS   \p buffer is too small to store the data of \p value
+ * @error ENOTSUP   \p iter points at a value of an unsupported type
+ *
+ * Strings and binaries are copied in \p buffer: \p value does not point at the
+ * document \p iter iterates on. \p buffer and \p bufsize are updated to point
+ * after the data of \p value.
+ */
+bool
+bson_iter_rbh_value(bson_iter_t *iter, struct rbh_value *value,
+                    char **buffer, size_t *bufsize);
+
 #endif
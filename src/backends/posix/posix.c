@@ -13,6 +13,7 @@
 #include <fts.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,9 @@
 #include "robinhood/sstack.h"
 #include "robinhood/statx.h"
 
+#include "utils.h"
+#include "value.h"
+
 
 /*----------------------------------------------------------------------------*
  |                               posix_iterator                               |
@@ -284,6 +288,71 @@ getxattrs(char *proc_fd_path, struct rbh_value_pair **_pairs,
     return count - skipped;
 }
 
+/**
+ * Fetch the values of a given set of xattrs
+ *
+ * Unlike getxattrs(), this does not list the xattrs of the file, it only
+ * tries to fetch the ones named in \p keys (which are skipped if they are
+ * not set on the file).
+ */
+static ssize_t
+getxattrs_subset(char *proc_fd_path, const struct rbh_value_map *keys,
+                 struct rbh_value_pair **_pairs, size_t *_pairs_count,
+                 struct rbh_sstack *values, struct rbh_sstack *xattrs)
+{
+    struct rbh_value_pair *pairs = *_pairs;
+    size_t pairs_count = *_pairs_count;
+    size_t count = 0;
+
+    if (pairs_count < keys->count) {
+        void *tmp;
+
+        tmp = reallocarray(pairs, keys->count, sizeof(*pairs));
+        if (tmp == NULL)
+            return -1;
+        *_pairs = pairs = tmp;
+        *_pairs_count = pairs_count = keys->count;
+    }
+
+    for (size_t i = 0; i < keys->count; i++) {
+        struct rbh_value_pair *pair = &pairs[count];
+        char buffer[XATTR_VALUE_MAX_VFS_SIZE];
+        struct rbh_value value = {
+            .type = RBH_VT_BINARY,
+        };
+        ssize_t length;
+
+        pair->key = keys->pairs[i].key;
+        length = getxattr(proc_fd_path, pair->key, &buffer, sizeof(buffer));
+        if (length == -1) {
+            switch (errno) {
+            case E2BIG:
+            case ENODATA:
+            case ENOTSUP:
+                continue;
+            default:
+                /* The Linux VFS does not allow values of more than 64KiB */
+                assert(errno != ERANGE);
+                return -1;
+            }
+        }
+        assert(length <= sizeof(buffer));
+
+        value.binary.data = rbh_sstack_push(xattrs, buffer, length);
+        if (value.binary.data == NULL)
+            return -1;
+        value.binary.size = length;
+
+        pair->value = rbh_sstack_push(values, &value, sizeof(value));
+        if (pair->value == NULL)
+            return -1;
+
+        count++;
+    }
+
+    return count;
+}
+
 static void
 sstack_clear(struct rbh_sstack *sstack)
 {
@@ -301,6 +370,95 @@ sstack_clear(struct rbh_sstack *sstack)
     }
 }
 
+/*----------------------------------------------------------------------------*
+ |                              posix_projection                              |
+ *----------------------------------------------------------------------------*/
+
+struct rbh_filter_projection *
+posix_projection_clone(const struct rbh_filter_projection *projection,
+                       const struct rbh_filter *filter,
+                       const struct rbh_filter *prune)
+{
+    struct rbh_filter_projection *clone;
+    unsigned int fsentry_mask = 0;
+    uint32_t statx_mask = 0;
+    ssize_t inode_size;
+    ssize_t ns_size;
+    size_t size;
+    char *data;
+    int rc;
+
+    ns_size = value_map_data_size(&projection->xattrs.ns);
+    if (ns_size < 0)
+        return NULL;
+
+    inode_size = value_map_data_size(&projection->xattrs.inode);
+    if (inode_size < 0)
+        return NULL;
+
+    size = sizealign(ns_size, alignof(*projection->xattrs.inode.pairs));
+    size += inode_size;
+
+    clone = malloc(sizeof(*clone) + size);
+    if (clone == NULL)
+        return NULL;
+    data = (char *)(clone + 1);
+
+    rbh_filter_fields(filter, &fsentry_mask, &statx_mask);
+    rbh_filter_fields(prune, &fsentry_mask, &statx_mask);
+    clone->fsentry_mask = projection->fsentry_mask | fsentry_mask;
+    clone->statx_mask = projection->statx_mask | statx_mask;
+
+    rc = value_map_copy(&clone->xattrs.ns, &projection->xattrs.ns, &data,
+                        &size);
+    /* If `projection' contained invalid data, value_map_data_size() would have
+     * caught it.
+     */
+    assert(rc == 0);
+
+    rc = value_map_copy(&clone->xattrs.inode, &projection->xattrs.inode,
+                        &data, &size);
+    assert(rc == 0);
+
+    /* scan-build: intentional dead store */
+    (void)rc;
+
+    /* An empty map means "every xattr" */
+    if (fsentry_mask & RBH_FP_NAMESPACE_XATTRS)
+        clone->xattrs.ns.count = 0;
+    if (fsentry_mask & RBH_FP_INODE_XATTRS)
+        clone->xattrs.inode.count = 0;
+
+    return clone;
+}
+
+bool
+posix_prune_needs_lazy_fields(const struct rbh_filter *prune)
+{
+    unsigned int fsentry_mask = 0;
+    uint32_t statx_mask = 0;
+
+    rbh_filter_fields(prune, &fsentry_mask, &statx_mask);
+    return fsentry_mask & (RBH_FP_ID | RBH_FP_SYMLINK
+                         | RBH_FP_NAMESPACE_XATTRS | RBH_FP_INODE_XATTRS);
+}
+
+uint32_t
+posix_projection_statx_mask(const struct rbh_filter_projection *projection)
+{
+    if (projection == NULL)
+        return RBH_STATX_BASIC_STATS | RBH_STATX_BTIME | RBH_STATX_MNT_ID;
+
+    if (!(projection->fsentry_mask & RBH_FP_STATX))
+        return RBH_STATX_TYPE;
+
+    return (projection->statx_mask & RBH_STATX_ALL) | RBH_STATX_TYPE;
+}
+
+/*----------------------------------------------------------------------------*
+ |                               posix_fsentry                                |
+ *----------------------------------------------------------------------------*/
+
 static __thread struct rbh_value_pair *ns_pairs;
 static __thread size_t ns_pairs_count = 1 << 7;
 static __thread struct rbh_sstack *ns_values;
@@ -323,34 +481,82 @@ free_ns_data(void)
         rbh_sstack_destroy(xattrs);
 }
 
-static struct rbh_fsentry *
-fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
-                    int (*ns_xattrs_callback)(const int, const uint16_t,
-                                              struct rbh_value_pair *,
-                                              ssize_t *,
-                                              struct rbh_value_pair *,
-                                              struct rbh_sstack *))
+void
+posix_free_thread_buffers(void)
+{
+    free_handle();
+    free_names();
+    free_ns_data();
+}
+
+/* Match an entry against `program' with only the fields that are known before
+ * any system call other than statx() is made
+ */
+static int
+fsentry_early_match(const struct rbh_filter_program *program,
+                    const struct rbh_id *id, const struct rbh_id *parent_id,
+                    const char *name, const struct rbh_statx *statxbuf)
+{
+    unsigned int pending = RBH_FP_SYMLINK | RBH_FP_NAMESPACE_XATTRS
+                         | RBH_FP_INODE_XATTRS;
+    struct rbh_fsentry fsentry = {
+        .mask = RBH_FP_NAME | RBH_FP_STATX,
+        .name = name,
+        .statx = statxbuf,
+    };
+
+    if (id != NULL) {
+        fsentry.mask |= RBH_FP_ID;
+        fsentry.id = *id;
+    } else {
+        pending |= RBH_FP_ID;
+    }
+
+    if (parent_id != NULL) {
+        fsentry.mask |= RBH_FP_PARENT_ID;
+        fsentry.parent_id = *parent_id;
+    }
+
+    return rbh_filter_program_match(program, &fsentry, pending);
+}
+
+struct rbh_fsentry *
+posix_fsentry_from_fd(int fd, const struct rbh_statx *_statxbuf,
+                      const char *path, const char *name,
+                      const struct rbh_id *parent_id, struct rbh_id **_id,
+                      int statx_sync_type,
+                      const struct rbh_filter_projection *projection,
+                      const struct rbh_filter_program *program,
+                      int (*ns_xattrs_callback)(const int,
+                                                const struct rbh_id *,
+                                                const uint16_t,
+                                                const struct rbh_value_map *,
+                                                struct rbh_value_pair *,
+                                                ssize_t *,
+                                                struct rbh_value_pair *,
+                                                struct rbh_sstack *))
 {
     const int statx_flags =
         AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
-    const struct rbh_value path = {
+    const struct rbh_value path_value = {
         .type = RBH_VT_STRING,
-        .string = ftsent->fts_pathlen == prefix_len ?
-            "/" : ftsent->fts_path + prefix_len,
+        .string = path,
     };
+    unsigned int mask = projection ? projection->fsentry_mask : RBH_FP_ALL;
     struct rbh_value_map inode_xattrs;
     struct rbh_value_map ns_xattrs;
     struct rbh_value_pair *pair;
     struct rbh_fsentry *fsentry;
     size_t pairs_count = 1 << 7;
     struct rbh_statx statxbuf;
+    struct rbh_id *id = *_id;
+    bool listed_xattrs = false;
     char proc_fd_path[64];
     char *symlink = NULL;
+    const char *where;
     ssize_t ns_count = 0;
-    struct rbh_id *id;
+    ssize_t count = 0;
     int save_errno;
-    ssize_t count;
-    int fd;
 
     if (pairs == NULL) {
         /* Per-thread initialization of `pairs' */
@@ -387,18 +593,19 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
             return NULL;
     }
 
-    fd = openat(AT_FDCWD, ftsent->fts_accpath,
-                O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
-    if (fd < 0 && (errno == ELOOP || errno == ENXIO))
-        /* If the file to open is a symlink or a socket, reopen it with O_PATH
-         * set
-         */
-        fd = openat(AT_FDCWD, ftsent->fts_accpath,
-                    O_CLOEXEC | O_NOFOLLOW | O_PATH | O_NONBLOCK);
+    if (sprintf(proc_fd_path, "/proc/self/fd/%d", fd) == -1) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* What to name the entry in error messages */
+    where = path != NULL ? path : proc_fd_path;
 
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open '%s': %s (%d)\n",
-                path.string, strerror(errno), errno);
+    if (_statxbuf != NULL) {
+        statxbuf = *_statxbuf;
+    } else if (rbh_statx(fd, "", statx_flags | statx_sync_type,
+                         posix_projection_statx_mask(projection), &statxbuf)) {
+        fprintf(stderr, "Failed to stat '%s': %s (%d)\n",
+                where, strerror(errno), errno);
         /* Set errno to ESTALE to not stop the iterator for a single failed
          * entry.
          */
@@ -406,35 +613,34 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
         return NULL;
     }
 
-    if (sprintf(proc_fd_path, "/proc/self/fd/%d", fd) == -1) {
-        errno = ENOMEM;
-        return NULL;
-    }
-
-    /* The root entry might already have its ID computed and stored in
-     * `fts_pointer'.
+    /* The entry might already have its ID computed (cf. `fts_pointer'), and
+     * the ID of directories is always needed to fill their children's parent
+     * ID.
      */
-    id = ftsent->fts_pointer ? : id_from_fd(fd);
-    if (id == NULL) {
-        save_errno = errno;
-        goto out_close;
+    if (id == NULL && statxbuf.stx_mask & RBH_STATX_TYPE
+     && S_ISDIR(statxbuf.stx_mode)) {
+        id = id_from_fd(fd);
+        if (id == NULL)
+            return NULL;
     }
 
-    if (rbh_statx(fd, "", statx_flags | statx_sync_type,
-                  RBH_STATX_BASIC_STATS | RBH_STATX_BTIME | RBH_STATX_MNT_ID,
-                  &statxbuf)) {
-        fprintf(stderr, "Failed to stat '%s': %s (%d)\n",
-                path.string, strerror(errno), errno);
-        /* Set errno to ESTALE to not stop the iterator for a single failed
-         * entry.
-         */
-        errno = ESTALE;
-        save_errno = errno;
-        goto out_free_id;
+    /* Do not fetch anything else if the metadata is enough to tell the entry
+     * does not match.
+     */
+    if (program != NULL
+     && fsentry_early_match(program, id, parent_id, name, &statxbuf) == 0)
+        mask &= ~(RBH_FP_ID | RBH_FP_SYMLINK | RBH_FP_NAMESPACE_XATTRS
+                  | RBH_FP_INODE_XATTRS);
+
+    if (id == NULL && mask & RBH_FP_ID) {
+        id = id_from_fd(fd);
+        if (id == NULL)
+            return NULL;
     }
 
     /* We want the actual type of the file we opened, not the one fts saw */
-    if (statxbuf.stx_mask & RBH_STATX_TYPE && S_ISLNK(statxbuf.stx_mode)) {
+    if (mask & RBH_FP_SYMLINK && statxbuf.stx_mask & RBH_STATX_TYPE
+     && S_ISLNK(statxbuf.stx_mode)) {
         if ((statxbuf.stx_mask & RBH_STATX_SIZE) == 0) {
             statxbuf.stx_size = page_size - 1;
             statxbuf.stx_mask |= RBH_STATX_SIZE;
@@ -444,7 +650,7 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
 
         if (symlink == NULL) {
             fprintf(stderr, "Failed to readlink '%s': %s (%d)\n",
-                    path.string, strerror(errno), errno);
+                    where, strerror(errno), errno);
             /* Set errno to ESTALE to not stop the iterator for a single failed
              * entry.
              */
@@ -454,38 +660,56 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
         }
     }
 
-    count = getxattrs(proc_fd_path, &pairs, &pairs_count, values, xattrs);
-    if (count == -1) {
-        if (errno != ENOMEM) {
-            fprintf(stderr, "Failed to get xattrs of '%s': %s (%d)\n",
-                    path.string, strerror(errno), errno);
-            /* Set errno to ESTALE to not stop the iterator for a single failed
-            * entry.
-            */
-            errno = ESTALE;
+    if (mask & RBH_FP_INODE_XATTRS) {
+        if (projection && projection->xattrs.inode.count > 0) {
+            /* Only fetch the xattrs we were asked for */
+            count = getxattrs_subset(proc_fd_path, &projection->xattrs.inode,
+                                     &pairs, &pairs_count, values, xattrs);
+        } else {
+            count = getxattrs(proc_fd_path, &pairs, &pairs_count, values,
+                              xattrs);
+            listed_xattrs = true;
+        }
+        if (count == -1) {
+            if (errno != ENOMEM) {
+                fprintf(stderr, "Failed to get xattrs of '%s': %s (%d)\n",
+                        where, strerror(errno), errno);
+                /* Set errno to ESTALE to not stop the iterator for a single
+                 * failed entry.
+                 */
+                errno = ESTALE;
+            }
+            save_errno = errno;
+            goto out_clear_sstacks;
         }
-        save_errno = errno;
-        goto out_clear_sstacks;
     }
 
-    pair = &ns_pairs[0];
-    pair->key = "path";
-    pair->value = rbh_sstack_push(ns_values, &path, sizeof(path));
-    if (pair->value == NULL) {
-        save_errno = errno;
-        goto out_clear_sstacks;
+    ns_xattrs.count = 0;
+    if (path != NULL) {
+        pair = &ns_pairs[ns_xattrs.count++];
+        pair->key = "path";
+        pair->value = rbh_sstack_push(ns_values, &path_value,
+                                      sizeof(path_value));
+        if (pair->value == NULL) {
+            save_errno = errno;
+            goto out_clear_sstacks;
+        }
     }
 
-    ns_xattrs.count = 1;
-
-    if (ns_xattrs_callback != NULL) {
-        ns_count = ns_xattrs_callback(fd, statxbuf.stx_mode, pairs, &count,
+    if (mask & RBH_FP_NAMESPACE_XATTRS && ns_xattrs_callback != NULL) {
+        /* The callback may only look for an xattr in `pairs' if every xattr
+         * of the entry was listed.
+         */
+        ns_count = ns_xattrs_callback(fd, id, statxbuf.stx_mode,
+                                      projection ? &projection->xattrs.ns
+                                                 : NULL,
+                                      listed_xattrs ? pairs : NULL, &count,
                                       &ns_pairs[ns_xattrs.count], ns_values);
         if (ns_count == -1) {
             if (errno != ENOMEM) {
                 fprintf(stderr,
                         "Failed to get namespace xattrs of '%s': %s (%d)\n",
-                        path.string, strerror(errno), errno);
+                        where, strerror(errno), errno);
                 /* Set errno to ESTALE to not stop the iterator for a single
                  * failed entry.
                  */
@@ -503,9 +727,9 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
     inode_xattrs.pairs = pairs;
     inode_xattrs.count = count;
 
-    fsentry = rbh_fsentry_new(id, ftsent->fts_parent->fts_pointer,
-                              ftsent->fts_name, &statxbuf, &ns_xattrs,
-                              &inode_xattrs, symlink);
+    fsentry = rbh_fsentry_new(id, parent_id, name, &statxbuf, &ns_xattrs,
+                              mask & RBH_FP_INODE_XATTRS ? &inode_xattrs : NULL,
+                              symlink);
     if (fsentry == NULL) {
         save_errno = errno;
         goto out_clear_sstacks;
@@ -515,8 +739,160 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
     sstack_clear(xattrs);
     sstack_clear(ns_values);
     free(symlink);
+
+    *_id = id;
+    return fsentry;
+
+out_clear_sstacks:
+    sstack_clear(values);
+    sstack_clear(xattrs);
+    sstack_clear(ns_values);
+
+    free(symlink);
+out_free_id:
+    /* Only free `id' if it was allocated here */
+    if (id != *_id)
+        free(id);
+
+    errno = save_errno;
+    return NULL;
+}
+
+struct rbh_fsentry *
+posix_fsentry_new(int dirfd, const char *accpath, const char *path,
+                  const char *name, const struct rbh_id *parent_id,
+                  struct rbh_id **id, int statx_sync_type,
+                  const struct rbh_filter_projection *projection,
+                  const struct rbh_filter_program *program,
+                  int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                            const uint16_t,
+                                            const struct rbh_value_map *,
+                                            struct rbh_value_pair *,
+                                            ssize_t *,
+                                            struct rbh_value_pair *,
+                                            struct rbh_sstack *))
+{
+    struct rbh_fsentry *fsentry;
+    int save_errno;
+    int fd;
+
+    fd = openat(dirfd, accpath, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0 && (errno == ELOOP || errno == ENXIO))
+        /* If the file to open is a symlink or a socket, reopen it with O_PATH
+         * set
+         */
+        fd = openat(dirfd, accpath,
+                    O_CLOEXEC | O_NOFOLLOW | O_PATH | O_NONBLOCK);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open '%s': %s (%d)\n",
+                path, strerror(errno), errno);
+        /* Set errno to ESTALE to not stop the iterator for a single failed
+         * entry.
+         */
+        errno = ESTALE;
+        return NULL;
+    }
+
+    fsentry = posix_fsentry_from_fd(fd, NULL, path, name, parent_id, id,
+                                    statx_sync_type, projection, program,
+                                    ns_xattrs_callback);
+    save_errno = errno;
     /* Ignore errors on close */
     close(fd);
+    errno = save_errno;
+
+    return fsentry;
+}
+
+bool
+posix_fsentry_is_unchanged(const struct rbh_fsentry *fsentry,
+                           int64_t unchanged_before)
+{
+    const uint32_t STATX_MASK = RBH_STATX_TYPE | RBH_STATX_CTIME;
+    const struct rbh_statx *statxbuf = fsentry->statx;
+
+    if (unchanged_before == 0 || !(fsentry->mask & RBH_FP_STATX))
+        return false;
+
+    if ((statxbuf->stx_mask & STATX_MASK) != STATX_MASK)
+        return false;
+
+    return S_ISDIR(statxbuf->stx_mode)
+        && statxbuf->stx_ctime.tv_sec < unchanged_before;
+}
+
+struct rbh_fsentry *
+posix_fsentry_mark_unchanged(struct rbh_fsentry *fsentry)
+{
+    static const struct rbh_value UNCHANGED = {
+        .type = RBH_VT_BOOLEAN,
+        .boolean = true,
+    };
+    struct rbh_value_map ns_xattrs = {
+        .count = 0,
+    };
+    struct rbh_fsentry *marked;
+    struct rbh_value_pair *pairs;
+
+    if (fsentry->mask & RBH_FP_NAMESPACE_XATTRS)
+        ns_xattrs = fsentry->xattrs.ns;
+
+    pairs = reallocarray(NULL, ns_xattrs.count + 1, sizeof(*pairs));
+    if (pairs == NULL)
+        return NULL;
+
+    memcpy(pairs, ns_xattrs.pairs, ns_xattrs.count * sizeof(*pairs));
+    pairs[ns_xattrs.count].key = RBH_NS_XATTR_UNCHANGED;
+    pairs[ns_xattrs.count].value = &UNCHANGED;
+    ns_xattrs.pairs = pairs;
+    ns_xattrs.count++;
+
+    marked = rbh_fsentry_new(
+            fsentry->mask & RBH_FP_ID ? &fsentry->id : NULL,
+            fsentry->mask & RBH_FP_PARENT_ID ? &fsentry->parent_id : NULL,
+            fsentry->mask & RBH_FP_NAME ? fsentry->name : NULL,
+            fsentry->mask & RBH_FP_STATX ? fsentry->statx : NULL,
+            &ns_xattrs,
+            fsentry->mask & RBH_FP_INODE_XATTRS ? &fsentry->xattrs.inode
+                                                : NULL,
+            fsentry->mask & RBH_FP_SYMLINK ? fsentry->symlink : NULL
+            );
+    free(pairs);
+    if (marked == NULL)
+        return NULL;
+
+    free(fsentry);
+    return marked;
+}
+
+static struct rbh_fsentry *
+fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
+                    const struct rbh_filter_projection *projection,
+                    const struct rbh_filter_program *program,
+                    int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                              const uint16_t,
+                                              const struct rbh_value_map *,
+                                              struct rbh_value_pair *,
+                                              ssize_t *,
+                                              struct rbh_value_pair *,
+                                              struct rbh_sstack *))
+{
+    const char *path = ftsent->fts_pathlen == prefix_len ?
+        "/" : ftsent->fts_path + prefix_len;
+    struct rbh_fsentry *fsentry;
+    /* The root entry might already have its ID computed and stored in
+     * `fts_pointer'.
+     */
+    struct rbh_id *id = ftsent->fts_pointer;
+
+    fsentry = posix_fsentry_new(AT_FDCWD, ftsent->fts_accpath, path,
+                                ftsent->fts_name,
+                                ftsent->fts_parent->fts_pointer, &id,
+                                statx_sync_type, projection, program,
+                                ns_xattrs_callback);
+    if (fsentry == NULL)
+        return NULL;
 
     switch (ftsent->fts_info) {
     case FTS_D:
@@ -528,20 +904,15 @@ fsentry_from_ftsent(FTSENT *ftsent, int statx_sync_type, size_t prefix_len,
     }
 
     return fsentry;
+}
 
-out_clear_sstacks:
-    sstack_clear(values);
-    sstack_clear(xattrs);
-    sstack_clear(ns_values);
-
-    free(symlink);
-out_free_id:
-    free(id);
-out_close:
-    close(fd);
-
-    errno = save_errno;
-    return NULL;
+static bool
+posix_iter_prunes(struct posix_iterator *posix_iter,
+                  const struct rbh_fsentry *directory, int level)
+{
+    return (unsigned int)level >= posix_iter->max_depth
+        || (posix_iter->prune != NULL
+         && rbh_filter_program_match(posix_iter->prune, directory, 0) == 1);
 }
 
 static void *
@@ -577,13 +948,48 @@ skip:
         return NULL;
     }
 
+    /* Only the subdirectories of unchanged directories are visited */
+    if (ftsent->fts_level > FTS_ROOTLEVEL && ftsent->fts_info != FTS_D
+     && ftsent->fts_parent->fts_number)
+        goto skip;
+
     fsentry = fsentry_from_ftsent(ftsent, posix_iter->statx_sync_type,
                                   posix_iter->prefix_len,
+                                  posix_iter->projection,
+                                  posix_iter->early_program,
                                   posix_iter->ns_xattrs_callback);
     if (fsentry == NULL && (errno == ENOENT || errno == ESTALE))
         /* The entry moved from under our feet */
         goto skip;
 
+    if (fsentry != NULL && ftsent->fts_info == FTS_D) {
+        /* fts yields pruned directories again, as FTS_DP, right away */
+        if (posix_iter_prunes(posix_iter, fsentry, ftsent->fts_level))
+            fts_set(posix_iter->fts_handle, ftsent, FTS_SKIP);
+
+        ftsent->fts_number =
+            posix_fsentry_is_unchanged(fsentry, posix_iter->unchanged_before);
+        if (ftsent->fts_number) {
+            struct rbh_fsentry *marked;
+
+            marked = posix_fsentry_mark_unchanged(fsentry);
+            if (marked == NULL) {
+                save_errno = errno;
+                free(fsentry);
+                errno = save_errno;
+                return NULL;
+            }
+            fsentry = marked;
+        }
+    }
+
+    if (fsentry != NULL && posix_iter->program != NULL
+     && rbh_filter_program_match(posix_iter->program, fsentry, 0) != 1) {
+        /* Directories that do not match are still walked */
+        free(fsentry);
+        goto skip;
+    }
+
     return fsentry;
 }
 
@@ -605,6 +1011,9 @@ posix_iter_destroy(void *iterator)
         }
     }
     fts_close(posix_iter->fts_handle);
+    rbh_filter_program_destroy(posix_iter->program);
+    rbh_filter_program_destroy(posix_iter->prune);
+    free(posix_iter->projection);
     free(posix_iter);
 }
 
@@ -652,6 +1061,12 @@ posix_iterator_new(const char *root, const char *entry, int statx_sync_type)
 
     posix_iter->iterator = POSIX_ITER;
     posix_iter->ns_xattrs_callback = NULL;
+    posix_iter->projection = NULL;
+    posix_iter->program = NULL;
+    posix_iter->prune = NULL;
+    posix_iter->early_program = NULL;
+    posix_iter->max_depth = UINT_MAX;
+    posix_iter->unchanged_before = 0;
     posix_iter->statx_sync_type = statx_sync_type;
     posix_iter->prefix_len = strcmp(root, "/") ? strlen(root) : 0;
     posix_iter->fts_handle =
@@ -691,6 +1106,70 @@ posix_get_statx_sync_type(struct posix_backend *posix, void *data,
     return 0;
 }
 
+static int
+posix_get_walker_threads(struct posix_backend *posix, void *data,
+                         size_t *data_size)
+{
+    unsigned int walker_threads = posix->walker_threads;
+
+    if (*data_size < sizeof(walker_threads)) {
+        *data_size = sizeof(walker_threads);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &walker_threads, sizeof(walker_threads));
+    *data_size = sizeof(walker_threads);
+    return 0;
+}
+
+static int
+posix_get_prune_filter(struct posix_backend *posix, void *data,
+                       size_t *data_size)
+{
+    const struct rbh_filter *prune = posix->prune;
+
+    if (*data_size < sizeof(prune)) {
+        *data_size = sizeof(prune);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &prune, sizeof(prune));
+    *data_size = sizeof(prune);
+    return 0;
+}
+
+static int
+posix_get_max_depth(struct posix_backend *posix, void *data,
+                    size_t *data_size)
+{
+    unsigned int max_depth = posix->max_depth;
+
+    if (*data_size < sizeof(max_depth)) {
+        *data_size = sizeof(max_depth);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &max_depth, sizeof(max_depth));
+    *data_size = sizeof(max_depth);
+    return 0;
+}
+
+static int
+posix_get_unchanged_before(struct posix_backend *posix, void *data,
+                           size_t *data_size)
+{
+    int64_t unchanged_before = posix->unchanged_before;
+
+    if (*data_size < sizeof(unchanged_before)) {
+        *data_size = sizeof(unchanged_before);
+        errno = EOVERFLOW;
+        return -1;
+    }
+    memcpy(data, &unchanged_before, sizeof(unchanged_before));
+    *data_size = sizeof(unchanged_before);
+    return 0;
+}
+
 int
 posix_backend_get_option(void *backend, unsigned int option, void *data,
                          size_t *data_size)
@@ -700,6 +1179,14 @@ posix_backend_get_option(void *backend, unsigned int option, void *data,
     switch (option) {
     case RBH_PBO_STATX_SYNC_TYPE:
         return posix_get_statx_sync_type(posix, data, data_size);
+    case RBH_PBO_WALKER_THREADS:
+        return posix_get_walker_threads(posix, data, data_size);
+    case RBH_PBO_PRUNE_FILTER:
+        return posix_get_prune_filter(posix, data, data_size);
+    case RBH_PBO_MAX_DEPTH:
+        return posix_get_max_depth(posix, data, data_size);
+    case RBH_PBO_UNCHANGED_BEFORE:
+        return posix_get_unchanged_before(posix, data, data_size);
     }
 
     errno = ENOPROTOOPT;
@@ -744,6 +1231,81 @@ posix_set_statx_sync_type(struct posix_backend *posix, const void *data,
     return -1;
 }
 
+static int
+posix_set_walker_threads(struct posix_backend *posix, const void *data,
+                         size_t data_size)
+{
+    unsigned int walker_threads;
+
+    if (data_size != sizeof(walker_threads)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&walker_threads, data, sizeof(walker_threads));
+
+    /* The threads of the walker are not split anymore */
+    posix->walker_threads = walker_threads;
+    posix->walker_partitions = 1;
+    posix->dir_partition = NULL;
+    return 0;
+}
+
+static int
+posix_set_prune_filter(struct posix_backend *posix, const void *data,
+                       size_t data_size)
+{
+    const struct rbh_filter *prune;
+
+    if (data_size != sizeof(prune)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&prune, data, sizeof(prune));
+
+    if (rbh_filter_validate(prune))
+        return -1;
+
+    posix->prune = prune;
+    return 0;
+}
+
+static int
+posix_set_max_depth(struct posix_backend *posix, const void *data,
+                    size_t data_size)
+{
+    unsigned int max_depth;
+
+    if (data_size != sizeof(max_depth)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&max_depth, data, sizeof(max_depth));
+
+    posix->max_depth = max_depth;
+    return 0;
+}
+
+static int
+posix_set_unchanged_before(struct posix_backend *posix, const void *data,
+                           size_t data_size)
+{
+    int64_t unchanged_before;
+
+    if (data_size != sizeof(unchanged_before)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&unchanged_before, data, sizeof(unchanged_before));
+
+    if (unchanged_before < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    posix->unchanged_before = unchanged_before;
+    return 0;
+}
+
 int
 posix_backend_set_option(void *backend, unsigned int option, const void *data,
                          size_t data_size)
@@ -753,6 +1315,14 @@ posix_backend_set_option(void *backend, unsigned int option, const void *data,
     switch (option) {
     case RBH_PBO_STATX_SYNC_TYPE:
         return posix_set_statx_sync_type(posix, data, data_size);
+    case RBH_PBO_WALKER_THREADS:
+        return posix_set_walker_threads(posix, data, data_size);
+    case RBH_PBO_PRUNE_FILTER:
+        return posix_set_prune_filter(posix, data, data_size);
+    case RBH_PBO_MAX_DEPTH:
+        return posix_set_max_depth(posix, data, data_size);
+    case RBH_PBO_UNCHANGED_BEFORE:
+        return posix_set_unchanged_before(posix, data, data_size);
     }
 
     errno = ENOPROTOOPT;
@@ -806,31 +1376,112 @@ set_root_properties(FTSENT *root)
     root->fts_namelen = 0;
 }
 
+/* Apply the skip, limit and sort options to an iterator, which is destroyed
+ * on error
+ */
+static struct rbh_mut_iterator *
+posix_options_iter(struct rbh_mut_iterator *fsentries,
+                   const struct rbh_filter_options *options)
+{
+    struct rbh_mut_iterator *iter;
+    int save_errno;
+
+    if (fsentries == NULL)
+        return NULL;
+
+    if (options->skip == 0 && options->limit == 0 && options->sort.count == 0)
+        return fsentries;
+
+    iter = posix_sort_iter_new(fsentries, options);
+    if (iter == NULL) {
+        save_errno = errno;
+        rbh_mut_iter_destroy(fsentries);
+        errno = save_errno;
+    }
+    return iter;
+}
+
+/* Telling unchanged directories apart requires their ctime */
+static void
+unchanged_projection(struct rbh_filter_projection *projection,
+                     const struct posix_backend *posix)
+{
+    if (posix->unchanged_before == 0)
+        return;
+
+    projection->fsentry_mask |= RBH_FP_STATX;
+    projection->statx_mask |= RBH_STATX_TYPE | RBH_STATX_CTIME;
+}
+
+/* Set the filter, the pruning rules and the incremental scan time of a
+ * posix_iterator
+ */
+static int
+posix_iter_set_filters(struct posix_iterator *posix_iter,
+                       const struct rbh_filter *filter,
+                       const struct posix_backend *posix)
+{
+    const struct rbh_filter *prune = posix->prune;
+
+    if (filter != NULL) {
+        posix_iter->program = rbh_filter_compile(filter);
+        if (posix_iter->program == NULL)
+            return -1;
+    }
+
+    if (prune != NULL) {
+        posix_iter->prune = rbh_filter_compile(prune);
+        if (posix_iter->prune == NULL)
+            return -1;
+    }
+
+    if (!posix_prune_needs_lazy_fields(prune))
+        posix_iter->early_program = posix_iter->program;
+    posix_iter->max_depth = posix->max_depth;
+    posix_iter->unchanged_before = posix->unchanged_before;
+    return 0;
+}
+
 struct rbh_mut_iterator *
 posix_backend_filter(void *backend, const struct rbh_filter *filter,
                      const struct rbh_filter_options *options)
 {
+    struct rbh_filter_projection projection = options->projection;
     struct posix_backend *posix = backend;
     struct posix_iterator *posix_iter;
+    struct rbh_mut_iterator *iter;
     struct rbh_fsentry *fsentry;
     int save_errno;
 
-    /* TODO: make use of `fsentries_mask' and `statx_mask' */
-
-    if (filter != NULL) {
-        errno = ENOTSUP;
+    if (rbh_filter_validate(filter))
         return NULL;
-    }
 
-    if (options->skip > 0 || options->limit > 0 || options->sort.count > 0) {
-        errno = ENOTSUP;
+    if (posix_sort_projection(&projection, options->sort.items,
+                              options->sort.count))
         return NULL;
+    unchanged_projection(&projection, posix);
+
+    if (posix->walker_threads > 0) {
+        iter = posix_walker_new(posix->root, NULL, posix->statx_sync_type,
+                                posix->walker_threads,
+                                posix->walker_partitions,
+                                posix->dir_partition, posix->open_by_handle,
+                                &projection, filter, posix->prune,
+                                posix->max_depth,
+                                posix->unchanged_before,
+                                posix->ns_xattrs_callback);
+        return posix_options_iter(iter, options);
     }
 
     posix_iter = posix->iter_new(posix->root, NULL, posix->statx_sync_type);
     if (posix_iter == NULL)
         return NULL;
 
+    posix_iter->projection = posix_projection_clone(&projection, filter,
+                                                    posix->prune);
+    if (posix_iter->projection == NULL)
+        goto out_destroy_iter;
+
     fsentry = rbh_mut_iter_next(&posix_iter->iterator);
     if (fsentry == NULL)
         goto out_destroy_iter;
@@ -841,7 +1492,13 @@ posix_backend_filter(void *backend, const struct rbh_filter *filter,
         /* This should never happen */
         goto out_destroy_iter;
 
-    return &posix_iter->iterator;
+    /* Only set the programs now, the root was read above regardless of
+     * whether it matches or is pruned.
+     */
+    if (posix_iter_set_filters(posix_iter, filter, posix))
+        goto out_destroy_iter;
+
+    return posix_options_iter(&posix_iter->iterator, options);
 
 out_destroy_iter:
     save_errno = errno;
@@ -955,20 +1612,20 @@ static struct rbh_mut_iterator *
 posix_branch_backend_filter(void *backend, const struct rbh_filter *filter,
                             const struct rbh_filter_options *options)
 {
+    struct rbh_filter_projection projection = options->projection;
     struct posix_branch_backend *branch = backend;
     struct posix_iterator *posix_iter;
+    struct rbh_mut_iterator *iter;
     char *root, *path;
     int save_errno;
 
-    if (filter != NULL) {
-        errno = ENOTSUP;
+    if (rbh_filter_validate(filter))
         return NULL;
-    }
 
-    if (options->skip > 0 || options->limit > 0 || options->sort.count > 0) {
-        errno = ENOTSUP;
+    if (posix_sort_projection(&projection, options->sort.items,
+                              options->sort.count))
         return NULL;
-    }
+    unchanged_projection(&projection, &branch->posix);
 
     root = realpath(branch->posix.root, NULL);
     if (root == NULL)
@@ -983,14 +1640,49 @@ posix_branch_backend_filter(void *backend, const struct rbh_filter *filter,
     }
 
     assert(strncmp(root, path, strlen(root)) == 0);
+    if (branch->posix.walker_threads > 0) {
+        iter = posix_walker_new(root, path + strlen(root),
+                                branch->posix.statx_sync_type,
+                                branch->posix.walker_threads,
+                                branch->posix.walker_partitions,
+                                branch->posix.dir_partition,
+                                branch->posix.open_by_handle, &projection,
+                                filter, branch->posix.prune,
+                                branch->posix.max_depth,
+                                branch->posix.unchanged_before,
+                                branch->posix.ns_xattrs_callback);
+        iter = posix_options_iter(iter, options);
+        goto out_free;
+    }
+
+    iter = NULL;
     posix_iter = branch->posix.iter_new(root, path + strlen(root),
-                                       branch->posix.statx_sync_type);
+                                        branch->posix.statx_sync_type);
+    if (posix_iter == NULL)
+        goto out_free;
+
+    posix_iter->projection = posix_projection_clone(&projection, filter,
+                                                    branch->posix.prune);
+    if (posix_iter->projection == NULL)
+        goto out_destroy_iter;
+
+    if (posix_iter_set_filters(posix_iter, filter, &branch->posix))
+        goto out_destroy_iter;
+    iter = posix_options_iter(&posix_iter->iterator, options);
+    goto out_free;
+
+out_destroy_iter:
+    save_errno = errno;
+    rbh_mut_iter_destroy(&posix_iter->iterator);
+    errno = save_errno;
+
+out_free:
     save_errno = errno;
     free(path);
     free(root);
     errno = save_errno;
 
-    return (struct rbh_mut_iterator *)posix_iter;
+    return iter;
 }
 
 static const struct rbh_backend_operations POSIX_BRANCH_BACKEND_OPS = {
@@ -1029,7 +1721,15 @@ posix_backend_branch(void *backend, const struct rbh_id *id)
     }
 
     branch->posix.iter_new = posix_iterator_new;
+    branch->posix.ns_xattrs_callback = posix->ns_xattrs_callback;
     branch->posix.statx_sync_type = posix->statx_sync_type;
+    branch->posix.walker_threads = posix->walker_threads;
+    branch->posix.walker_partitions = posix->walker_partitions;
+    branch->posix.dir_partition = posix->dir_partition;
+    branch->posix.open_by_handle = posix->open_by_handle;
+    branch->posix.prune = posix->prune;
+    branch->posix.max_depth = posix->max_depth;
+    branch->posix.unchanged_before = posix->unchanged_before;
     rbh_id_copy(&branch->id, id, &data, &data_size);
     branch->posix.backend = POSIX_BRANCH_BACKEND;
 
@@ -1084,7 +1784,15 @@ rbh_posix_backend_new(const char *path)
         *posix->root = '/';
 
     posix->iter_new = posix_iterator_new;
+    posix->ns_xattrs_callback = NULL;
     posix->statx_sync_type = AT_RBH_STATX_SYNC_AS_STAT;
+    posix->walker_threads = 0;
+    posix->walker_partitions = 1;
+    posix->dir_partition = NULL;
+    posix->open_by_handle = false;
+    posix->prune = NULL;
+    posix->max_depth = UINT_MAX;
+    posix->unchanged_before = 0;
     posix->backend = POSIX_BACKEND;
 
     return &posix->backend;
@@ -0,0 +1,186 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "robinhood/backends/posix_internal.h"
+#include "robinhood/id.h"
+
+/* Fetch the fsentries of files designated by their ID
+ *
+ * Files are opened through their file handle, relative to the root of the
+ * backend: neither their path, nor the path of their ancestors, is ever
+ * resolved.
+ */
+
+struct posix_rescan {
+    struct rbh_mut_iterator iterator;
+
+    struct rbh_iterator *ids;
+    struct rbh_filter_projection *projection;
+    int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                              const uint16_t,
+                              const struct rbh_value_map *,
+                              struct rbh_value_pair *, ssize_t *,
+                              struct rbh_value_pair *, struct rbh_sstack *);
+    int statx_sync_type;
+    int mount_fd;
+};
+
+int
+posix_open_by_id(int mount_fd, const struct rbh_id *id)
+{
+    struct file_handle *handle;
+    int save_errno;
+    int fd;
+
+    handle = rbh_file_handle_from_id(id);
+    if (handle == NULL)
+        return -1;
+
+    fd = open_by_handle_at(mount_fd, handle,
+                           O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0 && (errno == ELOOP || errno == ENXIO))
+        /* If the file to open is a symlink or a socket, reopen it with O_PATH
+         * set
+         */
+        fd = open_by_handle_at(mount_fd, handle,
+                               O_CLOEXEC | O_NOFOLLOW | O_PATH | O_NONBLOCK);
+
+    save_errno = errno;
+    free(handle);
+    errno = save_errno;
+    return fd;
+}
+
+static void *
+posix_rescan_iter_next(void *iterator)
+{
+    struct posix_rescan *rescan = iterator;
+
+    while (true) {
+        struct rbh_fsentry *fsentry;
+        const struct rbh_id *id;
+        struct rbh_id *copy;
+        int save_errno;
+        int fd;
+
+        id = rbh_iter_next(rescan->ids);
+        if (id == NULL)
+            return NULL;
+
+        fd = posix_open_by_id(rescan->mount_fd, id);
+        if (fd < 0) {
+            if (errno == ESTALE || errno == ENOENT)
+                /* The file was deleted */
+                continue;
+            return NULL;
+        }
+
+        /* Reuse the ID rather than compute it again */
+        copy = rbh_id_new(id->data, id->size);
+        if (copy == NULL) {
+            save_errno = errno;
+            close(fd);
+            errno = save_errno;
+            return NULL;
+        }
+
+        fsentry = posix_fsentry_from_fd(fd, NULL, NULL, NULL, NULL, &copy,
+                                        rescan->statx_sync_type,
+                                        rescan->projection, NULL,
+                                        rescan->ns_xattrs_callback);
+        save_errno = errno;
+        /* Ignore errors on close */
+        close(fd);
+        free(copy);
+
+        if (fsentry != NULL)
+            return fsentry;
+
+        /* posix_fsentry_from_fd() already printed an error message */
+        if (save_errno != ESTALE) {
+            errno = save_errno;
+            return NULL;
+        }
+    }
+}
+
+static void
+posix_rescan_iter_destroy(void *iterator)
+{
+    struct posix_rescan *rescan = iterator;
+
+    rbh_iter_destroy(rescan->ids);
+    free(rescan->projection);
+    close(rescan->mount_fd);
+    free(rescan);
+}
+
+static const struct rbh_mut_iterator_operations POSIX_RESCAN_ITER_OPS = {
+    .next = posix_rescan_iter_next,
+    .destroy = posix_rescan_iter_destroy,
+};
+
+static const struct rbh_mut_iterator POSIX_RESCAN_ITER = {
+    .ops = &POSIX_RESCAN_ITER_OPS,
+};
+
+struct rbh_mut_iterator *
+posix_rescan_new(const char *root, struct rbh_iterator *ids,
+                 int statx_sync_type,
+                 const struct rbh_filter_projection *projection,
+                 int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                           const uint16_t,
+                                           const struct rbh_value_map *,
+                                           struct rbh_value_pair *,
+                                           ssize_t *,
+                                           struct rbh_value_pair *,
+                                           struct rbh_sstack *))
+{
+    struct posix_rescan *rescan;
+    int save_errno;
+
+    rescan = malloc(sizeof(*rescan));
+    if (rescan == NULL)
+        return NULL;
+
+    rescan->projection = NULL;
+    if (projection != NULL) {
+        rescan->projection = posix_projection_clone(projection, NULL, NULL);
+        if (rescan->projection == NULL)
+            goto out_free_rescan;
+    }
+
+    rescan->mount_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rescan->mount_fd < 0)
+        goto out_free_projection;
+
+    rescan->iterator = POSIX_RESCAN_ITER;
+    rescan->ids = ids;
+    rescan->ns_xattrs_callback = ns_xattrs_callback;
+    rescan->statx_sync_type = statx_sync_type;
+
+    return &rescan->iterator;
+
+out_free_projection:
+    save_errno = errno;
+    free(rescan->projection);
+    errno = save_errno;
+out_free_rescan:
+    save_errno = errno;
+    free(rescan);
+    errno = save_errno;
+    return NULL;
+}
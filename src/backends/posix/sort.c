@@ -0,0 +1,1157 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "robinhood/backends/posix_internal.h"
+#include "robinhood/statx.h"
+
+/* Skip, limit and sort options for the posix backend
+ *
+ * Without any sorting option, skip and limit are applied on the fly.
+ *
+ * With a limit, only the `skip + limit' first fsentries are kept, in a binary
+ * heap whose top is the last of them, so that memory stays proportional to the
+ * limit.
+ *
+ * Without a limit (or with one larger than a run), fsentries are sorted with an
+ * external merge sort: they are accumulated in memory by runs of SORT_RUN_SIZE,
+ * each run is sorted and spilled to a temporary file, and runs are then merged
+ * together. Runs are organized in levels: whenever SORT_MERGE_WIDTH runs
+ * accumulate at one level, they are merged into a single run at the next one,
+ * which bounds the number of open files.
+ */
+
+#define SORT_RUN_SIZE (1 << 16)
+#define SORT_MERGE_WIDTH 16
+#define SORT_LEVELS 8
+
+/*----------------------------------------------------------------------------*
+ |                            posix_sort_projection()                         |
+ *----------------------------------------------------------------------------*/
+
+int
+posix_sort_projection(struct rbh_filter_projection *projection,
+                      const struct rbh_filter_sort *items, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const struct rbh_filter_field *field = &items[i].field;
+        const struct rbh_filter exists = {
+            .op = RBH_FOP_EXISTS,
+            .compare = {
+                .field = *field,
+                .value = {
+                    .type = RBH_VT_BOOLEAN,
+                    .boolean = true,
+                },
+            },
+        };
+
+        /* rbh_fsentry_compare() expects valid fields */
+        if (rbh_filter_validate(&exists))
+            return -1;
+
+        projection->fsentry_mask |= field->fsentry;
+        switch (field->fsentry) {
+        case RBH_FP_STATX:
+            projection->statx_mask |= field->statx;
+            break;
+        case RBH_FP_NAMESPACE_XATTRS:
+            projection->xattrs.ns.count = 0;
+            break;
+        case RBH_FP_INODE_XATTRS:
+            projection->xattrs.inode.count = 0;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                serialization                               |
+ *----------------------------------------------------------------------------*/
+
+/* Fsentries are spilled to temporary files in a simple binary format, which
+ * only needs to be read back by the process that wrote it.
+ */
+
+static int
+write_bytes(FILE *file, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size) {
+        errno = errno ? : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+write_size(FILE *file, size_t size)
+{
+    return write_bytes(file, &size, sizeof(size));
+}
+
+static int
+write_string(FILE *file, const char *string)
+{
+    size_t length = strlen(string) + 1;
+
+    if (write_size(file, length))
+        return -1;
+    return write_bytes(file, string, length);
+}
+
+static int
+write_map(FILE *file, const struct rbh_value_map *map);
+
+static int
+write_value(FILE *file, const struct rbh_value *value)
+{
+    if (write_bytes(file, &value->type, sizeof(value->type)))
+        return -1;
+
+    switch (value->type) {
+    case RBH_VT_BOOLEAN:
+        return write_bytes(file, &value->boolean, sizeof(value->boolean));
+    case RBH_VT_INT32:
+        return write_bytes(file, &value->int32, sizeof(value->int32));
+    case RBH_VT_UINT32:
+        return write_bytes(file, &value->uint32, sizeof(value->uint32));
+    case RBH_VT_INT64:
+        return write_bytes(file, &value->int64, sizeof(value->int64));
+    case RBH_VT_UINT64:
+        return write_bytes(file, &value->uint64, sizeof(value->uint64));
+    case RBH_VT_STRING:
+        return write_string(file, value->string);
+    case RBH_VT_BINARY:
+        if (write_size(file, value->binary.size))
+            return -1;
+        return write_bytes(file, value->binary.data, value->binary.size);
+    case RBH_VT_REGEX:
+        if (write_string(file, value->regex.string))
+            return -1;
+        return write_bytes(file, &value->regex.options,
+                           sizeof(value->regex.options));
+    case RBH_VT_SEQUENCE:
+        if (write_size(file, value->sequence.count))
+            return -1;
+        for (size_t i = 0; i < value->sequence.count; i++) {
+            if (write_value(file, &value->sequence.values[i]))
+                return -1;
+        }
+        return 0;
+    case RBH_VT_MAP:
+        return write_map(file, &value->map);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int
+write_map(FILE *file, const struct rbh_value_map *map)
+{
+    if (write_size(file, map->count))
+        return -1;
+
+    for (size_t i = 0; i < map->count; i++) {
+        const struct rbh_value_pair *pair = &map->pairs[i];
+        bool has_value = pair->value != NULL;
+
+        if (write_string(file, pair->key)
+         || write_bytes(file, &has_value, sizeof(has_value)))
+            return -1;
+
+        if (has_value && write_value(file, pair->value))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+write_id(FILE *file, const struct rbh_id *id)
+{
+    if (write_size(file, id->size))
+        return -1;
+    return write_bytes(file, id->data, id->size);
+}
+
+static int
+fsentry_write(FILE *file, const struct rbh_fsentry *fsentry)
+{
+    if (write_bytes(file, &fsentry->mask, sizeof(fsentry->mask)))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_ID && write_id(file, &fsentry->id))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_PARENT_ID
+     && write_id(file, &fsentry->parent_id))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_NAME && write_string(file, fsentry->name))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_STATX
+     && write_bytes(file, fsentry->statx, sizeof(*fsentry->statx)))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_SYMLINK && write_string(file, fsentry->symlink))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_NAMESPACE_XATTRS
+     && write_map(file, &fsentry->xattrs.ns))
+        return -1;
+
+    if (fsentry->mask & RBH_FP_INODE_XATTRS
+     && write_map(file, &fsentry->xattrs.inode))
+        return -1;
+
+    return 0;
+}
+
+/* The data read back from a file is stored in separate allocations, which are
+ * all released once the fsentry is rebuilt with rbh_fsentry_new()
+ */
+struct decoder {
+    FILE *file;
+    void **allocations;
+    size_t count;
+    size_t size;
+};
+
+static void *
+decoder_alloc(struct decoder *decoder, size_t size)
+{
+    void *data;
+
+    if (decoder->count == decoder->size) {
+        size_t new_size = decoder->size ? decoder->size * 2 : 16;
+        void **tmp;
+
+        tmp = reallocarray(decoder->allocations, new_size, sizeof(*tmp));
+        if (tmp == NULL)
+            return NULL;
+        decoder->allocations = tmp;
+        decoder->size = new_size;
+    }
+
+    /* Never return NULL for an empty allocation */
+    data = malloc(size ? : 1);
+    if (data == NULL)
+        return NULL;
+
+    decoder->allocations[decoder->count++] = data;
+    return data;
+}
+
+static void
+decoder_clear(struct decoder *decoder)
+{
+    for (size_t i = 0; i < decoder->count; i++)
+        free(decoder->allocations[i]);
+    decoder->count = 0;
+}
+
+static int
+read_bytes(struct decoder *decoder, void *data, size_t size)
+{
+    if (fread(data, 1, size, decoder->file) != size) {
+        /* Files are only ever read back in full */
+        errno = ferror(decoder->file) ? (errno ? : EIO) : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+read_size(struct decoder *decoder, size_t *size)
+{
+    return read_bytes(decoder, size, sizeof(*size));
+}
+
+static const char *
+read_string(struct decoder *decoder)
+{
+    size_t length;
+    char *string;
+
+    if (read_size(decoder, &length))
+        return NULL;
+
+    string = decoder_alloc(decoder, length);
+    if (string == NULL)
+        return NULL;
+
+    if (read_bytes(decoder, string, length))
+        return NULL;
+
+    if (length == 0 || string[length - 1] != '\0') {
+        errno = EIO;
+        return NULL;
+    }
+    return string;
+}
+
+static int
+read_map(struct decoder *decoder, struct rbh_value_map *map);
+
+static int
+read_value(struct decoder *decoder, struct rbh_value *value)
+{
+    struct rbh_value *values;
+    char *data;
+
+    if (read_bytes(decoder, &value->type, sizeof(value->type)))
+        return -1;
+
+    switch (value->type) {
+    case RBH_VT_BOOLEAN:
+        return read_bytes(decoder, &value->boolean, sizeof(value->boolean));
+    case RBH_VT_INT32:
+        return read_bytes(decoder, &value->int32, sizeof(value->int32));
+    case RBH_VT_UINT32:
+        return read_bytes(decoder, &value->uint32, sizeof(value->uint32));
+    case RBH_VT_INT64:
+        return read_bytes(decoder, &value->int64, sizeof(value->int64));
+    case RBH_VT_UINT64:
+        return read_bytes(decoder, &value->uint64, sizeof(value->uint64));
+    case RBH_VT_STRING:
+        value->string = read_string(decoder);
+        return value->string == NULL ? -1 : 0;
+    case RBH_VT_BINARY:
+        if (read_size(decoder, &value->binary.size))
+            return -1;
+
+        data = decoder_alloc(decoder, value->binary.size);
+        if (data == NULL)
+            return -1;
+        value->binary.data = data;
+        return read_bytes(decoder, data, value->binary.size);
+    case RBH_VT_REGEX:
+        value->regex.string = read_string(decoder);
+        if (value->regex.string == NULL)
+            return -1;
+        return read_bytes(decoder, &value->regex.options,
+                          sizeof(value->regex.options));
+    case RBH_VT_SEQUENCE:
+        if (read_size(decoder, &value->sequence.count))
+            return -1;
+
+        values = decoder_alloc(decoder,
+                               value->sequence.count * sizeof(*values));
+        if (values == NULL)
+            return -1;
+
+        for (size_t i = 0; i < value->sequence.count; i++) {
+            if (read_value(decoder, &values[i]))
+                return -1;
+        }
+        value->sequence.values = values;
+        return 0;
+    case RBH_VT_MAP:
+        return read_map(decoder, &value->map);
+    }
+
+    errno = EIO;
+    return -1;
+}
+
+static int
+read_map(struct decoder *decoder, struct rbh_value_map *map)
+{
+    struct rbh_value_pair *pairs;
+
+    if (read_size(decoder, &map->count))
+        return -1;
+
+    pairs = decoder_alloc(decoder, map->count * sizeof(*pairs));
+    if (pairs == NULL)
+        return -1;
+
+    for (size_t i = 0; i < map->count; i++) {
+        struct rbh_value *value;
+        bool has_value;
+
+        pairs[i].key = read_string(decoder);
+        if (pairs[i].key == NULL)
+            return -1;
+
+        if (read_bytes(decoder, &has_value, sizeof(has_value)))
+            return -1;
+
+        if (!has_value) {
+            pairs[i].value = NULL;
+            continue;
+        }
+
+        value = decoder_alloc(decoder, sizeof(*value));
+        if (value == NULL || read_value(decoder, value))
+            return -1;
+        pairs[i].value = value;
+    }
+
+    map->pairs = pairs;
+    return 0;
+}
+
+static int
+read_id(struct decoder *decoder, struct rbh_id *id)
+{
+    char *data;
+
+    if (read_size(decoder, &id->size))
+        return -1;
+
+    data = decoder_alloc(decoder, id->size);
+    if (data == NULL)
+        return -1;
+    id->data = data;
+
+    return read_bytes(decoder, data, id->size);
+}
+
+/* Returns NULL and sets errno to ENODATA at the end of the file */
+static struct rbh_fsentry *
+fsentry_read(struct decoder *decoder)
+{
+    struct rbh_value_map ns_xattrs, inode_xattrs;
+    struct rbh_id id, parent_id;
+    struct rbh_fsentry *fsentry;
+    const char *symlink = NULL;
+    struct rbh_statx statxbuf;
+    const char *name = NULL;
+    unsigned int mask;
+    int save_errno;
+
+    if (fread(&mask, sizeof(mask), 1, decoder->file) != 1) {
+        errno = ferror(decoder->file) ? (errno ? : EIO) : ENODATA;
+        return NULL;
+    }
+
+    if (mask & RBH_FP_ID && read_id(decoder, &id))
+        goto out_clear;
+
+    if (mask & RBH_FP_PARENT_ID && read_id(decoder, &parent_id))
+        goto out_clear;
+
+    if (mask & RBH_FP_NAME) {
+        name = read_string(decoder);
+        if (name == NULL)
+            goto out_clear;
+    }
+
+    if (mask & RBH_FP_STATX
+     && read_bytes(decoder, &statxbuf, sizeof(statxbuf)))
+        goto out_clear;
+
+    if (mask & RBH_FP_SYMLINK) {
+        symlink = read_string(decoder);
+        if (symlink == NULL)
+            goto out_clear;
+    }
+
+    if (mask & RBH_FP_NAMESPACE_XATTRS && read_map(decoder, &ns_xattrs))
+        goto out_clear;
+
+    if (mask & RBH_FP_INODE_XATTRS && read_map(decoder, &inode_xattrs))
+        goto out_clear;
+
+    fsentry = rbh_fsentry_new(mask & RBH_FP_ID ? &id : NULL,
+                              mask & RBH_FP_PARENT_ID ? &parent_id : NULL,
+                              name, mask & RBH_FP_STATX ? &statxbuf : NULL,
+                              mask & RBH_FP_NAMESPACE_XATTRS ? &ns_xattrs
+                                                             : NULL,
+                              mask & RBH_FP_INODE_XATTRS ? &inode_xattrs
+                                                         : NULL,
+                              symlink);
+    save_errno = errno;
+    decoder_clear(decoder);
+    errno = save_errno;
+    return fsentry;
+
+out_clear:
+    save_errno = errno;
+    decoder_clear(decoder);
+    errno = save_errno;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                    heaps                                   |
+ *----------------------------------------------------------------------------*/
+
+/* A binary heap of pointers, whose top is the smallest element according to
+ * `compare'
+ */
+struct heap {
+    void **elements;
+    size_t count;
+    int (*compare)(const void *, const void *, void *);
+    void *arg;
+};
+
+static void
+heap_sift_up(struct heap *heap, size_t index)
+{
+    void *element = heap->elements[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (heap->compare(heap->elements[parent], element, heap->arg) <= 0)
+            break;
+        heap->elements[index] = heap->elements[parent];
+        index = parent;
+    }
+    heap->elements[index] = element;
+}
+
+static void
+heap_sift_down(struct heap *heap, size_t index)
+{
+    void *element = heap->elements[index];
+
+    while (true) {
+        size_t child = 2 * index + 1;
+
+        if (child >= heap->count)
+            break;
+
+        if (child + 1 < heap->count
+         && heap->compare(heap->elements[child + 1], heap->elements[child],
+                          heap->arg) < 0)
+            child++;
+
+        if (heap->compare(element, heap->elements[child], heap->arg) <= 0)
+            break;
+
+        heap->elements[index] = heap->elements[child];
+        index = child;
+    }
+    heap->elements[index] = element;
+}
+
+/* `heap->elements' must have room for one more element */
+static void
+heap_push(struct heap *heap, void *element)
+{
+    heap->elements[heap->count] = element;
+    heap_sift_up(heap, heap->count++);
+}
+
+static void *
+heap_pop(struct heap *heap)
+{
+    void *top = heap->elements[0];
+
+    if (--heap->count > 0) {
+        heap->elements[0] = heap->elements[heap->count];
+        heap_sift_down(heap, 0);
+    }
+    return top;
+}
+
+static void
+heap_replace_top(struct heap *heap, void *element)
+{
+    heap->elements[0] = element;
+    heap_sift_down(heap, 0);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  sorting                                   |
+ *----------------------------------------------------------------------------*/
+
+struct sort_keys {
+    const struct rbh_filter_sort *items;
+    size_t count;
+};
+
+static int
+fsentry_compare(const void *first, const void *second, void *arg)
+{
+    const struct sort_keys *keys = arg;
+
+    return rbh_fsentry_compare(first, second, keys->items, keys->count);
+}
+
+/* Reverse order, for a heap whose top is the last element */
+static int
+fsentry_reverse_compare(const void *first, const void *second, void *arg)
+{
+    return fsentry_compare(second, first, arg);
+}
+
+static int
+fsentry_qsort_compare(const void *first, const void *second, void *arg)
+{
+    return fsentry_compare(*(void * const *)first, *(void * const *)second,
+                           arg);
+}
+
+/* A sorted run spilled to a temporary file */
+struct sort_run {
+    struct decoder decoder;
+    struct rbh_fsentry *head;
+};
+
+static int
+run_compare(const void *first, const void *second, void *arg)
+{
+    const struct sort_run *first_run = first;
+    const struct sort_run *second_run = second;
+
+    return fsentry_compare(first_run->head, second_run->head, arg);
+}
+
+static void
+run_destroy(struct sort_run *run)
+{
+    free(run->head);
+    fclose(run->decoder.file);
+    free(run->decoder.allocations);
+    free(run);
+}
+
+static struct sort_run *
+run_new(FILE *file)
+{
+    struct sort_run *run;
+
+    run = malloc(sizeof(*run));
+    if (run == NULL)
+        return NULL;
+
+    run->decoder = (struct decoder){
+        .file = file,
+    };
+    run->head = NULL;
+    return run;
+}
+
+/* Merge runs together, in a heap ordered by their heads */
+struct merger {
+    struct heap heap;
+};
+
+static void
+merger_fini(struct merger *merger)
+{
+    for (size_t i = 0; i < merger->heap.count; i++)
+        run_destroy(merger->heap.elements[i]);
+    free(merger->heap.elements);
+}
+
+/* Takes ownership of `runs' (even on error) */
+static int
+merger_init(struct merger *merger, struct sort_run **runs, size_t count,
+            struct sort_keys *keys)
+{
+    int save_errno;
+    size_t i;
+
+    merger->heap = (struct heap){
+        .elements = malloc(count * sizeof(*merger->heap.elements)),
+        .compare = run_compare,
+        .arg = keys,
+    };
+    if (merger->heap.elements == NULL) {
+        save_errno = errno;
+        for (i = 0; i < count; i++)
+            run_destroy(runs[i]);
+        errno = save_errno;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct sort_run *run = runs[i];
+
+        if (fseek(run->decoder.file, 0, SEEK_SET))
+            goto out_destroy_runs;
+
+        run->head = fsentry_read(&run->decoder);
+        if (run->head == NULL) {
+            if (errno != ENODATA)
+                goto out_destroy_runs;
+            run_destroy(run);
+            continue;
+        }
+        heap_push(&merger->heap, run);
+    }
+
+    return 0;
+
+out_destroy_runs:
+    save_errno = errno;
+    for (; i < count; i++)
+        run_destroy(runs[i]);
+    merger_fini(merger);
+    errno = save_errno;
+    return -1;
+}
+
+static struct rbh_fsentry *
+merger_next(struct merger *merger)
+{
+    struct rbh_fsentry *fsentry;
+    struct sort_run *run;
+
+    if (merger->heap.count == 0) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    run = merger->heap.elements[0];
+    fsentry = run->head;
+    run->head = fsentry_read(&run->decoder);
+    if (run->head != NULL) {
+        heap_replace_top(&merger->heap, run);
+    } else if (errno == ENODATA) {
+        run_destroy(heap_pop(&merger->heap));
+    } else {
+        /* Put `fsentry' back, so that a retry does not lose it */
+        run->head = fsentry;
+        return NULL;
+    }
+
+    return fsentry;
+}
+
+/* Write the fsentries `merger' yields to a new run */
+static struct sort_run *
+merger_spill(struct merger *merger)
+{
+    struct rbh_fsentry *fsentry;
+    struct sort_run *run;
+    int save_errno;
+    FILE *file;
+
+    file = tmpfile();
+    if (file == NULL)
+        return NULL;
+
+    run = run_new(file);
+    if (run == NULL) {
+        save_errno = errno;
+        fclose(file);
+        errno = save_errno;
+        return NULL;
+    }
+
+    while ((fsentry = merger_next(merger)) != NULL) {
+        int rc = fsentry_write(file, fsentry);
+
+        free(fsentry);
+        if (rc)
+            goto out_destroy_run;
+    }
+    if (errno != ENODATA)
+        goto out_destroy_run;
+
+    return run;
+
+out_destroy_run:
+    save_errno = errno;
+    run_destroy(run);
+    errno = save_errno;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                              posix_sort_iter                               |
+ *----------------------------------------------------------------------------*/
+
+struct posix_sort_iterator {
+    struct rbh_mut_iterator iterator;
+
+    struct rbh_mut_iterator *fsentries;
+    struct sort_keys keys;
+    size_t skip;
+    size_t limit;
+    size_t count;
+
+    bool sorted;
+    /* Sorted fsentries held in memory */
+    struct rbh_fsentry **array;
+    size_t array_count;
+    size_t array_index;
+    /* Runs spilled to temporary files */
+    struct sort_run *levels[SORT_LEVELS][SORT_MERGE_WIDTH];
+    size_t level_counts[SORT_LEVELS];
+    struct merger merger;
+    bool merging;
+};
+
+/* Merge the runs of a level into a single one */
+static struct sort_run *
+sort_iter_merge_level(struct posix_sort_iterator *sort_iter, size_t level)
+{
+    size_t count = sort_iter->level_counts[level];
+    struct merger merger;
+    struct sort_run *run;
+    int save_errno;
+
+    sort_iter->level_counts[level] = 0;
+    if (merger_init(&merger, sort_iter->levels[level], count,
+                    &sort_iter->keys))
+        return NULL;
+
+    run = merger_spill(&merger);
+    save_errno = errno;
+    merger_fini(&merger);
+    errno = save_errno;
+    return run;
+}
+
+/* Takes ownership of `run' (even on error) */
+static int
+sort_iter_push_run(struct posix_sort_iterator *sort_iter, struct sort_run *run,
+                   size_t level)
+{
+    struct sort_run *merged;
+    int save_errno;
+
+    if (sort_iter->level_counts[level] == SORT_MERGE_WIDTH) {
+        merged = sort_iter_merge_level(sort_iter, level);
+        if (merged == NULL)
+            goto out_destroy_run;
+
+        if (level == SORT_LEVELS - 1)
+            /* The last level is merged into itself */
+            sort_iter->levels[level][sort_iter->level_counts[level]++] = merged;
+        else if (sort_iter_push_run(sort_iter, merged, level + 1))
+            goto out_destroy_run;
+    }
+
+    sort_iter->levels[level][sort_iter->level_counts[level]++] = run;
+    return 0;
+
+out_destroy_run:
+    save_errno = errno;
+    run_destroy(run);
+    errno = save_errno;
+    return -1;
+}
+
+/* Sort `array', and spill it to a new run */
+static int
+sort_iter_spill(struct posix_sort_iterator *sort_iter)
+{
+    struct sort_run *run;
+    int save_errno;
+    FILE *file;
+
+    qsort_r(sort_iter->array, sort_iter->array_count,
+            sizeof(*sort_iter->array), fsentry_qsort_compare,
+            &sort_iter->keys);
+
+    file = tmpfile();
+    if (file == NULL)
+        return -1;
+
+    for (size_t i = 0; i < sort_iter->array_count; i++) {
+        if (fsentry_write(file, sort_iter->array[i]))
+            goto out_close;
+    }
+
+    run = run_new(file);
+    if (run == NULL)
+        goto out_close;
+
+    for (size_t i = 0; i < sort_iter->array_count; i++)
+        free(sort_iter->array[i]);
+    sort_iter->array_count = 0;
+
+    return sort_iter_push_run(sort_iter, run, 0);
+
+out_close:
+    save_errno = errno;
+    fclose(file);
+    errno = save_errno;
+    return -1;
+}
+
+/* Whether it is worth keeping the `skip + limit' first fsentries in memory,
+ * rather than sorting them all
+ */
+static bool
+sort_iter_keeps_top(struct posix_sort_iterator *sort_iter)
+{
+    return sort_iter->limit > 0 && sort_iter->limit <= SORT_RUN_SIZE
+        && sort_iter->skip <= SORT_RUN_SIZE - sort_iter->limit;
+}
+
+/* Keep the `skip + limit' first fsentries
+ *
+ * If `fsentries' fails, this can be called again to resume where it stopped.
+ */
+static int
+sort_iter_top(struct posix_sort_iterator *sort_iter)
+{
+    struct heap heap = {
+        .compare = fsentry_reverse_compare,
+        .arg = &sort_iter->keys,
+    };
+    size_t size = sort_iter->skip + sort_iter->limit;
+    struct rbh_fsentry *fsentry;
+
+    if (sort_iter->array == NULL) {
+        sort_iter->array = reallocarray(NULL, size, sizeof(*sort_iter->array));
+        if (sort_iter->array == NULL)
+            return -1;
+    }
+    /* The heap may have been partially filled by a previous call */
+    heap.elements = (void **)sort_iter->array;
+    heap.count = sort_iter->array_count;
+
+    while ((fsentry = rbh_mut_iter_next(sort_iter->fsentries)) != NULL) {
+        if (heap.count < size) {
+            heap_push(&heap, fsentry);
+            sort_iter->array_count = heap.count;
+        } else if (fsentry_compare(fsentry, heap.elements[0],
+                                   &sort_iter->keys) < 0) {
+            free(heap.elements[0]);
+            heap_replace_top(&heap, fsentry);
+        } else {
+            free(fsentry);
+        }
+    }
+    if (errno != ENODATA)
+        return -1;
+
+    qsort_r(sort_iter->array, sort_iter->array_count,
+            sizeof(*sort_iter->array), fsentry_qsort_compare,
+            &sort_iter->keys);
+    sort_iter->array_index = sort_iter->skip;
+    return 0;
+}
+
+/* Sort every fsentry, spilling them to temporary files as needed
+ *
+ * If `fsentries' fails, this can be called again to resume where it stopped.
+ */
+static int
+sort_iter_all(struct posix_sort_iterator *sort_iter)
+{
+    struct sort_run *runs[SORT_LEVELS * SORT_MERGE_WIDTH];
+    struct rbh_fsentry *fsentry;
+    size_t count = 0;
+
+    if (sort_iter->merging)
+        goto skip;
+
+    if (sort_iter->array == NULL) {
+        sort_iter->array = reallocarray(NULL, SORT_RUN_SIZE,
+                                        sizeof(*sort_iter->array));
+        if (sort_iter->array == NULL)
+            return -1;
+    }
+
+    while (true) {
+        /* Spill before reading more, so that a failed spill can be retried */
+        if (sort_iter->array_count == SORT_RUN_SIZE
+         && sort_iter_spill(sort_iter))
+            return -1;
+
+        fsentry = rbh_mut_iter_next(sort_iter->fsentries);
+        if (fsentry == NULL)
+            break;
+        sort_iter->array[sort_iter->array_count++] = fsentry;
+    }
+    if (errno != ENODATA)
+        return -1;
+
+    for (size_t i = 0; i < SORT_LEVELS; i++)
+        count += sort_iter->level_counts[i];
+
+    if (count == 0) {
+        /* Everything fits in memory */
+        qsort_r(sort_iter->array, sort_iter->array_count,
+                sizeof(*sort_iter->array), fsentry_qsort_compare,
+                &sort_iter->keys);
+        sort_iter->array_index = sort_iter->skip;
+        return 0;
+    }
+
+    if (sort_iter->array_count > 0 && sort_iter_spill(sort_iter))
+        return -1;
+
+    count = 0;
+    for (size_t i = 0; i < SORT_LEVELS; i++) {
+        for (size_t j = 0; j < sort_iter->level_counts[i]; j++)
+            runs[count++] = sort_iter->levels[i][j];
+        sort_iter->level_counts[i] = 0;
+    }
+
+    if (merger_init(&sort_iter->merger, runs, count, &sort_iter->keys))
+        return -1;
+    sort_iter->merging = true;
+
+skip:
+    /* Skip the first fsentries */
+    while (sort_iter->skip > 0) {
+        fsentry = merger_next(&sort_iter->merger);
+        if (fsentry == NULL)
+            return errno == ENODATA ? 0 : -1;
+        free(fsentry);
+        sort_iter->skip--;
+    }
+    return 0;
+}
+
+static void *
+posix_sort_iter_next(void *iterator)
+{
+    struct posix_sort_iterator *sort_iter = iterator;
+    struct rbh_fsentry *fsentry;
+
+    if (sort_iter->limit > 0 && sort_iter->count >= sort_iter->limit) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    if (sort_iter->keys.count == 0) {
+        /* No sorting, skip the first fsentries on the fly */
+        while (sort_iter->skip > 0) {
+            fsentry = rbh_mut_iter_next(sort_iter->fsentries);
+            if (fsentry == NULL)
+                return NULL;
+            free(fsentry);
+            sort_iter->skip--;
+        }
+
+        fsentry = rbh_mut_iter_next(sort_iter->fsentries);
+        if (fsentry != NULL)
+            sort_iter->count++;
+        return fsentry;
+    }
+
+    if (!sort_iter->sorted) {
+        int rc = sort_iter_keeps_top(sort_iter) ? sort_iter_top(sort_iter)
+                                                : sort_iter_all(sort_iter);
+
+        if (rc)
+            return NULL;
+        sort_iter->sorted = true;
+    }
+
+    if (sort_iter->merging) {
+        fsentry = merger_next(&sort_iter->merger);
+    } else if (sort_iter->array_index < sort_iter->array_count) {
+        fsentry = sort_iter->array[sort_iter->array_index];
+        sort_iter->array[sort_iter->array_index++] = NULL;
+    } else {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    if (fsentry != NULL)
+        sort_iter->count++;
+    return fsentry;
+}
+
+static void
+posix_sort_iter_destroy(void *iterator)
+{
+    struct posix_sort_iterator *sort_iter = iterator;
+
+    for (size_t i = 0; i < sort_iter->array_count; i++)
+        free(sort_iter->array[i]);
+    free(sort_iter->array);
+
+    for (size_t i = 0; i < SORT_LEVELS; i++) {
+        for (size_t j = 0; j < sort_iter->level_counts[i]; j++)
+            run_destroy(sort_iter->levels[i][j]);
+    }
+
+    if (sort_iter->merging)
+        merger_fini(&sort_iter->merger);
+
+    rbh_mut_iter_destroy(sort_iter->fsentries);
+    free(sort_iter);
+}
+
+static const struct rbh_mut_iterator_operations POSIX_SORT_ITER_OPS = {
+    .next = posix_sort_iter_next,
+    .destroy = posix_sort_iter_destroy,
+};
+
+static const struct rbh_mut_iterator POSIX_SORT_ITER = {
+    .ops = &POSIX_SORT_ITER_OPS,
+};
+
+static const char *
+field_xattr(const struct rbh_filter_field *field)
+{
+    switch (field->fsentry) {
+    case RBH_FP_NAMESPACE_XATTRS:
+    case RBH_FP_INODE_XATTRS:
+        return field->xattr;
+    default:
+        return NULL;
+    }
+}
+
+struct rbh_mut_iterator *
+posix_sort_iter_new(struct rbh_mut_iterator *fsentries,
+                    const struct rbh_filter_options *options)
+{
+    struct posix_sort_iterator *sort_iter;
+    struct rbh_filter_sort *items;
+    size_t size;
+    char *data;
+
+    size = options->sort.count * sizeof(*items);
+    for (size_t i = 0; i < options->sort.count; i++) {
+        const char *xattr = field_xattr(&options->sort.items[i].field);
+
+        if (xattr != NULL)
+            size += strlen(xattr) + 1;
+    }
+
+    sort_iter = calloc(1, sizeof(*sort_iter) + size);
+    if (sort_iter == NULL)
+        return NULL;
+
+    /* Copy the sorting options, which the caller may free */
+    items = (struct rbh_filter_sort *)(sort_iter + 1);
+    data = (char *)(items + options->sort.count);
+    for (size_t i = 0; i < options->sort.count; i++) {
+        const char *xattr = field_xattr(&options->sort.items[i].field);
+
+        items[i] = options->sort.items[i];
+        if (xattr != NULL) {
+            size_t length = strlen(xattr) + 1;
+
+            items[i].field.xattr = memcpy(data, xattr, length);
+            data += length;
+        }
+    }
+
+    sort_iter->iterator = POSIX_SORT_ITER;
+    sort_iter->fsentries = fsentries;
+    sort_iter->keys.items = items;
+    sort_iter->keys.count = options->sort.count;
+    sort_iter->skip = options->skip;
+    sort_iter->limit = options->limit;
+
+    return &sort_iter->iterator;
+}
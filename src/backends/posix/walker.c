@@ -0,0 +1,1400 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+#endif
+
+#include "robinhood/backends/posix_internal.h"
+#include "robinhood/id.h"
+#include "robinhood/statx.h"
+
+/* A parallel walker for the posix backend
+ *
+ * Directories are read by a pool of threads, each of which owns a deque of
+ * directories to read. A worker pushes the subdirectories it discovers at the
+ * back of its own deque, and pops from there (which keeps the walk mostly
+ * depth-first, and the memory footprint low). Idle workers steal directories
+ * from the front of other workers' deques, where the oldest, and hopefully
+ * biggest, subtrees sit.
+ *
+ * Fsentries (and errors) are handed to the consumer of the iterator through a
+ * bounded queue, which throttles workers when the consumer cannot keep up.
+ *
+ * Workers may also be split into partitions (e.g. one per metadata server of
+ * a distributed filesystem): each directory is then queued in the partition
+ * a callback assigns it to, and workers only steal from the deques of their
+ * own partition.
+ *
+ * Unlike fts(3), the walker does not allocate anything per directory entry:
+ * directories are read with getdents64(2) into a large buffer each worker
+ * reuses, and entries are opened relative to their parent directory.
+ * Directories themselves may be opened through their file handle, so that the
+ * filesystem does not resolve their whole path every time.
+ *
+ * Entries are processed by windows of siblings. When io_uring is available,
+ * the files of a window are opened, and then stat-ed, with a single system
+ * call each, which hides most of the latency of network filesystems.
+ */
+
+static const struct rbh_id ROOT_PARENT_ID = {
+    .data = NULL,
+    .size = 0,
+};
+
+/*----------------------------------------------------------------------------*
+ |                                  dirents                                   |
+ *----------------------------------------------------------------------------*/
+
+/* glibc only provides a wrapper for getdents64() since version 2.30 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Large enough to read most directories in a single system call */
+#define DIRENTS_BUFFER_SIZE (1 << 20)
+
+struct dirents {
+    char *buffer;
+    size_t offset;
+    size_t length;
+    int fd;
+};
+
+static void
+dirents_init(struct dirents *dirents, int fd, char *buffer)
+{
+    dirents->buffer = buffer;
+    dirents->offset = 0;
+    dirents->length = 0;
+    dirents->fd = fd;
+}
+
+static bool
+dirents_empty(struct dirents *dirents)
+{
+    return dirents->offset >= dirents->length;
+}
+
+/* Returns NULL and sets errno to 0 once the directory has been fully read */
+static struct linux_dirent64 *
+dirents_next(struct dirents *dirents)
+{
+    struct linux_dirent64 *dirent;
+
+    if (dirents->offset >= dirents->length) {
+        long rc;
+
+        rc = syscall(SYS_getdents64, dirents->fd, dirents->buffer,
+                     DIRENTS_BUFFER_SIZE);
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = 0;
+            return NULL;
+        }
+
+        dirents->offset = 0;
+        dirents->length = rc;
+    }
+
+    dirent = (struct linux_dirent64 *)(dirents->buffer + dirents->offset);
+    dirents->offset += dirent->d_reclen;
+    return dirent;
+}
+
+#ifdef HAVE_IO_URING
+
+/*----------------------------------------------------------------------------*
+ |                                   uring                                    |
+ *----------------------------------------------------------------------------*/
+
+/* A minimal io_uring wrapper, not to depend on liburing
+ *
+ * Requests are always submitted by batches that fit in the submission queue,
+ * and the caller waits for all of them to complete before preparing the next
+ * batch.
+ */
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int to_submit;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *sq_ring;
+    size_t sq_ring_size;
+    char *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static int
+uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    int save_errno;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_entries = params.sq_entries;
+    ring->to_submit = 0;
+
+    ring->sq_ring_size = params.sq_off.array
+                       + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes
+                       + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto out_close;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto out_unmap_sq_ring;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto out_unmap_cq_ring;
+
+    ring->sq_head = (unsigned int *)(ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(ring->sq_ring + params.sq_off.array);
+
+    ring->cq_head = (unsigned int *)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + params.cq_off.cqes);
+
+    return 0;
+
+out_unmap_cq_ring:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+out_unmap_sq_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+out_close:
+    save_errno = errno;
+    close(ring->fd);
+    errno = save_errno;
+    return -1;
+}
+
+static void
+uring_fini(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ring, uint64_t user_data)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    if (tail - head == ring->sq_entries)
+        return NULL;
+
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    /* The kernel only reads the submission queue in io_uring_enter() */
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/* Submit every prepared request, and wait for \p count of them to complete
+ *
+ * \p results is indexed by the `user_data' of requests.
+ */
+static int
+uring_wait(struct uring *ring, unsigned int count, int *results)
+{
+    while (count > 0) {
+        unsigned int head;
+        int rc;
+
+        rc = syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, count,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->to_submit -= rc;
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            results[cqe->user_data] = cqe->res;
+            head++;
+            count--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+#endif
+
+/*----------------------------------------------------------------------------*
+ |                                walker_deque                                |
+ *----------------------------------------------------------------------------*/
+
+struct walker_dir {
+    struct rbh_id *id;
+    char *path;
+    unsigned int depth;
+    /* Only the subdirectories of unchanged directories are visited */
+    bool unchanged;
+};
+
+struct walker_deque {
+    pthread_mutex_t lock;
+    struct walker_dir *dirs;
+    size_t size;
+    size_t first;
+    size_t count;
+};
+
+static int
+walker_deque_init(struct walker_deque *deque)
+{
+    int rc;
+
+    rc = pthread_mutex_init(&deque->lock, NULL);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+
+    deque->dirs = NULL;
+    deque->size = 0;
+    deque->first = 0;
+    deque->count = 0;
+    return 0;
+}
+
+static int
+walker_deque_push(struct walker_deque *deque, const struct walker_dir *dir)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->size) {
+        size_t size = deque->size ? deque->size * 2 : 1 << 6;
+        struct walker_dir *dirs;
+
+        dirs = reallocarray(NULL, size, sizeof(*dirs));
+        if (dirs == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+
+        /* Unwrap the ring */
+        for (size_t i = 0; i < deque->count; i++)
+            dirs[i] = deque->dirs[(deque->first + i) % deque->size];
+
+        free(deque->dirs);
+        deque->dirs = dirs;
+        deque->size = size;
+        deque->first = 0;
+    }
+
+    deque->dirs[(deque->first + deque->count++) % deque->size] = *dir;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/* The owner of a deque pops from the back, thieves pop from the front */
+static bool
+walker_deque_pop(struct walker_deque *deque, bool back, struct walker_dir *dir)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+
+    if (back) {
+        *dir = deque->dirs[(deque->first + deque->count - 1) % deque->size];
+    } else {
+        *dir = deque->dirs[deque->first];
+        deque->first = (deque->first + 1) % deque->size;
+    }
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static void
+walker_deque_destroy(struct walker_deque *deque)
+{
+    struct walker_dir dir;
+
+    while (walker_deque_pop(deque, false, &dir)) {
+        free(dir.id);
+        free(dir.path);
+    }
+    free(deque->dirs);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                posix_walker                                |
+ *----------------------------------------------------------------------------*/
+
+/* Maximum number of fsentries workers may read ahead of the consumer */
+#define WALKER_QUEUE_SIZE (1 << 12)
+
+struct walker_item {
+    struct rbh_fsentry *fsentry;
+    int error;
+};
+
+struct posix_walker;
+
+/* Number of sibling entries processed at once */
+#define WALKER_WINDOW_SIZE 64
+
+struct walker_window_entry {
+    const char *name;
+    int fd;
+    bool has_statx;
+    struct rbh_statx statxbuf;
+};
+
+struct walker_worker {
+    struct posix_walker *walker;
+    struct walker_deque deque;
+    /* getdents64() buffer */
+    char *dirents;
+    /* Buffer for the path of entries */
+    char *path;
+    size_t path_size;
+    struct walker_window_entry window[WALKER_WINDOW_SIZE];
+#ifdef HAVE_IO_URING
+    struct uring ring;
+    bool has_ring;
+    int results[WALKER_WINDOW_SIZE];
+#endif
+    pthread_t thread;
+    size_t index;
+    size_t partition;
+};
+
+struct walker_partition {
+    pthread_cond_t work;
+    /* Number of directories sitting in the deques of the partition */
+    size_t queued;
+};
+
+struct posix_walker {
+    struct rbh_mut_iterator iterator;
+
+    int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                              const uint16_t,
+                              const struct rbh_value_map *,
+                              struct rbh_value_pair *, ssize_t *,
+                              struct rbh_value_pair *, struct rbh_sstack *);
+    struct rbh_filter_projection *projection;
+    struct rbh_filter_program *program;
+    struct rbh_filter_program *prune;
+    /* `program', or NULL if `prune' needs the fields it would skip */
+    const struct rbh_filter_program *early_program;
+    unsigned int max_depth;
+    int64_t unchanged_before;
+    uint32_t statx_mask;
+    int statx_sync_type;
+    size_t prefix_len;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    int (*dir_partition)(int, const struct rbh_id *);
+    /* A file descriptor to open directories by handle with, or -1 */
+    int mount_fd;
+
+    /* Everything below is protected by `lock' (except for the deques) */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    /* Worker i belongs to partition `i % nb_partitions' */
+    struct walker_partition *partitions;
+    size_t nb_partitions;
+    /* Number of directories that were not completely read yet */
+    size_t pending;
+    /* Number of workers that did not exit yet */
+    size_t running;
+    bool stop;
+
+    struct walker_item items[WALKER_QUEUE_SIZE];
+    size_t first_item;
+    size_t item_count;
+
+    size_t nb_workers;
+    struct walker_worker workers[];
+};
+
+/* Hand an fsentry, or an error, to the consumer
+ *
+ * Returns false if the walker is being destroyed, in which case \p fsentry is
+ * freed.
+ */
+static bool
+walker_emit(struct posix_walker *walker, struct rbh_fsentry *fsentry,
+            int error)
+{
+    struct walker_item *item;
+
+    pthread_mutex_lock(&walker->lock);
+    while (!walker->stop && walker->item_count == WALKER_QUEUE_SIZE)
+        pthread_cond_wait(&walker->not_full, &walker->lock);
+
+    if (walker->stop) {
+        pthread_mutex_unlock(&walker->lock);
+        free(fsentry);
+        return false;
+    }
+
+    item = &walker->items[
+        (walker->first_item + walker->item_count++) % WALKER_QUEUE_SIZE
+        ];
+    item->fsentry = fsentry;
+    item->error = error;
+
+    pthread_cond_signal(&walker->not_empty);
+    pthread_mutex_unlock(&walker->lock);
+    return true;
+}
+
+static size_t
+walker_dir_partition(struct posix_walker *walker, int dirfd,
+                     const struct walker_dir *dir, size_t fallback)
+{
+    int partition;
+
+    if (walker->nb_partitions == 1)
+        return 0;
+
+    partition = walker->dir_partition(dirfd, dir->id);
+    if (partition < 0)
+        /* Keep the directory where it was discovered */
+        return fallback;
+    return partition % walker->nb_partitions;
+}
+
+/* Queue a directory \p dirfd is a file descriptor of the parent of */
+static int
+walker_push_dir(struct walker_worker *worker, int dirfd,
+                const struct walker_dir *dir)
+{
+    struct posix_walker *walker = worker->walker;
+    struct walker_worker *owner = worker;
+    size_t partition;
+
+    /* The first worker of a partition collects the directories other
+     * partitions discover for it
+     */
+    partition = walker_dir_partition(walker, dirfd, dir, worker->partition);
+    if (partition != worker->partition)
+        owner = &walker->workers[partition];
+
+    if (walker_deque_push(&owner->deque, dir))
+        return -1;
+
+    pthread_mutex_lock(&walker->lock);
+    walker->partitions[partition].queued++;
+    walker->pending++;
+    pthread_cond_signal(&walker->partitions[partition].work);
+    pthread_mutex_unlock(&walker->lock);
+    return 0;
+}
+
+static bool
+walker_pop_dir(struct walker_worker *worker, struct walker_dir *dir)
+{
+    struct posix_walker *walker = worker->walker;
+    struct walker_partition *partition =
+        &walker->partitions[worker->partition];
+
+    pthread_mutex_lock(&walker->lock);
+    while (!walker->stop && partition->queued == 0 && walker->pending > 0)
+        pthread_cond_wait(&partition->work, &walker->lock);
+
+    if (walker->stop || partition->queued == 0) {
+        /* The walk is over */
+        pthread_mutex_unlock(&walker->lock);
+        return false;
+    }
+
+    /* Reserve a directory: it is now guaranteed that at least one of the
+     * deques of the partition holds a directory no other worker will take.
+     */
+    partition->queued--;
+    pthread_mutex_unlock(&walker->lock);
+
+    for (size_t i = 0; true; i++) {
+        struct walker_worker *victim =
+            &walker->workers[(worker->index + i) % walker->nb_workers];
+
+        if (victim->partition != worker->partition)
+            continue;
+
+        if (walker_deque_pop(&victim->deque, victim == worker, dir))
+            return true;
+    }
+}
+
+static void
+walker_done_dir(struct posix_walker *walker)
+{
+    pthread_mutex_lock(&walker->lock);
+    if (--walker->pending == 0) {
+        for (size_t i = 0; i < walker->nb_partitions; i++)
+            pthread_cond_broadcast(&walker->partitions[i].work);
+    }
+    pthread_mutex_unlock(&walker->lock);
+}
+
+static bool
+is_walkable_dir(struct posix_walker *walker, const struct rbh_fsentry *fsentry)
+{
+    const struct rbh_statx *statxbuf = fsentry->statx;
+
+    if (!(fsentry->mask & RBH_FP_STATX))
+        return false;
+
+    if (!(statxbuf->stx_mask & RBH_STATX_TYPE) || !S_ISDIR(statxbuf->stx_mode))
+        return false;
+
+    /* Do not cross mount points (cf. FTS_XDEV) */
+    return statxbuf->stx_dev_major == walker->dev_major
+        && statxbuf->stx_dev_minor == walker->dev_minor;
+}
+
+static char *
+path_join(char **buffer, size_t *size, const char *dirpath, const char *name)
+{
+    size_t dirlen = strlen(dirpath);
+    size_t namelen = strlen(name);
+    bool slash = dirlen == 0 || dirpath[dirlen - 1] != '/';
+    size_t length = dirlen + slash + namelen + 1;
+
+    if (length > *size) {
+        char *tmp;
+
+        tmp = realloc(*buffer, length);
+        if (tmp == NULL)
+            return NULL;
+        *buffer = tmp;
+        *size = length;
+    }
+
+    memcpy(*buffer, dirpath, dirlen);
+    if (slash)
+        (*buffer)[dirlen] = '/';
+    memcpy(*buffer + dirlen + slash, name, namelen + 1);
+    return *buffer;
+}
+
+/* Open and stat the entries of a window ahead of time, if possible */
+static void
+walker_prefetch(struct walker_worker *worker, int dirfd, size_t count)
+{
+#ifdef HAVE_IO_URING
+    const int statx_flags =
+        AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+    struct uring *ring = &worker->ring;
+    unsigned int opened = 0;
+    int rc;
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        worker->window[i].fd = -1;
+        worker->window[i].has_statx = false;
+    }
+
+#ifdef HAVE_IO_URING
+    if (!worker->has_ring || count == 0)
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring, i);
+
+        worker->results[i] = -ECANCELED;
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t)worker->window[i].name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK;
+    }
+
+    rc = uring_wait(ring, count, worker->results);
+
+    for (size_t i = 0; i < count; i++) {
+        /* Failures (eg. symlinks, sockets, ...) are handled synchronously */
+        if (worker->results[i] >= 0)
+            worker->window[i].fd = worker->results[i];
+    }
+
+    if (rc)
+        goto out_disable;
+
+    for (size_t i = 0; i < count; i++) {
+        struct walker_window_entry *entry = &worker->window[i];
+        struct io_uring_sqe *sqe;
+
+        if (entry->fd < 0)
+            continue;
+
+        worker->results[i] = -ECANCELED;
+        sqe = uring_get_sqe(ring, i);
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = entry->fd;
+        sqe->addr = (uintptr_t)"";
+        sqe->len = worker->walker->statx_mask;
+        sqe->off = (uintptr_t)&entry->statxbuf;
+        sqe->statx_flags =
+            statx_flags | worker->walker->statx_sync_type;
+        opened++;
+    }
+
+    rc = uring_wait(ring, opened, worker->results);
+
+    for (size_t i = 0; i < count; i++) {
+        struct walker_window_entry *entry = &worker->window[i];
+
+        /* Failures are handled synchronously as well */
+        if (entry->fd < 0 || worker->results[i] < 0)
+            continue;
+
+        entry->statxbuf.stx_mask =
+            rbh_statx_mask_from_statx(entry->statxbuf.stx_mask);
+        entry->has_statx = true;
+    }
+
+    if (rc == 0)
+        return;
+
+out_disable:
+    /* Something is off with io_uring, stop using it (files that were opened
+     * ahead of time are still used)
+     */
+    uring_fini(ring);
+    worker->has_ring = false;
+#endif
+}
+
+static bool
+walker_matches(struct posix_walker *walker, const struct rbh_fsentry *fsentry)
+{
+    return walker->program == NULL
+        || rbh_filter_program_match(walker->program, fsentry, 0) == 1;
+}
+
+static bool
+walker_prunes(struct posix_walker *walker, const struct rbh_fsentry *directory,
+              unsigned int depth)
+{
+    return depth >= walker->max_depth
+        || (walker->prune != NULL
+         && rbh_filter_program_match(walker->prune, directory, 0) == 1);
+}
+
+/* Emit an entry of a directory, and queue it if it is a directory itself
+ *
+ * Returns false if the walker is being destroyed.
+ */
+static bool
+walker_visit(struct walker_worker *worker, struct walker_dir *parent,
+             int dirfd, struct walker_window_entry *entry)
+{
+    struct posix_walker *walker = worker->walker;
+    struct walker_dir child = {
+        .id = NULL,
+        .depth = parent->depth + 1,
+    };
+    struct rbh_fsentry *fsentry;
+    const char *path;
+
+    child.path = path_join(&worker->path, &worker->path_size, parent->path,
+                           entry->name);
+    if (child.path == NULL)
+        return walker_emit(walker, NULL, errno);
+    path = child.path + walker->prefix_len;
+
+    if (entry->fd < 0)
+        fsentry = posix_fsentry_new(dirfd, entry->name, path, entry->name,
+                                    parent->id, &child.id,
+                                    walker->statx_sync_type,
+                                    walker->projection,
+                                    walker->early_program,
+                                    walker->ns_xattrs_callback);
+    else
+        fsentry = posix_fsentry_from_fd(entry->fd,
+                                        entry->has_statx ?
+                                            &entry->statxbuf : NULL,
+                                        path, entry->name, parent->id,
+                                        &child.id, walker->statx_sync_type,
+                                        walker->projection,
+                                        walker->early_program,
+                                        walker->ns_xattrs_callback);
+    if (fsentry == NULL) {
+        if (errno == ENOENT || errno == ESTALE)
+            /* The entry moved from under our feet */
+            return true;
+
+        return walker_emit(walker, NULL, errno);
+    }
+
+    child.unchanged = posix_fsentry_is_unchanged(fsentry,
+                                                 walker->unchanged_before);
+    if (child.unchanged) {
+        struct rbh_fsentry *marked;
+
+        marked = posix_fsentry_mark_unchanged(fsentry);
+        if (marked == NULL) {
+            int save_errno = errno;
+
+            free(fsentry);
+            free(child.id);
+            return walker_emit(walker, NULL, save_errno);
+        }
+        fsentry = marked;
+    }
+
+    if (!is_walkable_dir(walker, fsentry)
+     || walker_prunes(walker, fsentry, child.depth)) {
+        free(child.id);
+        if (!walker_matches(walker, fsentry)) {
+            free(fsentry);
+            return true;
+        }
+        return walker_emit(walker, fsentry, 0);
+    }
+
+    /* Directories are emitted before their content is queued, and walked
+     * whether they match or not
+     */
+    if (!walker_matches(walker, fsentry)) {
+        free(fsentry);
+    } else if (!walker_emit(walker, fsentry, 0)) {
+        free(child.id);
+        return false;
+    }
+
+    child.path = strdup(child.path);
+    if (child.path == NULL || walker_push_dir(worker, dirfd, &child)) {
+        int save_errno = errno;
+
+        free(child.path);
+        free(child.id);
+        return walker_emit(walker, NULL, save_errno);
+    }
+
+    return true;
+}
+
+static int
+walker_open_dir(struct posix_walker *walker, const struct walker_dir *dir)
+{
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW;
+
+    if (walker->mount_fd >= 0 && dir->id != NULL) {
+        struct file_handle *handle;
+        int save_errno;
+        int fd;
+
+        handle = rbh_file_handle_from_id(dir->id);
+        if (handle == NULL)
+            return -1;
+
+        fd = open_by_handle_at(walker->mount_fd, handle, flags);
+        save_errno = errno;
+        free(handle);
+        if (fd >= 0)
+            return fd;
+
+        /* The directory was deleted */
+        if (save_errno == ESTALE) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    return open(dir->path, flags);
+}
+
+/* Read a directory, emit its content, and queue its subdirectories
+ *
+ * Returns false if the walker is being destroyed.
+ */
+static bool
+walker_read_dir(struct walker_worker *worker, struct walker_dir *parent)
+{
+    struct posix_walker *walker = worker->walker;
+    struct linux_dirent64 *dirent;
+    struct dirents dirents;
+    bool keep_going = true;
+    bool eof = false;
+    int fd;
+
+    fd = walker_open_dir(walker, parent);
+    if (fd < 0)
+        /* If the directory moved from under our feet, just ignore it */
+        return errno == ENOENT || walker_emit(walker, NULL, errno);
+
+    dirents_init(&dirents, fd, worker->dirents);
+
+    while (keep_going && !eof) {
+        size_t count = 0;
+        size_t i;
+
+        /* Gather a window of entries, without refilling the buffer of
+         * dirents, as that would overwrite the names already gathered.
+         */
+        while (count < WALKER_WINDOW_SIZE) {
+            if (count > 0 && dirents_empty(&dirents))
+                break;
+
+            dirent = dirents_next(&dirents);
+            if (dirent == NULL) {
+                if (errno != 0)
+                    keep_going = walker_emit(walker, NULL, errno);
+                eof = true;
+                break;
+            }
+
+            if (strcmp(dirent->d_name, ".") == 0
+             || strcmp(dirent->d_name, "..") == 0)
+                continue;
+
+            if (parent->unchanged && dirent->d_type != DT_DIR
+             && dirent->d_type != DT_UNKNOWN)
+                continue;
+
+            worker->window[count++].name = dirent->d_name;
+        }
+
+        walker_prefetch(worker, fd, count);
+
+        for (i = 0; i < count && keep_going; i++) {
+            keep_going = walker_visit(worker, parent, fd, &worker->window[i]);
+            if (worker->window[i].fd >= 0)
+                close(worker->window[i].fd);
+        }
+
+        /* Close the files that were opened in advance, but not visited */
+        for (; i < count; i++) {
+            if (worker->window[i].fd >= 0)
+                close(worker->window[i].fd);
+        }
+    }
+
+    /* Ignore errors on close */
+    close(fd);
+    return keep_going;
+}
+
+static void *
+walker_work(void *arg)
+{
+    struct walker_worker *worker = arg;
+    struct posix_walker *walker = worker->walker;
+    struct walker_dir dir;
+
+#ifdef HAVE_IO_URING
+    /* Fall back on synchronous system calls if io_uring is not available */
+    worker->has_ring = uring_init(&worker->ring, WALKER_WINDOW_SIZE) == 0;
+#endif
+
+    while (walker_pop_dir(worker, &dir)) {
+        bool keep_going;
+
+        keep_going = walker_read_dir(worker, &dir);
+        free(dir.path);
+        free(dir.id);
+        walker_done_dir(walker);
+        if (!keep_going)
+            break;
+    }
+
+#ifdef HAVE_IO_URING
+    if (worker->has_ring)
+        uring_fini(&worker->ring);
+#endif
+    posix_free_thread_buffers();
+
+    pthread_mutex_lock(&walker->lock);
+    if (--walker->running == 0)
+        pthread_cond_broadcast(&walker->not_empty);
+    pthread_mutex_unlock(&walker->lock);
+    return NULL;
+}
+
+static void *
+posix_walker_iter_next(void *iterator)
+{
+    struct posix_walker *walker = iterator;
+    struct walker_item item;
+
+    pthread_mutex_lock(&walker->lock);
+    while (walker->item_count == 0 && walker->running > 0)
+        pthread_cond_wait(&walker->not_empty, &walker->lock);
+
+    if (walker->item_count == 0) {
+        pthread_mutex_unlock(&walker->lock);
+        errno = ENODATA;
+        return NULL;
+    }
+
+    item = walker->items[walker->first_item];
+    walker->first_item = (walker->first_item + 1) % WALKER_QUEUE_SIZE;
+    walker->item_count--;
+    pthread_cond_signal(&walker->not_full);
+    pthread_mutex_unlock(&walker->lock);
+
+    if (item.fsentry == NULL)
+        errno = item.error;
+    return item.fsentry;
+}
+
+static void
+posix_walker_stop(struct posix_walker *walker, size_t nb_threads)
+{
+    pthread_mutex_lock(&walker->lock);
+    walker->stop = true;
+    for (size_t i = 0; i < walker->nb_partitions; i++)
+        pthread_cond_broadcast(&walker->partitions[i].work);
+    pthread_cond_broadcast(&walker->not_full);
+    pthread_mutex_unlock(&walker->lock);
+
+    for (size_t i = 0; i < nb_threads; i++)
+        pthread_join(walker->workers[i].thread, NULL);
+}
+
+static void
+posix_walker_free(struct posix_walker *walker)
+{
+    for (size_t i = 0; i < walker->item_count; i++)
+        free(walker->items[(walker->first_item + i) % WALKER_QUEUE_SIZE]
+                .fsentry);
+
+    for (size_t i = 0; i < walker->nb_workers; i++) {
+        walker_deque_destroy(&walker->workers[i].deque);
+        free(walker->workers[i].dirents);
+        free(walker->workers[i].path);
+    }
+
+    for (size_t i = 0; i < walker->nb_partitions; i++)
+        pthread_cond_destroy(&walker->partitions[i].work);
+    free(walker->partitions);
+
+    pthread_cond_destroy(&walker->not_full);
+    pthread_cond_destroy(&walker->not_empty);
+    pthread_mutex_destroy(&walker->lock);
+    rbh_filter_program_destroy(walker->program);
+    rbh_filter_program_destroy(walker->prune);
+    free(walker->projection);
+    if (walker->mount_fd >= 0)
+        close(walker->mount_fd);
+    free(walker);
+}
+
+static void
+posix_walker_iter_destroy(void *iterator)
+{
+    struct posix_walker *walker = iterator;
+
+    posix_walker_stop(walker, walker->nb_workers);
+    posix_walker_free(walker);
+}
+
+static const struct rbh_mut_iterator_operations POSIX_WALKER_ITER_OPS = {
+    .next = posix_walker_iter_next,
+    .destroy = posix_walker_iter_destroy,
+};
+
+static const struct rbh_mut_iterator POSIX_WALKER_ITER = {
+    .ops = &POSIX_WALKER_ITER_OPS,
+};
+
+static struct posix_walker *
+posix_walker_alloc(unsigned int nb_threads, unsigned int nb_partitions)
+{
+    struct posix_walker *walker;
+    size_t i;
+    size_t j;
+    int rc;
+
+    walker = malloc(sizeof(*walker) + nb_threads * sizeof(*walker->workers));
+    if (walker == NULL)
+        return NULL;
+
+    walker->partitions = reallocarray(NULL, nb_partitions,
+                                      sizeof(*walker->partitions));
+    if (walker->partitions == NULL) {
+        rc = errno;
+        goto out_free_walker;
+    }
+
+    rc = pthread_mutex_init(&walker->lock, NULL);
+    if (rc)
+        goto out_free_partitions;
+
+    rc = pthread_cond_init(&walker->not_empty, NULL);
+    if (rc)
+        goto out_destroy_lock;
+
+    rc = pthread_cond_init(&walker->not_full, NULL);
+    if (rc)
+        goto out_destroy_not_empty;
+
+    for (j = 0; j < nb_partitions; j++) {
+        rc = pthread_cond_init(&walker->partitions[j].work, NULL);
+        if (rc)
+            goto out_destroy_works;
+        walker->partitions[j].queued = 0;
+    }
+
+    for (i = 0; i < nb_threads; i++) {
+        walker->workers[i].walker = walker;
+        walker->workers[i].index = i;
+        walker->workers[i].partition = i % nb_partitions;
+        walker->workers[i].path = NULL;
+        walker->workers[i].path_size = 0;
+        walker->workers[i].dirents = malloc(DIRENTS_BUFFER_SIZE);
+        if (walker->workers[i].dirents == NULL) {
+            rc = errno;
+            goto out_destroy_deques;
+        }
+
+        if (walker_deque_init(&walker->workers[i].deque)) {
+            rc = errno;
+            free(walker->workers[i].dirents);
+            goto out_destroy_deques;
+        }
+    }
+
+    walker->iterator = POSIX_WALKER_ITER;
+    walker->nb_partitions = nb_partitions;
+    walker->dir_partition = NULL;
+    walker->mount_fd = -1;
+    walker->pending = 0;
+    walker->running = 0;
+    walker->stop = false;
+    walker->first_item = 0;
+    walker->item_count = 0;
+    walker->nb_workers = nb_threads;
+    walker->projection = NULL;
+    walker->program = NULL;
+    walker->prune = NULL;
+    walker->early_program = NULL;
+    return walker;
+
+out_destroy_deques:
+    while (i-- > 0) {
+        walker_deque_destroy(&walker->workers[i].deque);
+        free(walker->workers[i].dirents);
+    }
+out_destroy_works:
+    while (j-- > 0)
+        pthread_cond_destroy(&walker->partitions[j].work);
+    pthread_cond_destroy(&walker->not_full);
+out_destroy_not_empty:
+    pthread_cond_destroy(&walker->not_empty);
+out_destroy_lock:
+    pthread_mutex_destroy(&walker->lock);
+out_free_partitions:
+    free(walker->partitions);
+out_free_walker:
+    free(walker);
+    errno = rc;
+    return NULL;
+}
+
+/* Opening files by handle requires the CAP_DAC_READ_SEARCH capability */
+static bool
+can_open_by_handle(int mount_fd, const struct rbh_id *id)
+{
+    struct file_handle *handle;
+    int fd;
+
+    handle = rbh_file_handle_from_id(id);
+    if (handle == NULL)
+        return false;
+
+    fd = open_by_handle_at(mount_fd, handle,
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(handle);
+    if (fd < 0)
+        return false;
+
+    close(fd);
+    return true;
+}
+
+struct rbh_mut_iterator *
+posix_walker_new(const char *root, const char *entry, int statx_sync_type,
+                 unsigned int nb_threads, unsigned int nb_partitions,
+                 int (*dir_partition)(int, const struct rbh_id *),
+                 bool open_by_handle,
+                 const struct rbh_filter_projection *projection,
+                 const struct rbh_filter *filter,
+                 const struct rbh_filter *prune, unsigned int max_depth,
+                 int64_t unchanged_before,
+                 int (*ns_xattrs_callback)(const int, const struct rbh_id *,
+                                           const uint16_t,
+                                           const struct rbh_value_map *,
+                                           struct rbh_value_pair *,
+                                           ssize_t *,
+                                           struct rbh_value_pair *,
+                                           struct rbh_sstack *))
+{
+    struct walker_dir dir = {
+        .id = NULL,
+        .depth = 0,
+    };
+    struct posix_walker *walker;
+    struct rbh_fsentry *fsentry;
+    const char *name;
+    bool walkable;
+    int save_errno;
+    size_t i;
+    int fd;
+
+    /* Same constraints as posix_iterator_new() */
+    assert(strlen(root) > 0);
+    assert(strcmp(root, "/") == 0 || root[strlen(root) - 1] != '/');
+    assert(nb_threads > 0);
+    assert(nb_partitions <= 1 || dir_partition != NULL);
+
+    /* Every partition needs at least one worker */
+    if (nb_partitions == 0 || dir_partition == NULL)
+        nb_partitions = 1;
+    else if (nb_partitions > nb_threads)
+        nb_partitions = nb_threads;
+
+    if (entry == NULL) {
+        dir.path = strdup(root);
+    } else {
+        assert(strcmp(root, "/") == 0 || *entry == '/' || *entry == '\0');
+        if (asprintf(&dir.path, "%s%s", root, entry) < 0)
+            dir.path = NULL;
+    }
+
+    if (dir.path == NULL)
+        return NULL;
+
+    /* posix_fsentry_new() hides the reason why the root could not be opened
+     * behind ESTALE, which is not helpful when it simply does not exist.
+     */
+    fd = open(dir.path, O_CLOEXEC | O_NOFOLLOW | O_PATH);
+    if (fd < 0) {
+        save_errno = errno;
+        goto out_free_path;
+    }
+    close(fd);
+
+    walker = posix_walker_alloc(nb_threads, nb_partitions);
+    if (walker == NULL) {
+        save_errno = errno;
+        goto out_free_path;
+    }
+
+    if (projection != NULL) {
+        walker->projection = posix_projection_clone(projection, filter,
+                                                    prune);
+        if (walker->projection == NULL) {
+            save_errno = errno;
+            goto out_free_walker;
+        }
+    }
+
+    if (filter != NULL) {
+        walker->program = rbh_filter_compile(filter);
+        if (walker->program == NULL) {
+            save_errno = errno;
+            goto out_free_walker;
+        }
+    }
+
+    if (prune != NULL) {
+        walker->prune = rbh_filter_compile(prune);
+        if (walker->prune == NULL) {
+            save_errno = errno;
+            goto out_free_walker;
+        }
+    }
+
+    if (!posix_prune_needs_lazy_fields(prune))
+        walker->early_program = walker->program;
+    walker->max_depth = max_depth;
+    walker->unchanged_before = unchanged_before;
+
+    walker->dir_partition = dir_partition;
+    walker->statx_mask = posix_projection_statx_mask(walker->projection);
+    walker->ns_xattrs_callback = ns_xattrs_callback;
+    walker->statx_sync_type = statx_sync_type;
+    walker->prefix_len = strcmp(root, "/") ? strlen(root) : 0;
+
+    name = strrchr(dir.path, '/');
+    name = name == NULL ? dir.path : name + 1;
+
+    fsentry = posix_fsentry_new(AT_FDCWD, dir.path,
+                                dir.path[walker->prefix_len] == '\0' ?
+                                    "/" : dir.path + walker->prefix_len,
+                                entry == NULL ? "" : name,
+                                entry == NULL ? &ROOT_PARENT_ID : NULL,
+                                &dir.id, statx_sync_type, walker->projection,
+                                walker->early_program, ns_xattrs_callback);
+    if (fsentry == NULL) {
+        save_errno = errno;
+        goto out_free_walker;
+    }
+
+    /* The walker does not cross mount points */
+    if (fsentry->mask & RBH_FP_STATX) {
+        walker->dev_major = fsentry->statx->stx_dev_major;
+        walker->dev_minor = fsentry->statx->stx_dev_minor;
+    }
+
+    dir.unchanged = posix_fsentry_is_unchanged(fsentry, unchanged_before);
+    if (dir.unchanged) {
+        struct rbh_fsentry *marked;
+
+        marked = posix_fsentry_mark_unchanged(fsentry);
+        if (marked == NULL) {
+            save_errno = errno;
+            free(fsentry);
+            goto out_free_walker;
+        }
+        fsentry = marked;
+    }
+
+    walkable = is_walkable_dir(walker, fsentry)
+            && !walker_prunes(walker, fsentry, dir.depth);
+    if (walker_matches(walker, fsentry))
+        walker->items[walker->item_count++] = (struct walker_item){
+            .fsentry = fsentry,
+        };
+    else
+        free(fsentry);
+
+    if (walkable) {
+        size_t partition = 0;
+
+        fd = open(dir.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd >= 0) {
+            partition = walker_dir_partition(walker, fd, &dir, 0);
+            /* The root of the walk doubles as the mount point */
+            if (open_by_handle && can_open_by_handle(fd, dir.id))
+                walker->mount_fd = fd;
+            else
+                close(fd);
+        }
+
+        if (walker_deque_push(&walker->workers[partition].deque, &dir)) {
+            save_errno = errno;
+            goto out_free_walker;
+        }
+        walker->partitions[partition].queued = walker->pending = 1;
+        dir.path = NULL;
+        dir.id = NULL;
+    }
+    free(dir.path);
+    free(dir.id);
+
+    walker->running = nb_threads;
+    for (i = 0; i < nb_threads; i++) {
+        int rc;
+
+        rc = pthread_create(&walker->workers[i].thread, NULL, walker_work,
+                            &walker->workers[i]);
+        if (rc) {
+            pthread_mutex_lock(&walker->lock);
+            walker->running -= nb_threads - i;
+            pthread_mutex_unlock(&walker->lock);
+            posix_walker_stop(walker, i);
+            posix_walker_free(walker);
+            errno = rc;
+            return NULL;
+        }
+    }
+
+    return &walker->iterator;
+
+out_free_walker:
+    free(dir.id);
+    posix_walker_free(walker);
+out_free_path:
+    free(dir.path);
+    errno = save_errno;
+    return NULL;
+}
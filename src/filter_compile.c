@@ -0,0 +1,698 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "robinhood/filter.h"
+#include "robinhood/statx.h"
+
+#include "filter.h"
+#include "value.h"
+
+/*----------------------------------------------------------------------------*
+ |                                 integers                                   |
+ *----------------------------------------------------------------------------*/
+
+static int
+integer_qsort_compare(const void *first, const void *second)
+{
+    return integer_compare(*(const struct integer *)first,
+                           *(const struct integer *)second);
+}
+
+static struct integer
+statx_integer(const struct rbh_statx *statxbuf, uint32_t field)
+{
+    struct rbh_value value;
+    struct integer integer;
+
+    statx_field(statxbuf, field, &value);
+    if (!integer_from_value(&value, &integer))
+        /* statx_field() only yields integers */
+        __builtin_unreachable();
+    return integer;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                instructions                                |
+ *----------------------------------------------------------------------------*/
+
+enum opcode {
+    OP_TRUE,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    /* Compare a statx field to an integer */
+    OP_STATX_COMPARE,
+    /* Apply a bitmask to a statx field */
+    OP_STATX_BITS,
+    /* Look a statx field up in a sorted array of integers */
+    OP_STATX_IN,
+    /* Compare the name or the symlink to a string */
+    OP_STRING_COMPARE,
+    /* Look the name or the symlink up in a sorted array of strings */
+    OP_STRING_IN,
+    /* Match the name or the symlink against a regex */
+    OP_STRING_REGEX,
+    /* Check whether a field (or an xattr) exists */
+    OP_EXISTS,
+    /* Anything else, evaluated with a struct rbh_filter_matcher */
+    OP_GENERIC,
+};
+
+struct instruction {
+    enum opcode opcode;
+    enum rbh_filter_operator op;
+    /* The property (and statx field) the instruction reads */
+    unsigned int property;
+    uint32_t statx;
+    /* Index of the first instruction after the ones of this subtree */
+    size_t end;
+    union {
+        struct integer integer;
+        uint64_t mask;
+        struct {
+            struct integer *values;
+            size_t count;
+        } integers;
+        const char *string;
+        struct {
+            const char **values;
+            size_t count;
+        } strings;
+        regex_t *regex;
+        struct {
+            /* NULL unless the field is an xattr */
+            const char *xattr;
+            bool exists;
+        } exists;
+        struct rbh_filter_matcher *matcher;
+    };
+};
+
+struct rbh_filter_program {
+    /* Strings in the instructions point inside `filter' */
+    struct rbh_filter *filter;
+    size_t count;
+    struct instruction instructions[];
+};
+
+static void
+instruction_fini(struct instruction *instruction)
+{
+    switch (instruction->opcode) {
+    case OP_STATX_IN:
+        free(instruction->integers.values);
+        break;
+    case OP_STRING_IN:
+        free(instruction->strings.values);
+        break;
+    case OP_STRING_REGEX:
+        regfree(instruction->regex);
+        free(instruction->regex);
+        break;
+    case OP_GENERIC:
+        rbh_filter_matcher_destroy(instruction->matcher);
+        break;
+    default:
+        break;
+    }
+}
+
+    /*--------------------------------------------------------------------*
+     |                                cost                                |
+     *--------------------------------------------------------------------*/
+
+/* Rough estimates of the cost of evaluating a filter, only their relative
+ * order matters
+ *
+ * Only the evaluation itself is accounted for: retrieving the fields is the
+ * business of the caller, which can tell which ones are still missing with the
+ * `pending' argument of rbh_filter_program_match().
+ */
+static unsigned int
+filter_cost(const struct rbh_filter *filter)
+{
+    unsigned int cost = 0;
+
+    if (filter == NULL)
+        return 0;
+
+    if (rbh_is_logical_operator(filter->op)) {
+        for (size_t i = 0; i < filter->logical.count; i++)
+            cost += filter_cost(filter->logical.filters[i]);
+        return cost;
+    }
+
+    switch (filter->compare.field.fsentry) {
+    case RBH_FP_STATX:
+        /* An integer */
+        cost = 1;
+        break;
+    case RBH_FP_ID:
+    case RBH_FP_PARENT_ID:
+    case RBH_FP_NAME:
+    case RBH_FP_SYMLINK:
+        /* A string, or a binary */
+        cost = 2;
+        break;
+    default:
+        /* A lookup in a map, and a struct rbh_filter_matcher */
+        cost = 4;
+        break;
+    }
+
+    switch (filter->op) {
+    case RBH_FOP_IN:
+        cost += 2;
+        break;
+    case RBH_FOP_REGEX:
+        cost += 32;
+        break;
+    default:
+        break;
+    }
+
+    return cost;
+}
+
+    /*--------------------------------------------------------------------*
+     |                              compile                               |
+     *--------------------------------------------------------------------*/
+
+static size_t
+instruction_count(const struct rbh_filter *filter)
+{
+    size_t count = 1;
+
+    if (filter == NULL || !rbh_is_logical_operator(filter->op))
+        return 1;
+
+    for (size_t i = 0; i < filter->logical.count; i++)
+        count += instruction_count(filter->logical.filters[i]);
+    return count;
+}
+
+static int
+string_qsort_compare(const void *first, const void *second)
+{
+    return strcmp(*(const char * const *)first, *(const char * const *)second);
+}
+
+static bool
+is_string_field(const struct rbh_filter_field *field)
+{
+    return field->fsentry == RBH_FP_NAME || field->fsentry == RBH_FP_SYMLINK;
+}
+
+static bool
+is_ordering(enum rbh_filter_operator op)
+{
+    switch (op) {
+    case RBH_FOP_EQUAL:
+    case RBH_FOP_STRICTLY_LOWER:
+    case RBH_FOP_LOWER_OR_EQUAL:
+    case RBH_FOP_STRICTLY_GREATER:
+    case RBH_FOP_GREATER_OR_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool
+is_bitwise(enum rbh_filter_operator op)
+{
+    switch (op) {
+    case RBH_FOP_BITS_ANY_SET:
+    case RBH_FOP_BITS_ALL_SET:
+    case RBH_FOP_BITS_ANY_CLEAR:
+    case RBH_FOP_BITS_ALL_CLEAR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Only keep the elements of `sequence' a statx field may be equal to */
+static int
+compile_statx_in(struct instruction *instruction,
+                 const struct rbh_value *sequence)
+{
+    struct integer *values;
+    size_t count = 0;
+
+    values = reallocarray(NULL, sequence->sequence.count, sizeof(*values));
+    if (values == NULL && sequence->sequence.count > 0)
+        return -1;
+
+    for (size_t i = 0; i < sequence->sequence.count; i++) {
+        if (integer_from_value(&sequence->sequence.values[i], &values[count]))
+            count++;
+    }
+    qsort(values, count, sizeof(*values), integer_qsort_compare);
+
+    instruction->opcode = OP_STATX_IN;
+    instruction->integers.values = values;
+    instruction->integers.count = count;
+    return 0;
+}
+
+/* Only keep the elements of `sequence' a string may be equal to */
+static int
+compile_string_in(struct instruction *instruction,
+                  const struct rbh_value *sequence)
+{
+    const char **values;
+    size_t count = 0;
+
+    values = reallocarray(NULL, sequence->sequence.count, sizeof(*values));
+    if (values == NULL && sequence->sequence.count > 0)
+        return -1;
+
+    for (size_t i = 0; i < sequence->sequence.count; i++) {
+        if (sequence->sequence.values[i].type == RBH_VT_STRING)
+            values[count++] = sequence->sequence.values[i].string;
+    }
+    qsort(values, count, sizeof(*values), string_qsort_compare);
+
+    instruction->opcode = OP_STRING_IN;
+    instruction->strings.values = values;
+    instruction->strings.count = count;
+    return 0;
+}
+
+static bool
+has_regex(const struct rbh_value *sequence)
+{
+    for (size_t i = 0; i < sequence->sequence.count; i++) {
+        if (sequence->sequence.values[i].type == RBH_VT_REGEX)
+            return true;
+    }
+    return false;
+}
+
+static int
+compile_regex(struct instruction *instruction, const struct rbh_value *value)
+{
+    instruction->regex = malloc(sizeof(*instruction->regex));
+    if (instruction->regex == NULL)
+        return -1;
+
+    if (regex_compile(instruction->regex, value)) {
+        int save_errno = errno;
+
+        free(instruction->regex);
+        errno = save_errno;
+        return -1;
+    }
+
+    instruction->opcode = OP_STRING_REGEX;
+    return 0;
+}
+
+static int
+compile_comparison(struct instruction *instruction,
+                   const struct rbh_filter *filter)
+{
+    const struct rbh_filter_field *field = &filter->compare.field;
+    const struct rbh_value *value = &filter->compare.value;
+
+    instruction->op = filter->op;
+    instruction->property = field->fsentry;
+    instruction->statx = field->statx;
+
+    if (filter->op == RBH_FOP_EXISTS) {
+        instruction->opcode = OP_EXISTS;
+        instruction->exists.exists = value->boolean;
+        instruction->exists.xattr = field->xattr;
+        return 0;
+    }
+
+    if (field->fsentry == RBH_FP_STATX) {
+        if (is_ordering(filter->op)
+         && integer_from_value(value, &instruction->integer)) {
+            instruction->opcode = OP_STATX_COMPARE;
+            return 0;
+        }
+
+        if (is_bitwise(filter->op)) {
+            struct integer mask;
+
+            if (!integer_from_value(value, &mask))
+                /* rbh_filter_validate() prevents this */
+                __builtin_unreachable();
+            instruction->opcode = OP_STATX_BITS;
+            instruction->mask = integer_bits(mask);
+            return 0;
+        }
+
+        if (filter->op == RBH_FOP_IN && !has_regex(value))
+            return compile_statx_in(instruction, value);
+    } else if (is_string_field(field)) {
+        if (is_ordering(filter->op) && value->type == RBH_VT_STRING) {
+            instruction->opcode = OP_STRING_COMPARE;
+            instruction->string = value->string;
+            return 0;
+        }
+
+        if (filter->op == RBH_FOP_REGEX)
+            return compile_regex(instruction, value);
+
+        if (filter->op == RBH_FOP_IN && !has_regex(value))
+            return compile_string_in(instruction, value);
+    }
+
+    instruction->matcher = rbh_filter_matcher_new(filter);
+    if (instruction->matcher == NULL)
+        return -1;
+
+    instruction->opcode = OP_GENERIC;
+    return 0;
+}
+
+/* Sort the operands of a logical filter, cheapest first (insertion sort, to
+ * preserve the order of operands of equal cost)
+ */
+static const struct rbh_filter **
+sorted_operands(const struct rbh_filter *filter)
+{
+    const struct rbh_filter **operands;
+    unsigned int *costs;
+
+    operands = reallocarray(NULL, filter->logical.count, sizeof(*operands));
+    if (operands == NULL)
+        return NULL;
+
+    costs = reallocarray(NULL, filter->logical.count, sizeof(*costs));
+    if (costs == NULL) {
+        free(operands);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < filter->logical.count; i++) {
+        const struct rbh_filter *operand = filter->logical.filters[i];
+        unsigned int cost = filter_cost(operand);
+        size_t j = i;
+
+        for (; j > 0 && costs[j - 1] > cost; j--) {
+            operands[j] = operands[j - 1];
+            costs[j] = costs[j - 1];
+        }
+        operands[j] = operand;
+        costs[j] = cost;
+    }
+
+    free(costs);
+    return operands;
+}
+
+static int
+compile(struct rbh_filter_program *program, const struct rbh_filter *filter)
+{
+    struct instruction *instruction = &program->instructions[program->count];
+    const struct rbh_filter **operands;
+    int save_errno;
+
+    /* `program->count' is only incremented once `instruction' holds
+     * resources rbh_filter_program_destroy() can release.
+     */
+    instruction->opcode = OP_TRUE;
+    if (filter == NULL) {
+        instruction->end = ++program->count;
+        return 0;
+    }
+
+    if (!rbh_is_logical_operator(filter->op)) {
+        if (compile_comparison(instruction, filter))
+            return -1;
+        instruction->end = ++program->count;
+        return 0;
+    }
+
+    instruction->opcode = filter->op == RBH_FOP_AND ? OP_AND
+                        : filter->op == RBH_FOP_OR ? OP_OR : OP_NOT;
+    program->count++;
+
+    operands = sorted_operands(filter);
+    if (operands == NULL)
+        return -1;
+
+    for (size_t i = 0; i < filter->logical.count; i++) {
+        if (compile(program, operands[i])) {
+            save_errno = errno;
+            free(operands);
+            errno = save_errno;
+            return -1;
+        }
+    }
+    free(operands);
+
+    instruction->end = program->count;
+    return 0;
+}
+
+struct rbh_filter_program *
+rbh_filter_compile(const struct rbh_filter *filter)
+{
+    struct rbh_filter_program *program;
+    size_t count;
+    int save_errno;
+
+    if (rbh_filter_validate(filter))
+        return NULL;
+
+    count = instruction_count(filter);
+    program = malloc(sizeof(*program) + count * sizeof(*program->instructions));
+    if (program == NULL)
+        return NULL;
+    program->count = 0;
+
+    if (filter == NULL) {
+        program->filter = NULL;
+    } else {
+        program->filter = rbh_filter_clone(filter);
+        if (program->filter == NULL) {
+            save_errno = errno;
+            free(program);
+            errno = save_errno;
+            return NULL;
+        }
+    }
+
+    if (compile(program, program->filter)) {
+        save_errno = errno;
+        rbh_filter_program_destroy(program);
+        errno = save_errno;
+        return NULL;
+    }
+
+    return program;
+}
+
+void
+rbh_filter_program_destroy(struct rbh_filter_program *program)
+{
+    if (program == NULL)
+        return;
+
+    for (size_t i = 0; i < program->count; i++)
+        instruction_fini(&program->instructions[i]);
+    free(program->filter);
+    free(program);
+}
+
+    /*--------------------------------------------------------------------*
+     |                                run                                 |
+     *--------------------------------------------------------------------*/
+
+static bool
+statx_matches(const struct instruction *instruction,
+              const struct rbh_statx *statxbuf)
+{
+    struct integer field = statx_integer(statxbuf, instruction->statx);
+
+    switch (instruction->opcode) {
+    case OP_STATX_COMPARE:
+        return ordering_matches(instruction->op,
+                                integer_compare(field, instruction->integer));
+    case OP_STATX_BITS:
+        return bits_match(instruction->op, integer_bits(field),
+                          instruction->mask);
+    case OP_STATX_IN:
+        if (instruction->integers.count == 0)
+            return false;
+        return bsearch(&field, instruction->integers.values,
+                       instruction->integers.count,
+                       sizeof(*instruction->integers.values),
+                       integer_qsort_compare) != NULL;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+static bool
+string_matches(const struct instruction *instruction, const char *string)
+{
+    switch (instruction->opcode) {
+    case OP_STRING_COMPARE:
+        return ordering_matches(instruction->op,
+                                strcmp(string, instruction->string));
+    case OP_STRING_IN:
+        if (instruction->strings.count == 0)
+            return false;
+        return bsearch(&string, instruction->strings.values,
+                       instruction->strings.count,
+                       sizeof(*instruction->strings.values),
+                       string_qsort_compare) != NULL;
+    case OP_STRING_REGEX:
+        return regexec(instruction->regex, string, 0, NULL, 0) == 0;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+static bool
+field_exists(const struct instruction *instruction,
+             const struct rbh_fsentry *fsentry)
+{
+    if (!(fsentry->mask & instruction->property))
+        return false;
+
+    switch (instruction->property) {
+    case RBH_FP_STATX:
+        return fsentry->statx->stx_mask & instruction->statx;
+    case RBH_FP_NAMESPACE_XATTRS:
+        return instruction->exists.xattr == NULL
+            || value_map_lookup(&fsentry->xattrs.ns,
+                                instruction->exists.xattr) != NULL;
+    case RBH_FP_INODE_XATTRS:
+        return instruction->exists.xattr == NULL
+            || value_map_lookup(&fsentry->xattrs.inode,
+                                instruction->exists.xattr) != NULL;
+    default:
+        return true;
+    }
+}
+
+static enum match
+run(const struct instruction *instructions, size_t index,
+    const struct rbh_fsentry *fsentry, unsigned int pending)
+{
+    const struct instruction *instruction = &instructions[index];
+    enum match result;
+
+    switch (instruction->opcode) {
+    case OP_TRUE:
+        return MATCH_TRUE;
+    case OP_AND:
+        result = MATCH_TRUE;
+        for (size_t i = index + 1; i < instruction->end;
+             i = instructions[i].end) {
+            switch (run(instructions, i, fsentry, pending)) {
+            case MATCH_FALSE:
+                return MATCH_FALSE;
+            case MATCH_UNKNOWN:
+                result = MATCH_UNKNOWN;
+                break;
+            case MATCH_TRUE:
+                break;
+            }
+        }
+        return result;
+    case OP_OR:
+        result = MATCH_FALSE;
+        for (size_t i = index + 1; i < instruction->end;
+             i = instructions[i].end) {
+            switch (run(instructions, i, fsentry, pending)) {
+            case MATCH_TRUE:
+                return MATCH_TRUE;
+            case MATCH_UNKNOWN:
+                result = MATCH_UNKNOWN;
+                break;
+            case MATCH_FALSE:
+                break;
+            }
+        }
+        return result;
+    case OP_NOT:
+        switch (run(instructions, index + 1, fsentry, pending)) {
+        case MATCH_TRUE:
+            return MATCH_FALSE;
+        case MATCH_FALSE:
+            return MATCH_TRUE;
+        case MATCH_UNKNOWN:
+            return MATCH_UNKNOWN;
+        }
+        __builtin_unreachable();
+    case OP_GENERIC:
+        switch (rbh_filter_matcher_match(instruction->matcher, fsentry,
+                                         pending)) {
+        case 1:
+            return MATCH_TRUE;
+        case 0:
+            return MATCH_FALSE;
+        default:
+            return MATCH_UNKNOWN;
+        }
+    default:
+        break;
+    }
+
+    /* A comparison on a single field */
+    if (pending & instruction->property)
+        return MATCH_UNKNOWN;
+
+    if (instruction->opcode == OP_EXISTS)
+        return field_exists(instruction, fsentry) == instruction->exists.exists
+             ? MATCH_TRUE : MATCH_FALSE;
+
+    if (!(fsentry->mask & instruction->property))
+        return MATCH_FALSE;
+
+    switch (instruction->property) {
+    case RBH_FP_STATX:
+        if (!(fsentry->statx->stx_mask & instruction->statx))
+            return MATCH_FALSE;
+        return statx_matches(instruction, fsentry->statx) ? MATCH_TRUE
+                                                          : MATCH_FALSE;
+    case RBH_FP_NAME:
+        return string_matches(instruction, fsentry->name) ? MATCH_TRUE
+                                                          : MATCH_FALSE;
+    case RBH_FP_SYMLINK:
+        return string_matches(instruction, fsentry->symlink) ? MATCH_TRUE
+                                                             : MATCH_FALSE;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+int
+rbh_filter_program_match(const struct rbh_filter_program *program,
+                         const struct rbh_fsentry *fsentry,
+                         unsigned int pending)
+{
+    switch (run(program->instructions, 0, fsentry, pending)) {
+    case MATCH_TRUE:
+        return 1;
+    case MATCH_FALSE:
+        return 0;
+    case MATCH_UNKNOWN:
+        break;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
@@ -0,0 +1,709 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "robinhood/backend.h"
+#include "robinhood/filter.h"
+#include "robinhood/statx.h"
+
+#include "filter.h"
+#include "value.h"
+
+/*----------------------------------------------------------------------------*
+ |                             rbh_filter_fields()                            |
+ *----------------------------------------------------------------------------*/
+
+void
+rbh_filter_fields(const struct rbh_filter *filter, unsigned int *fsentry_mask,
+                  uint32_t *statx_mask)
+{
+    const struct rbh_filter_field *field;
+
+    if (filter == NULL)
+        return;
+
+    if (rbh_is_logical_operator(filter->op)) {
+        for (size_t i = 0; i < filter->logical.count; i++)
+            rbh_filter_fields(filter->logical.filters[i], fsentry_mask,
+                              statx_mask);
+        return;
+    }
+
+    field = &filter->compare.field;
+    *fsentry_mask |= field->fsentry;
+    if (field->fsentry == RBH_FP_STATX)
+        *statx_mask |= field->statx;
+}
+
+/*----------------------------------------------------------------------------*
+ |                            rbh_filter_matcher                              |
+ *----------------------------------------------------------------------------*/
+
+/* A node of the filter, with its regexes compiled */
+struct matcher_node {
+    const struct rbh_filter *filter;
+    /* RBH_FOP_REGEX: a single regex
+     * RBH_FOP_IN: one regex per element of the sequence (only those that are
+     *             regexes are compiled), or NULL if there are none
+     */
+    regex_t *regexes;
+    /* Logical filters only */
+    struct matcher_node *children;
+};
+
+struct rbh_filter_matcher {
+    struct rbh_filter *filter;
+    struct matcher_node root;
+};
+
+static void
+node_fini(struct matcher_node *node);
+
+static int
+node_init(struct matcher_node *node, const struct rbh_filter *filter)
+{
+    const struct rbh_value *values;
+    int save_errno;
+    size_t count;
+    size_t i;
+
+    node->filter = filter;
+    node->regexes = NULL;
+    node->children = NULL;
+
+    if (filter == NULL)
+        return 0;
+
+    switch (filter->op) {
+    case RBH_FOP_REGEX:
+        node->regexes = malloc(sizeof(*node->regexes));
+        if (node->regexes == NULL)
+            return -1;
+
+        if (regex_compile(&node->regexes[0], &filter->compare.value)) {
+            save_errno = errno;
+            free(node->regexes);
+            node->regexes = NULL;
+            errno = save_errno;
+            return -1;
+        }
+        return 0;
+    case RBH_FOP_IN:
+        values = filter->compare.value.sequence.values;
+        count = filter->compare.value.sequence.count;
+
+        for (i = 0; i < count; i++) {
+            if (values[i].type == RBH_VT_REGEX)
+                break;
+        }
+        if (i == count)
+            /* No regex to compile */
+            return 0;
+
+        node->regexes = malloc(count * sizeof(*node->regexes));
+        if (node->regexes == NULL)
+            return -1;
+
+        for (i = 0; i < count; i++) {
+            if (values[i].type != RBH_VT_REGEX)
+                continue;
+
+            if (regex_compile(&node->regexes[i], &values[i]))
+                goto out_free_regexes;
+        }
+        return 0;
+    case RBH_FOP_AND:
+    case RBH_FOP_OR:
+    case RBH_FOP_NOT:
+        count = filter->logical.count;
+        node->children = malloc(count * sizeof(*node->children));
+        if (node->children == NULL)
+            return -1;
+
+        for (i = 0; i < count; i++) {
+            if (node_init(&node->children[i], filter->logical.filters[i]))
+                goto out_free_children;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+
+out_free_regexes:
+    save_errno = errno;
+    while (i-- > 0) {
+        if (values[i].type == RBH_VT_REGEX)
+            regfree(&node->regexes[i]);
+    }
+    free(node->regexes);
+    node->regexes = NULL;
+    errno = save_errno;
+    return -1;
+
+out_free_children:
+    save_errno = errno;
+    while (i-- > 0)
+        node_fini(&node->children[i]);
+    free(node->children);
+    node->children = NULL;
+    errno = save_errno;
+    return -1;
+}
+
+static void
+node_fini(struct matcher_node *node)
+{
+    const struct rbh_filter *filter = node->filter;
+
+    if (filter == NULL)
+        return;
+
+    switch (filter->op) {
+    case RBH_FOP_REGEX:
+        regfree(&node->regexes[0]);
+        free(node->regexes);
+        break;
+    case RBH_FOP_IN:
+        if (node->regexes == NULL)
+            break;
+
+        for (size_t i = 0; i < filter->compare.value.sequence.count; i++) {
+            if (filter->compare.value.sequence.values[i].type == RBH_VT_REGEX)
+                regfree(&node->regexes[i]);
+        }
+        free(node->regexes);
+        break;
+    case RBH_FOP_AND:
+    case RBH_FOP_OR:
+    case RBH_FOP_NOT:
+        for (size_t i = 0; i < filter->logical.count; i++)
+            node_fini(&node->children[i]);
+        free(node->children);
+        break;
+    default:
+        break;
+    }
+}
+
+struct rbh_filter_matcher *
+rbh_filter_matcher_new(const struct rbh_filter *filter)
+{
+    struct rbh_filter_matcher *matcher;
+    int save_errno;
+
+    if (rbh_filter_validate(filter))
+        return NULL;
+
+    matcher = malloc(sizeof(*matcher));
+    if (matcher == NULL)
+        return NULL;
+
+    if (filter == NULL) {
+        matcher->filter = NULL;
+    } else {
+        matcher->filter = rbh_filter_clone(filter);
+        if (matcher->filter == NULL)
+            goto out_free_matcher;
+    }
+
+    if (node_init(&matcher->root, matcher->filter))
+        goto out_free_filter;
+
+    return matcher;
+
+out_free_filter:
+    save_errno = errno;
+    free(matcher->filter);
+    errno = save_errno;
+out_free_matcher:
+    save_errno = errno;
+    free(matcher);
+    errno = save_errno;
+    return NULL;
+}
+
+void
+rbh_filter_matcher_destroy(struct rbh_filter_matcher *matcher)
+{
+    if (matcher == NULL)
+        return;
+
+    node_fini(&matcher->root);
+    free(matcher->filter);
+    free(matcher);
+}
+
+    /*--------------------------------------------------------------------*
+     |                              fields                                |
+     *--------------------------------------------------------------------*/
+
+enum field_state {
+    FS_MISSING,
+    FS_PRESENT,
+    FS_PENDING,
+};
+
+/* Fetch the value of `field' in `fsentry' */
+static enum field_state
+fsentry_field(const struct rbh_fsentry *fsentry,
+              const struct rbh_filter_field *field, unsigned int pending,
+              struct rbh_value *value)
+{
+    const struct rbh_value_map *map;
+    const struct rbh_value *tmp;
+
+    if (pending & field->fsentry)
+        return FS_PENDING;
+
+    if (!(fsentry->mask & field->fsentry))
+        return FS_MISSING;
+
+    switch (field->fsentry) {
+    case RBH_FP_ID:
+        value->type = RBH_VT_BINARY;
+        value->binary.data = fsentry->id.data;
+        value->binary.size = fsentry->id.size;
+        return FS_PRESENT;
+    case RBH_FP_PARENT_ID:
+        value->type = RBH_VT_BINARY;
+        value->binary.data = fsentry->parent_id.data;
+        value->binary.size = fsentry->parent_id.size;
+        return FS_PRESENT;
+    case RBH_FP_NAME:
+        value->type = RBH_VT_STRING;
+        value->string = fsentry->name;
+        return FS_PRESENT;
+    case RBH_FP_SYMLINK:
+        value->type = RBH_VT_STRING;
+        value->string = fsentry->symlink;
+        return FS_PRESENT;
+    case RBH_FP_STATX:
+        if (!(fsentry->statx->stx_mask & field->statx))
+            return FS_MISSING;
+
+        statx_field(fsentry->statx, field->statx, value);
+        return FS_PRESENT;
+    case RBH_FP_NAMESPACE_XATTRS:
+        map = &fsentry->xattrs.ns;
+        break;
+    case RBH_FP_INODE_XATTRS:
+        map = &fsentry->xattrs.inode;
+        break;
+    default:
+        /* rbh_filter_validate() prevents this */
+        __builtin_unreachable();
+    }
+
+    if (field->xattr == NULL) {
+        value->type = RBH_VT_MAP;
+        value->map = *map;
+        return FS_PRESENT;
+    }
+
+    tmp = value_map_lookup(map, field->xattr);
+    if (tmp == NULL)
+        return FS_MISSING;
+
+    *value = *tmp;
+    return FS_PRESENT;
+}
+
+    /*--------------------------------------------------------------------*
+     |                            comparisons                             |
+     *--------------------------------------------------------------------*/
+
+/**
+ * Compare two values
+ *
+ * @param first     the first value to compare
+ * @param second    the second value to compare
+ * @param result    a pointer to an integer set to a value lower than, equal
+ *                  to, or greater than 0 if \p first is respectively lower
+ *                  than, equal to, or greater than \p second
+ *
+ * @return          true if \p first and \p second are comparable, false
+ *                  otherwise
+ */
+static bool
+value_compare(const struct rbh_value *first, const struct rbh_value *second,
+              int *result)
+{
+    struct integer first_integer, second_integer;
+    size_t count;
+
+    if (integer_from_value(first, &first_integer)
+     && integer_from_value(second, &second_integer)) {
+        *result = integer_compare(first_integer, second_integer);
+        return true;
+    }
+
+    if (first->type != second->type)
+        return false;
+
+    switch (first->type) {
+    case RBH_VT_BOOLEAN:
+        *result = (int)first->boolean - (int)second->boolean;
+        return true;
+    case RBH_VT_STRING:
+        *result = strcmp(first->string, second->string);
+        return true;
+    case RBH_VT_BINARY:
+        if (first->binary.size != second->binary.size) {
+            *result = first->binary.size < second->binary.size ? -1 : 1;
+            return true;
+        }
+        *result = memcmp(first->binary.data, second->binary.data,
+                         first->binary.size);
+        return true;
+    case RBH_VT_REGEX:
+        *result = strcmp(first->regex.string, second->regex.string);
+        if (*result == 0)
+            *result = (int)first->regex.options - (int)second->regex.options;
+        return true;
+    case RBH_VT_SEQUENCE:
+        count = first->sequence.count < second->sequence.count ?
+            first->sequence.count : second->sequence.count;
+
+        for (size_t i = 0; i < count; i++) {
+            if (!value_compare(&first->sequence.values[i],
+                               &second->sequence.values[i], result))
+                return false;
+            if (*result)
+                return true;
+        }
+        *result = first->sequence.count < second->sequence.count ? -1
+                : first->sequence.count > second->sequence.count ? 1 : 0;
+        return true;
+    case RBH_VT_MAP:
+        count = first->map.count < second->map.count ?
+            first->map.count : second->map.count;
+
+        for (size_t i = 0; i < count; i++) {
+            const struct rbh_value_pair *first_pair = &first->map.pairs[i];
+            const struct rbh_value_pair *second_pair = &second->map.pairs[i];
+
+            *result = strcmp(first_pair->key, second_pair->key);
+            if (*result)
+                return true;
+
+            if (first_pair->value == NULL || second_pair->value == NULL) {
+                *result = (first_pair->value != NULL)
+                        - (second_pair->value != NULL);
+            } else if (!value_compare(first_pair->value, second_pair->value,
+                                      result)) {
+                return false;
+            }
+            if (*result)
+                return true;
+        }
+        *result = first->map.count < second->map.count ? -1
+                : first->map.count > second->map.count ? 1 : 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool
+regex_matches(const regex_t *regex, const struct rbh_value *value)
+{
+    if (value->type != RBH_VT_STRING)
+        return false;
+
+    return regexec(regex, value->string, 0, NULL, 0) == 0;
+}
+
+/* Does a single value (not an element of a sequence) match a comparison? */
+static bool
+value_matches(const struct matcher_node *node, const struct rbh_value *field)
+{
+    const struct rbh_filter *filter = node->filter;
+    const struct rbh_value *value = &filter->compare.value;
+    struct integer bits, mask;
+    int result;
+
+    switch (filter->op) {
+    case RBH_FOP_EQUAL:
+    case RBH_FOP_STRICTLY_LOWER:
+    case RBH_FOP_LOWER_OR_EQUAL:
+    case RBH_FOP_STRICTLY_GREATER:
+    case RBH_FOP_GREATER_OR_EQUAL:
+        return value_compare(field, value, &result)
+            && ordering_matches(filter->op, result);
+    case RBH_FOP_REGEX:
+        return regex_matches(&node->regexes[0], field);
+    case RBH_FOP_IN:
+        for (size_t i = 0; i < value->sequence.count; i++) {
+            const struct rbh_value *element = &value->sequence.values[i];
+
+            if (element->type == RBH_VT_REGEX) {
+                if (regex_matches(&node->regexes[i], field))
+                    return true;
+            } else if (value_compare(field, element, &result) && result == 0) {
+                return true;
+            }
+        }
+        return false;
+    case RBH_FOP_BITS_ANY_SET:
+    case RBH_FOP_BITS_ALL_SET:
+    case RBH_FOP_BITS_ANY_CLEAR:
+    case RBH_FOP_BITS_ALL_CLEAR:
+        if (!integer_from_value(field, &bits))
+            return false;
+
+        if (!integer_from_value(value, &mask))
+            /* rbh_filter_validate() prevents this */
+            __builtin_unreachable();
+
+        return bits_match(filter->op, integer_bits(bits), integer_bits(mask));
+    default:
+        __builtin_unreachable();
+    }
+}
+
+    /*--------------------------------------------------------------------*
+     |                             evaluation                             |
+     *--------------------------------------------------------------------*/
+
+static enum match
+comparison_match(const struct matcher_node *node,
+                 const struct rbh_fsentry *fsentry, unsigned int pending)
+{
+    const struct rbh_filter *filter = node->filter;
+    struct rbh_value field;
+
+    switch (fsentry_field(fsentry, &filter->compare.field, pending, &field)) {
+    case FS_PENDING:
+        return MATCH_UNKNOWN;
+    case FS_MISSING:
+        if (filter->op == RBH_FOP_EXISTS)
+            return filter->compare.value.boolean ? MATCH_FALSE : MATCH_TRUE;
+        return MATCH_FALSE;
+    case FS_PRESENT:
+        break;
+    }
+
+    if (filter->op == RBH_FOP_EXISTS)
+        return filter->compare.value.boolean ? MATCH_TRUE : MATCH_FALSE;
+
+    if (value_matches(node, &field))
+        return MATCH_TRUE;
+
+    /* Comparing a sequence to anything but a sequence is done element-wise */
+    if (field.type == RBH_VT_SEQUENCE
+     && filter->compare.value.type != RBH_VT_SEQUENCE) {
+        for (size_t i = 0; i < field.sequence.count; i++) {
+            if (value_matches(node, &field.sequence.values[i]))
+                return MATCH_TRUE;
+        }
+    }
+
+    return MATCH_FALSE;
+}
+
+static enum match
+node_match(const struct matcher_node *node, const struct rbh_fsentry *fsentry,
+           unsigned int pending)
+{
+    const struct rbh_filter *filter = node->filter;
+    enum match result;
+
+    if (filter == NULL)
+        return MATCH_TRUE;
+
+    switch (filter->op) {
+    case RBH_FOP_AND:
+        result = MATCH_TRUE;
+        for (size_t i = 0; i < filter->logical.count; i++) {
+            switch (node_match(&node->children[i], fsentry, pending)) {
+            case MATCH_FALSE:
+                return MATCH_FALSE;
+            case MATCH_UNKNOWN:
+                result = MATCH_UNKNOWN;
+                break;
+            case MATCH_TRUE:
+                break;
+            }
+        }
+        return result;
+    case RBH_FOP_OR:
+        result = MATCH_FALSE;
+        for (size_t i = 0; i < filter->logical.count; i++) {
+            switch (node_match(&node->children[i], fsentry, pending)) {
+            case MATCH_TRUE:
+                return MATCH_TRUE;
+            case MATCH_UNKNOWN:
+                result = MATCH_UNKNOWN;
+                break;
+            case MATCH_FALSE:
+                break;
+            }
+        }
+        return result;
+    case RBH_FOP_NOT:
+        switch (node_match(&node->children[0], fsentry, pending)) {
+        case MATCH_TRUE:
+            return MATCH_FALSE;
+        case MATCH_FALSE:
+            return MATCH_TRUE;
+        case MATCH_UNKNOWN:
+            return MATCH_UNKNOWN;
+        }
+        __builtin_unreachable();
+    default:
+        return comparison_match(node, fsentry, pending);
+    }
+}
+
+int
+rbh_filter_matcher_match(const struct rbh_filter_matcher *matcher,
+                         const struct rbh_fsentry *fsentry,
+                         unsigned int pending)
+{
+    switch (node_match(&matcher->root, fsentry, pending)) {
+    case MATCH_TRUE:
+        return 1;
+    case MATCH_FALSE:
+        return 0;
+    case MATCH_UNKNOWN:
+        break;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_fsentry_compare()                            |
+ *----------------------------------------------------------------------------*/
+
+/* The rank of the type of a value in the ordering of mongo */
+static int
+value_rank(const struct rbh_value *value)
+{
+    switch (value->type) {
+    case RBH_VT_INT32:
+    case RBH_VT_UINT32:
+    case RBH_VT_INT64:
+    case RBH_VT_UINT64:
+        return 1;
+    case RBH_VT_STRING:
+        return 2;
+    case RBH_VT_MAP:
+        return 3;
+    case RBH_VT_SEQUENCE:
+        return 4;
+    case RBH_VT_BINARY:
+        return 5;
+    case RBH_VT_BOOLEAN:
+        return 6;
+    case RBH_VT_REGEX:
+        return 7;
+    }
+    __builtin_unreachable();
+}
+
+static int
+optional_value_order(const struct rbh_value *first,
+                     const struct rbh_value *second)
+{
+    if (first == NULL || second == NULL)
+        return (first != NULL) - (second != NULL);
+
+    return value_order(first, second);
+}
+
+int
+value_order(const struct rbh_value *first, const struct rbh_value *second)
+{
+    int first_rank = value_rank(first);
+    int second_rank = value_rank(second);
+    size_t count;
+    int result;
+
+    if (first_rank != second_rank)
+        return first_rank - second_rank;
+
+    switch (first->type) {
+    case RBH_VT_SEQUENCE:
+        count = first->sequence.count < second->sequence.count ?
+            first->sequence.count : second->sequence.count;
+
+        for (size_t i = 0; i < count; i++) {
+            result = value_order(&first->sequence.values[i],
+                                 &second->sequence.values[i]);
+            if (result)
+                return result;
+        }
+        return first->sequence.count < second->sequence.count ? -1
+             : first->sequence.count > second->sequence.count ? 1 : 0;
+    case RBH_VT_MAP:
+        count = first->map.count < second->map.count ?
+            first->map.count : second->map.count;
+
+        for (size_t i = 0; i < count; i++) {
+            const struct rbh_value_pair *first_pair = &first->map.pairs[i];
+            const struct rbh_value_pair *second_pair = &second->map.pairs[i];
+
+            result = strcmp(first_pair->key, second_pair->key);
+            if (result)
+                return result;
+
+            result = optional_value_order(first_pair->value,
+                                          second_pair->value);
+            if (result)
+                return result;
+        }
+        return first->map.count < second->map.count ? -1
+             : first->map.count > second->map.count ? 1 : 0;
+    default:
+        /* Values of the same rank are always comparable */
+        value_compare(first, second, &result);
+        return result;
+    }
+}
+
+bool
+fsentry_field_value(const struct rbh_fsentry *fsentry,
+                    const struct rbh_filter_field *field,
+                    struct rbh_value *value)
+{
+    return fsentry_field(fsentry, field, 0, value) == FS_PRESENT;
+}
+
+int
+rbh_fsentry_compare(const struct rbh_fsentry *first,
+                    const struct rbh_fsentry *second,
+                    const struct rbh_filter_sort *items, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        struct rbh_value first_value, second_value;
+        bool first_present, second_present;
+        int result;
+
+        first_present = fsentry_field(first, &items[i].field, 0,
+                                      &first_value) == FS_PRESENT;
+        second_present = fsentry_field(second, &items[i].field, 0,
+                                       &second_value) == FS_PRESENT;
+
+        result = optional_value_order(first_present ? &first_value : NULL,
+                                      second_present ? &second_value : NULL);
+        if (result)
+            return (result < 0) == items[i].ascending ? -1 : 1;
+    }
+
+    return 0;
+}
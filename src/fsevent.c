@@ -317,3 +317,340 @@ rbh_fsevent_ns_xattr_new(const struct rbh_id *id,
 
     return fsevent_clone(&ns_xattr);
 }
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_fsevent_coalesce()                           |
+ *----------------------------------------------------------------------------*/
+
+static bool
+id_equal(const struct rbh_id *first, const struct rbh_id *second)
+{
+    return first->size == second->size
+        && memcmp(first->data, second->data, first->size) == 0;
+}
+
+static bool
+is_inode_xattr(const struct rbh_fsevent *fsevent)
+{
+    return fsevent->type == RBH_FET_XATTR && fsevent->ns.parent_id == NULL;
+}
+
+/* Whether `second' can be merged into `first' (they share the same ID) */
+static bool
+fsevent_mergeable(const struct rbh_fsevent *first,
+                  const struct rbh_fsevent *second)
+{
+    switch (first->type) {
+    case RBH_FET_UPSERT:
+        return second->type == RBH_FET_UPSERT || is_inode_xattr(second);
+    case RBH_FET_XATTR:
+        if (is_inode_xattr(first))
+            return is_inode_xattr(second);
+        return second->type == RBH_FET_XATTR && second->ns.parent_id != NULL
+            && id_equal(first->ns.parent_id, second->ns.parent_id)
+            && strcmp(first->ns.name, second->ns.name) == 0;
+    default:
+        return false;
+    }
+}
+
+/* The fields of `src' override those of `dest' */
+static void
+statx_merge(struct rbh_statx *dest, const struct rbh_statx *src)
+{
+    uint32_t mask = src->stx_mask;
+
+    if (mask & RBH_STATX_TYPE)
+        dest->stx_mode = (dest->stx_mode & ~S_IFMT) | (src->stx_mode & S_IFMT);
+    if (mask & RBH_STATX_MODE)
+        dest->stx_mode = (dest->stx_mode & S_IFMT) | (src->stx_mode & ~S_IFMT);
+    if (mask & RBH_STATX_NLINK)
+        dest->stx_nlink = src->stx_nlink;
+    if (mask & RBH_STATX_UID)
+        dest->stx_uid = src->stx_uid;
+    if (mask & RBH_STATX_GID)
+        dest->stx_gid = src->stx_gid;
+    if (mask & RBH_STATX_ATIME_SEC)
+        dest->stx_atime.tv_sec = src->stx_atime.tv_sec;
+    if (mask & RBH_STATX_ATIME_NSEC)
+        dest->stx_atime.tv_nsec = src->stx_atime.tv_nsec;
+    if (mask & RBH_STATX_BTIME_SEC)
+        dest->stx_btime.tv_sec = src->stx_btime.tv_sec;
+    if (mask & RBH_STATX_BTIME_NSEC)
+        dest->stx_btime.tv_nsec = src->stx_btime.tv_nsec;
+    if (mask & RBH_STATX_CTIME_SEC)
+        dest->stx_ctime.tv_sec = src->stx_ctime.tv_sec;
+    if (mask & RBH_STATX_CTIME_NSEC)
+        dest->stx_ctime.tv_nsec = src->stx_ctime.tv_nsec;
+    if (mask & RBH_STATX_MTIME_SEC)
+        dest->stx_mtime.tv_sec = src->stx_mtime.tv_sec;
+    if (mask & RBH_STATX_MTIME_NSEC)
+        dest->stx_mtime.tv_nsec = src->stx_mtime.tv_nsec;
+    if (mask & RBH_STATX_INO)
+        dest->stx_ino = src->stx_ino;
+    if (mask & RBH_STATX_SIZE)
+        dest->stx_size = src->stx_size;
+    if (mask & RBH_STATX_BLOCKS)
+        dest->stx_blocks = src->stx_blocks;
+    if (mask & RBH_STATX_MNT_ID)
+        dest->stx_mnt_id = src->stx_mnt_id;
+    if (mask & RBH_STATX_BLKSIZE)
+        dest->stx_blksize = src->stx_blksize;
+    if (mask & RBH_STATX_ATTRIBUTES) {
+        dest->stx_attributes = src->stx_attributes;
+        dest->stx_attributes_mask = src->stx_attributes_mask;
+    }
+    if (mask & RBH_STATX_RDEV_MAJOR)
+        dest->stx_rdev_major = src->stx_rdev_major;
+    if (mask & RBH_STATX_RDEV_MINOR)
+        dest->stx_rdev_minor = src->stx_rdev_minor;
+    if (mask & RBH_STATX_DEV_MAJOR)
+        dest->stx_dev_major = src->stx_dev_major;
+    if (mask & RBH_STATX_DEV_MINOR)
+        dest->stx_dev_minor = src->stx_dev_minor;
+
+    dest->stx_mask |= mask;
+}
+
+/* Merge `second' into `first', which must be mergeable */
+static struct rbh_fsevent *
+fsevent_merge(const struct rbh_fsevent *first,
+              const struct rbh_fsevent *second)
+{
+    struct rbh_fsevent merge = *first;
+    struct rbh_value_pair *pairs;
+    struct rbh_fsevent *clone;
+    struct rbh_statx statxbuf;
+    size_t count = 0;
+
+    pairs = reallocarray(NULL, first->xattrs.count + second->xattrs.count,
+                         sizeof(*pairs));
+    if (pairs == NULL && first->xattrs.count + second->xattrs.count > 0)
+        return NULL;
+
+    /* The xattrs of `first' that `second' does not update, then those of
+     * `second'
+     */
+    for (size_t i = 0; i < first->xattrs.count; i++) {
+        const struct rbh_value_pair *pair = &first->xattrs.pairs[i];
+        bool overridden = false;
+
+        for (size_t j = 0; j < second->xattrs.count; j++) {
+            if (strcmp(pair->key, second->xattrs.pairs[j].key) == 0) {
+                overridden = true;
+                break;
+            }
+        }
+
+        if (!overridden)
+            pairs[count++] = *pair;
+    }
+    for (size_t i = 0; i < second->xattrs.count; i++)
+        pairs[count++] = second->xattrs.pairs[i];
+
+    merge.xattrs.pairs = pairs;
+    merge.xattrs.count = count;
+
+    if (first->type == RBH_FET_UPSERT && second->type == RBH_FET_UPSERT) {
+        if (first->upsert.statx && second->upsert.statx) {
+            statxbuf = *first->upsert.statx;
+            statx_merge(&statxbuf, second->upsert.statx);
+            merge.upsert.statx = &statxbuf;
+        } else if (second->upsert.statx) {
+            merge.upsert.statx = second->upsert.statx;
+        }
+
+        if (second->upsert.symlink)
+            merge.upsert.symlink = second->upsert.symlink;
+    }
+
+    clone = fsevent_clone(&merge);
+    free(pairs);
+    return clone;
+}
+
+struct coalesce_iterator {
+    struct rbh_iterator iterator;
+
+    struct rbh_iterator *fsevents;
+    size_t *merged;
+
+    /* A run of coalesced fsevents on the same ID */
+    struct rbh_fsevent **run;
+    size_t capacity;
+    size_t count;
+    /* Once the run is complete, the index of the next fsevent to yield */
+    size_t index;
+    bool complete;
+
+    /* The first fsevent of the next run */
+    struct rbh_fsevent *next;
+    bool exhausted;
+};
+
+static void
+coalesce_run_clear(struct coalesce_iterator *coalesce)
+{
+    for (size_t i = 0; i < coalesce->count; i++)
+        free(coalesce->run[i]);
+    coalesce->count = 0;
+    coalesce->index = 0;
+    coalesce->complete = false;
+}
+
+static void
+coalesce_account(struct coalesce_iterator *coalesce, size_t count)
+{
+    if (coalesce->merged)
+        *coalesce->merged += count;
+}
+
+/* Append a copy of `fsevent' to the current run, merging it if possible */
+static int
+coalesce_run_push(struct coalesce_iterator *coalesce,
+                  const struct rbh_fsevent *fsevent)
+{
+    struct rbh_fsevent *last = NULL;
+    struct rbh_fsevent *copy;
+
+    if (fsevent->type == RBH_FET_DELETE) {
+        /* Whatever came before is deleted anyway */
+        coalesce_account(coalesce, coalesce->count);
+        coalesce_run_clear(coalesce);
+    } else if (coalesce->count > 0) {
+        last = coalesce->run[coalesce->count - 1];
+        if (!fsevent_mergeable(last, fsevent))
+            last = NULL;
+    }
+
+    if (last) {
+        copy = fsevent_merge(last, fsevent);
+        if (copy == NULL)
+            return -1;
+
+        free(last);
+        coalesce->run[coalesce->count - 1] = copy;
+        coalesce_account(coalesce, 1);
+        return 0;
+    }
+
+    if (coalesce->count == coalesce->capacity) {
+        size_t capacity = coalesce->capacity ? coalesce->capacity * 2 : 4;
+        struct rbh_fsevent **run;
+
+        run = reallocarray(coalesce->run, capacity, sizeof(*run));
+        if (run == NULL)
+            return -1;
+        coalesce->run = run;
+        coalesce->capacity = capacity;
+    }
+
+    copy = fsevent_clone(fsevent);
+    if (copy == NULL)
+        return -1;
+
+    coalesce->run[coalesce->count++] = copy;
+    return 0;
+}
+
+/* Read fsevents until one has a different ID than those of the current run */
+static int
+coalesce_run_fill(struct coalesce_iterator *coalesce)
+{
+    if (coalesce->next) {
+        coalesce->run[coalesce->count++] = coalesce->next;
+        coalesce->next = NULL;
+    }
+
+    while (!coalesce->exhausted) {
+        const struct rbh_fsevent *fsevent;
+
+        errno = 0;
+        fsevent = rbh_iter_next(coalesce->fsevents);
+        if (fsevent == NULL) {
+            if (errno != ENODATA)
+                return -1;
+            coalesce->exhausted = true;
+            break;
+        }
+
+        if (coalesce->count > 0
+         && !id_equal(&fsevent->id, &coalesce->run[0]->id)) {
+            coalesce->next = fsevent_clone(fsevent);
+            if (coalesce->next == NULL)
+                return -1;
+            break;
+        }
+
+        if (coalesce_run_push(coalesce, fsevent))
+            return -1;
+    }
+
+    coalesce->complete = true;
+    return 0;
+}
+
+static const void *
+coalesce_iter_next(void *iterator)
+{
+    struct coalesce_iterator *coalesce = iterator;
+
+    if (coalesce->complete) {
+        if (coalesce->index < coalesce->count)
+            return coalesce->run[coalesce->index++];
+        coalesce_run_clear(coalesce);
+    }
+
+    if (coalesce_run_fill(coalesce))
+        return NULL;
+
+    if (coalesce->count == 0) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    return coalesce->run[coalesce->index++];
+}
+
+static void
+coalesce_iter_destroy(void *iterator)
+{
+    struct coalesce_iterator *coalesce = iterator;
+
+    coalesce_run_clear(coalesce);
+    free(coalesce->run);
+    free(coalesce->next);
+    rbh_iter_destroy(coalesce->fsevents);
+    free(coalesce);
+}
+
+static const struct rbh_iterator_operations COALESCE_ITER_OPS = {
+    .next = coalesce_iter_next,
+    .destroy = coalesce_iter_destroy,
+};
+
+static const struct rbh_iterator COALESCE_ITERATOR = {
+    .ops = &COALESCE_ITER_OPS,
+};
+
+struct rbh_iterator *
+rbh_fsevent_coalesce(struct rbh_iterator *fsevents, size_t *merged)
+{
+    struct coalesce_iterator *coalesce;
+
+    coalesce = malloc(sizeof(*coalesce));
+    if (coalesce == NULL)
+        return NULL;
+
+    coalesce->iterator = COALESCE_ITERATOR;
+    coalesce->fsevents = fsevents;
+    coalesce->merged = merged;
+    coalesce->run = NULL;
+    coalesce->capacity = 0;
+    coalesce->count = 0;
+    coalesce->index = 0;
+    coalesce->complete = false;
+    coalesce->next = NULL;
+    coalesce->exhausted = false;
+    return &coalesce->iterator;
+}
@@ -11,6 +11,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -614,3 +615,192 @@ rbh_mut_iter_ring(struct rbh_ring *ring, size_t element_size)
 {
     return (struct rbh_mut_iterator *)rbh_iter_ring(ring, element_size);
 }
+
+/*----------------------------------------------------------------------------*
+ |                          rbh_mut_iter_prefetch()                           |
+ *----------------------------------------------------------------------------*/
+
+struct prefetch_iterator {
+    struct rbh_mut_iterator iterator;
+
+    struct rbh_mut_iterator *subiter;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    /* The elements read ahead of the consumer */
+    struct rbh_ring *ring;
+    size_t capacity;
+    size_t count;
+    /* The error `subiter' failed with, 0 until then */
+    int error;
+    /* The iterator is being destroyed */
+    bool stopped;
+};
+
+static void *
+prefetch_iter_fill(void *arg)
+{
+    struct prefetch_iterator *prefetch = arg;
+
+    while (true) {
+        void *element;
+        int error;
+
+        errno = 0;
+        element = rbh_mut_iter_next(prefetch->subiter);
+        error = errno;
+
+        pthread_mutex_lock(&prefetch->lock);
+        while (!prefetch->stopped && prefetch->count == prefetch->capacity)
+            pthread_cond_wait(&prefetch->not_full, &prefetch->lock);
+
+        if (prefetch->stopped) {
+            pthread_mutex_unlock(&prefetch->lock);
+            free(element);
+            return NULL;
+        }
+
+        if (element == NULL) {
+            prefetch->error = error ? error : ENODATA;
+            pthread_cond_signal(&prefetch->not_empty);
+            pthread_mutex_unlock(&prefetch->lock);
+            return NULL;
+        }
+
+        /* Cannot fail: there is enough room */
+        rbh_ring_push(prefetch->ring, &element, sizeof(element));
+        prefetch->count++;
+        pthread_cond_signal(&prefetch->not_empty);
+        pthread_mutex_unlock(&prefetch->lock);
+    }
+}
+
+static void *
+prefetch_iter_next(void *iterator)
+{
+    struct prefetch_iterator *prefetch = iterator;
+    size_t readable;
+    void **first;
+    void *element;
+
+    pthread_mutex_lock(&prefetch->lock);
+    while (prefetch->count == 0 && prefetch->error == 0)
+        pthread_cond_wait(&prefetch->not_empty, &prefetch->lock);
+
+    if (prefetch->count == 0) {
+        errno = prefetch->error;
+        pthread_mutex_unlock(&prefetch->lock);
+        return NULL;
+    }
+
+    first = rbh_ring_peek(prefetch->ring, &readable);
+    element = *first;
+    rbh_ring_pop(prefetch->ring, sizeof(element));
+    prefetch->count--;
+    pthread_cond_signal(&prefetch->not_full);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return element;
+}
+
+static void
+prefetch_iter_destroy(void *iterator)
+{
+    struct prefetch_iterator *prefetch = iterator;
+    size_t readable;
+    void **elements;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stopped = true;
+    pthread_cond_signal(&prefetch->not_full);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->thread, NULL);
+
+    elements = rbh_ring_peek(prefetch->ring, &readable);
+    for (size_t i = 0; i < prefetch->count; i++)
+        free(elements[i]);
+
+    rbh_mut_iter_destroy(prefetch->subiter);
+    pthread_cond_destroy(&prefetch->not_full);
+    pthread_cond_destroy(&prefetch->not_empty);
+    pthread_mutex_destroy(&prefetch->lock);
+    rbh_ring_destroy(prefetch->ring);
+    free(prefetch);
+}
+
+static const struct rbh_mut_iterator_operations PREFETCH_ITER_OPS = {
+    .next = prefetch_iter_next,
+    .destroy = prefetch_iter_destroy,
+};
+
+static const struct rbh_mut_iterator PREFETCH_ITERATOR = {
+    .ops = &PREFETCH_ITER_OPS,
+};
+
+struct rbh_mut_iterator *
+rbh_mut_iter_prefetch(struct rbh_mut_iterator *iterator, size_t count)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    struct prefetch_iterator *prefetch;
+    size_t size;
+    int rc;
+
+    if (count == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    prefetch = malloc(sizeof(*prefetch));
+    if (prefetch == NULL)
+        return NULL;
+
+    /* Rings are made of whole pages */
+    size = count * sizeof(void *);
+    size = (size + pagesize - 1) / pagesize * pagesize;
+
+    prefetch->ring = rbh_ring_new(size);
+    if (prefetch->ring == NULL) {
+        rc = errno;
+        goto out_free_prefetch;
+    }
+
+    rc = pthread_mutex_init(&prefetch->lock, NULL);
+    if (rc)
+        goto out_destroy_ring;
+
+    rc = pthread_cond_init(&prefetch->not_empty, NULL);
+    if (rc)
+        goto out_destroy_lock;
+
+    rc = pthread_cond_init(&prefetch->not_full, NULL);
+    if (rc)
+        goto out_destroy_not_empty;
+
+    prefetch->iterator = PREFETCH_ITERATOR;
+    prefetch->subiter = iterator;
+    prefetch->capacity = size / sizeof(void *);
+    prefetch->count = 0;
+    prefetch->error = 0;
+    prefetch->stopped = false;
+
+    rc = pthread_create(&prefetch->thread, NULL, prefetch_iter_fill, prefetch);
+    if (rc)
+        goto out_destroy_not_full;
+
+    return &prefetch->iterator;
+
+out_destroy_not_full:
+    pthread_cond_destroy(&prefetch->not_full);
+out_destroy_not_empty:
+    pthread_cond_destroy(&prefetch->not_empty);
+out_destroy_lock:
+    pthread_mutex_destroy(&prefetch->lock);
+out_destroy_ring:
+    rbh_ring_destroy(prefetch->ring);
+out_free_prefetch:
+    free(prefetch);
+    errno = rc;
+    return NULL;
+}
@@ -0,0 +1,681 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "robinhood/backend.h"
+#include "robinhood/report.h"
+
+#include "utils.h"
+#include "value.h"
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_report_validate()                            |
+ *----------------------------------------------------------------------------*/
+
+static int
+report_field_validate(const struct rbh_filter_field *field)
+{
+    const struct rbh_filter exists = {
+        .op = RBH_FOP_EXISTS,
+        .compare = {
+            .field = *field,
+            .value = {
+                .type = RBH_VT_BOOLEAN,
+                .boolean = true,
+            },
+        },
+    };
+
+    return rbh_filter_validate(&exists);
+}
+
+int
+rbh_report_validate(const struct rbh_report *report)
+{
+    for (size_t i = 0; i < report->groups.count; i++) {
+        const struct rbh_report_group *group = &report->groups.items[i];
+
+        if (report_field_validate(&group->field))
+            return -1;
+
+        for (size_t j = 1; j < group->buckets.count; j++) {
+            if (group->buckets.boundaries[j - 1]
+                    >= group->buckets.boundaries[j]) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < report->outputs.count; i++) {
+        const struct rbh_report_output *output = &report->outputs.items[i];
+
+        switch (output->accumulator) {
+        case RBH_RA_COUNT:
+            continue;
+        case RBH_RA_SUM:
+        case RBH_RA_MIN:
+        case RBH_RA_MAX:
+            if (report_field_validate(&output->field))
+                return -1;
+            continue;
+        }
+
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_report_row_new()                             |
+ *----------------------------------------------------------------------------*/
+
+static ssize_t
+values_data_size(const struct rbh_value * const *values, size_t count,
+                 size_t size)
+{
+    size = sizealign(size, alignof(*values));
+    size += count * sizeof(*values);
+
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] == NULL)
+            continue;
+
+        size = sizealign(size, alignof(*values[i]));
+        size += sizeof(*values[i]);
+        if (value_data_size(values[i], size) < 0)
+            return -1;
+        size += value_data_size(values[i], size);
+    }
+
+    return size;
+}
+
+static const struct rbh_value **
+values_copy(const struct rbh_value * const *values, size_t count,
+            char **buffer, size_t *bufsize)
+{
+    const struct rbh_value **copies;
+    size_t size = *bufsize;
+    char *data = *buffer;
+
+    copies = aligned_memalloc(alignof(*copies), count * sizeof(*copies), &data,
+                              &size);
+    assert(copies);
+
+    for (size_t i = 0; i < count; i++) {
+        struct rbh_value *copy;
+        int rc;
+
+        if (values[i] == NULL) {
+            copies[i] = NULL;
+            continue;
+        }
+
+        copy = aligned_memalloc(alignof(*copy), sizeof(*copy), &data, &size);
+        assert(copy);
+
+        rc = value_copy(copy, values[i], &data, &size);
+        assert(rc == 0);
+        (void)rc;
+
+        copies[i] = copy;
+    }
+
+    *buffer = data;
+    *bufsize = size;
+    return copies;
+}
+
+struct rbh_report_row *
+rbh_report_row_new(const struct rbh_value * const *keys, size_t key_count,
+                   const struct rbh_value * const *values, size_t value_count)
+{
+    struct rbh_report_row *row;
+    ssize_t size;
+    size_t bufsize;
+    char *data;
+
+    size = values_data_size(keys, key_count, 0);
+    if (size < 0)
+        return NULL;
+
+    size = values_data_size(values, value_count, size);
+    if (size < 0)
+        return NULL;
+
+    row = malloc(sizeof(*row) + size);
+    if (row == NULL)
+        return NULL;
+    data = (char *)row + sizeof(*row);
+    bufsize = size;
+
+    row->keys = values_copy(keys, key_count, &data, &bufsize);
+    row->values = values_copy(values, value_count, &data, &bufsize);
+    return row;
+}
+
+/*----------------------------------------------------------------------------*
+ |                       rbh_generic_backend_report()                         |
+ *----------------------------------------------------------------------------*/
+
+static struct rbh_value *
+value_clone(const struct rbh_value *value)
+{
+    struct rbh_value *clone;
+    size_t size;
+    char *data;
+    int rc;
+
+    if (value_data_size(value, sizeof(*clone)) < 0)
+        return NULL;
+    size = value_data_size(value, sizeof(*clone));
+
+    clone = malloc(sizeof(*clone) + size);
+    if (clone == NULL)
+        return NULL;
+    data = (char *)clone + sizeof(*clone);
+
+    rc = value_copy(clone, value, &data, &size);
+    assert(rc == 0);
+    (void)rc;
+
+    return clone;
+}
+
+static bool
+value_to_int64(const struct rbh_value *value, int64_t *i64)
+{
+    switch (value->type) {
+    case RBH_VT_INT32:
+        *i64 = value->int32;
+        return true;
+    case RBH_VT_UINT32:
+        *i64 = value->uint32;
+        return true;
+    case RBH_VT_INT64:
+        *i64 = value->int64;
+        return true;
+    case RBH_VT_UINT64:
+        *i64 = value->uint64;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int
+optional_value_order(const struct rbh_value *first,
+                     const struct rbh_value *second)
+{
+    if (first == NULL || second == NULL)
+        return (first != NULL) - (second != NULL);
+
+    return value_order(first, second);
+}
+
+static int
+keys_order(const struct rbh_value * const *first,
+           const struct rbh_value * const *second, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        int result = optional_value_order(first[i], second[i]);
+
+        if (result)
+            return result;
+    }
+    return 0;
+}
+
+    /*--------------------------------------------------------------------*
+     |                               group                                |
+     *--------------------------------------------------------------------*/
+
+/* The state of an output of a report, for a group */
+union accumulator {
+    /* RBH_RA_COUNT */
+    uint64_t count;
+    /* RBH_RA_SUM */
+    int64_t sum;
+    /* RBH_RA_MIN, RBH_RA_MAX */
+    struct rbh_value *value;
+};
+
+struct report_group {
+    struct rbh_value **keys;
+    union accumulator accumulators[];
+};
+
+static struct report_group *
+report_group_new(size_t key_count, size_t output_count,
+                 const struct rbh_value * const *keys)
+{
+    struct report_group *group;
+
+    group = calloc(1, sizeof(*group)
+                    + output_count * sizeof(*group->accumulators)
+                    + key_count * sizeof(*group->keys));
+    if (group == NULL)
+        return NULL;
+    group->keys = (struct rbh_value **)&group->accumulators[output_count];
+
+    for (size_t i = 0; i < key_count; i++) {
+        if (keys[i] == NULL)
+            continue;
+
+        group->keys[i] = value_clone(keys[i]);
+        if (group->keys[i] == NULL)
+            goto out_free_keys;
+    }
+
+    return group;
+
+out_free_keys:
+    for (size_t i = 0; i < key_count; i++)
+        free(group->keys[i]);
+    free(group);
+    errno = ENOMEM;
+    return NULL;
+}
+
+static void
+report_group_destroy(struct report_group *group, size_t key_count,
+                     const enum rbh_report_accumulator *accumulators,
+                     size_t output_count)
+{
+    for (size_t i = 0; i < output_count; i++) {
+        switch (accumulators[i]) {
+        case RBH_RA_MIN:
+        case RBH_RA_MAX:
+            free(group->accumulators[i].value);
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < key_count; i++)
+        free(group->keys[i]);
+    free(group);
+}
+
+static int
+report_group_accumulate(const struct rbh_report *report,
+                        struct report_group *group,
+                        const struct rbh_fsentry *fsentry)
+{
+    for (size_t i = 0; i < report->outputs.count; i++) {
+        const struct rbh_report_output *output = &report->outputs.items[i];
+        union accumulator *accumulator = &group->accumulators[i];
+        struct rbh_value value;
+        struct rbh_value *clone;
+        int64_t i64;
+        int order;
+
+        if (output->accumulator == RBH_RA_COUNT) {
+            accumulator->count++;
+            continue;
+        }
+
+        if (!fsentry_field_value(fsentry, &output->field, &value))
+            continue;
+
+        switch (output->accumulator) {
+        case RBH_RA_SUM:
+            /* Like mongo, ignore values that are not numbers */
+            if (!value_to_int64(&value, &i64))
+                break;
+
+            if ((value.type == RBH_VT_UINT64 && value.uint64 > INT64_MAX)
+             || __builtin_add_overflow(accumulator->sum, i64,
+                                       &accumulator->sum)) {
+                errno = EOVERFLOW;
+                return -1;
+            }
+            break;
+        case RBH_RA_MIN:
+        case RBH_RA_MAX:
+            if (accumulator->value != NULL) {
+                order = value_order(&value, accumulator->value);
+                if (output->accumulator == RBH_RA_MIN ? order >= 0 : order <= 0)
+                    break;
+            }
+
+            clone = value_clone(&value);
+            if (clone == NULL)
+                return -1;
+
+            free(accumulator->value);
+            accumulator->value = clone;
+            break;
+        default:
+            __builtin_unreachable();
+        }
+    }
+
+    return 0;
+}
+
+    /*--------------------------------------------------------------------*
+     |                              iterator                              |
+     *--------------------------------------------------------------------*/
+
+struct report_iterator {
+    struct rbh_mut_iterator iterator;
+
+    size_t key_count;
+    enum rbh_report_accumulator *accumulators;
+    size_t output_count;
+
+    /* Sorted by keys */
+    struct report_group **groups;
+    size_t count;
+    size_t size;
+    size_t index;
+
+    /* Scratch space to build the keys and values of rows */
+    const struct rbh_value **keys;
+    struct rbh_value *key_values;
+    const struct rbh_value **values;
+    struct rbh_value *value_values;
+};
+
+static void *
+report_iter_next(void *iterator)
+{
+    struct report_iterator *report_iter = iterator;
+    struct report_group *group;
+    struct rbh_report_row *row;
+
+    if (report_iter->index == report_iter->count) {
+        errno = ENODATA;
+        return NULL;
+    }
+    group = report_iter->groups[report_iter->index];
+
+    for (size_t i = 0; i < report_iter->key_count; i++)
+        report_iter->keys[i] = group->keys[i];
+
+    for (size_t i = 0; i < report_iter->output_count; i++) {
+        union accumulator *accumulator = &group->accumulators[i];
+        struct rbh_value *value = &report_iter->value_values[i];
+
+        switch (report_iter->accumulators[i]) {
+        case RBH_RA_COUNT:
+            value->type = RBH_VT_UINT64;
+            value->uint64 = accumulator->count;
+            report_iter->values[i] = value;
+            break;
+        case RBH_RA_SUM:
+            value->type = RBH_VT_INT64;
+            value->int64 = accumulator->sum;
+            report_iter->values[i] = value;
+            break;
+        case RBH_RA_MIN:
+        case RBH_RA_MAX:
+            report_iter->values[i] = accumulator->value;
+            break;
+        }
+    }
+
+    row = rbh_report_row_new(report_iter->keys, report_iter->key_count,
+                             report_iter->values, report_iter->output_count);
+    if (row == NULL)
+        return NULL;
+
+    /* Rows are only ever read once, release the memory as soon as possible */
+    report_group_destroy(group, report_iter->key_count,
+                         report_iter->accumulators, report_iter->output_count);
+    report_iter->groups[report_iter->index++] = NULL;
+    return row;
+}
+
+static void
+report_iter_destroy(void *iterator)
+{
+    struct report_iterator *report_iter = iterator;
+
+    for (size_t i = report_iter->index; i < report_iter->count; i++)
+        report_group_destroy(report_iter->groups[i], report_iter->key_count,
+                             report_iter->accumulators,
+                             report_iter->output_count);
+    free(report_iter->groups);
+    free(report_iter->accumulators);
+    free(report_iter->keys);
+    free(report_iter->key_values);
+    free(report_iter->values);
+    free(report_iter->value_values);
+    free(report_iter);
+}
+
+static const struct rbh_mut_iterator_operations REPORT_ITER_OPS = {
+    .next = report_iter_next,
+    .destroy = report_iter_destroy,
+};
+
+static const struct rbh_mut_iterator REPORT_ITERATOR = {
+    .ops = &REPORT_ITER_OPS,
+};
+
+static struct report_iterator *
+report_iter_new(const struct rbh_report *report)
+{
+    size_t key_count = report->groups.count;
+    size_t output_count = report->outputs.count;
+    struct report_iterator *report_iter;
+
+    report_iter = calloc(1, sizeof(*report_iter));
+    if (report_iter == NULL)
+        return NULL;
+
+    report_iter->iterator = REPORT_ITERATOR;
+    report_iter->key_count = key_count;
+    report_iter->output_count = output_count;
+
+    /* Allocate at least one element, malloc(0) may return NULL */
+    report_iter->accumulators =
+        malloc((output_count + 1) * sizeof(*report_iter->accumulators));
+    report_iter->keys = malloc((key_count + 1) * sizeof(*report_iter->keys));
+    report_iter->key_values =
+        malloc((key_count + 1) * sizeof(*report_iter->key_values));
+    report_iter->values =
+        malloc((output_count + 1) * sizeof(*report_iter->values));
+    report_iter->value_values =
+        malloc((output_count + 1) * sizeof(*report_iter->value_values));
+    if (report_iter->accumulators == NULL
+     || report_iter->keys == NULL || report_iter->key_values == NULL
+     || report_iter->values == NULL || report_iter->value_values == NULL) {
+        report_iter_destroy(report_iter);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < output_count; i++)
+        report_iter->accumulators[i] = report->outputs.items[i].accumulator;
+
+    return report_iter;
+}
+
+/* Compute the keys of the group of an fsentry (in report_iter->keys) */
+static void
+report_iter_keys(struct report_iterator *report_iter,
+                 const struct rbh_report *report,
+                 const struct rbh_fsentry *fsentry)
+{
+    for (size_t i = 0; i < report->groups.count; i++) {
+        const struct rbh_report_group *group = &report->groups.items[i];
+        struct rbh_value *key = &report_iter->key_values[i];
+        struct rbh_value value;
+        size_t low, high;
+
+        report_iter->keys[i] = NULL;
+        if (!fsentry_field_value(fsentry, &group->field, &value))
+            continue;
+
+        if (group->buckets.count == 0) {
+            *key = value;
+            report_iter->keys[i] = key;
+            continue;
+        }
+
+        /* Look for the greatest boundary lower than or equal to `value' */
+        low = 0;
+        high = group->buckets.count;
+        key->type = RBH_VT_INT64;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+
+            key->int64 = group->buckets.boundaries[middle];
+            if (value_order(&value, key) >= 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        if (low == 0)
+            /* `value' is lower than every boundary */
+            continue;
+
+        key->int64 = group->buckets.boundaries[low - 1];
+        report_iter->keys[i] = key;
+    }
+}
+
+/* Find the group matching report_iter->keys, or create it */
+static struct report_group *
+report_iter_group(struct report_iterator *report_iter)
+{
+    size_t key_count = report_iter->key_count;
+    struct report_group *group;
+    size_t low = 0;
+    size_t high = report_iter->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int result;
+
+        group = report_iter->groups[middle];
+        result = keys_order(report_iter->keys,
+                            (const struct rbh_value * const *)group->keys,
+                            key_count);
+        if (result == 0)
+            return group;
+        if (result < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+
+    if (report_iter->count == report_iter->size) {
+        size_t size = report_iter->size ? report_iter->size * 2 : 16;
+        struct report_group **groups;
+
+        groups = reallocarray(report_iter->groups, size, sizeof(*groups));
+        if (groups == NULL)
+            return NULL;
+
+        report_iter->groups = groups;
+        report_iter->size = size;
+    }
+
+    group = report_group_new(key_count, report_iter->output_count,
+                             report_iter->keys);
+    if (group == NULL)
+        return NULL;
+
+    memmove(&report_iter->groups[low + 1], &report_iter->groups[low],
+            (report_iter->count - low) * sizeof(*report_iter->groups));
+    report_iter->groups[low] = group;
+    report_iter->count++;
+    return group;
+}
+
+static void
+projection_add(struct rbh_filter_projection *projection,
+               const struct rbh_filter_field *field)
+{
+    projection->fsentry_mask |= field->fsentry;
+    if (field->fsentry == RBH_FP_STATX)
+        projection->statx_mask |= field->statx;
+}
+
+struct rbh_mut_iterator *
+rbh_generic_backend_report(struct rbh_backend *backend,
+                           const struct rbh_filter *filter,
+                           const struct rbh_report *report)
+{
+    struct rbh_filter_options options = { 0 };
+    struct report_iterator *report_iter;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    int save_errno;
+
+    if (rbh_report_validate(report))
+        return NULL;
+
+    for (size_t i = 0; i < report->groups.count; i++)
+        projection_add(&options.projection, &report->groups.items[i].field);
+
+    for (size_t i = 0; i < report->outputs.count; i++) {
+        if (report->outputs.items[i].accumulator != RBH_RA_COUNT)
+            projection_add(&options.projection,
+                           &report->outputs.items[i].field);
+    }
+
+    report_iter = report_iter_new(report);
+    if (report_iter == NULL)
+        return NULL;
+
+    fsentries = rbh_backend_filter(backend, filter, &options);
+    if (fsentries == NULL)
+        goto out_destroy_report_iter;
+
+    while (true) {
+        struct report_group *group;
+
+        errno = 0;
+        fsentry = rbh_mut_iter_next(fsentries);
+        if (fsentry == NULL)
+            break;
+
+        report_iter_keys(report_iter, report, fsentry);
+        group = report_iter_group(report_iter);
+        if (group == NULL || report_group_accumulate(report, group, fsentry)) {
+            free(fsentry);
+            goto out_destroy_fsentries;
+        }
+        free(fsentry);
+    }
+
+    if (errno != ENODATA)
+        goto out_destroy_fsentries;
+
+    rbh_mut_iter_destroy(fsentries);
+    return &report_iter->iterator;
+
+out_destroy_fsentries:
+    save_errno = errno;
+    rbh_mut_iter_destroy(fsentries);
+    errno = save_errno;
+out_destroy_report_iter:
+    save_errno = errno;
+    report_iter_destroy(report_iter);
+    errno = save_errno;
+    return NULL;
+}
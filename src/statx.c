@@ -55,8 +55,8 @@ statx_from_stat(struct rbh_statx *statxbuf, struct stat *stat)
 }
 #endif
 
-static uint32_t
-statx2rbh_statx_mask(uint32_t mask)
+uint32_t
+rbh_statx_mask_from_statx(uint32_t mask)
 {
     mask |= RBH_STATX_ATTRIBUTES | RBH_STATX_BLKSIZE | RBH_STATX_RDEV
           | RBH_STATX_DEV;
@@ -84,7 +84,7 @@ rbh_statx(int dirfd, const char *restrict pathname, int flags,
     int rc;
 
     rc = statx(dirfd, pathname, flags, mask, (struct statx *)statxbuf);
-    statxbuf->stx_mask = statx2rbh_statx_mask(statxbuf->stx_mask);
+    statxbuf->stx_mask = rbh_statx_mask_from_statx(statxbuf->stx_mask);
     return rc;
 #else
     struct stat stat;
@@ -0,0 +1,731 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "robinhood/fsevent.h"
+#include "robinhood/itertools.h"
+#include "robinhood/ring.h"
+#include "robinhood/sync.h"
+
+/* Default number of items each queue can hold */
+#define SYNC_QUEUE_SIZE (1 << 12)
+/* Default number of fsevents per rbh_backend_update() */
+#define SYNC_BATCH_SIZE (1 << 10)
+/* Number of items a stage moves between queues at once */
+#define SYNC_CHUNK_SIZE 64
+
+static uint64_t
+sync_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Charge the time elapsed since `*last' to `counter' */
+static void
+sync_account(uint64_t *counter, uint64_t *last)
+{
+    uint64_t now = sync_now();
+
+    __atomic_add_fetch(counter, now - *last, __ATOMIC_RELAXED);
+    *last = now;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                 sync_queue                                 |
+ *----------------------------------------------------------------------------*/
+
+/* A bounded, blocking queue of pointers to free()able items */
+struct sync_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct rbh_ring *ring;
+    size_t capacity;
+    size_t count;
+    size_t peak;
+    /* No more items will be pushed */
+    bool closed;
+    /* The sync was interrupted */
+    bool aborted;
+};
+
+static int
+sync_queue_init(struct sync_queue *queue, size_t size)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t bytes;
+    int rc;
+
+    bytes = size * sizeof(void *);
+    bytes = (bytes + pagesize - 1) / pagesize * pagesize;
+
+    queue->ring = rbh_ring_new(bytes);
+    if (queue->ring == NULL)
+        return -1;
+
+    rc = pthread_mutex_init(&queue->lock, NULL);
+    if (rc)
+        goto out_destroy_ring;
+
+    rc = pthread_cond_init(&queue->not_empty, NULL);
+    if (rc)
+        goto out_destroy_lock;
+
+    rc = pthread_cond_init(&queue->not_full, NULL);
+    if (rc)
+        goto out_destroy_not_empty;
+
+    queue->capacity = bytes / sizeof(void *);
+    queue->count = 0;
+    queue->peak = 0;
+    queue->closed = false;
+    queue->aborted = false;
+    return 0;
+
+out_destroy_not_empty:
+    pthread_cond_destroy(&queue->not_empty);
+out_destroy_lock:
+    pthread_mutex_destroy(&queue->lock);
+out_destroy_ring:
+    rbh_ring_destroy(queue->ring);
+    errno = rc;
+    return -1;
+}
+
+/**
+ * Push items into a queue, blocking while it is full
+ *
+ * @return  the number of items pushed, less than \p count only if \p queue
+ *          was aborted
+ */
+static size_t
+sync_queue_push(struct sync_queue *queue, void **items, size_t count)
+{
+    size_t pushed = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (pushed < count) {
+        size_t room;
+
+        while (!queue->aborted && queue->count == queue->capacity)
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        if (queue->aborted)
+            break;
+
+        room = queue->capacity - queue->count;
+        if (room > count - pushed)
+            room = count - pushed;
+
+        /* Cannot fail: there is enough room */
+        rbh_ring_push(queue->ring, &items[pushed], room * sizeof(*items));
+        queue->count += room;
+        if (queue->count > queue->peak)
+            queue->peak = queue->count;
+        pushed += room;
+        pthread_cond_broadcast(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return pushed;
+}
+
+/**
+ * Pop up to \p count items from a queue, blocking while it is empty
+ *
+ * @return  the number of items popped, 0 only if \p queue is closed and empty,
+ *          or aborted
+ */
+static size_t
+sync_queue_pop(struct sync_queue *queue, void **items, size_t count)
+{
+    size_t readable;
+    void **first;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->aborted && !queue->closed && queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+    if (queue->aborted) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    if (count > queue->count)
+        count = queue->count;
+
+    first = rbh_ring_peek(queue->ring, &readable);
+    for (size_t i = 0; i < count; i++)
+        items[i] = first[i];
+    rbh_ring_pop(queue->ring, count * sizeof(*items));
+    queue->count -= count;
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return count;
+}
+
+static void
+sync_queue_close(struct sync_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+sync_queue_abort(struct sync_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->aborted = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+sync_queue_stats(struct sync_queue *queue, struct rbh_sync_queue_stats *stats)
+{
+    pthread_mutex_lock(&queue->lock);
+    stats->capacity = queue->capacity;
+    stats->count = queue->count;
+    stats->peak = queue->peak;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+sync_queue_destroy(struct sync_queue *queue)
+{
+    size_t readable;
+    void **items;
+
+    items = rbh_ring_peek(queue->ring, &readable);
+    for (size_t i = 0; i < queue->count; i++)
+        free(items[i]);
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    rbh_ring_destroy(queue->ring);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  rbh_sync                                  |
+ *----------------------------------------------------------------------------*/
+
+struct sync_stage {
+    size_t threads;
+    /* Number of threads still running, the last one closes `output' */
+    size_t running;
+    struct sync_queue *input;
+    struct sync_queue *output;
+    /* Turn an item into `output' ones, return how many or -1 on error */
+    int (*transform)(struct rbh_sync *sync, void *item, void **output);
+
+    uint64_t items;
+    uint64_t busy_ns;
+    uint64_t starved_ns;
+    uint64_t blocked_ns;
+};
+
+struct sync_worker {
+    struct rbh_sync *sync;
+    struct sync_stage *stage;
+    pthread_t thread;
+};
+
+struct rbh_sync {
+    struct rbh_backend *destination;
+    struct rbh_mut_iterator *fsentries;
+    int (*enrich)(struct rbh_fsentry **fsentry, void *arg);
+    void *enrich_arg;
+    size_t batch_size;
+
+    struct sync_stage stages[RBH_SS_COUNT];
+    /* The input queue of each stage, the walk stage has none */
+    struct sync_queue queues[RBH_SS_COUNT];
+
+    struct sync_worker *workers;
+    size_t worker_count;
+    bool joined;
+
+    uint64_t start;
+    uint64_t applied;
+    /* The first error any stage ran into */
+    int error;
+};
+
+static void
+sync_abort(struct rbh_sync *sync)
+{
+    for (size_t i = 0; i < RBH_SS_COUNT; i++) {
+        if (sync->stages[i].input)
+            sync_queue_abort(sync->stages[i].input);
+    }
+}
+
+static void
+sync_fail(struct rbh_sync *sync, int error)
+{
+    int expected = 0;
+
+    __atomic_compare_exchange_n(&sync->error, &expected, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    sync_abort(sync);
+}
+
+static void
+sync_stage_exit(struct sync_stage *stage)
+{
+    if (__atomic_sub_fetch(&stage->running, 1, __ATOMIC_ACQ_REL) == 0
+     && stage->output)
+        sync_queue_close(stage->output);
+}
+
+/* Push items downstream and free those that could not be */
+static void
+sync_stage_push(struct sync_stage *stage, void **items, size_t count,
+                uint64_t *last)
+{
+    size_t pushed;
+
+    pushed = sync_queue_push(stage->output, items, count);
+    for (size_t i = pushed; i < count; i++)
+        free(items[i]);
+    sync_account(&stage->blocked_ns, last);
+}
+
+static void *
+sync_walk(void *arg)
+{
+    struct sync_worker *worker = arg;
+    struct sync_stage *stage = worker->stage;
+    struct rbh_sync *sync = worker->sync;
+    void *chunk[SYNC_CHUNK_SIZE];
+    uint64_t last = sync_now();
+    size_t count = 0;
+
+    while (true) {
+        struct rbh_fsentry *fsentry;
+
+        fsentry = rbh_mut_iter_next(sync->fsentries);
+        if (fsentry == NULL) {
+            if (errno != ENODATA)
+                sync_fail(sync, errno);
+            break;
+        }
+
+        chunk[count++] = fsentry;
+        __atomic_add_fetch(&stage->items, 1, __ATOMIC_RELAXED);
+        if (count < SYNC_CHUNK_SIZE)
+            continue;
+
+        sync_account(&stage->busy_ns, &last);
+        sync_stage_push(stage, chunk, count, &last);
+        count = 0;
+    }
+
+    sync_account(&stage->busy_ns, &last);
+    sync_stage_push(stage, chunk, count, &last);
+    sync_stage_exit(stage);
+    return NULL;
+}
+
+static int
+sync_enrich(struct rbh_sync *sync, void *item, void **output)
+{
+    struct rbh_fsentry *fsentry = item;
+
+    if (sync->enrich(&fsentry, sync->enrich_arg))
+        return -1;
+
+    output[0] = fsentry;
+    return 1;
+}
+
+/* Build the LINK fsevent of an fsentry, without RBH_NS_XATTR_UNCHANGED */
+static struct rbh_fsevent *
+sync_link_new(const struct rbh_fsentry *fsentry)
+{
+    const struct rbh_value_map *ns_xattrs = &fsentry->xattrs.ns;
+    struct rbh_value_map stripped;
+    struct rbh_fsevent *link;
+
+    if (!(fsentry->mask & RBH_FP_NAMESPACE_XATTRS))
+        return rbh_fsevent_link_new(&fsentry->id, NULL, &fsentry->parent_id,
+                                    fsentry->name);
+
+    for (size_t i = 0; i < ns_xattrs->count; i++) {
+        struct rbh_value_pair *pairs;
+
+        if (strcmp(ns_xattrs->pairs[i].key, RBH_NS_XATTR_UNCHANGED))
+            continue;
+
+        pairs = reallocarray(NULL, ns_xattrs->count, sizeof(*pairs));
+        if (pairs == NULL)
+            return NULL;
+
+        memcpy(pairs, ns_xattrs->pairs, i * sizeof(*pairs));
+        memcpy(&pairs[i], &ns_xattrs->pairs[i + 1],
+               (ns_xattrs->count - i - 1) * sizeof(*pairs));
+        stripped.pairs = pairs;
+        stripped.count = ns_xattrs->count - 1;
+
+        link = rbh_fsevent_link_new(&fsentry->id, &stripped,
+                                    &fsentry->parent_id, fsentry->name);
+        free(pairs);
+        return link;
+    }
+
+    return rbh_fsevent_link_new(&fsentry->id, ns_xattrs, &fsentry->parent_id,
+                                fsentry->name);
+}
+
+static int
+sync_convert(struct rbh_sync *sync, void *item, void **output)
+{
+    struct rbh_fsentry *fsentry = item;
+    int count = 0;
+
+    if (!(fsentry->mask & RBH_FP_ID)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fsentry->mask & (RBH_FP_STATX | RBH_FP_SYMLINK | RBH_FP_INODE_XATTRS)) {
+        output[count] = rbh_fsevent_upsert_new(
+                &fsentry->id,
+                fsentry->mask & RBH_FP_INODE_XATTRS ?
+                    &fsentry->xattrs.inode : NULL,
+                fsentry->mask & RBH_FP_STATX ? fsentry->statx : NULL,
+                fsentry->mask & RBH_FP_SYMLINK ? fsentry->symlink : NULL
+                );
+        if (output[count] == NULL)
+            return -1;
+        count++;
+    }
+
+    if ((fsentry->mask & RBH_FP_PARENT_ID) && (fsentry->mask & RBH_FP_NAME)) {
+        output[count] = sync_link_new(fsentry);
+        if (output[count] == NULL) {
+            int save_errno = errno;
+
+            while (count--)
+                free(output[count]);
+            errno = save_errno;
+            return -1;
+        }
+        count++;
+    }
+
+    free(fsentry);
+    return count;
+}
+
+/* Shared by the enrich and convert stages */
+static void *
+sync_transform(void *arg)
+{
+    struct sync_worker *worker = arg;
+    struct sync_stage *stage = worker->stage;
+    struct rbh_sync *sync = worker->sync;
+    void *output[2 * SYNC_CHUNK_SIZE];
+    void *input[SYNC_CHUNK_SIZE];
+    uint64_t last = sync_now();
+
+    while (true) {
+        size_t count;
+        size_t produced = 0;
+        size_t i;
+
+        count = sync_queue_pop(stage->input, input, SYNC_CHUNK_SIZE);
+        sync_account(&stage->starved_ns, &last);
+        if (count == 0)
+            break;
+
+        for (i = 0; i < count; i++) {
+            int rc = stage->transform(sync, input[i], &output[produced]);
+
+            if (rc < 0) {
+                sync_fail(sync, errno);
+                break;
+            }
+            produced += rc;
+        }
+        __atomic_add_fetch(&stage->items, i, __ATOMIC_RELAXED);
+        sync_account(&stage->busy_ns, &last);
+
+        /* Only happens on error */
+        for (; i < count; i++)
+            free(input[i]);
+
+        sync_stage_push(stage, output, produced, &last);
+    }
+
+    sync_stage_exit(stage);
+    return NULL;
+}
+
+static void *
+sync_apply(void *arg)
+{
+    struct sync_worker *worker = arg;
+    struct sync_stage *stage = worker->stage;
+    struct rbh_sync *sync = worker->sync;
+    struct rbh_fsevent *batch;
+    uint64_t last = sync_now();
+    void **fsevents;
+
+    fsevents = reallocarray(NULL, sync->batch_size, sizeof(*fsevents));
+    if (fsevents == NULL) {
+        sync_fail(sync, errno);
+        goto out;
+    }
+
+    batch = reallocarray(NULL, sync->batch_size, sizeof(*batch));
+    if (batch == NULL) {
+        sync_fail(sync, errno);
+        goto out_free_fsevents;
+    }
+
+    while (true) {
+        struct rbh_iterator *iter;
+        ssize_t applied;
+        size_t count;
+
+        count = sync_queue_pop(stage->input, fsevents, sync->batch_size);
+        sync_account(&stage->starved_ns, &last);
+        if (count == 0)
+            break;
+
+        /* The copies still point inside the original allocations */
+        for (size_t i = 0; i < count; i++)
+            batch[i] = *(struct rbh_fsevent *)fsevents[i];
+
+        iter = rbh_iter_array(batch, sizeof(*batch), count);
+        if (iter == NULL) {
+            applied = -1;
+        } else {
+            applied = rbh_backend_update(sync->destination, iter);
+            rbh_iter_destroy(iter);
+        }
+
+        if (applied < 0)
+            sync_fail(sync, errno);
+        else
+            __atomic_add_fetch(&sync->applied, applied, __ATOMIC_RELAXED);
+
+        for (size_t i = 0; i < count; i++)
+            free(fsevents[i]);
+        __atomic_add_fetch(&stage->items, count, __ATOMIC_RELAXED);
+        sync_account(&stage->busy_ns, &last);
+    }
+
+    free(batch);
+out_free_fsevents:
+    free(fsevents);
+out:
+    sync_stage_exit(stage);
+    return NULL;
+}
+
+static void
+sync_join(struct rbh_sync *sync)
+{
+    for (size_t i = 0; i < sync->worker_count; i++)
+        pthread_join(sync->workers[i].thread, NULL);
+    sync->joined = true;
+}
+
+static void
+sync_free(struct rbh_sync *sync)
+{
+    for (size_t i = 0; i < RBH_SS_COUNT; i++) {
+        if (sync->stages[i].input)
+            sync_queue_destroy(sync->stages[i].input);
+    }
+    if (sync->fsentries)
+        rbh_mut_iter_destroy(sync->fsentries);
+    free(sync->workers);
+    free(sync);
+}
+
+static int
+sync_start(struct rbh_sync *sync)
+{
+    static void *(*const routines[RBH_SS_COUNT])(void *) = {
+        [RBH_SS_WALK] = sync_walk,
+        [RBH_SS_ENRICH] = sync_transform,
+        [RBH_SS_CONVERT] = sync_transform,
+        [RBH_SS_APPLY] = sync_apply,
+    };
+    size_t count = 0;
+
+    for (size_t i = 0; i < RBH_SS_COUNT; i++)
+        count += sync->stages[i].threads;
+
+    sync->workers = reallocarray(NULL, count, sizeof(*sync->workers));
+    if (sync->workers == NULL)
+        return -1;
+
+    for (size_t i = 0; i < RBH_SS_COUNT; i++) {
+        struct sync_stage *stage = &sync->stages[i];
+
+        for (size_t j = 0; j < stage->threads; j++) {
+            struct sync_worker *worker = &sync->workers[sync->worker_count];
+            int rc;
+
+            worker->sync = sync;
+            worker->stage = stage;
+            rc = pthread_create(&worker->thread, NULL, routines[i], worker);
+            if (rc) {
+                sync_fail(sync, rc);
+                sync_join(sync);
+                errno = rc;
+                return -1;
+            }
+            sync->worker_count++;
+        }
+    }
+
+    return 0;
+}
+
+struct rbh_sync *
+rbh_sync_new(struct rbh_backend *source, struct rbh_backend *destination,
+             const struct rbh_sync_options *options)
+{
+    const struct rbh_sync_options defaults = { 0 };
+    struct rbh_sync *sync;
+    size_t queue_size;
+    int save_errno;
+
+    if (options == NULL)
+        options = &defaults;
+
+    sync = calloc(1, sizeof(*sync));
+    if (sync == NULL)
+        return NULL;
+
+    sync->destination = destination;
+    sync->enrich = options->enrich;
+    sync->enrich_arg = options->enrich_arg;
+    sync->batch_size =
+        options->batch_size ? options->batch_size : SYNC_BATCH_SIZE;
+    queue_size = options->queue_size ? options->queue_size : SYNC_QUEUE_SIZE;
+
+    sync->stages[RBH_SS_WALK].threads = 1;
+    if (options->enrich) {
+        sync->stages[RBH_SS_ENRICH].threads =
+            options->enrich_threads ? options->enrich_threads : 1;
+        sync->stages[RBH_SS_ENRICH].transform = sync_enrich;
+    }
+    sync->stages[RBH_SS_CONVERT].threads =
+        options->convert_threads ? options->convert_threads : 1;
+    sync->stages[RBH_SS_CONVERT].transform = sync_convert;
+    sync->stages[RBH_SS_APPLY].threads = 1;
+
+    /* Connect the stages that run, in reverse order */
+    for (size_t i = RBH_SS_COUNT, next = RBH_SS_COUNT; i-- > 0; ) {
+        struct sync_stage *stage = &sync->stages[i];
+
+        if (stage->threads == 0)
+            continue;
+
+        stage->running = stage->threads;
+        if (next < RBH_SS_COUNT)
+            stage->output = sync->stages[next].input;
+        next = i;
+
+        if (i == RBH_SS_WALK)
+            break;
+
+        if (sync_queue_init(&sync->queues[i], queue_size))
+            goto out_free_sync;
+        stage->input = &sync->queues[i];
+    }
+
+    sync->fsentries = rbh_backend_filter(source, options->filter,
+                                         &options->filter_options);
+    if (sync->fsentries == NULL)
+        goto out_free_sync;
+
+    sync->start = sync_now();
+    if (sync_start(sync))
+        goto out_free_sync;
+
+    return sync;
+
+out_free_sync:
+    save_errno = errno;
+    sync_free(sync);
+    errno = save_errno;
+    return NULL;
+}
+
+void
+rbh_sync_stats(struct rbh_sync *sync, struct rbh_sync_stats *stats)
+{
+    for (size_t i = 0; i < RBH_SS_COUNT; i++) {
+        struct rbh_sync_stage_stats *stage_stats = &stats->stages[i];
+        struct sync_stage *stage = &sync->stages[i];
+
+        stage_stats->threads = stage->threads;
+        stage_stats->items = __atomic_load_n(&stage->items, __ATOMIC_RELAXED);
+        stage_stats->busy_ns = __atomic_load_n(&stage->busy_ns,
+                                               __ATOMIC_RELAXED);
+        stage_stats->starved_ns = __atomic_load_n(&stage->starved_ns,
+                                                  __ATOMIC_RELAXED);
+        stage_stats->blocked_ns = __atomic_load_n(&stage->blocked_ns,
+                                                  __ATOMIC_RELAXED);
+
+        if (stage->input)
+            sync_queue_stats(stage->input, &stats->queues[i]);
+        else
+            stats->queues[i] = (struct rbh_sync_queue_stats){ 0 };
+    }
+
+    stats->elapsed_ns = sync_now() - sync->start;
+    stats->applied = __atomic_load_n(&sync->applied, __ATOMIC_RELAXED);
+}
+
+ssize_t
+rbh_sync_wait(struct rbh_sync *sync)
+{
+    if (!sync->joined)
+        sync_join(sync);
+
+    if (sync->error) {
+        errno = sync->error;
+        return -1;
+    }
+    return sync->applied;
+}
+
+void
+rbh_sync_destroy(struct rbh_sync *sync)
+{
+    if (!sync->joined) {
+        sync_abort(sync);
+        sync_join(sync);
+    }
+    sync_free(sync);
+}
@@ -262,6 +262,32 @@ value_map_copy(struct rbh_value_map *dest, const struct rbh_value_map *src,
     return 0;
 }
 
+const struct rbh_value *
+value_map_lookup(const struct rbh_value_map *map, const char *key)
+{
+    for (size_t i = 0; i < map->count; i++) {
+        const struct rbh_value_pair *pair = &map->pairs[i];
+        size_t length = strlen(pair->key);
+        const struct rbh_value *value;
+
+        if (strncmp(pair->key, key, length))
+            continue;
+
+        if (key[length] == '\0')
+            return pair->value;
+
+        if (key[length] != '.' || pair->value == NULL
+         || pair->value->type != RBH_VT_MAP)
+            continue;
+
+        value = value_map_lookup(&pair->value->map, key + length + 1);
+        if (value != NULL)
+            return value;
+    }
+
+    return NULL;
+}
+
 static struct rbh_value *
 value_clone(const struct rbh_value *value)
 {
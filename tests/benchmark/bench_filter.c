@@ -0,0 +1,337 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+/* Compare how fast filters evaluate as trees and as compiled programs
+ *
+ * Each filter of a set of representative ones is evaluated against a corpus
+ * of synthetic fsentries, first with a struct rbh_filter_matcher, then with a
+ * struct rbh_filter_program.
+ *
+ * Usage: bench_filter [ITERATIONS]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <error.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "robinhood/filter.h"
+#include "robinhood/fsentry.h"
+#include "robinhood/statx.h"
+
+#define CORPUS_SIZE 4096
+
+#define ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
+
+/*----------------------------------------------------------------------------*
+ |                                   corpus                                   |
+ *----------------------------------------------------------------------------*/
+
+/* Regular files, directories and symlinks, owned by a handful of users, of
+ * increasing sizes; every other file has a "user.project" xattr.
+ */
+static struct rbh_fsentry *
+fsentry_new(size_t index)
+{
+    static const mode_t TYPES[] = { S_IFREG, S_IFREG, S_IFREG, S_IFDIR,
+                                    S_IFLNK };
+    const struct rbh_id id = {
+        .data = (const char *)&index,
+        .size = sizeof(index),
+    };
+    const struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_TYPE | RBH_STATX_MODE | RBH_STATX_UID
+                  | RBH_STATX_SIZE,
+        .stx_mode = TYPES[index % ARRAY_SIZE(TYPES)] | 0644,
+        .stx_uid = index % 7,
+        .stx_size = index * 1024,
+    };
+    const struct rbh_value project = {
+        .type = RBH_VT_STRING,
+        .string = "robinhood",
+    };
+    const struct rbh_value_pair pair = {
+        .key = "user.project",
+        .value = &project,
+    };
+    const struct rbh_value_map xattrs = {
+        .pairs = &pair,
+        .count = index % 2,
+    };
+    char name[32];
+
+    snprintf(name, sizeof(name), "file-%06zu.%s", index,
+             index % 3 ? "dat" : "log");
+
+    return rbh_fsentry_new(&id, &id, name, &statx, NULL, &xattrs, NULL);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  filters                                   |
+ *----------------------------------------------------------------------------*/
+
+static const struct rbh_filter TYPE_FILTER = {
+    .op = RBH_FOP_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_TYPE,
+        },
+        .value = {
+            .type = RBH_VT_UINT32,
+            .uint32 = S_IFREG,
+        },
+    },
+};
+
+static const struct rbh_filter SIZE_FILTER = {
+    .op = RBH_FOP_STRICTLY_GREATER,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_SIZE,
+        },
+        .value = {
+            .type = RBH_VT_UINT64,
+            .uint64 = 3 << 20,
+        },
+    },
+};
+
+static const struct rbh_value UIDS[] = {
+    { .type = RBH_VT_UINT32, .uint32 = 1, },
+    { .type = RBH_VT_UINT32, .uint32 = 3, },
+    { .type = RBH_VT_UINT32, .uint32 = 5, },
+};
+
+static const struct rbh_filter UID_FILTER = {
+    .op = RBH_FOP_IN,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_UID,
+        },
+        .value = {
+            .type = RBH_VT_SEQUENCE,
+            .sequence = {
+                .values = UIDS,
+                .count = ARRAY_SIZE(UIDS),
+            },
+        },
+    },
+};
+
+static const struct rbh_filter XATTR_FILTER = {
+    .op = RBH_FOP_EXISTS,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_INODE_XATTRS,
+            .xattr = "user.project",
+        },
+        .value = {
+            .type = RBH_VT_BOOLEAN,
+            .boolean = true,
+        },
+    },
+};
+
+static const struct rbh_filter REGEX_FILTER = {
+    .op = RBH_FOP_REGEX,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_NAME,
+        },
+        .value = {
+            .type = RBH_VT_REGEX,
+            .regex = {
+                .string = "\\.dat$",
+            },
+        },
+    },
+};
+
+static const struct rbh_filter *UID_OR_SIZE_FILTERS[] = {
+    &UID_FILTER,
+    &SIZE_FILTER,
+};
+
+static const struct rbh_filter UID_OR_SIZE_FILTER = {
+    .op = RBH_FOP_OR,
+    .logical = {
+        .filters = UID_OR_SIZE_FILTERS,
+        .count = ARRAY_SIZE(UID_OR_SIZE_FILTERS),
+    },
+};
+
+/* The most expensive predicates come first */
+static const struct rbh_filter *WORST_ORDER_FILTERS[] = {
+    &XATTR_FILTER,
+    &REGEX_FILTER,
+    &UID_OR_SIZE_FILTER,
+    &TYPE_FILTER,
+};
+
+static const struct rbh_filter *BEST_ORDER_FILTERS[] = {
+    &TYPE_FILTER,
+    &UID_OR_SIZE_FILTER,
+    &XATTR_FILTER,
+    &REGEX_FILTER,
+};
+
+static const struct {
+    const char *name;
+    struct rbh_filter filter;
+} FILTERS[] = {
+    {
+        .name = "AND(xattr, regex, OR(IN, >), type)",
+        .filter = {
+            .op = RBH_FOP_AND,
+            .logical = {
+                .filters = WORST_ORDER_FILTERS,
+                .count = ARRAY_SIZE(WORST_ORDER_FILTERS),
+            },
+        },
+    },
+    {
+        .name = "AND(type, OR(IN, >), xattr, regex)",
+        .filter = {
+            .op = RBH_FOP_AND,
+            .logical = {
+                .filters = BEST_ORDER_FILTERS,
+                .count = ARRAY_SIZE(BEST_ORDER_FILTERS),
+            },
+        },
+    },
+    {
+        .name = "OR(uid IN {1, 3, 5}, size > N)",
+        .filter = {
+            .op = RBH_FOP_OR,
+            .logical = {
+                .filters = UID_OR_SIZE_FILTERS,
+                .count = ARRAY_SIZE(UID_OR_SIZE_FILTERS),
+            },
+        },
+    },
+    { .name = "uid IN {1, 3, 5}", .filter = UID_FILTER, },
+    { .name = "size > N", .filter = SIZE_FILTER, },
+    { .name = "type == S_IFREG", .filter = TYPE_FILTER, },
+};
+
+/*----------------------------------------------------------------------------*
+ |                                 benchmark                                  |
+ *----------------------------------------------------------------------------*/
+
+static double
+elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)
+         + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the number of nanoseconds an evaluation takes on average */
+static double
+bench_matcher(const struct rbh_filter *filter, struct rbh_fsentry **corpus,
+              unsigned long iterations, size_t *matches)
+{
+    struct rbh_filter_matcher *matcher;
+    struct timespec start, end;
+
+    matcher = rbh_filter_matcher_new(filter);
+    if (matcher == NULL)
+        error(EXIT_FAILURE, errno, "rbh_filter_matcher_new");
+
+    *matches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < CORPUS_SIZE; j++)
+            *matches += rbh_filter_matcher_match(matcher, corpus[j], 0) == 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    rbh_filter_matcher_destroy(matcher);
+    return elapsed(&start, &end) * 1e9 / (iterations * CORPUS_SIZE);
+}
+
+static double
+bench_program(const struct rbh_filter *filter, struct rbh_fsentry **corpus,
+              unsigned long iterations, size_t *matches)
+{
+    struct rbh_filter_program *program;
+    struct timespec start, end;
+
+    program = rbh_filter_compile(filter);
+    if (program == NULL)
+        error(EXIT_FAILURE, errno, "rbh_filter_compile");
+
+    *matches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < CORPUS_SIZE; j++)
+            *matches += rbh_filter_program_match(program, corpus[j], 0) == 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    rbh_filter_program_destroy(program);
+    return elapsed(&start, &end) * 1e9 / (iterations * CORPUS_SIZE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct rbh_fsentry *corpus[CORPUS_SIZE];
+    unsigned long iterations = 1024;
+
+    if (argc > 2)
+        error(EXIT_FAILURE, EINVAL, "usage: %s [ITERATIONS]", argv[0]);
+
+    if (argc == 2) {
+        char *endptr;
+
+        iterations = strtoul(argv[1], &endptr, 0);
+        if (*endptr != '\0' || iterations == 0)
+            error(EXIT_FAILURE, EINVAL, "%s", argv[1]);
+    }
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        corpus[i] = fsentry_new(i);
+        if (corpus[i] == NULL)
+            error(EXIT_FAILURE, errno, "rbh_fsentry_new");
+    }
+
+    printf("%lu evaluations per filter (ns/evaluation: tree vs compiled)\n",
+           iterations * CORPUS_SIZE);
+
+    for (size_t i = 0; i < ARRAY_SIZE(FILTERS); i++) {
+        size_t tree_matches, program_matches;
+        double tree, program;
+
+        tree = bench_matcher(&FILTERS[i].filter, corpus, iterations,
+                             &tree_matches);
+        program = bench_program(&FILTERS[i].filter, corpus, iterations,
+                                &program_matches);
+
+        /* Both evaluators must agree */
+        if (tree_matches != program_matches)
+            error(EXIT_FAILURE, 0, "%s: %zu vs %zu matches", FILTERS[i].name,
+                  tree_matches, program_matches);
+
+        printf("%-36s %6.1f vs %6.1f\n", FILTERS[i].name, tree, program);
+    }
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+        free(corpus[i]);
+
+    return EXIT_SUCCESS;
+}
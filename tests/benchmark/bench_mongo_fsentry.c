@@ -0,0 +1,321 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+/* Measure how fast the mongo backend decodes fsentries
+ *
+ * The corpus mimics what the lustre backend stores in a mongo database:
+ * regular files with a full statx, a path, and a layout made of several
+ * components (PFL, mirrors, ...), each striped over several OSTs.
+ *
+ * Usage: bench_mongo_fsentry [ITERATIONS]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <error.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include <bson.h>
+
+#include "robinhood/fsentry.h"
+#include "robinhood/statx.h"
+
+#include "mongo.h"
+
+#define CORPUS_SIZE 4096
+#define MAX_COMPONENTS 16
+#define MAX_STRIPES 8
+
+/*----------------------------------------------------------------------------*
+ |                                   corpus                                   |
+ *----------------------------------------------------------------------------*/
+
+struct layout {
+    struct rbh_value stripe_count[MAX_COMPONENTS];
+    struct rbh_value stripe_size[MAX_COMPONENTS];
+    struct rbh_value pattern[MAX_COMPONENTS];
+    struct rbh_value comp_flags[MAX_COMPONENTS];
+    struct rbh_value pool[MAX_COMPONENTS];
+    struct rbh_value mirror_id[MAX_COMPONENTS];
+    struct rbh_value begin[MAX_COMPONENTS];
+    struct rbh_value end[MAX_COMPONENTS];
+    struct rbh_value ost[MAX_COMPONENTS * MAX_STRIPES];
+};
+
+static void
+layout_init(struct layout *layout, size_t components, size_t stripes)
+{
+    for (size_t i = 0; i < components; i++) {
+        layout->stripe_count[i].type = RBH_VT_UINT32;
+        layout->stripe_count[i].uint32 = stripes;
+        layout->stripe_size[i].type = RBH_VT_UINT64;
+        layout->stripe_size[i].uint64 = 1 << 20;
+        layout->pattern[i].type = RBH_VT_UINT64;
+        layout->pattern[i].uint64 = 1;
+        layout->comp_flags[i].type = RBH_VT_UINT32;
+        layout->comp_flags[i].uint32 = i == 0 ? 0x10 : 0;
+        layout->pool[i].type = RBH_VT_STRING;
+        layout->pool[i].string = i % 2 ? "flash" : "archive";
+        layout->mirror_id[i].type = RBH_VT_UINT32;
+        layout->mirror_id[i].uint32 = i / 4;
+        layout->begin[i].type = RBH_VT_UINT64;
+        layout->begin[i].uint64 = i == 0 ? 0 : (UINT64_C(1) << (20 + i));
+        layout->end[i].type = RBH_VT_UINT64;
+        layout->end[i].uint64 = i + 1 == components ? UINT64_MAX
+                                                    : UINT64_C(1) << (21 + i);
+
+        for (size_t j = 0; j < stripes; j++) {
+            struct rbh_value *ost = &layout->ost[i * stripes + j];
+
+            ost->type = RBH_VT_UINT64;
+            ost->uint64 = (i * stripes + j) % 512;
+        }
+    }
+}
+
+static bool
+bson_append_lustre_xattrs(bson_t *bson, size_t index)
+{
+    size_t components = 1 + index % MAX_COMPONENTS;
+    size_t stripes = 1 + index % MAX_STRIPES;
+    char fid[16] = { 0 };
+    struct layout layout;
+
+#define SEQUENCE(_key, _values, _count) \
+    { .key = _key, .value = &(const struct rbh_value){ \
+        .type = RBH_VT_SEQUENCE, \
+        .sequence = { .values = _values, .count = _count, }, \
+    }, }
+#define UINT32(_key, _value) \
+    { .key = _key, .value = &(const struct rbh_value){ \
+        .type = RBH_VT_UINT32, .uint32 = _value, \
+    }, }
+
+    const struct rbh_value_pair pairs[] = {
+        { .key = "fid", .value = &(const struct rbh_value){
+            .type = RBH_VT_BINARY,
+            .binary = { .data = fid, .size = sizeof(fid), },
+        }, },
+        UINT32("hsm_state", index % 3),
+        UINT32("hsm_archive_id", 1),
+        UINT32("flags", 0),
+        { .key = "magic", .value = &(const struct rbh_value){
+            .type = RBH_VT_STRING,
+            .string = "LOV_USER_MAGIC_COMP_V1",
+        }, },
+        UINT32("gen", index % 7),
+        UINT32("mirror_count", 1 + components / 4),
+        SEQUENCE("stripe_count", layout.stripe_count, components),
+        SEQUENCE("stripe_size", layout.stripe_size, components),
+        SEQUENCE("pattern", layout.pattern, components),
+        SEQUENCE("comp_flags", layout.comp_flags, components),
+        SEQUENCE("pool", layout.pool, components),
+        SEQUENCE("mirror_id", layout.mirror_id, components),
+        SEQUENCE("begin", layout.begin, components),
+        SEQUENCE("end", layout.end, components),
+        SEQUENCE("ost", layout.ost, components * stripes),
+    };
+    const struct rbh_value_map xattrs = {
+        .pairs = pairs,
+        .count = sizeof(pairs) / sizeof(*pairs),
+    };
+
+#undef UINT32
+#undef SEQUENCE
+
+    layout_init(&layout, components, stripes);
+    memcpy(fid, &index, sizeof(index));
+
+    return BSON_APPEND_RBH_VALUE_MAP(bson, MFF_XATTRS, &xattrs);
+}
+
+static bool
+bson_append_timestamp(bson_t *bson, const char *key, int64_t sec, int32_t nsec)
+{
+    bson_t document;
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+        && BSON_APPEND_INT64(&document, MFF_STATX_TIMESTAMP_SEC, sec)
+        && BSON_APPEND_INT32(&document, MFF_STATX_TIMESTAMP_NSEC, nsec)
+        && bson_append_document_end(bson, &document);
+}
+
+static bool
+bson_append_device(bson_t *bson, const char *key, int32_t major,
+                   int32_t minor)
+{
+    bson_t document;
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document)
+        && BSON_APPEND_INT32(&document, MFF_STATX_DEVICE_MAJOR, major)
+        && BSON_APPEND_INT32(&document, MFF_STATX_DEVICE_MINOR, minor)
+        && bson_append_document_end(bson, &document);
+}
+
+static bool
+bson_append_lustre_statx(bson_t *bson, size_t index)
+{
+    bson_t attributes;
+    bson_t document;
+
+    return BSON_APPEND_DOCUMENT_BEGIN(bson, MFF_STATX, &document)
+        && BSON_APPEND_INT32(&document, MFF_STATX_BLKSIZE, 4194304)
+        && BSON_APPEND_INT32(&document, MFF_STATX_NLINK, 1)
+        && BSON_APPEND_INT32(&document, MFF_STATX_UID, 1000 + index % 37)
+        && BSON_APPEND_INT32(&document, MFF_STATX_GID, 1000 + index % 11)
+        && BSON_APPEND_INT32(&document, MFF_STATX_TYPE, S_IFREG)
+        && BSON_APPEND_INT32(&document, MFF_STATX_MODE, 0644)
+        && BSON_APPEND_INT64(&document, MFF_STATX_INO, 0x200000400 + index)
+        && BSON_APPEND_INT64(&document, MFF_STATX_SIZE, index << 20)
+        && BSON_APPEND_INT64(&document, MFF_STATX_BLOCKS, index << 11)
+        && BSON_APPEND_DOCUMENT_BEGIN(&document, MFF_STATX_ATTRIBUTES,
+                                      &attributes)
+        && BSON_APPEND_BOOL(&attributes, MFF_STATX_COMPRESSED, false)
+        && BSON_APPEND_BOOL(&attributes, MFF_STATX_IMMUTABLE, false)
+        && BSON_APPEND_BOOL(&attributes, MFF_STATX_APPEND, false)
+        && BSON_APPEND_BOOL(&attributes, MFF_STATX_NODUMP, false)
+        && BSON_APPEND_BOOL(&attributes, MFF_STATX_ENCRYPTED, false)
+        && bson_append_document_end(&document, &attributes)
+        && bson_append_timestamp(&document, MFF_STATX_ATIME, 1700000000, 1)
+        && bson_append_timestamp(&document, MFF_STATX_BTIME, 1600000000, 2)
+        && bson_append_timestamp(&document, MFF_STATX_CTIME, 1650000000, 3)
+        && bson_append_timestamp(&document, MFF_STATX_MTIME, 1650000000, 4)
+        && bson_append_device(&document, MFF_STATX_RDEV, 0, 0)
+        && bson_append_device(&document, MFF_STATX_DEV, 253, 1)
+        && BSON_APPEND_INT64(&document, MFF_STATX_MNT_ID, 27)
+        && bson_append_document_end(bson, &document);
+}
+
+/* {_id: ..., ns: {parent: ..., name: ..., xattrs: {path: ...}},
+ *  statx: {...}, xattrs: {...}}
+ *
+ * "ns" is a document rather than an array: this is how entries look once the
+ * filter pipeline unwound them.
+ */
+static bson_t *
+bson_new_lustre_entry(size_t index)
+{
+    char id_data[16] = { 0 };
+    char parent_data[16] = { 0 };
+    const struct rbh_id id = { .data = id_data, .size = sizeof(id_data), };
+    const struct rbh_id parent = {
+        .data = parent_data,
+        .size = sizeof(parent_data),
+    };
+    size_t parent_index = index / 64;
+    char pathname[128];
+    char name[32];
+    const struct rbh_value path = {
+        .type = RBH_VT_STRING,
+        .string = pathname,
+    };
+    const struct rbh_value_pair pair = {
+        .key = "path",
+        .value = &path,
+    };
+    const struct rbh_value_map ns_xattrs = {
+        .pairs = &pair,
+        .count = 1,
+    };
+    bson_t *bson;
+    bson_t ns;
+
+    memcpy(id_data, &index, sizeof(index));
+    memcpy(parent_data, &parent_index, sizeof(parent_index));
+
+    snprintf(name, sizeof(name), "file-%06zu.dat", index);
+    snprintf(pathname, sizeof(pathname),
+             "/scratch/project-%03zu/user-%03zu/run-%04zu/%s", index % 100,
+             index % 37, parent_index, name);
+
+    bson = bson_new();
+    if (BSON_APPEND_RBH_ID(bson, MFF_ID, &id)
+     && BSON_APPEND_DOCUMENT_BEGIN(bson, MFF_NAMESPACE, &ns)
+     && BSON_APPEND_RBH_ID(&ns, MFF_PARENT_ID, &parent)
+     && BSON_APPEND_UTF8(&ns, MFF_NAME, name)
+     && BSON_APPEND_RBH_VALUE_MAP(&ns, MFF_XATTRS, &ns_xattrs)
+     && bson_append_document_end(bson, &ns)
+     && bson_append_lustre_statx(bson, index)
+     && bson_append_lustre_xattrs(bson, index))
+        return bson;
+
+    bson_destroy(bson);
+    errno = ENOBUFS;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                 benchmark                                  |
+ *----------------------------------------------------------------------------*/
+
+static double
+elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)
+         + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static bson_t *corpus[CORPUS_SIZE];
+    struct timespec start, end;
+    unsigned long iterations = 64;
+    size_t bytes = 0;
+    double seconds;
+
+    if (argc > 2)
+        error(EXIT_FAILURE, EINVAL, "usage: %s [ITERATIONS]", argv[0]);
+
+    if (argc == 2) {
+        char *endptr;
+
+        iterations = strtoul(argv[1], &endptr, 0);
+        if (*endptr != '\0' || iterations == 0)
+            error(EXIT_FAILURE, EINVAL, "%s", argv[1]);
+    }
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        corpus[i] = bson_new_lustre_entry(i);
+        if (corpus[i] == NULL)
+            error(EXIT_FAILURE, errno, "bson_new_lustre_entry");
+        bytes += corpus[i]->len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < CORPUS_SIZE; j++) {
+            struct rbh_fsentry *fsentry;
+
+            fsentry = fsentry_from_bson(corpus[j]);
+            if (fsentry == NULL)
+                error(EXIT_FAILURE, errno, "fsentry_from_bson");
+            free(fsentry);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = elapsed(&start, &end);
+
+    printf("%lu fsentries decoded (%zu bytes of BSON on average) in %.3fs\n",
+           iterations * CORPUS_SIZE, bytes / CORPUS_SIZE, seconds);
+    printf("%.0f fsentries/s, %.1f ns/fsentry\n",
+           iterations * CORPUS_SIZE / seconds,
+           seconds * 1e9 / (iterations * CORPUS_SIZE));
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+        bson_destroy(corpus[i]);
+
+    return EXIT_SUCCESS;
+}
@@ -15,7 +15,9 @@
 
 #include <sys/stat.h>
 
+#include "robinhood/backend.h"
 #include "robinhood/filter.h"
+#include "robinhood/fsentry.h"
 #include "robinhood/statx.h"
 
 #include "check-compat.h"
@@ -1024,6 +1026,741 @@ START_TEST(rfc_basic)
 }
 END_TEST
 
+/*----------------------------------------------------------------------------*
+ |                            rbh_filter_fields()                             |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rff_basic)
+{
+    const struct rbh_filter NAME_FILTER = {
+        .op = RBH_FOP_REGEX,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .value = {
+                .type = RBH_VT_REGEX,
+                .regex = {
+                    .string = "^a",
+                },
+            },
+        },
+    };
+    const struct rbh_filter SIZE_FILTER = {
+        .op = RBH_FOP_STRICTLY_GREATER,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .value = {
+                .type = RBH_VT_UINT64,
+                .uint64 = 0,
+            },
+        },
+    };
+    const struct rbh_filter *FILTERS[] = {
+        &NAME_FILTER,
+        &SIZE_FILTER,
+    };
+    const struct rbh_filter AND_FILTER = {
+        .op = RBH_FOP_AND,
+        .logical = {
+            .filters = FILTERS,
+            .count = ARRAY_SIZE(FILTERS),
+        },
+    };
+    unsigned int fsentry_mask = RBH_FP_ID;
+    uint32_t statx_mask = 0;
+
+    rbh_filter_fields(NULL, &fsentry_mask, &statx_mask);
+    ck_assert_uint_eq(fsentry_mask, RBH_FP_ID);
+    ck_assert_uint_eq(statx_mask, 0);
+
+    rbh_filter_fields(&AND_FILTER, &fsentry_mask, &statx_mask);
+    ck_assert_uint_eq(fsentry_mask, RBH_FP_ID | RBH_FP_NAME | RBH_FP_STATX);
+    ck_assert_uint_eq(statx_mask, RBH_STATX_SIZE);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                          rbh_filter_matcher_new()                          |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rfmn_bad_regex)
+{
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_REGEX,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .value = {
+                .type = RBH_VT_REGEX,
+                .regex = {
+                    .string = "(",
+                },
+            },
+        },
+    };
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_filter_matcher_new(&FILTER));
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                         rbh_filter_matcher_match()                         |
+ *----------------------------------------------------------------------------*/
+
+static struct rbh_fsentry *
+fsentry_new(const char *name, mode_t mode, uint64_t size,
+            const struct rbh_value_map *inode_xattrs)
+{
+    const struct rbh_statx STATX = {
+        .stx_mask = RBH_STATX_TYPE | RBH_STATX_MODE | RBH_STATX_SIZE,
+        .stx_mode = mode,
+        .stx_size = size,
+    };
+    struct rbh_fsentry *fsentry;
+
+    fsentry = rbh_fsentry_new(NULL, NULL, name, &STATX, NULL, inode_xattrs,
+                              NULL);
+    ck_assert_ptr_nonnull(fsentry);
+    return fsentry;
+}
+
+static int
+match(const struct rbh_filter *filter, const struct rbh_fsentry *fsentry,
+      unsigned int pending)
+{
+    struct rbh_filter_matcher *matcher;
+    int rc;
+
+    matcher = rbh_filter_matcher_new(filter);
+    ck_assert_ptr_nonnull(matcher);
+    rc = rbh_filter_matcher_match(matcher, fsentry, pending);
+    rbh_filter_matcher_destroy(matcher);
+    return rc;
+}
+
+START_TEST(rfmm_null_filter)
+{
+    struct rbh_fsentry *fsentry = fsentry_new("a", S_IFREG, 0, NULL);
+
+    ck_assert_int_eq(match(NULL, fsentry, 0), 1);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_integers)
+{
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_STRICTLY_GREATER,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .value = {
+                .type = RBH_VT_INT32,
+                .int32 = -1,
+            },
+        },
+    };
+    struct rbh_fsentry *fsentry = fsentry_new("a", S_IFREG, 0, NULL);
+
+    /* A uint64 compared to a negative int32 */
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 1);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_regex)
+{
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_REGEX,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .value = {
+                .type = RBH_VT_REGEX,
+                .regex = {
+                    .string = "^a.*\\.c$",
+                    .options = RBH_RO_CASE_INSENSITIVE,
+                },
+            },
+        },
+    };
+    struct rbh_fsentry *fsentry;
+
+    fsentry = fsentry_new("Abc.C", S_IFREG, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 1);
+    free(fsentry);
+
+    fsentry = fsentry_new("abc.h", S_IFREG, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 0);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_in)
+{
+    const struct rbh_value TYPES[] = {
+        {
+            .type = RBH_VT_UINT32,
+            .uint32 = S_IFLNK,
+        },
+        {
+            .type = RBH_VT_UINT32,
+            .uint32 = S_IFDIR,
+        },
+    };
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_IN,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_TYPE,
+            },
+            .value = {
+                .type = RBH_VT_SEQUENCE,
+                .sequence = {
+                    .values = TYPES,
+                    .count = ARRAY_SIZE(TYPES),
+                },
+            },
+        },
+    };
+    struct rbh_fsentry *fsentry;
+
+    fsentry = fsentry_new("a", S_IFDIR | 0755, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 1);
+    free(fsentry);
+
+    fsentry = fsentry_new("a", S_IFREG | 0755, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 0);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_bits)
+{
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_BITS_ALL_SET,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_MODE,
+            },
+            .value = {
+                .type = RBH_VT_UINT32,
+                .uint32 = 0750,
+            },
+        },
+    };
+    struct rbh_fsentry *fsentry;
+
+    fsentry = fsentry_new("a", S_IFREG | 0755, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 1);
+    free(fsentry);
+
+    fsentry = fsentry_new("a", S_IFREG | 0700, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 0);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_missing_xattr)
+{
+    const struct rbh_value ONE = {
+        .type = RBH_VT_INT32,
+        .int32 = 1,
+    };
+    const struct rbh_value_pair PAIR = {
+        .key = "user",
+        .value = &(const struct rbh_value){
+            .type = RBH_VT_MAP,
+            .map = {
+                .pairs = &(const struct rbh_value_pair){
+                    .key = "a",
+                    .value = &ONE,
+                },
+                .count = 1,
+            },
+        },
+    };
+    const struct rbh_value_map XATTRS = {
+        .pairs = &PAIR,
+        .count = 1,
+    };
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_INODE_XATTRS,
+                .xattr = "user.a",
+            },
+            .value = ONE,
+        },
+    };
+    const struct rbh_filter *FILTERS[] = {
+        &FILTER,
+    };
+    const struct rbh_filter NOT_FILTER = {
+        .op = RBH_FOP_NOT,
+        .logical = {
+            .filters = FILTERS,
+            .count = 1,
+        },
+    };
+    struct rbh_fsentry *fsentry;
+
+    /* Dotted keys designate nested maps */
+    fsentry = fsentry_new("a", S_IFREG, 0, &XATTRS);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 1);
+    ck_assert_int_eq(match(&NOT_FILTER, fsentry, 0), 0);
+    free(fsentry);
+
+    /* A missing field never matches, its negation always does */
+    fsentry = fsentry_new("a", S_IFREG, 0, NULL);
+    ck_assert_int_eq(match(&FILTER, fsentry, 0), 0);
+    ck_assert_int_eq(match(&NOT_FILTER, fsentry, 0), 1);
+    free(fsentry);
+}
+END_TEST
+
+START_TEST(rfmm_pending)
+{
+    const struct rbh_filter SIZE_FILTER = {
+        .op = RBH_FOP_GREATER_OR_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .value = {
+                .type = RBH_VT_UINT64,
+                .uint64 = 1024,
+            },
+        },
+    };
+    const struct rbh_filter XATTR_FILTER = {
+        .op = RBH_FOP_EXISTS,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_INODE_XATTRS,
+                .xattr = "user.a",
+            },
+            .value = {
+                .type = RBH_VT_BOOLEAN,
+                .boolean = true,
+            },
+        },
+    };
+    const struct rbh_filter *FILTERS[] = {
+        &SIZE_FILTER,
+        &XATTR_FILTER,
+    };
+    const struct rbh_filter AND_FILTER = {
+        .op = RBH_FOP_AND,
+        .logical = {
+            .filters = FILTERS,
+            .count = ARRAY_SIZE(FILTERS),
+        },
+    };
+    struct rbh_fsentry *fsentry;
+
+    fsentry = fsentry_new("a", S_IFREG, 0, NULL);
+    ck_assert_int_eq(match(&AND_FILTER, fsentry, RBH_FP_INODE_XATTRS), 0);
+    free(fsentry);
+
+    fsentry = fsentry_new("a", S_IFREG, 4096, NULL);
+    errno = 0;
+    ck_assert_int_eq(match(&AND_FILTER, fsentry, RBH_FP_INODE_XATTRS), -1);
+    ck_assert_int_eq(errno, EAGAIN);
+    free(fsentry);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                            rbh_filter_compile()                            |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rfcp_bad_regex)
+{
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_REGEX,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_SYMLINK,
+            },
+            .value = {
+                .type = RBH_VT_REGEX,
+                .regex = {
+                    .string = "[",
+                },
+            },
+        },
+    };
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_filter_compile(&FILTER));
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+static const struct rbh_filter SIZE_FILTER = {
+    .op = RBH_FOP_STRICTLY_GREATER,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_SIZE,
+        },
+        .value = {
+            .type = RBH_VT_INT32,
+            .int32 = 1024,
+        },
+    },
+};
+
+static const struct rbh_filter MTIME_FILTER = {
+    .op = RBH_FOP_LOWER_OR_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_MTIME_SEC,
+        },
+        .value = {
+            .type = RBH_VT_INT64,
+            .int64 = -1,
+        },
+    },
+};
+
+static const struct rbh_value TYPES[] = {
+    {
+        .type = RBH_VT_UINT32,
+        .uint32 = S_IFLNK,
+    },
+    {
+        .type = RBH_VT_STRING,
+        .string = "directory",
+    },
+    {
+        .type = RBH_VT_INT64,
+        .int64 = S_IFDIR,
+    },
+};
+
+static const struct rbh_filter TYPE_FILTER = {
+    .op = RBH_FOP_IN,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_TYPE,
+        },
+        .value = {
+            .type = RBH_VT_SEQUENCE,
+            .sequence = {
+                .values = TYPES,
+                .count = ARRAY_SIZE(TYPES),
+            },
+        },
+    },
+};
+
+static const struct rbh_filter MODE_FILTER = {
+    .op = RBH_FOP_BITS_ANY_CLEAR,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_MODE,
+        },
+        .value = {
+            .type = RBH_VT_UINT64,
+            .uint64 = 0111,
+        },
+    },
+};
+
+static const struct rbh_filter NAME_FILTER = {
+    .op = RBH_FOP_GREATER_OR_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_NAME,
+        },
+        .value = {
+            .type = RBH_VT_STRING,
+            .string = "b",
+        },
+    },
+};
+
+static const struct rbh_value NAMES[] = {
+    {
+        .type = RBH_VT_STRING,
+        .string = "zz",
+    },
+    {
+        .type = RBH_VT_UINT32,
+        .uint32 = 0,
+    },
+    {
+        .type = RBH_VT_STRING,
+        .string = "abc",
+    },
+};
+
+static const struct rbh_filter NAMES_FILTER = {
+    .op = RBH_FOP_IN,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_NAME,
+        },
+        .value = {
+            .type = RBH_VT_SEQUENCE,
+            .sequence = {
+                .values = NAMES,
+                .count = ARRAY_SIZE(NAMES),
+            },
+        },
+    },
+};
+
+static const struct rbh_filter REGEX_FILTER = {
+    .op = RBH_FOP_REGEX,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_NAME,
+        },
+        .value = {
+            .type = RBH_VT_REGEX,
+            .regex = {
+                .string = "^A",
+                .options = RBH_RO_CASE_INSENSITIVE,
+            },
+        },
+    },
+};
+
+static const struct rbh_filter SYMLINK_FILTER = {
+    .op = RBH_FOP_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_SYMLINK,
+        },
+        .value = {
+            .type = RBH_VT_STRING,
+            .string = "target",
+        },
+    },
+};
+
+static const struct rbh_filter XATTR_FILTER = {
+    .op = RBH_FOP_EXISTS,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_INODE_XATTRS,
+            .xattr = "user.a",
+        },
+        .value = {
+            .type = RBH_VT_BOOLEAN,
+            .boolean = true,
+        },
+    },
+};
+
+static const struct rbh_filter *AND_FILTERS[] = {
+    &XATTR_FILTER,
+    &REGEX_FILTER,
+    NULL,
+    &SIZE_FILTER,
+};
+
+static const struct rbh_filter *OR_FILTERS[] = {
+    &SYMLINK_FILTER,
+    &NAMES_FILTER,
+    &TYPE_FILTER,
+};
+
+static const struct rbh_filter *NOT_FILTERS[] = {
+    &XATTR_FILTER,
+};
+
+static const struct rbh_filter COMPILED_FILTERS[] = {
+    SIZE_FILTER,
+    MTIME_FILTER,
+    TYPE_FILTER,
+    MODE_FILTER,
+    NAME_FILTER,
+    NAMES_FILTER,
+    REGEX_FILTER,
+    SYMLINK_FILTER,
+    XATTR_FILTER,
+    {
+        .op = RBH_FOP_AND,
+        .logical = {
+            .filters = AND_FILTERS,
+            .count = ARRAY_SIZE(AND_FILTERS),
+        },
+    },
+    {
+        .op = RBH_FOP_OR,
+        .logical = {
+            .filters = OR_FILTERS,
+            .count = ARRAY_SIZE(OR_FILTERS),
+        },
+    },
+    {
+        .op = RBH_FOP_NOT,
+        .logical = {
+            .filters = NOT_FILTERS,
+            .count = ARRAY_SIZE(NOT_FILTERS),
+        },
+    },
+};
+
+START_TEST(rfcp_same_as_matcher)
+{
+    const struct rbh_value_pair PAIR = {
+        .key = "user.a",
+        .value = &(const struct rbh_value){
+            .type = RBH_VT_STRING,
+            .string = "a",
+        },
+    };
+    const struct rbh_value_map XATTRS = {
+        .pairs = &PAIR,
+        .count = 1,
+    };
+    const char *ENTRY_NAMES[] = { "abc", "Abc", "b", "zz" };
+    const mode_t MODES[] = { S_IFREG | 0644, S_IFDIR | 0755, S_IFLNK | 0777 };
+    const uint64_t SIZES[] = { 0, 4096 };
+    const int64_t MTIMES[] = { -5, 100 };
+    const unsigned int PENDING[] = {
+        0,
+        RBH_FP_INODE_XATTRS,
+        RBH_FP_SYMLINK | RBH_FP_INODE_XATTRS,
+        RBH_FP_NAME | RBH_FP_STATX,
+    };
+    const struct rbh_filter *filter = &COMPILED_FILTERS[_i];
+    struct rbh_filter_matcher *matcher;
+    struct rbh_filter_program *program;
+
+    matcher = rbh_filter_matcher_new(filter);
+    ck_assert_ptr_nonnull(matcher);
+    program = rbh_filter_compile(filter);
+    ck_assert_ptr_nonnull(program);
+
+    for (size_t i = 0; i < ARRAY_SIZE(ENTRY_NAMES) * ARRAY_SIZE(MODES)
+                           * ARRAY_SIZE(SIZES) * ARRAY_SIZE(MTIMES) * 2; i++) {
+        const char *name = ENTRY_NAMES[i % ARRAY_SIZE(ENTRY_NAMES)];
+        size_t index = i / ARRAY_SIZE(ENTRY_NAMES);
+        struct rbh_statx statxbuf = {
+            .stx_mask = RBH_STATX_TYPE | RBH_STATX_MODE | RBH_STATX_SIZE
+                      | RBH_STATX_MTIME_SEC,
+        };
+        struct rbh_fsentry *fsentry;
+        bool has_xattrs;
+
+        statxbuf.stx_mode = MODES[index % ARRAY_SIZE(MODES)];
+        index /= ARRAY_SIZE(MODES);
+        statxbuf.stx_size = SIZES[index % ARRAY_SIZE(SIZES)];
+        index /= ARRAY_SIZE(SIZES);
+        statxbuf.stx_mtime.tv_sec = MTIMES[index % ARRAY_SIZE(MTIMES)];
+        index /= ARRAY_SIZE(MTIMES);
+        has_xattrs = index % 2;
+
+        fsentry = rbh_fsentry_new(NULL, NULL, name, &statxbuf, NULL,
+                                  has_xattrs ? &XATTRS : NULL,
+                                  S_ISLNK(statxbuf.stx_mode) ? "target" : NULL);
+        ck_assert_ptr_nonnull(fsentry);
+
+        for (size_t j = 0; j < ARRAY_SIZE(PENDING); j++) {
+            int expected;
+
+            expected = rbh_filter_matcher_match(matcher, fsentry, PENDING[j]);
+            ck_assert_int_eq(
+                    rbh_filter_program_match(program, fsentry, PENDING[j]),
+                    expected
+                    );
+            if (expected == -1)
+                ck_assert_int_eq(errno, EAGAIN);
+        }
+        free(fsentry);
+    }
+
+    rbh_filter_program_destroy(program);
+    rbh_filter_matcher_destroy(matcher);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_fsentry_compare()                            |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rfsc_basic)
+{
+    const struct rbh_value ONE = {
+        .type = RBH_VT_INT32,
+        .int32 = 1,
+    };
+    const struct rbh_value_map XATTRS = {
+        .pairs = &(const struct rbh_value_pair){
+            .key = "user.a",
+            .value = &ONE,
+        },
+        .count = 1,
+    };
+    const struct rbh_filter_sort BY_SIZE[] = {
+        {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .ascending = true,
+        },
+        {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .ascending = false,
+        },
+    };
+    const struct rbh_filter_sort BY_XATTR = {
+        .field = {
+            .fsentry = RBH_FP_INODE_XATTRS,
+            .xattr = "user.a",
+        },
+        .ascending = true,
+    };
+    struct rbh_fsentry *a, *b, *c;
+
+    a = fsentry_new("a", S_IFREG, 2, NULL);
+    b = fsentry_new("b", S_IFREG, 1, &XATTRS);
+    c = fsentry_new("c", S_IFREG, 1, NULL);
+
+    ck_assert_int_eq(rbh_fsentry_compare(a, a, BY_SIZE, 2), 0);
+    ck_assert_int_gt(rbh_fsentry_compare(a, b, BY_SIZE, 2), 0);
+    ck_assert_int_lt(rbh_fsentry_compare(b, a, BY_SIZE, 2), 0);
+    /* Ties are broken by the next sorting option */
+    ck_assert_int_gt(rbh_fsentry_compare(b, c, BY_SIZE, 2), 0);
+    ck_assert_int_eq(rbh_fsentry_compare(b, c, BY_SIZE, 1), 0);
+    ck_assert_int_eq(rbh_fsentry_compare(a, b, BY_SIZE, 0), 0);
+
+    /* Missing fields sort first */
+    ck_assert_int_lt(rbh_fsentry_compare(a, b, &BY_XATTR, 1), 0);
+    ck_assert_int_eq(rbh_fsentry_compare(a, c, &BY_XATTR, 1), 0);
+
+    free(c);
+    free(b);
+    free(a);
+}
+END_TEST
+
 static Suite *
 unit_suite(void)
 {
@@ -1081,6 +1818,39 @@ unit_suite(void)
 
     suite_add_tcase(suite, tests);
 
+    tests = tcase_create("rbh_filter_fields");
+    tcase_add_test(tests, rff_basic);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_filter_matcher_new");
+    tcase_add_test(tests, rfmn_bad_regex);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_filter_matcher_match");
+    tcase_add_test(tests, rfmm_null_filter);
+    tcase_add_test(tests, rfmm_integers);
+    tcase_add_test(tests, rfmm_regex);
+    tcase_add_test(tests, rfmm_in);
+    tcase_add_test(tests, rfmm_bits);
+    tcase_add_test(tests, rfmm_missing_xattr);
+    tcase_add_test(tests, rfmm_pending);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_filter_compile");
+    tcase_add_test(tests, rfcp_bad_regex);
+    tcase_add_loop_test(tests, rfcp_same_as_matcher, 0,
+                        ARRAY_SIZE(COMPILED_FILTERS));
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_fsentry_compare");
+    tcase_add_test(tests, rfsc_basic);
+
+    suite_add_tcase(suite, tests);
+
     return suite;
 }
 
@@ -15,6 +15,7 @@
 #include <sys/stat.h>
 
 #include "robinhood/fsevent.h"
+#include "robinhood/itertools.h"
 #include "robinhood/statx.h"
 
 #include "check-compat.h"
@@ -687,6 +688,259 @@ START_TEST(rfnxn_null_name)
 }
 END_TEST
 
+/*----------------------------------------------------------------------------*
+ |                           rbh_fsevent_coalesce()                           |
+ *----------------------------------------------------------------------------*/
+
+static const struct rbh_id ID_A = {
+    .data = "abcdefg",
+    .size = 8,
+};
+
+static const struct rbh_id ID_B = {
+    .data = "hijklmn",
+    .size = 8,
+};
+
+static struct rbh_iterator *
+coalesce_array(const struct rbh_fsevent *fsevents, size_t count,
+               size_t *merged)
+{
+    struct rbh_iterator *array;
+    struct rbh_iterator *coalesce;
+
+    array = rbh_iter_array(fsevents, sizeof(*fsevents), count);
+    ck_assert_ptr_nonnull(array);
+
+    coalesce = rbh_fsevent_coalesce(array, merged);
+    ck_assert_ptr_nonnull(coalesce);
+    return coalesce;
+}
+
+static void
+ck_assert_coalesce_exhausted(struct rbh_iterator *coalesce)
+{
+    errno = 0;
+    ck_assert_ptr_null(rbh_iter_next(coalesce));
+    ck_assert_int_eq(errno, ENODATA);
+}
+
+START_TEST(rfc_upserts)
+{
+    const struct rbh_statx UID = {
+        .stx_mask = RBH_STATX_UID,
+        .stx_uid = 1,
+    };
+    const struct rbh_statx SIZE = {
+        .stx_mask = RBH_STATX_SIZE | RBH_STATX_UID,
+        .stx_uid = 2,
+        .stx_size = 3,
+    };
+    const struct rbh_value VALUE = {
+        .type = RBH_VT_STRING,
+        .string = "opqrstu",
+    };
+    const struct rbh_value_pair PAIR = {
+        .key = "vwxyzab",
+        .value = &VALUE,
+    };
+    const struct rbh_fsevent FSEVENTS[] = {
+        {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+            .upsert.statx = &UID,
+        }, {
+            .type = RBH_FET_XATTR,
+            .id = ID_A,
+            .xattrs = {
+                .pairs = &PAIR,
+                .count = 1,
+            },
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+            .upsert = {
+                .statx = &SIZE,
+                .symlink = "cdefghi",
+            },
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_B,
+        },
+    };
+    const struct rbh_fsevent *fsevent;
+    struct rbh_iterator *coalesce;
+    size_t merged = 0;
+
+    coalesce = coalesce_array(FSEVENTS, 4, &merged);
+
+    fsevent = rbh_iter_next(coalesce);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_int_eq(fsevent->type, RBH_FET_UPSERT);
+    ck_assert_id_eq(&fsevent->id, &ID_A);
+    ck_assert_value_map_eq(&fsevent->xattrs, &FSEVENTS[1].xattrs);
+    ck_assert_ptr_nonnull(fsevent->upsert.statx);
+    ck_assert_uint_eq(fsevent->upsert.statx->stx_mask,
+                      RBH_STATX_UID | RBH_STATX_SIZE);
+    ck_assert_uint_eq(fsevent->upsert.statx->stx_uid, 2);
+    ck_assert_uint_eq(fsevent->upsert.statx->stx_size, 3);
+    ck_assert_pstr_eq(fsevent->upsert.symlink, "cdefghi");
+
+    fsevent = rbh_iter_next(coalesce);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_fsevent_eq(fsevent, &FSEVENTS[3]);
+
+    ck_assert_coalesce_exhausted(coalesce);
+    ck_assert_uint_eq(merged, 2);
+
+    rbh_iter_destroy(coalesce);
+}
+END_TEST
+
+START_TEST(rfc_xattrs)
+{
+    const struct rbh_value VALUE = {
+        .type = RBH_VT_STRING,
+        .string = "opqrstu",
+    };
+    const struct rbh_value_pair FIRST[] = {
+        { .key = "a", .value = &VALUE },
+        { .key = "b", .value = &VALUE },
+    };
+    const struct rbh_value_pair SECOND[] = {
+        { .key = "a", .value = NULL },
+    };
+    const struct rbh_value_pair MERGED[] = {
+        { .key = "b", .value = &VALUE },
+        { .key = "a", .value = NULL },
+    };
+    const struct rbh_fsevent FSEVENTS[] = {
+        {
+            .type = RBH_FET_XATTR,
+            .id = ID_A,
+            .xattrs = {
+                .pairs = FIRST,
+                .count = 2,
+            },
+        }, {
+            .type = RBH_FET_XATTR,
+            .id = ID_A,
+            .xattrs = {
+                .pairs = SECOND,
+                .count = 1,
+            },
+        },
+    };
+    const struct rbh_fsevent EXPECTED = {
+        .type = RBH_FET_XATTR,
+        .id = ID_A,
+        .xattrs = {
+            .pairs = MERGED,
+            .count = 2,
+        },
+    };
+    const struct rbh_fsevent *fsevent;
+    struct rbh_iterator *coalesce;
+    size_t merged = 0;
+
+    coalesce = coalesce_array(FSEVENTS, 2, &merged);
+
+    fsevent = rbh_iter_next(coalesce);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_fsevent_eq(fsevent, &EXPECTED);
+
+    ck_assert_coalesce_exhausted(coalesce);
+    ck_assert_uint_eq(merged, 1);
+
+    rbh_iter_destroy(coalesce);
+}
+END_TEST
+
+START_TEST(rfc_delete)
+{
+    const struct rbh_fsevent FSEVENTS[] = {
+        {
+            .type = RBH_FET_LINK,
+            .id = ID_A,
+            .link = {
+                .parent_id = &ID_B,
+                .name = "opqrstu",
+            },
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+        }, {
+            .type = RBH_FET_DELETE,
+            .id = ID_A,
+        }, {
+            .type = RBH_FET_DELETE,
+            .id = ID_B,
+        },
+    };
+    const struct rbh_fsevent *fsevent;
+    struct rbh_iterator *coalesce;
+    size_t merged = 0;
+
+    coalesce = coalesce_array(FSEVENTS, 4, &merged);
+
+    fsevent = rbh_iter_next(coalesce);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_fsevent_eq(fsevent, &FSEVENTS[2]);
+
+    fsevent = rbh_iter_next(coalesce);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_fsevent_eq(fsevent, &FSEVENTS[3]);
+
+    ck_assert_coalesce_exhausted(coalesce);
+    ck_assert_uint_eq(merged, 2);
+
+    rbh_iter_destroy(coalesce);
+}
+END_TEST
+
+START_TEST(rfc_ordered)
+{
+    const struct rbh_fsevent FSEVENTS[] = {
+        {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+        }, {
+            .type = RBH_FET_LINK,
+            .id = ID_A,
+            .link = {
+                .parent_id = &ID_B,
+                .name = "opqrstu",
+            },
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_B,
+        }, {
+            .type = RBH_FET_UPSERT,
+            .id = ID_A,
+        },
+    };
+    struct rbh_iterator *coalesce;
+    size_t merged = 0;
+
+    coalesce = coalesce_array(FSEVENTS, 5, &merged);
+
+    for (size_t i = 0; i < 5; i++) {
+        const struct rbh_fsevent *fsevent = rbh_iter_next(coalesce);
+
+        ck_assert_ptr_nonnull(fsevent);
+        ck_assert_fsevent_eq(fsevent, &FSEVENTS[i]);
+    }
+
+    ck_assert_coalesce_exhausted(coalesce);
+    ck_assert_uint_eq(merged, 0);
+
+    rbh_iter_destroy(coalesce);
+}
+END_TEST
+
 static Suite *
 unit_suite(void)
 {
@@ -739,6 +993,14 @@ unit_suite(void)
 
     suite_add_tcase(suite, tests);
 
+    tests = tcase_create("rbh_fsevent_coalesce()");
+    tcase_add_test(tests, rfc_upserts);
+    tcase_add_test(tests, rfc_xattrs);
+    tcase_add_test(tests, rfc_delete);
+    tcase_add_test(tests, rfc_ordered);
+
+    suite_add_tcase(suite, tests);
+
     return suite;
 }
 
@@ -301,6 +301,76 @@ START_TEST(rir_basic)
 }
 END_TEST
 
+/*----------------------------------------------------------------------------*
+ |                          rbh_mut_iter_prefetch()                           |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rimp_basic)
+{
+    char STRING[] = "abcdefghijklmno";
+    struct rbh_mut_iterator *iter;
+    struct rbh_mut_iterator *array;
+
+    array = rbh_mut_iter_array(STRING, sizeof(*STRING), sizeof(STRING));
+    ck_assert_ptr_nonnull(array);
+
+    iter = rbh_mut_iter_prefetch(array, 4);
+    ck_assert_ptr_nonnull(iter);
+
+    for (size_t i = 0; i < sizeof(STRING); i++)
+        ck_assert_ptr_eq(rbh_mut_iter_next(iter), &STRING[i]);
+
+    for (size_t i = 0; i < 2; i++) {
+        errno = 0;
+        ck_assert_ptr_null(rbh_mut_iter_next(iter));
+        ck_assert_int_eq(errno, ENODATA);
+    }
+
+    rbh_mut_iter_destroy(iter);
+}
+END_TEST
+
+/* We have to rely on libasan to test that memory is properly deallocated */
+START_TEST(rimp_destroy_early)
+{
+    const char STRING[] = "abcdefghijklmno";
+    struct ascii_iterator _ascii;
+    struct rbh_mut_iterator *iter;
+
+    _ascii.iterator = ASCII_ITERATOR;
+    _ascii.c = 'a';
+
+    /* The ascii iterator is never exhausted */
+    iter = rbh_mut_iter_prefetch(&_ascii.iterator, 1);
+    ck_assert_ptr_nonnull(iter);
+
+    for (size_t i = 0; i < sizeof(STRING) - 1; i++) {
+        char *c = rbh_mut_iter_next(iter);
+
+        ck_assert_ptr_nonnull(c);
+        ck_assert_int_eq(*c, STRING[i]);
+        free(c);
+    }
+
+    rbh_mut_iter_destroy(iter);
+}
+END_TEST
+
+START_TEST(rimp_zero)
+{
+    struct rbh_mut_iterator *array;
+
+    array = rbh_mut_iter_array(NULL, 0, 0);
+    ck_assert_ptr_nonnull(array);
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_mut_iter_prefetch(array, 0));
+    ck_assert_int_eq(errno, EINVAL);
+
+    rbh_mut_iter_destroy(array);
+}
+END_TEST
+
 static Suite *
 unit_suite(void)
 {
@@ -339,6 +409,13 @@ unit_suite(void)
 
     suite_add_tcase(suite, tests);
 
+    tests = tcase_create("rbh_mut_iter_prefetch()");
+    tcase_add_test(tests, rimp_basic);
+    tcase_add_test(tests, rimp_destroy_early);
+    tcase_add_test(tests, rimp_zero);
+
+    suite_add_tcase(suite, tests);
+
     return suite;
 }
 
@@ -0,0 +1,432 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lustre/lustreapi.h>
+#include <lustre/lustre_user.h>
+
+#include "check-compat.h"
+#include "robinhood/backends/lustre.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/id.h"
+#include "robinhood/statx.h"
+
+#include "check_macros.h"
+
+/*----------------------------------------------------------------------------*
+ |                                  helpers                                   |
+ *----------------------------------------------------------------------------*/
+
+#define ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
+
+static const struct lu_fid ROOT = { .f_seq = 0x200000007, .f_oid = 1 };
+static const struct lu_fid DIR_A = { .f_seq = 0x200000400, .f_oid = 1 };
+static const struct lu_fid DIR_B = { .f_seq = 0x200000400, .f_oid = 2 };
+static const struct lu_fid FILE_A = { .f_seq = 0x200000400, .f_oid = 3 };
+static const struct lu_fid FILE_B = { .f_seq = 0x200000400, .f_oid = 4 };
+
+struct record {
+    enum changelog_rec_type type;
+    uint16_t flags;
+    uint64_t index;
+    struct lu_fid tfid;
+    struct lu_fid pfid;
+    const char *name;
+    /* CL_RENAME */
+    struct lu_fid sfid;
+    struct lu_fid spfid;
+    const char *sname;
+    /* CL_SETXATTR */
+    const char *xattr;
+};
+
+/* Serialize records the way llapi_changelog_recv() returns them */
+static size_t
+dump_records(const struct record *records, size_t count, char *dump)
+{
+    size_t offset = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct record *record = &records[i];
+        struct changelog_ext_extra_flags extra_flags = {
+            .cr_extra_flags = record->xattr ? CLFE_XATTR : CLFE_INVALID,
+        };
+        struct changelog_rec header = {
+            .cr_flags = record->flags | CLF_VERSION | CLF_JOBID
+                      | CLF_EXTRA_FLAGS,
+            .cr_type = record->type,
+            .cr_index = record->index,
+            .cr_tfid = record->tfid,
+            .cr_pfid = record->pfid,
+        };
+        size_t namelen = record->name ? strlen(record->name) : 0;
+        char *name;
+
+        if (record->sname) {
+            header.cr_flags |= CLF_RENAME;
+            namelen += 1 + strlen(record->sname);
+        }
+        header.cr_namelen = namelen;
+
+        memset(dump + offset, 0,
+               changelog_rec_offset(header.cr_flags,
+                                    extra_flags.cr_extra_flags) + namelen);
+        memcpy(dump + offset, &header, sizeof(header));
+        if (record->sname) {
+            struct changelog_ext_rename rename = {
+                .cr_sfid = record->sfid,
+                .cr_spfid = record->spfid,
+            };
+
+            memcpy(dump + offset + sizeof(header), &rename, sizeof(rename));
+        }
+        memcpy(dump + offset
+                    + changelog_rec_offset(header.cr_flags & ~CLF_EXTRA_FLAGS,
+                                           CLFE_INVALID),
+               &extra_flags, sizeof(extra_flags));
+        if (record->xattr)
+            strcpy(dump + offset
+                        + changelog_rec_offset(header.cr_flags, CLFE_INVALID),
+                   record->xattr);
+
+        /* Records are not aligned, do not use changelog_rec_name() */
+        name = dump + offset
+             + changelog_rec_offset(header.cr_flags,
+                                    extra_flags.cr_extra_flags);
+        if (record->name)
+            memcpy(name, record->name, strlen(record->name));
+        if (record->sname)
+            memcpy(name + strlen(record->name) + 1, record->sname,
+                   strlen(record->sname));
+
+        offset += changelog_rec_offset(header.cr_flags,
+                                       extra_flags.cr_extra_flags) + namelen;
+    }
+
+    return offset;
+}
+
+struct expected {
+    enum rbh_fsevent_type type;
+    const struct lu_fid *fid;
+    /* RBH_FET_LINK, RBH_FET_UNLINK */
+    const struct lu_fid *parent_fid;
+    const char *name;
+    /* The first enrichment hint, NULL if there is none */
+    const char *hint;
+    /* The value of the "statx" hint */
+    uint32_t statx;
+};
+
+static void
+ck_assert_fsevent_expected(const struct rbh_fsevent *fsevent,
+                           const struct expected *expected)
+{
+    const struct rbh_value_pair *pair;
+    struct rbh_id *id;
+
+    ck_assert_int_eq(fsevent->type, expected->type);
+
+    id = rbh_id_from_lu_fid(expected->fid);
+    ck_assert_ptr_nonnull(id);
+    ck_assert_id_eq(&fsevent->id, id);
+    free(id);
+
+    if (expected->parent_fid) {
+        id = rbh_id_from_lu_fid(expected->parent_fid);
+        ck_assert_ptr_nonnull(id);
+        ck_assert_id_eq(fsevent->link.parent_id, id);
+        ck_assert_str_eq(fsevent->link.name, expected->name);
+        free(id);
+    }
+
+    if (expected->hint == NULL) {
+        ck_assert_uint_eq(fsevent->xattrs.count, 0);
+        return;
+    }
+
+    ck_assert_uint_eq(fsevent->xattrs.count, 1);
+    ck_assert_str_eq(fsevent->xattrs.pairs[0].key, RBH_LUSTRE_ENRICH);
+    ck_assert_int_eq(fsevent->xattrs.pairs[0].value->type, RBH_VT_MAP);
+    ck_assert_uint_ge(fsevent->xattrs.pairs[0].value->map.count, 1);
+
+    pair = &fsevent->xattrs.pairs[0].value->map.pairs[0];
+    ck_assert_str_eq(pair->key, expected->hint);
+    if (strcmp(expected->hint, "statx") == 0) {
+        ck_assert_int_eq(pair->value->type, RBH_VT_UINT32);
+        ck_assert_uint_eq(pair->value->uint32, expected->statx);
+    }
+}
+
+static char dump[1 << 14] __attribute__((aligned(8)));
+
+static void
+ck_assert_changelog_yields(const struct record *records, size_t count,
+                           size_t batch_size, const struct expected *expected,
+                           size_t expected_count)
+{
+    struct rbh_iterator *fsevents;
+    uint64_t consumed = 0;
+    size_t size;
+
+    size = dump_records(records, count, dump);
+    fsevents = lustre_changelog_fsevents(
+            lustre_changelog_dump_records(dump, size), batch_size, &consumed
+            );
+    ck_assert_ptr_nonnull(fsevents);
+
+    for (size_t i = 0; i < expected_count; i++) {
+        const struct rbh_fsevent *fsevent = rbh_iter_next(fsevents);
+
+        ck_assert_ptr_nonnull(fsevent);
+        ck_assert_fsevent_expected(fsevent, &expected[i]);
+    }
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_iter_next(fsevents));
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(consumed, count ? records[count - 1].index : 0);
+
+    rbh_iter_destroy(fsevents);
+}
+
+#define DIRECTORY_STATX (RBH_STATX_MTIME | RBH_STATX_CTIME | RBH_STATX_NLINK)
+#define DATA_STATX (RBH_STATX_MTIME | RBH_STATX_CTIME | RBH_STATX_SIZE \
+                  | RBH_STATX_BLOCKS)
+
+/*----------------------------------------------------------------------------*
+ |                        lustre_changelog_fsevents()                         |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(lcf_create)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_CREATE, .index = 1, .tfid = FILE_A, .pfid = ROOT,
+          .name = "file" },
+    };
+    const struct expected EXPECTED[] = {
+        { RBH_FET_LINK, &FILE_A, &ROOT, "file", "path" },
+        { RBH_FET_UPSERT, &FILE_A, .hint = "statx",
+          .statx = RBH_STATX_ALL },
+        { RBH_FET_UPSERT, &ROOT, .hint = "statx", .statx = DIRECTORY_STATX },
+        { RBH_FET_XATTR, &FILE_A, .hint = "lustre" },
+    };
+
+    ck_assert_changelog_yields(RECORDS, ARRAY_SIZE(RECORDS), 16, EXPECTED,
+                               ARRAY_SIZE(EXPECTED));
+}
+END_TEST
+
+START_TEST(lcf_unlink)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_UNLINK, .index = 1, .tfid = FILE_A, .pfid = ROOT,
+          .name = "link" },
+        { .type = CL_UNLINK, .index = 2, .flags = CLF_UNLINK_LAST,
+          .tfid = FILE_A, .pfid = DIR_A, .name = "file" },
+    };
+    const struct expected EXPECTED[] = {
+        { RBH_FET_UNLINK, &FILE_A, &ROOT, "link" },
+        { RBH_FET_UPSERT, &ROOT, .hint = "statx", .statx = DIRECTORY_STATX },
+        { RBH_FET_UNLINK, &FILE_A, &DIR_A, "file" },
+        { RBH_FET_DELETE, &FILE_A },
+        { RBH_FET_UPSERT, &DIR_A, .hint = "statx", .statx = DIRECTORY_STATX },
+    };
+
+    ck_assert_changelog_yields(RECORDS, ARRAY_SIZE(RECORDS), 16, EXPECTED,
+                               ARRAY_SIZE(EXPECTED));
+}
+END_TEST
+
+START_TEST(lcf_rename)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_RENAME, .index = 1, .flags = CLF_RENAME_LAST,
+          .tfid = FILE_B, .pfid = DIR_B, .name = "target",
+          .sfid = FILE_A, .spfid = DIR_A, .sname = "source" },
+    };
+    const struct expected EXPECTED[] = {
+        { RBH_FET_UNLINK, &FILE_B, &DIR_B, "target" },
+        { RBH_FET_DELETE, &FILE_B },
+        { RBH_FET_UNLINK, &FILE_A, &DIR_A, "source" },
+        { RBH_FET_LINK, &FILE_A, &DIR_B, "target", "path" },
+        { RBH_FET_UPSERT, &FILE_A, .hint = "statx",
+          .statx = RBH_STATX_CTIME },
+        { RBH_FET_UPSERT, &DIR_A, .hint = "statx", .statx = DIRECTORY_STATX },
+        { RBH_FET_UPSERT, &DIR_B, .hint = "statx", .statx = DIRECTORY_STATX },
+    };
+
+    ck_assert_changelog_yields(RECORDS, ARRAY_SIZE(RECORDS), 16, EXPECTED,
+                               ARRAY_SIZE(EXPECTED));
+}
+END_TEST
+
+START_TEST(lcf_merge)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_MTIME, .index = 1, .tfid = FILE_A },
+        { .type = CL_SETXATTR, .index = 2, .tfid = FILE_A,
+          .xattr = "user.a" },
+        { .type = CL_ATIME, .index = 3, .tfid = FILE_A },
+        { .type = CL_SETXATTR, .index = 4, .tfid = FILE_A,
+          .xattr = "user.a" },
+        { .type = CL_MARK, .index = 5 },
+    };
+    const struct expected EXPECTED[] = {
+        { RBH_FET_UPSERT, &FILE_A, .hint = "statx",
+          .statx = DATA_STATX | RBH_STATX_ATIME },
+        { RBH_FET_XATTR, &FILE_A, .hint = "xattrs" },
+    };
+
+    ck_assert_changelog_yields(RECORDS, ARRAY_SIZE(RECORDS), 16, EXPECTED,
+                               ARRAY_SIZE(EXPECTED));
+}
+END_TEST
+
+START_TEST(lcf_delete)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_CREATE, .index = 1, .tfid = FILE_A, .pfid = ROOT,
+          .name = "file" },
+        { .type = CL_CLOSE, .index = 2, .tfid = FILE_A },
+        { .type = CL_UNLINK, .index = 3, .flags = CLF_UNLINK_LAST,
+          .tfid = FILE_A, .pfid = ROOT, .name = "file" },
+    };
+    const struct expected EXPECTED[] = {
+        { RBH_FET_LINK, &FILE_A, &ROOT, "file", "path" },
+        { RBH_FET_UPSERT, &ROOT, .hint = "statx", .statx = DIRECTORY_STATX },
+        { RBH_FET_UNLINK, &FILE_A, &ROOT, "file" },
+        { RBH_FET_DELETE, &FILE_A },
+    };
+
+    ck_assert_changelog_yields(RECORDS, ARRAY_SIZE(RECORDS), 16, EXPECTED,
+                               ARRAY_SIZE(EXPECTED));
+}
+END_TEST
+
+START_TEST(lcf_batches)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_MTIME, .index = 7, .tfid = FILE_A },
+        { .type = CL_CTIME, .index = 8, .tfid = FILE_A },
+    };
+    const struct rbh_fsevent *fsevent;
+    struct rbh_iterator *fsevents;
+    uint64_t consumed = 0;
+    size_t size;
+
+    size = dump_records(RECORDS, ARRAY_SIZE(RECORDS), dump);
+    fsevents = lustre_changelog_fsevents(
+            lustre_changelog_dump_records(dump, size), 1, &consumed
+            );
+    ck_assert_ptr_nonnull(fsevents);
+
+    /* Records of different batches are not merged */
+    fsevent = rbh_iter_next(fsevents);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_int_eq(fsevent->type, RBH_FET_UPSERT);
+    ck_assert_uint_eq(consumed, 6);
+
+    fsevent = rbh_iter_next(fsevents);
+    ck_assert_ptr_nonnull(fsevent);
+    ck_assert_int_eq(fsevent->type, RBH_FET_UPSERT);
+    ck_assert_uint_eq(consumed, 7);
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_iter_next(fsevents));
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(consumed, 8);
+
+    rbh_iter_destroy(fsevents);
+}
+END_TEST
+
+START_TEST(lcf_truncated)
+{
+    const struct record RECORDS[] = {
+        { .type = CL_CREATE, .index = 1, .tfid = FILE_A, .pfid = ROOT,
+          .name = "file" },
+    };
+    struct rbh_iterator *fsevents;
+    size_t size;
+
+    size = dump_records(RECORDS, ARRAY_SIZE(RECORDS), dump);
+    fsevents = lustre_changelog_fsevents(
+            lustre_changelog_dump_records(dump, size - 1), 16, NULL
+            );
+    ck_assert_ptr_nonnull(fsevents);
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_iter_next(fsevents));
+    ck_assert_int_eq(errno, EINVAL);
+
+    rbh_iter_destroy(fsevents);
+}
+END_TEST
+
+START_TEST(lcf_einval)
+{
+    struct rbh_iterator *records;
+
+    records = lustre_changelog_dump_records(dump, 0);
+    ck_assert_ptr_nonnull(records);
+
+    errno = 0;
+    ck_assert_ptr_null(lustre_changelog_fsevents(records, 0, NULL));
+    ck_assert_int_eq(errno, EINVAL);
+
+    rbh_iter_destroy(records);
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("lustre changelog");
+    tests = tcase_create("lustre_changelog_fsevents()");
+    tcase_add_test(tests, lcf_create);
+    tcase_add_test(tests, lcf_unlink);
+    tcase_add_test(tests, lcf_rename);
+    tcase_add_test(tests, lcf_merge);
+    tcase_add_test(tests, lcf_delete);
+    tcase_add_test(tests, lcf_batches);
+    tcase_add_test(tests, lcf_truncated);
+    tcase_add_test(tests, lcf_einval);
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
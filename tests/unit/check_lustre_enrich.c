@@ -0,0 +1,449 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check-compat.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/backends/posix.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/itertools.h"
+#include "robinhood/statx.h"
+
+/*----------------------------------------------------------------------------*
+ |                     fixtures to run tests in isolation                     |
+ *----------------------------------------------------------------------------*/
+
+static const char TMPDIR[] = "/tmp/tmp.d.XXXXXX";
+static __thread char tmpdir[sizeof(TMPDIR)];
+
+static void
+unchecked_setup_tmpdir(void)
+{
+    memcpy(tmpdir, TMPDIR, sizeof(tmpdir));
+    ck_assert_ptr_nonnull(mkdtemp(tmpdir));
+    ck_assert_int_eq(chdir(tmpdir), 0);
+}
+
+static int
+delete(const char *fpath, const struct stat *sb, int typeflags,
+       struct FTW * ftwbuf)
+{
+    ck_assert_int_eq(remove(fpath), 0);
+    return 0;
+}
+
+#ifndef NOPENFD
+#define NOPENFD (16)
+#endif
+
+static void
+unchecked_teardown_tmpdir(void)
+{
+    ck_assert_int_eq(
+            nftw(tmpdir, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  helpers                                   |
+ *----------------------------------------------------------------------------*/
+
+/* A file of that size fails to be enriched */
+#define FAULTY_SIZE 13
+
+/* Stands for the "lustre" attribute: the size of regular files */
+static int
+fake_get_attribute(void *backend, const char *attr_name, void *_arg,
+                   struct rbh_value_pair *pairs)
+{
+    struct lustre_attribute_arg *arg = _arg;
+    struct rbh_value value = {
+        .type = RBH_VT_UINT64,
+    };
+    struct stat statbuf;
+
+    ck_assert_str_eq(attr_name, "lustre");
+
+    if (!S_ISREG(arg->mode))
+        return 0;
+
+    if (fstat(arg->fd, &statbuf))
+        return -1;
+
+    if (statbuf.st_size == FAULTY_SIZE) {
+        errno = EIO;
+        return -1;
+    }
+
+    value.uint64 = statbuf.st_size;
+    pairs[0].key = "size";
+    pairs[0].value = rbh_sstack_push(arg->values, &value, sizeof(value));
+    if (pairs[0].value == NULL)
+        return -1;
+
+    return 1;
+}
+
+static const struct rbh_backend_operations FAKE_BACKEND_OPS = {
+    .get_attribute = fake_get_attribute,
+};
+
+static struct rbh_backend FAKE_BACKEND = {
+    .name = "fake",
+    .ops = &FAKE_BACKEND_OPS,
+};
+
+static void
+make_file(const char *path, size_t size)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(ftruncate(fd, size), 0);
+    ck_assert_int_eq(close(fd), 0);
+}
+
+/* tree/
+ * |-- d/
+ * |   |-- f (3 bytes)
+ * |   `-- l -> f
+ * `-- g (5 bytes)
+ */
+static void
+make_tree(const char *root)
+{
+    ck_assert_int_eq(mkdir(root, 0700), 0);
+    ck_assert_int_eq(chdir(root), 0);
+    ck_assert_int_eq(mkdir("d", 0700), 0);
+    make_file("d/f", 3);
+    ck_assert_int_eq(symlink("f", "d/l"), 0);
+    make_file("g", 5);
+    ck_assert_int_eq(chdir(".."), 0);
+}
+
+static struct rbh_iterator *
+walk(struct rbh_backend *posix, unsigned int fsentry_mask)
+{
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = fsentry_mask,
+            .statx_mask = RBH_STATX_TYPE,
+        },
+    };
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_iterator *constified;
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    constified = rbh_iter_constify(fsentries);
+    ck_assert_ptr_nonnull(constified);
+
+    return constified;
+}
+
+struct inode_iterator {
+    struct rbh_iterator iterator;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+};
+
+static const void *
+inode_iter_next(void *iterator)
+{
+    struct inode_iterator *inodes = iterator;
+
+    free(inodes->fsentry);
+    inodes->fsentry = rbh_mut_iter_next(inodes->fsentries);
+    if (inodes->fsentry == NULL)
+        return NULL;
+
+    inodes->fsentry->mask &= ~(RBH_FP_PARENT_ID | RBH_FP_NAME | RBH_FP_STATX);
+    return inodes->fsentry;
+}
+
+static void
+inode_iter_destroy(void *iterator)
+{
+    struct inode_iterator *inodes = iterator;
+
+    free(inodes->fsentry);
+    rbh_mut_iter_destroy(inodes->fsentries);
+    free(inodes);
+}
+
+static const struct rbh_iterator_operations INODE_ITER_OPS = {
+    .next = inode_iter_next,
+    .destroy = inode_iter_destroy,
+};
+
+/* Walk a backend, and only keep the ID of the fsentries */
+static struct rbh_iterator *
+walk_inodes(struct rbh_backend *posix)
+{
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_ID,
+        },
+    };
+    struct inode_iterator *inodes;
+
+    inodes = malloc(sizeof(*inodes));
+    ck_assert_ptr_nonnull(inodes);
+
+    inodes->iterator.ops = &INODE_ITER_OPS;
+    inodes->fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(inodes->fsentries);
+    inodes->fsentry = NULL;
+
+    return &inodes->iterator;
+}
+
+/* Check an fsevent carries the size of one of the regular files of the tree */
+static void
+ck_assert_enriched(const struct rbh_fsevent *fsevent, bool in_namespace)
+{
+    const struct rbh_value *value;
+
+    ck_assert_int_eq(fsevent->type, RBH_FET_XATTR);
+    ck_assert_uint_eq(fsevent->xattrs.count, 1);
+    ck_assert_str_eq(fsevent->xattrs.pairs[0].key, "size");
+
+    value = fsevent->xattrs.pairs[0].value;
+    ck_assert_int_eq(value->type, RBH_VT_UINT64);
+
+    if (!in_namespace) {
+        ck_assert_ptr_null(fsevent->ns.parent_id);
+        ck_assert_ptr_null(fsevent->ns.name);
+        ck_assert(value->uint64 == 3 || value->uint64 == 5);
+        return;
+    }
+
+    ck_assert_ptr_nonnull(fsevent->ns.parent_id);
+    ck_assert_ptr_nonnull(fsevent->ns.name);
+    if (strcmp(fsevent->ns.name, "f") == 0)
+        ck_assert_uint_eq(value->uint64, 3);
+    else if (strcmp(fsevent->ns.name, "g") == 0)
+        ck_assert_uint_eq(value->uint64, 5);
+    else
+        ck_abort_msg("unexpected fsevent for '%s'", fsevent->ns.name);
+}
+
+/*----------------------------------------------------------------------------*
+ |                            lustre_enrich_new()                             |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(le_einval)
+{
+    struct rbh_iterator *fsentries;
+
+    fsentries = rbh_iter_array(NULL, sizeof(struct rbh_fsentry), 0);
+    ck_assert_ptr_nonnull(fsentries);
+
+    errno = 0;
+    ck_assert_ptr_null(lustre_enrich_new(&FAKE_BACKEND, ".", fsentries, 0));
+    ck_assert_int_eq(errno, EINVAL);
+
+    rbh_iter_destroy(fsentries);
+}
+END_TEST
+
+START_TEST(le_namespace)
+{
+    static const char *TREE = "tree";
+    struct rbh_mut_iterator *fsevents;
+    struct rbh_fsevent *fsevent;
+    struct rbh_backend *posix;
+    size_t count = 0;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    fsevents = lustre_enrich_new(
+            &FAKE_BACKEND, TREE,
+            walk(posix, RBH_FP_ID | RBH_FP_PARENT_ID | RBH_FP_NAME
+                      | RBH_FP_STATX),
+            _i
+            );
+    ck_assert_ptr_nonnull(fsevents);
+
+    while ((fsevent = rbh_mut_iter_next(fsevents)) != NULL) {
+        ck_assert_enriched(fsevent, true);
+        free(fsevent);
+        count++;
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    /* Only regular files have the attribute */
+    ck_assert_uint_eq(count, 2);
+
+    rbh_mut_iter_destroy(fsevents);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(le_inode)
+{
+    static const char *TREE = "tree";
+    struct rbh_mut_iterator *fsevents;
+    struct rbh_fsevent *fsevent;
+    struct rbh_backend *posix;
+    size_t count = 0;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    /* Without a statx, the mode of the entries is fetched again */
+    fsevents = lustre_enrich_new(&FAKE_BACKEND, TREE, walk_inodes(posix), _i);
+    ck_assert_ptr_nonnull(fsevents);
+
+    while ((fsevent = rbh_mut_iter_next(fsevents)) != NULL) {
+        ck_assert_enriched(fsevent, false);
+        free(fsevent);
+        count++;
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, 2);
+
+    rbh_mut_iter_destroy(fsevents);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(le_error)
+{
+    static const char *TREE = "tree";
+    struct rbh_mut_iterator *fsevents;
+    struct rbh_fsevent *fsevent;
+    struct rbh_backend *posix;
+    size_t errors = 0;
+    size_t count = 0;
+
+    make_tree(TREE);
+    make_file("tree/faulty", FAULTY_SIZE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    fsevents = lustre_enrich_new(
+            &FAKE_BACKEND, TREE,
+            walk(posix, RBH_FP_ID | RBH_FP_PARENT_ID | RBH_FP_NAME
+                      | RBH_FP_STATX),
+            _i
+            );
+    ck_assert_ptr_nonnull(fsevents);
+
+    /* An error does not prevent the other entries from being enriched */
+    while (true) {
+        errno = 0;
+        fsevent = rbh_mut_iter_next(fsevents);
+        if (fsevent == NULL) {
+            if (errno == ENODATA)
+                break;
+            ck_assert_int_eq(errno, EIO);
+            errors++;
+            continue;
+        }
+
+        ck_assert_enriched(fsevent, true);
+        free(fsevent);
+        count++;
+    }
+    ck_assert_uint_eq(errors, 1);
+    ck_assert_uint_eq(count, 2);
+
+    rbh_mut_iter_destroy(fsevents);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(le_destroy_early)
+{
+    static const char *TREE = "tree";
+    struct rbh_mut_iterator *fsevents;
+    struct rbh_backend *posix;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    fsevents = lustre_enrich_new(&FAKE_BACKEND, TREE, walk(posix, RBH_FP_ID),
+                                 _i);
+    ck_assert_ptr_nonnull(fsevents);
+
+    /* Pending fsevents are released along with the iterator */
+    rbh_mut_iter_destroy(fsevents);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("lustre enrich");
+    tests = tcase_create("enrich");
+    tcase_add_unchecked_fixture(tests, unchecked_setup_tmpdir,
+                                unchecked_teardown_tmpdir);
+    tcase_add_test(tests, le_einval);
+    tcase_add_loop_test(tests, le_namespace, 1, 4);
+    tcase_add_loop_test(tests, le_inode, 1, 4);
+    tcase_add_loop_test(tests, le_error, 1, 4);
+    tcase_add_loop_test(tests, le_destroy_early, 1, 4);
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
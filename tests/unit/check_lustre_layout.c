@@ -0,0 +1,359 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <lustre/lustreapi.h>
+
+#include "check-compat.h"
+#include "robinhood/backends/lustre_internal.h"
+#include "robinhood/sstack.h"
+
+#include "check_macros.h"
+
+/*----------------------------------------------------------------------------*
+ |                                  helpers                                   |
+ *----------------------------------------------------------------------------*/
+
+#define UINT32(X) { .type = RBH_VT_UINT32, .uint32 = (X) }
+#define UINT64(X) { .type = RBH_VT_UINT64, .uint64 = (X) }
+#define STRING(X) { .type = RBH_VT_STRING, .string = (X) }
+#define SEQUENCE(X) \
+    { .type = RBH_VT_SEQUENCE, \
+      .sequence = { .values = (X), .count = sizeof(X) / sizeof(*(X)) } }
+
+#define ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
+
+static struct rbh_sstack *values;
+
+static void
+setup_values(void)
+{
+    values = rbh_sstack_new(1 << 12);
+    ck_assert_ptr_nonnull(values);
+}
+
+static void
+teardown_values(void)
+{
+    rbh_sstack_destroy(values);
+}
+
+/* ck_assert_value_eq() does not compare the elements of sequences */
+static void
+ck_assert_value_deep_eq(const struct rbh_value *value,
+                        const struct rbh_value *expected)
+{
+    ck_assert_value_eq(value, expected);
+    if (value->type != RBH_VT_SEQUENCE)
+        return;
+
+    for (size_t i = 0; i < value->sequence.count; i++)
+        ck_assert_value_deep_eq(&value->sequence.values[i],
+                                &expected->sequence.values[i]);
+}
+
+static void
+ck_assert_layout_eq(const void *lov, size_t size, uint16_t mode,
+                    const struct rbh_value_pair *expected, size_t count)
+{
+    struct rbh_value_pair pairs[LUSTRE_LAYOUT_MAX_PAIRS];
+    const struct rbh_value_map EXPECTED = {
+        .pairs = expected,
+        .count = count,
+    };
+    struct rbh_value_map map = {
+        .pairs = pairs,
+    };
+    int rc;
+
+    rc = lustre_layout_from_lov(lov, size, mode, pairs, values);
+    ck_assert_int_ge(rc, 0);
+    map.count = rc;
+
+    ck_assert_value_map_eq(&map, &EXPECTED);
+    for (size_t i = 0; i < count; i++)
+        ck_assert_value_deep_eq(map.pairs[i].value, expected[i].value);
+}
+
+/* Leave garbage where the next function calls will put their variables */
+static void __attribute__((noinline))
+dirty_stack(void)
+{
+    volatile unsigned char garbage[1 << 14];
+
+    for (size_t i = 0; i < sizeof(garbage); i++)
+        garbage[i] = 0xa5;
+}
+
+/*----------------------------------------------------------------------------*
+ |                               captured blobs                               |
+ *----------------------------------------------------------------------------*/
+
+/* Layouts as read from the "lustre.lov" xattr (getfattr -e hex) */
+
+static const unsigned char LOV_V1[] = {
+    0xd0, 0x0b, 0xd1, 0x0b, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x02, 0x00, 0x03, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const unsigned char LOV_V3[] = {
+    0xd0, 0x0b, 0xd3, 0x0b, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x40, 0x00, 0x01, 0x00, 0x07, 0x00, 0x66, 0x6c, 0x61, 0x73,
+    0x68, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+};
+
+static const unsigned char LOV_COMP[] = {
+    0xd0, 0x0b, 0xd6, 0x0b, 0xe8, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+    0x38, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xb8, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd0, 0x0b, 0xd1, 0x0b,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x00, 0xd0, 0x0b, 0xd3, 0x0b, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x04, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+};
+
+static const unsigned char LOV_FOREIGN[] = {
+    0xd0, 0x0b, 0xd7, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const unsigned char LOV_DIR[] = {
+    0xd0, 0x0b, 0xd1, 0x0b, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/*----------------------------------------------------------------------------*
+ |                          lustre_layout_from_lov()                          |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(llfl_v1)
+{
+    const struct rbh_value STRIPE_COUNT[] = { UINT64(2) };
+    const struct rbh_value STRIPE_SIZE[] = { UINT64(1 << 20) };
+    const struct rbh_value PATTERN[] = { UINT64(LLAPI_LAYOUT_RAID0) };
+    const struct rbh_value COMP_FLAGS[] = { UINT32(0) };
+    const struct rbh_value POOL[] = { STRING("") };
+    const struct rbh_value OST[] = { UINT64(1), UINT64(0) };
+    const struct rbh_value VALUES[] = {
+        UINT32(0), STRING("LOV_USER_MAGIC_V1"), UINT32(3),
+        SEQUENCE(STRIPE_COUNT), SEQUENCE(STRIPE_SIZE), SEQUENCE(PATTERN),
+        SEQUENCE(COMP_FLAGS), SEQUENCE(POOL), SEQUENCE(OST),
+    };
+    const struct rbh_value_pair PAIRS[] = {
+        { .key = "flags", .value = &VALUES[0] },
+        { .key = "magic", .value = &VALUES[1] },
+        { .key = "gen", .value = &VALUES[2] },
+        { .key = "stripe_count", .value = &VALUES[3] },
+        { .key = "stripe_size", .value = &VALUES[4] },
+        { .key = "pattern", .value = &VALUES[5] },
+        { .key = "comp_flags", .value = &VALUES[6] },
+        { .key = "pool", .value = &VALUES[7] },
+        { .key = "ost", .value = &VALUES[8] },
+    };
+
+    /* Plain layouts do not set the fields of composite ones */
+    if (_i)
+        dirty_stack();
+
+    ck_assert_layout_eq(LOV_V1, sizeof(LOV_V1), S_IFREG, PAIRS,
+                        ARRAY_SIZE(PAIRS));
+}
+END_TEST
+
+START_TEST(llfl_v3)
+{
+    const struct rbh_value STRIPE_COUNT[] = { UINT64(1) };
+    const struct rbh_value STRIPE_SIZE[] = { UINT64(4 << 20) };
+    const struct rbh_value PATTERN[] = { UINT64(LLAPI_LAYOUT_RAID0) };
+    const struct rbh_value COMP_FLAGS[] = { UINT32(0) };
+    const struct rbh_value POOL[] = { STRING("flash") };
+    const struct rbh_value OST[] = { UINT64(2) };
+    const struct rbh_value VALUES[] = {
+        UINT32(0), STRING("LOV_USER_MAGIC_V3"), UINT32(7),
+        SEQUENCE(STRIPE_COUNT), SEQUENCE(STRIPE_SIZE), SEQUENCE(PATTERN),
+        SEQUENCE(COMP_FLAGS), SEQUENCE(POOL), SEQUENCE(OST),
+    };
+    const struct rbh_value_pair PAIRS[] = {
+        { .key = "flags", .value = &VALUES[0] },
+        { .key = "magic", .value = &VALUES[1] },
+        { .key = "gen", .value = &VALUES[2] },
+        { .key = "stripe_count", .value = &VALUES[3] },
+        { .key = "stripe_size", .value = &VALUES[4] },
+        { .key = "pattern", .value = &VALUES[5] },
+        { .key = "comp_flags", .value = &VALUES[6] },
+        { .key = "pool", .value = &VALUES[7] },
+        { .key = "ost", .value = &VALUES[8] },
+    };
+
+    ck_assert_layout_eq(LOV_V3, sizeof(LOV_V3), S_IFREG, PAIRS,
+                        ARRAY_SIZE(PAIRS));
+}
+END_TEST
+
+START_TEST(llfl_composite)
+{
+    const struct rbh_value STRIPE_COUNT[] = { UINT64(1), UINT64(4) };
+    const struct rbh_value STRIPE_SIZE[] = {
+        UINT64(1 << 20), UINT64(1 << 20)
+    };
+    const struct rbh_value PATTERN[] = {
+        UINT64(LLAPI_LAYOUT_RAID0), UINT64(LLAPI_LAYOUT_RAID0)
+    };
+    const struct rbh_value COMP_FLAGS[] = { UINT32(LCME_FL_INIT), UINT32(0) };
+    const struct rbh_value POOL[] = { STRING(""), STRING("") };
+    const struct rbh_value MIRROR_ID[] = { UINT32(1), UINT32(1) };
+    const struct rbh_value BEGIN[] = { UINT64(0), UINT64(1 << 20) };
+    const struct rbh_value END[] = { UINT64(1 << 20), UINT64(UINT64_MAX) };
+    /* The second component is not instantiated */
+    const struct rbh_value OST[] = { UINT64(3), UINT64(-1) };
+    const struct rbh_value VALUES[] = {
+        UINT32(0), STRING("LOV_USER_MAGIC_COMP_V1"), UINT32(5), UINT32(1),
+        SEQUENCE(STRIPE_COUNT), SEQUENCE(STRIPE_SIZE), SEQUENCE(PATTERN),
+        SEQUENCE(COMP_FLAGS), SEQUENCE(POOL), SEQUENCE(MIRROR_ID),
+        SEQUENCE(BEGIN), SEQUENCE(END), SEQUENCE(OST),
+    };
+    const struct rbh_value_pair PAIRS[] = {
+        { .key = "flags", .value = &VALUES[0] },
+        { .key = "magic", .value = &VALUES[1] },
+        { .key = "gen", .value = &VALUES[2] },
+        { .key = "mirror_count", .value = &VALUES[3] },
+        { .key = "stripe_count", .value = &VALUES[4] },
+        { .key = "stripe_size", .value = &VALUES[5] },
+        { .key = "pattern", .value = &VALUES[6] },
+        { .key = "comp_flags", .value = &VALUES[7] },
+        { .key = "pool", .value = &VALUES[8] },
+        { .key = "mirror_id", .value = &VALUES[9] },
+        { .key = "begin", .value = &VALUES[10] },
+        { .key = "end", .value = &VALUES[11] },
+        { .key = "ost", .value = &VALUES[12] },
+    };
+
+    ck_assert_layout_eq(LOV_COMP, sizeof(LOV_COMP), S_IFREG, PAIRS,
+                        ARRAY_SIZE(PAIRS));
+}
+END_TEST
+
+START_TEST(llfl_directory)
+{
+    const struct rbh_value STRIPE_COUNT[] = { UINT64(LLAPI_LAYOUT_DEFAULT) };
+    const struct rbh_value STRIPE_SIZE[] = { UINT64(LLAPI_LAYOUT_DEFAULT) };
+    const struct rbh_value PATTERN[] = { UINT64(LLAPI_LAYOUT_RAID0) };
+    const struct rbh_value COMP_FLAGS[] = { UINT32(0) };
+    const struct rbh_value POOL[] = { STRING("") };
+    const struct rbh_value VALUES[] = {
+        UINT32(0), SEQUENCE(STRIPE_COUNT), SEQUENCE(STRIPE_SIZE),
+        SEQUENCE(PATTERN), SEQUENCE(COMP_FLAGS), SEQUENCE(POOL),
+    };
+    const struct rbh_value_pair PAIRS[] = {
+        { .key = "flags", .value = &VALUES[0] },
+        { .key = "stripe_count", .value = &VALUES[1] },
+        { .key = "stripe_size", .value = &VALUES[2] },
+        { .key = "pattern", .value = &VALUES[3] },
+        { .key = "comp_flags", .value = &VALUES[4] },
+        { .key = "pool", .value = &VALUES[5] },
+    };
+
+    ck_assert_layout_eq(LOV_DIR, sizeof(LOV_DIR), S_IFDIR, PAIRS,
+                        ARRAY_SIZE(PAIRS));
+}
+END_TEST
+
+START_TEST(llfl_truncated)
+{
+    struct rbh_value_pair pairs[LUSTRE_LAYOUT_MAX_PAIRS];
+
+    errno = 0;
+    ck_assert_int_eq(lustre_layout_from_lov(LOV_V1, 20, S_IFREG, pairs,
+                                            values), -1);
+    ck_assert_int_eq(errno, EINVAL);
+
+    errno = 0;
+    ck_assert_int_eq(lustre_layout_from_lov(LOV_COMP, sizeof(LOV_COMP) - 1,
+                                            S_IFREG, pairs, values), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+START_TEST(llfl_foreign)
+{
+    struct rbh_value_pair pairs[LUSTRE_LAYOUT_MAX_PAIRS];
+
+    errno = 0;
+    ck_assert_int_eq(lustre_layout_from_lov(LOV_FOREIGN, sizeof(LOV_FOREIGN),
+                                            S_IFREG, pairs, values), -1);
+    ck_assert_int_eq(errno, ENOTSUP);
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("lustre layout");
+    tests = tcase_create("lustre_layout_from_lov()");
+    tcase_add_checked_fixture(tests, setup_values, teardown_values);
+    tcase_add_loop_test(tests, llfl_v1, 0, 2);
+    tcase_add_test(tests, llfl_v3);
+    tcase_add_test(tests, llfl_composite);
+    tcase_add_test(tests, llfl_directory);
+    tcase_add_test(tests, llfl_truncated);
+    tcase_add_test(tests, llfl_foreign);
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
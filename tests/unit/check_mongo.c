@@ -0,0 +1,266 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+/* These tests need a mongod server listening on localhost:27017, they are
+ * skipped otherwise.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "check-compat.h"
+#include "robinhood/backend.h"
+#include "robinhood/backends/mongo.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/itertools.h"
+#include "robinhood/statx.h"
+
+#include "check_macros.h"
+
+#define ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
+
+/* The exit status meson expects from a skipped test */
+#define EXIT_SKIP 77
+
+static bool
+mongod_is_listening(void)
+{
+    const struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(27017),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    bool listening;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+
+    listening = connect(fd, (const struct sockaddr *)&address,
+                        sizeof(address)) == 0;
+    close(fd);
+    return listening;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  fixtures                                  |
+ *----------------------------------------------------------------------------*/
+
+static const struct rbh_id ID = {
+    .data = "check_mongo",
+    .size = sizeof("check_mongo"),
+};
+
+static const struct rbh_id PARENT_ID = {
+    .data = "check_mongo_parent",
+    .size = sizeof("check_mongo_parent"),
+};
+
+static struct rbh_backend *mongo;
+
+static void
+mongo_update(struct rbh_fsevent **fsevents, size_t count)
+{
+    struct rbh_fsevent batch[count];
+    struct rbh_iterator *iter;
+
+    /* The copies still point inside the original allocations */
+    for (size_t i = 0; i < count; i++)
+        batch[i] = *fsevents[i];
+
+    iter = rbh_iter_array(batch, sizeof(*batch), count);
+    ck_assert_ptr_nonnull(iter);
+    ck_assert_int_eq(rbh_backend_update(mongo, iter), count);
+    rbh_iter_destroy(iter);
+}
+
+static void
+forget_id(void)
+{
+    struct rbh_fsevent *delete;
+
+    delete = rbh_fsevent_delete_new(&ID);
+    ck_assert_ptr_nonnull(delete);
+    mongo_update(&delete, 1);
+    free(delete);
+}
+
+static void
+setup(void)
+{
+    mongo = rbh_mongo_backend_new("check_mongo");
+    ck_assert_ptr_nonnull(mongo);
+    forget_id();
+}
+
+static void
+teardown(void)
+{
+    forget_id();
+    rbh_backend_destroy(mongo);
+}
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_backend_update()                             |
+ *----------------------------------------------------------------------------*/
+
+static const struct rbh_filter ID_FILTER = {
+    .op = RBH_FOP_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_ID,
+        },
+        .value = {
+            .type = RBH_VT_BINARY,
+            .binary = {
+                .data = "check_mongo",
+                .size = sizeof("check_mongo"),
+            },
+        },
+    },
+};
+
+/* One fsevent per bulk write, with up to IN_FLIGHTS[_i] of them executed in
+ * the background
+ */
+static const unsigned int IN_FLIGHTS[] = { 0, 1, 4 };
+
+static void
+set_bulk_options(unsigned int in_flight)
+{
+    const size_t max_count = 1;
+
+    ck_assert_int_eq(rbh_backend_set_option(mongo, RBH_MBO_BULK_MAX_COUNT,
+                                            &max_count, sizeof(max_count)),
+                     0);
+    ck_assert_int_eq(rbh_backend_set_option(mongo, RBH_MBO_BULKS_IN_FLIGHT,
+                                            &in_flight, sizeof(in_flight)),
+                     0);
+}
+
+static struct rbh_fsentry *
+fetch_id(void)
+{
+    const struct rbh_filter_projection projection = {
+        .fsentry_mask = RBH_FP_ID,
+    };
+
+    return rbh_backend_filter_one(mongo, &ID_FILTER, &projection);
+}
+
+START_TEST(mbu_delete_after_upsert)
+{
+    const struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_TYPE,
+        .stx_mode = S_IFREG,
+    };
+    struct rbh_fsevent *fsevents[3];
+
+    set_bulk_options(IN_FLIGHTS[_i]);
+
+    fsevents[0] = rbh_fsevent_upsert_new(&ID, NULL, &statx, NULL);
+    ck_assert_ptr_nonnull(fsevents[0]);
+    fsevents[1] = rbh_fsevent_link_new(&ID, NULL, &PARENT_ID, "check_mongo");
+    ck_assert_ptr_nonnull(fsevents[1]);
+    fsevents[2] = rbh_fsevent_delete_new(&ID);
+    ck_assert_ptr_nonnull(fsevents[2]);
+
+    for (size_t i = 0; i < 16; i++) {
+        mongo_update(fsevents, ARRAY_SIZE(fsevents));
+
+        ck_assert_ptr_null(fetch_id());
+        ck_assert_int_eq(errno, ENOENT);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(fsevents); i++)
+        free(fsevents[i]);
+}
+END_TEST
+
+START_TEST(mbu_upsert_after_delete)
+{
+    const struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_TYPE,
+        .stx_mode = S_IFREG,
+    };
+    struct rbh_fsevent *fsevents[3];
+
+    set_bulk_options(IN_FLIGHTS[_i]);
+
+    fsevents[0] = rbh_fsevent_delete_new(&ID);
+    ck_assert_ptr_nonnull(fsevents[0]);
+    fsevents[1] = rbh_fsevent_upsert_new(&ID, NULL, &statx, NULL);
+    ck_assert_ptr_nonnull(fsevents[1]);
+    fsevents[2] = rbh_fsevent_link_new(&ID, NULL, &PARENT_ID, "check_mongo");
+    ck_assert_ptr_nonnull(fsevents[2]);
+
+    for (size_t i = 0; i < 16; i++) {
+        struct rbh_fsentry *fsentry;
+
+        mongo_update(fsevents, ARRAY_SIZE(fsevents));
+
+        fsentry = fetch_id();
+        ck_assert_ptr_nonnull(fsentry);
+        ck_assert_id_eq(&fsentry->id, &ID);
+        free(fsentry);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(fsevents); i++)
+        free(fsevents[i]);
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("mongo backend");
+    tests = tcase_create("update");
+    tcase_add_checked_fixture(tests, setup, teardown);
+    tcase_add_loop_test(tests, mbu_delete_after_upsert, 0,
+                        ARRAY_SIZE(IN_FLIGHTS));
+    tcase_add_loop_test(tests, mbu_upsert_after_delete, 0,
+                        ARRAY_SIZE(IN_FLIGHTS));
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    if (!mongod_is_listening())
+        return EXIT_SKIP;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
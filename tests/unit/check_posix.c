@@ -13,12 +13,20 @@
 #include <fcntl.h>
 #include <ftw.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/xattr.h>
+
 #include "check-compat.h"
 #include "robinhood/backends/posix.h"
+#include "robinhood/backends/posix_internal.h"
+#include "robinhood/itertools.h"
+#include "robinhood/statx.h"
 #ifndef HAVE_STATX
 # include "robinhood/statx-compat.h"
 #endif
@@ -115,11 +123,848 @@ START_TEST(pf_empty_root)
 }
 END_TEST
 
+static void
+make_tree(const char *root)
+{
+    ck_assert_int_eq(mkdir(root, S_IRWXU), 0);
+    ck_assert_int_eq(chdir(root), 0);
+    ck_assert_int_eq(mkdir("a", S_IRWXU), 0);
+    ck_assert_int_eq(mkdir("a/b", S_IRWXU), 0);
+    ck_assert_int_eq(mkdir("c", S_IRWXU), 0);
+    ck_assert_int_eq(close(creat("f", S_IRUSR)), 0);
+    ck_assert_int_eq(close(creat("a/f", S_IRUSR)), 0);
+    ck_assert_int_eq(close(creat("a/b/f", S_IRUSR)), 0);
+    ck_assert_int_eq(symlink("a/b", "l"), 0);
+    ck_assert_int_eq(chdir(".."), 0);
+}
+
+/* The tree make_tree() builds holds 8 entries (including its root) */
+#define TREE_SIZE 8
+
+/* Walk a tree make_tree() built, check each entry comes after its parent */
+static void
+ck_assert_walks_tree(struct rbh_backend *posix)
+{
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_ID | RBH_FP_PARENT_ID | RBH_FP_NAME,
+        },
+    };
+    struct rbh_id *ids[TREE_SIZE];
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    size_t count = 0;
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        bool parent_found = false;
+
+        ck_assert_uint_lt(count, TREE_SIZE);
+        ck_assert(fsentry->mask & RBH_FP_ID);
+        ck_assert(fsentry->mask & RBH_FP_PARENT_ID);
+
+        if (count == 0) {
+            /* The root comes first */
+            ck_assert_str_eq(fsentry->name, "");
+            ck_assert_uint_eq(fsentry->parent_id.size, 0);
+        }
+
+        /* Directories are yielded before their content */
+        for (size_t i = 0; i < count; i++) {
+            if (ids[i]->size == fsentry->parent_id.size
+             && memcmp(ids[i]->data, fsentry->parent_id.data,
+                       ids[i]->size) == 0)
+                parent_found = true;
+        }
+        ck_assert(count == 0 || parent_found);
+
+        ids[count] = rbh_id_new(fsentry->id.data, fsentry->id.size);
+        ck_assert_ptr_nonnull(ids[count]);
+        count++;
+
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, TREE_SIZE);
+
+    for (size_t i = 0; i < count; i++)
+        free(ids[i]);
+
+    rbh_mut_iter_destroy(fsentries);
+}
+
+START_TEST(pf_walker_threads)
+{
+    static const char *TREE = "tree";
+    const unsigned int threads = _i;
+    struct rbh_backend *posix;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    ck_assert_walks_tree(posix);
+
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+/* Spread directories over partitions, and fail for some of them */
+static int
+partition_by_id(int fd, const struct rbh_id *id)
+{
+    unsigned char last = id->data[id->size - 1];
+
+    (void)fd;
+
+    if (last % 4 == 3) {
+        errno = EINVAL;
+        return -1;
+    }
+    return last;
+}
+
+START_TEST(pf_walker_partitions)
+{
+    static const char *TREE = "tree";
+    struct posix_backend *posix;
+
+    make_tree(TREE);
+
+    posix = (struct posix_backend *)rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    /* Backends that overload the posix one set those */
+    posix->walker_threads = _i;
+    posix->walker_partitions = 3;
+    posix->dir_partition = partition_by_id;
+
+    ck_assert_walks_tree(&posix->backend);
+
+    rbh_backend_destroy(&posix->backend);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(pf_walker_by_handle)
+{
+    static const char *TREE = "tree";
+    struct posix_backend *posix;
+
+    make_tree(TREE);
+
+    posix = (struct posix_backend *)rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    /* Backends that overload the posix one set this */
+    posix->walker_threads = _i;
+    posix->open_by_handle = true;
+
+    ck_assert_walks_tree(&posix->backend);
+
+    rbh_backend_destroy(&posix->backend);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(pf_projection)
+{
+    static const char *TREE = "tree";
+    const struct rbh_value_pair XATTRS[] = {
+        { .key = "user.a", },
+    };
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_ID | RBH_FP_NAME | RBH_FP_INODE_XATTRS,
+            .xattrs.inode = {
+                .pairs = XATTRS,
+                .count = 1,
+            },
+        },
+    };
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *posix;
+    size_t xattrs_count = 0;
+    size_t count = 0;
+
+    make_tree(TREE);
+    ck_assert_int_eq(setxattr("tree/f", "user.a", "a", 1, 0), 0);
+    ck_assert_int_eq(setxattr("tree/f", "user.b", "b", 1, 0), 0);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert(fsentry->mask & RBH_FP_ID);
+        ck_assert(fsentry->mask & RBH_FP_NAME);
+        ck_assert(fsentry->mask & RBH_FP_INODE_XATTRS);
+        /* Symlinks are not read unless asked to */
+        ck_assert(!(fsentry->mask & RBH_FP_SYMLINK));
+
+        /* Only the requested xattrs are fetched */
+        for (size_t i = 0; i < fsentry->xattrs.inode.count; i++) {
+            const struct rbh_value_pair *pair = &fsentry->xattrs.inode.pairs[i];
+
+            ck_assert_str_eq(pair->key, "user.a");
+            ck_assert_uint_eq(pair->value->binary.size, 1);
+            ck_assert_mem_eq(pair->value->binary.data, "a", 1);
+            xattrs_count++;
+        }
+
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, TREE_SIZE);
+    ck_assert_uint_eq(xattrs_count, 1);
+
+    rbh_mut_iter_destroy(fsentries);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(pf_filter)
+{
+    static const char *TREE = "tree";
+    const struct rbh_filter LINK_FILTER = {
+        .op = RBH_FOP_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_TYPE,
+            },
+            .value = {
+                .type = RBH_VT_UINT32,
+                .uint32 = S_IFLNK,
+            },
+        },
+    };
+    const struct rbh_filter NAME_FILTER = {
+        .op = RBH_FOP_REGEX,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .value = {
+                .type = RBH_VT_REGEX,
+                .regex = {
+                    .string = "^f$",
+                },
+            },
+        },
+    };
+    const struct rbh_filter XATTR_FILTER = {
+        .op = RBH_FOP_EXISTS,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_INODE_XATTRS,
+                .xattr = "user.a",
+            },
+            .value = {
+                .type = RBH_VT_BOOLEAN,
+                .boolean = true,
+            },
+        },
+    };
+    const struct rbh_filter *AND_FILTERS[] = {
+        &NAME_FILTER,
+        &XATTR_FILTER,
+    };
+    const struct rbh_filter AND_FILTER = {
+        .op = RBH_FOP_AND,
+        .logical = {
+            .filters = AND_FILTERS,
+            .count = 2,
+        },
+    };
+    const struct rbh_filter *OR_FILTERS[] = {
+        &LINK_FILTER,
+        &AND_FILTER,
+    };
+    const struct rbh_filter FILTER = {
+        .op = RBH_FOP_OR,
+        .logical = {
+            .filters = OR_FILTERS,
+            .count = 2,
+        },
+    };
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_NAME,
+        },
+    };
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *posix;
+    bool found_link = false;
+    bool found_file = false;
+
+    make_tree(TREE);
+    ck_assert_int_eq(setxattr("tree/f", "user.a", "a", 1, 0), 0);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    fsentries = rbh_backend_filter(posix, &FILTER, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    /* Only "l" and "f" (not "a/f", nor "a/b/f") match */
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert(fsentry->mask & RBH_FP_NAME);
+        if (strcmp(fsentry->name, "l") == 0) {
+            ck_assert(!found_link);
+            found_link = true;
+        } else {
+            ck_assert_str_eq(fsentry->name, "f");
+            ck_assert(!found_file);
+            found_file = true;
+        }
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert(found_link && found_file);
+
+    rbh_mut_iter_destroy(fsentries);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+static const struct rbh_filter FILE_FILTER = {
+    .op = RBH_FOP_EQUAL,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_TYPE,
+        },
+        .value = {
+            .type = RBH_VT_UINT32,
+            .uint32 = S_IFREG,
+        },
+    },
+};
+
+static void
+set_size(const char *path, off_t size)
+{
+    ck_assert_int_eq(chmod(path, S_IRUSR | S_IWUSR), 0);
+    ck_assert_int_eq(truncate(path, size), 0);
+}
+
+static void
+check_sizes(struct rbh_backend *posix,
+            const struct rbh_filter_options *options, const uint64_t *sizes,
+            size_t count)
+{
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    size_t i = 0;
+
+    fsentries = rbh_backend_filter(posix, &FILE_FILTER, options);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert_uint_lt(i, count);
+        /* The sorting fields are fetched, even if the projection omits them */
+        ck_assert(fsentry->mask & RBH_FP_STATX);
+        ck_assert(fsentry->statx->stx_mask & RBH_STATX_SIZE);
+        ck_assert_uint_eq(fsentry->statx->stx_size, sizes[i++]);
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(i, count);
+
+    rbh_mut_iter_destroy(fsentries);
+}
+
+START_TEST(pf_sort)
+{
+    static const char *TREE = "tree";
+    struct rbh_filter_sort item = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_SIZE,
+        },
+        .ascending = true,
+    };
+    struct rbh_filter_options options = {
+        .projection = {
+            .fsentry_mask = RBH_FP_NAME,
+        },
+        .sort = {
+            .items = &item,
+            .count = 1,
+        },
+    };
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_backend *posix;
+
+    make_tree(TREE);
+    set_size("tree/f", 3);
+    set_size("tree/a/f", 1);
+    set_size("tree/a/b/f", 2);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    check_sizes(posix, &options, (const uint64_t[]){ 1, 2, 3 }, 3);
+
+    /* Only `skip + limit' fsentries are kept */
+    options.skip = 1;
+    options.limit = 1;
+    check_sizes(posix, &options, (const uint64_t[]){ 2 }, 1);
+
+    options.skip = 0;
+    options.limit = 2;
+    item.ascending = false;
+    check_sizes(posix, &options, (const uint64_t[]){ 3, 2 }, 2);
+
+    options.limit = 0;
+    check_sizes(posix, &options, (const uint64_t[]){ 3, 2, 1 }, 3);
+
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+START_TEST(pf_skip_limit)
+{
+    static const char *TREE = "tree";
+    const struct rbh_filter_options OPTIONS = {
+        .skip = 3,
+        .limit = 4,
+    };
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *posix;
+    size_t count = 0;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, 4);
+
+    rbh_mut_iter_destroy(fsentries);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+/* Count the fsentries of a backend, none of which may be named `name' */
+static size_t
+count_fsentries(struct rbh_backend *posix, const char *name)
+{
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_NAME,
+        },
+    };
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    size_t count = 0;
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        if (name != NULL)
+            ck_assert_int_ne(strcmp(fsentry->name, name), 0);
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+
+    rbh_mut_iter_destroy(fsentries);
+    return count;
+}
+
+START_TEST(pf_prune)
+{
+    static const char *TREE = "tree";
+    const struct rbh_filter PRUNE = {
+        .op = RBH_FOP_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_NAME,
+            },
+            .value = {
+                .type = RBH_VT_STRING,
+                .string = "b",
+            },
+        },
+    };
+    const struct rbh_filter *prune = &PRUNE;
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_backend *posix;
+    unsigned int max_depth;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    /* Pruned directories are still yielded, but not their content: this is
+     * everything but "a/b/f"
+     */
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_PRUNE_FILTER,
+                                            &prune, sizeof(prune)), 0);
+    ck_assert_uint_eq(count_fsentries(posix, NULL), TREE_SIZE - 1);
+    prune = NULL;
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_PRUNE_FILTER,
+                                            &prune, sizeof(prune)), 0);
+
+    /* The root, "a", "c", "f" and "l" */
+    max_depth = 1;
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_MAX_DEPTH,
+                                            &max_depth, sizeof(max_depth)), 0);
+    ck_assert_uint_eq(count_fsentries(posix, "b"), 5);
+
+    /* Only the root */
+    max_depth = 0;
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_MAX_DEPTH,
+                                            &max_depth, sizeof(max_depth)), 0);
+    ck_assert_uint_eq(count_fsentries(posix, "a"), 1);
+
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+static bool
+has_ns_xattr(const struct rbh_fsentry *fsentry, const char *key)
+{
+    if (!(fsentry->mask & RBH_FP_NAMESPACE_XATTRS))
+        return false;
+
+    for (size_t i = 0; i < fsentry->xattrs.ns.count; i++) {
+        if (strcmp(fsentry->xattrs.ns.pairs[i].key, key) == 0)
+            return true;
+    }
+    return false;
+}
+
+START_TEST(pf_unchanged)
+{
+    static const char *TREE = "tree";
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_NAME | RBH_FP_NAMESPACE_XATTRS,
+        },
+    };
+    /* Test both the fts based iterator and the walker */
+    const unsigned int threads = _i;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *posix;
+    int64_t unchanged_before;
+    size_t count = 0;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_WALKER_THREADS,
+                                            &threads, sizeof(threads)), 0);
+
+    /* Every directory is older than this */
+    unchanged_before = time(NULL) + 3600;
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_UNCHANGED_BEFORE,
+                                            &unchanged_before,
+                                            sizeof(unchanged_before)), 0);
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    /* Only directories are yielded: the root, "a", "a/b" and "c" */
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert(fsentry->mask & RBH_FP_STATX);
+        ck_assert(S_ISDIR(fsentry->statx->stx_mode));
+        ck_assert(fsentry->statx->stx_mask & RBH_STATX_CTIME);
+        ck_assert_int_lt(fsentry->statx->stx_ctime.tv_sec, unchanged_before);
+        ck_assert(has_ns_xattr(fsentry, RBH_NS_XATTR_UNCHANGED));
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, 4);
+    rbh_mut_iter_destroy(fsentries);
+
+    /* And every directory is more recent than this */
+    unchanged_before = 1;
+    ck_assert_int_eq(rbh_backend_set_option(posix, RBH_PBO_UNCHANGED_BEFORE,
+                                            &unchanged_before,
+                                            sizeof(unchanged_before)), 0);
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    count = 0;
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert(!has_ns_xattr(fsentry, RBH_NS_XATTR_UNCHANGED));
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, TREE_SIZE);
+    rbh_mut_iter_destroy(fsentries);
+
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                           posix_sort_iter_new()                            |
+ *----------------------------------------------------------------------------*/
+
+/* An iterator of fsentries of given sizes, which fails once halfway through */
+struct flaky_iterator {
+    struct rbh_mut_iterator iterator;
+    const uint64_t *sizes;
+    size_t count;
+    size_t index;
+    bool failed;
+};
+
+static void *
+flaky_iter_next(void *iterator)
+{
+    struct flaky_iterator *flaky = iterator;
+    struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_SIZE,
+    };
+    const struct rbh_id id = {
+        .data = (const char *)&flaky->index,
+        .size = sizeof(flaky->index),
+    };
+
+    if (!flaky->failed && flaky->index == flaky->count / 2) {
+        flaky->failed = true;
+        /* rbh_mut_iter_next() would retry on EAGAIN */
+        errno = EIO;
+        return NULL;
+    }
+
+    if (flaky->index == flaky->count) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    statx.stx_size = flaky->sizes[flaky->index++];
+    return rbh_fsentry_new(&id, NULL, NULL, &statx, NULL, NULL, NULL);
+}
+
+static void
+flaky_iter_destroy(void *iterator)
+{
+    free(iterator);
+}
+
+static const struct rbh_mut_iterator_operations FLAKY_ITER_OPS = {
+    .next = flaky_iter_next,
+    .destroy = flaky_iter_destroy,
+};
+
+START_TEST(psi_resume)
+{
+    static const uint64_t SIZES[] = { 5, 3, 8, 1, 9, 2, 7, 4, 6, 0 };
+    const struct rbh_filter_sort item = {
+        .field = {
+            .fsentry = RBH_FP_STATX,
+            .statx = RBH_STATX_SIZE,
+        },
+        .ascending = true,
+    };
+    const struct rbh_filter_options options = {
+        .skip = 1,
+        /* Keep the top fsentries in memory, or sort them all */
+        .limit = _i ? 0 : 4,
+        .sort = {
+            .items = &item,
+            .count = 1,
+        },
+    };
+    struct rbh_mut_iterator *fsentries;
+    struct flaky_iterator *flaky;
+    struct rbh_fsentry *fsentry;
+    uint64_t expected = 1;
+
+    flaky = malloc(sizeof(*flaky));
+    ck_assert_ptr_nonnull(flaky);
+    flaky->iterator.ops = &FLAKY_ITER_OPS;
+    flaky->sizes = SIZES;
+    flaky->count = sizeof(SIZES) / sizeof(*SIZES);
+    flaky->index = 0;
+    flaky->failed = false;
+
+    fsentries = posix_sort_iter_new(&flaky->iterator, &options);
+    ck_assert_ptr_nonnull(fsentries);
+
+    errno = 0;
+    fsentry = rbh_mut_iter_next(fsentries);
+    ck_assert_ptr_null(fsentry);
+    ck_assert_int_eq(errno, EIO);
+
+    /* Nothing read before the error is lost */
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert_uint_eq(fsentry->statx->stx_size, expected++);
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(expected, _i ? 10 : 5);
+
+    rbh_mut_iter_destroy(fsentries);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                             posix_rescan_new()                             |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(prn_basic)
+{
+    static const char *TREE = "tree";
+    const struct rbh_filter_options OPTIONS = {
+        .projection = {
+            .fsentry_mask = RBH_FP_ID,
+        },
+    };
+    const struct rbh_filter_projection PROJECTION = {
+        .fsentry_mask = RBH_FP_ID | RBH_FP_STATX | RBH_FP_NAMESPACE_XATTRS,
+        .statx_mask = RBH_STATX_TYPE,
+    };
+    struct rbh_id *copies[TREE_SIZE];
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_id ids[TREE_SIZE];
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *posix;
+    size_t rescanned = 0;
+    size_t count = 0;
+
+    make_tree(TREE);
+
+    posix = rbh_posix_backend_new(TREE);
+    ck_assert_ptr_nonnull(posix);
+
+    fsentries = rbh_backend_filter(posix, NULL, &OPTIONS);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        ck_assert_uint_lt(count, TREE_SIZE);
+        copies[count] = rbh_id_new(fsentry->id.data, fsentry->id.size);
+        ck_assert_ptr_nonnull(copies[count]);
+        ids[count] = *copies[count];
+        count++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(count, TREE_SIZE);
+    rbh_mut_iter_destroy(fsentries);
+
+    /* Deleted files are skipped */
+    ck_assert_int_eq(unlink("tree/a/b/f"), 0);
+
+    fsentries = posix_rescan_new(TREE, rbh_iter_array(ids, sizeof(*ids),
+                                                      count),
+                                 AT_RBH_STATX_SYNC_AS_STAT, &PROJECTION,
+                                 NULL);
+    ck_assert_ptr_nonnull(fsentries);
+
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        bool found = false;
+
+        ck_assert_uint_eq(fsentry->mask,
+                          RBH_FP_ID | RBH_FP_STATX | RBH_FP_NAMESPACE_XATTRS);
+        ck_assert(fsentry->statx->stx_mask & RBH_STATX_TYPE);
+        /* Files are not reached through a path */
+        ck_assert_uint_eq(fsentry->xattrs.ns.count, 0);
+
+        for (size_t i = 0; i < count; i++) {
+            if (ids[i].size == fsentry->id.size
+             && memcmp(ids[i].data, fsentry->id.data, ids[i].size) == 0)
+                found = true;
+        }
+        ck_assert(found);
+
+        rescanned++;
+        free(fsentry);
+    }
+    ck_assert_int_eq(errno, ENODATA);
+    ck_assert_uint_eq(rescanned, TREE_SIZE - 1);
+
+    for (size_t i = 0; i < count; i++)
+        free(copies[i]);
+
+    rbh_mut_iter_destroy(fsentries);
+    rbh_backend_destroy(posix);
+    ck_assert_int_eq(
+            nftw(TREE, delete, NOPENFD, FTW_DEPTH | FTW_MOUNT | FTW_PHYS), 0
+            );
+}
+END_TEST
+
 /*----------------------------------------------------------------------------*
  |                               posix options                                |
  *----------------------------------------------------------------------------*/
 
-static const unsigned int PBO_MAX = RBH_PBO_STATX_SYNC_TYPE + 1;
+static const unsigned int PBO_MAX = RBH_PBO_UNCHANGED_BEFORE + 1;
 
 START_TEST(pbo_get_unknown)
 {
@@ -154,6 +999,10 @@ END_TEST
 
 static const size_t PBO_SIZES[] = {
     [BO_INDEX(RBH_PBO_STATX_SYNC_TYPE)] = sizeof(int),
+    [BO_INDEX(RBH_PBO_WALKER_THREADS)] = sizeof(unsigned int),
+    [BO_INDEX(RBH_PBO_PRUNE_FILTER)] = sizeof(const struct rbh_filter *),
+    [BO_INDEX(RBH_PBO_MAX_DEPTH)] = sizeof(unsigned int),
+    [BO_INDEX(RBH_PBO_UNCHANGED_BEFORE)] = sizeof(int64_t),
 };
 
 START_TEST(pbo_get_sizes)
@@ -186,9 +1035,17 @@ START_TEST(pbo_get_sizes)
 END_TEST
 
 static const int PSST_DEFAULT = AT_STATX_SYNC_AS_STAT;
+static const unsigned int PWT_DEFAULT = 0;
+static const struct rbh_filter *const PPF_DEFAULT = NULL;
+static const unsigned int PMD_DEFAULT = UINT_MAX;
+static const int64_t PUB_DEFAULT = 0;
 
 static const void *PBO_DEFAULTS[] = {
     [BO_INDEX(RBH_PBO_STATX_SYNC_TYPE)] = &PSST_DEFAULT,
+    [BO_INDEX(RBH_PBO_WALKER_THREADS)] = &PWT_DEFAULT,
+    [BO_INDEX(RBH_PBO_PRUNE_FILTER)] = &PPF_DEFAULT,
+    [BO_INDEX(RBH_PBO_MAX_DEPTH)] = &PMD_DEFAULT,
+    [BO_INDEX(RBH_PBO_UNCHANGED_BEFORE)] = &PUB_DEFAULT,
 };
 
 START_TEST(pbo_defaults)
@@ -247,8 +1104,40 @@ static const void * const RSST_INVALIDS[] = {
     NULL,
 };
 
+static const void * const RWT_INVALIDS[] = {
+    NULL,
+};
+
+static const struct rbh_filter RPF_INVALID_FILTER = {
+    .op = RBH_FOP_NOT,
+    .logical = {
+        .count = 0,
+    },
+};
+static const struct rbh_filter *const RPF_INVALID = &RPF_INVALID_FILTER;
+
+static const void * const RPF_INVALIDS[] = {
+    &RPF_INVALID,
+    NULL,
+};
+
+static const void * const RMD_INVALIDS[] = {
+    NULL,
+};
+
+static const int64_t RUB_NEGATIVE = -1;
+
+static const void * const RUB_INVALIDS[] = {
+    &RUB_NEGATIVE,
+    NULL,
+};
+
 static const void * const * const RPBO_INVALIDS[] = {
     [BO_INDEX(RBH_PBO_STATX_SYNC_TYPE)] = RSST_INVALIDS,
+    [BO_INDEX(RBH_PBO_WALKER_THREADS)] = RWT_INVALIDS,
+    [BO_INDEX(RBH_PBO_PRUNE_FILTER)] = RPF_INVALIDS,
+    [BO_INDEX(RBH_PBO_MAX_DEPTH)] = RMD_INVALIDS,
+    [BO_INDEX(RBH_PBO_UNCHANGED_BEFORE)] = RUB_INVALIDS,
 };
 
 START_TEST(pbo_set_invalids)
@@ -279,8 +1168,28 @@ static const void * const RSST_UNSUPPORTEDS[] = {
     NULL,
 };
 
+static const void * const RWT_UNSUPPORTEDS[] = {
+    NULL,
+};
+
+static const void * const RPF_UNSUPPORTEDS[] = {
+    NULL,
+};
+
+static const void * const RMD_UNSUPPORTEDS[] = {
+    NULL,
+};
+
+static const void * const RUB_UNSUPPORTEDS[] = {
+    NULL,
+};
+
 static const void * const * const RPBO_UNSUPPORTEDS[] = {
     [BO_INDEX(RBH_PBO_STATX_SYNC_TYPE)] = RSST_UNSUPPORTEDS,
+    [BO_INDEX(RBH_PBO_WALKER_THREADS)] = RWT_UNSUPPORTEDS,
+    [BO_INDEX(RBH_PBO_PRUNE_FILTER)] = RPF_UNSUPPORTEDS,
+    [BO_INDEX(RBH_PBO_MAX_DEPTH)] = RMD_UNSUPPORTEDS,
+    [BO_INDEX(RBH_PBO_UNCHANGED_BEFORE)] = RUB_UNSUPPORTEDS,
 };
 
 START_TEST(pbo_set_unsupporteds)
@@ -314,8 +1223,62 @@ static const void * const RSST_VALIDS[] = {
     NULL,
 };
 
+static const unsigned int RWT_SINGLE = 1;
+static const unsigned int RWT_MANY = 16;
+
+static const void * const RWT_VALIDS[] = {
+    &RWT_MANY,
+    &RWT_SINGLE,
+    &PWT_DEFAULT,
+    NULL,
+};
+
+static const struct rbh_filter RPF_VALID_FILTER = {
+    .op = RBH_FOP_EXISTS,
+    .compare = {
+        .field = {
+            .fsentry = RBH_FP_NAME,
+        },
+        .value = {
+            .type = RBH_VT_BOOLEAN,
+            .boolean = true,
+        },
+    },
+};
+static const struct rbh_filter *const RPF_VALID = &RPF_VALID_FILTER;
+
+static const void * const RPF_VALIDS[] = {
+    &RPF_VALID,
+    &PPF_DEFAULT,
+    NULL,
+};
+
+static const unsigned int RMD_ROOT_ONLY = 0;
+static const unsigned int RMD_SOME = 3;
+
+static const void * const RMD_VALIDS[] = {
+    &RMD_ROOT_ONLY,
+    &RMD_SOME,
+    &PMD_DEFAULT,
+    NULL,
+};
+
+static const int64_t RUB_SOME = 1700000000;
+static const int64_t RUB_MAX = INT64_MAX;
+
+static const void * const RUB_VALIDS[] = {
+    &RUB_SOME,
+    &RUB_MAX,
+    &PUB_DEFAULT,
+    NULL,
+};
+
 static const void * const * const RBPO_VALIDS[] = {
     [BO_INDEX(RBH_PBO_STATX_SYNC_TYPE)] = RSST_VALIDS,
+    [BO_INDEX(RBH_PBO_WALKER_THREADS)] = RWT_VALIDS,
+    [BO_INDEX(RBH_PBO_PRUNE_FILTER)] = RPF_VALIDS,
+    [BO_INDEX(RBH_PBO_MAX_DEPTH)] = RMD_VALIDS,
+    [BO_INDEX(RBH_PBO_UNCHANGED_BEFORE)] = RUB_VALIDS,
 };
 
 START_TEST(pbo_set_valids)
@@ -355,6 +1318,27 @@ unit_suite(void)
                                 unchecked_teardown_tmpdir);
     tcase_add_test(tests, pf_missing_root);
     tcase_add_test(tests, pf_empty_root);
+    tcase_add_loop_test(tests, pf_walker_threads, 1, 5);
+    tcase_add_loop_test(tests, pf_walker_partitions, 1, 5);
+    tcase_add_loop_test(tests, pf_walker_by_handle, 1, 3);
+    tcase_add_loop_test(tests, pf_projection, 0, 2);
+    tcase_add_loop_test(tests, pf_filter, 0, 2);
+    tcase_add_loop_test(tests, pf_skip_limit, 0, 2);
+    tcase_add_loop_test(tests, pf_sort, 0, 2);
+    tcase_add_loop_test(tests, pf_prune, 0, 2);
+    tcase_add_loop_test(tests, pf_unchanged, 0, 2);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("sort");
+    tcase_add_loop_test(tests, psi_resume, 0, 2);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rescan");
+    tcase_add_unchecked_fixture(tests, unchecked_setup_tmpdir,
+                                unchecked_teardown_tmpdir);
+    tcase_add_test(tests, prn_basic);
 
     suite_add_tcase(suite, tests);
 
@@ -0,0 +1,551 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "check-compat.h"
+#include "robinhood/backend.h"
+#include "robinhood/report.h"
+#include "robinhood/statx.h"
+
+/*----------------------------------------------------------------------------*
+ |                                test backend                                |
+ *----------------------------------------------------------------------------*/
+
+/* uid = index % 3, size = base + index, the name is only set for even indexes
+ */
+#define SOURCE_SIZE 30
+
+struct source_iterator {
+    struct rbh_mut_iterator iterator;
+    uint64_t base;
+    size_t index;
+};
+
+static void *
+source_iter_next(void *iterator)
+{
+    struct source_iterator *source = iterator;
+    const struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_UID | RBH_STATX_SIZE,
+        .stx_uid = source->index % 3,
+        .stx_size = source->base + source->index,
+    };
+    const struct rbh_id id = {
+        .data = (const char *)&source->index,
+        .size = sizeof(source->index),
+    };
+    struct rbh_fsentry *fsentry;
+
+    if (source->index == SOURCE_SIZE) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    fsentry = rbh_fsentry_new(&id, NULL, source->index % 2 ? NULL : "name",
+                              &statx, NULL, NULL, NULL);
+    ck_assert_ptr_nonnull(fsentry);
+    source->index++;
+    return fsentry;
+}
+
+static const struct rbh_mut_iterator_operations SOURCE_ITER_OPS = {
+    .next = source_iter_next,
+    .destroy = free,
+};
+
+static struct rbh_mut_iterator *
+source_filter(void *backend, const struct rbh_filter *filter,
+              const struct rbh_filter_options *options)
+{
+    struct source_iterator *source;
+
+    /* Only the fields the report needs are projected */
+    ck_assert(!(options->projection.fsentry_mask & RBH_FP_ID));
+
+    source = calloc(1, sizeof(*source));
+    ck_assert_ptr_nonnull(source);
+
+    source->iterator.ops = &SOURCE_ITER_OPS;
+    return &source->iterator;
+}
+
+static const struct rbh_backend_operations SOURCE_OPS = {
+    .filter = source_filter,
+};
+
+static struct rbh_backend SOURCE = {
+    .id = UINT8_MAX,
+    .ops = &SOURCE_OPS,
+};
+
+/* Sizes big enough for their sum not to fit in an int64_t */
+static struct rbh_mut_iterator *
+huge_source_filter(void *backend, const struct rbh_filter *filter,
+                   const struct rbh_filter_options *options)
+{
+    struct rbh_mut_iterator *iterator;
+    struct source_iterator *source;
+
+    iterator = source_filter(backend, filter, options);
+    source = (struct source_iterator *)iterator;
+    source->base = INT64_MAX / 4;
+    return iterator;
+}
+
+static const struct rbh_backend_operations HUGE_SOURCE_OPS = {
+    .filter = huge_source_filter,
+};
+
+static struct rbh_backend HUGE_SOURCE = {
+    .id = UINT8_MAX,
+    .ops = &HUGE_SOURCE_OPS,
+};
+
+static void
+assert_integer_eq(const struct rbh_value *value, int64_t expected)
+{
+    ck_assert_ptr_nonnull(value);
+    switch (value->type) {
+    case RBH_VT_UINT32:
+        ck_assert_int_eq(value->uint32, expected);
+        break;
+    case RBH_VT_INT64:
+        ck_assert_int_eq(value->int64, expected);
+        break;
+    case RBH_VT_UINT64:
+        ck_assert_int_eq(value->uint64, expected);
+        break;
+    default:
+        ck_abort();
+    }
+}
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_report_validate()                            |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rrv_valid)
+{
+    const int64_t boundaries[] = { 0, 10, 20 };
+    const struct rbh_report_group groups[] = {
+        {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .buckets = {
+                .boundaries = boundaries,
+                .count = 3,
+            },
+        },
+    };
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_COUNT,
+        },
+    };
+    const struct rbh_report report = {
+        .groups = {
+            .items = groups,
+            .count = 1,
+        },
+        .outputs = {
+            .items = outputs,
+            .count = 1,
+        },
+    };
+
+    ck_assert_int_eq(rbh_report_validate(&report), 0);
+}
+END_TEST
+
+START_TEST(rrv_unsorted_boundaries)
+{
+    const int64_t boundaries[] = { 0, 10, 10 };
+    const struct rbh_report_group groups[] = {
+        {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .buckets = {
+                .boundaries = boundaries,
+                .count = 3,
+            },
+        },
+    };
+    const struct rbh_report report = {
+        .groups = {
+            .items = groups,
+            .count = 1,
+        },
+    };
+
+    errno = 0;
+    ck_assert_int_eq(rbh_report_validate(&report), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+START_TEST(rrv_invalid_output)
+{
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_SUM,
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_ALL,
+            },
+        },
+    };
+    const struct rbh_report report = {
+        .outputs = {
+            .items = outputs,
+            .count = 1,
+        },
+    };
+
+    errno = 0;
+    ck_assert_int_eq(rbh_report_validate(&report), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                           rbh_report_row_new()                             |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rrrn_basic)
+{
+    const struct rbh_value string = {
+        .type = RBH_VT_STRING,
+        .string = "abcdefg",
+    };
+    const struct rbh_value uint64 = {
+        .type = RBH_VT_UINT64,
+        .uint64 = 42,
+    };
+    const struct rbh_value *keys[] = { &string, NULL };
+    const struct rbh_value *values[] = { &uint64 };
+    struct rbh_report_row *row;
+
+    row = rbh_report_row_new(keys, 2, values, 1);
+    ck_assert_ptr_nonnull(row);
+
+    ck_assert_ptr_ne(row->keys[0], &string);
+    ck_assert_int_eq(row->keys[0]->type, RBH_VT_STRING);
+    ck_assert_ptr_ne(row->keys[0]->string, string.string);
+    ck_assert_str_eq(row->keys[0]->string, string.string);
+    ck_assert_ptr_null(row->keys[1]);
+    ck_assert_ptr_ne(row->values[0], &uint64);
+    ck_assert_int_eq(row->values[0]->type, RBH_VT_UINT64);
+    ck_assert_uint_eq(row->values[0]->uint64, 42);
+
+    free(row);
+}
+END_TEST
+
+/*----------------------------------------------------------------------------*
+ |                            rbh_backend_report()                            |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rbr_per_uid)
+{
+    const struct rbh_filter_field size = {
+        .fsentry = RBH_FP_STATX,
+        .statx = RBH_STATX_SIZE,
+    };
+    const struct rbh_report_group groups[] = {
+        {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_UID,
+            },
+        },
+    };
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_COUNT,
+        },
+        {
+            .accumulator = RBH_RA_SUM,
+            .field = size,
+        },
+        {
+            .accumulator = RBH_RA_MIN,
+            .field = size,
+        },
+        {
+            .accumulator = RBH_RA_MAX,
+            .field = size,
+        },
+    };
+    const struct rbh_report report = {
+        .groups = {
+            .items = groups,
+            .count = 1,
+        },
+        .outputs = {
+            .items = outputs,
+            .count = 4,
+        },
+    };
+    struct rbh_mut_iterator *rows;
+    struct rbh_report_row *row;
+
+    rows = rbh_backend_report(&SOURCE, NULL, &report);
+    ck_assert_ptr_nonnull(rows);
+
+    for (int64_t uid = 0; uid < 3; uid++) {
+        int64_t count = SOURCE_SIZE / 3;
+        int64_t max = SOURCE_SIZE - 3 + uid;
+
+        row = rbh_mut_iter_next(rows);
+        ck_assert_ptr_nonnull(row);
+
+        assert_integer_eq(row->keys[0], uid);
+        assert_integer_eq(row->values[0], count);
+        assert_integer_eq(row->values[1], (uid + max) * count / 2);
+        assert_integer_eq(row->values[2], uid);
+        assert_integer_eq(row->values[3], max);
+        free(row);
+    }
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_mut_iter_next(rows));
+    ck_assert_int_eq(errno, ENODATA);
+
+    rbh_mut_iter_destroy(rows);
+}
+END_TEST
+
+START_TEST(rbr_histogram)
+{
+    const int64_t boundaries[] = { 5, 10, 20 };
+    const struct rbh_report_group groups[] = {
+        {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+            .buckets = {
+                .boundaries = boundaries,
+                .count = 3,
+            },
+        },
+    };
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_COUNT,
+        },
+    };
+    const struct rbh_report report = {
+        .groups = {
+            .items = groups,
+            .count = 1,
+        },
+        .outputs = {
+            .items = outputs,
+            .count = 1,
+        },
+    };
+    const int64_t counts[] = { 5, 5, 10, SOURCE_SIZE - 20 };
+    struct rbh_mut_iterator *rows;
+    struct rbh_report_row *row;
+
+    rows = rbh_backend_report(&SOURCE, NULL, &report);
+    ck_assert_ptr_nonnull(rows);
+
+    /* Sizes lower than the first boundary are grouped under a missing key */
+    row = rbh_mut_iter_next(rows);
+    ck_assert_ptr_nonnull(row);
+    ck_assert_ptr_null(row->keys[0]);
+    assert_integer_eq(row->values[0], counts[0]);
+    free(row);
+
+    for (size_t i = 0; i < 3; i++) {
+        row = rbh_mut_iter_next(rows);
+        ck_assert_ptr_nonnull(row);
+        assert_integer_eq(row->keys[0], boundaries[i]);
+        assert_integer_eq(row->values[0], counts[i + 1]);
+        free(row);
+    }
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_mut_iter_next(rows));
+    ck_assert_int_eq(errno, ENODATA);
+
+    rbh_mut_iter_destroy(rows);
+}
+END_TEST
+
+START_TEST(rbr_missing)
+{
+    const struct rbh_filter_field name = {
+        .fsentry = RBH_FP_NAME,
+    };
+    const struct rbh_report_group groups[] = {
+        {
+            .field = name,
+        },
+    };
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_COUNT,
+        },
+        {
+            .accumulator = RBH_RA_MIN,
+            .field = name,
+        },
+    };
+    const struct rbh_report report = {
+        .groups = {
+            .items = groups,
+            .count = 1,
+        },
+        .outputs = {
+            .items = outputs,
+            .count = 2,
+        },
+    };
+    struct rbh_mut_iterator *rows;
+    struct rbh_report_row *row;
+
+    rows = rbh_backend_report(&SOURCE, NULL, &report);
+    ck_assert_ptr_nonnull(rows);
+
+    row = rbh_mut_iter_next(rows);
+    ck_assert_ptr_nonnull(row);
+    ck_assert_ptr_null(row->keys[0]);
+    assert_integer_eq(row->values[0], SOURCE_SIZE / 2);
+    ck_assert_ptr_null(row->values[1]);
+    free(row);
+
+    row = rbh_mut_iter_next(rows);
+    ck_assert_ptr_nonnull(row);
+    ck_assert_int_eq(row->keys[0]->type, RBH_VT_STRING);
+    ck_assert_str_eq(row->keys[0]->string, "name");
+    assert_integer_eq(row->values[0], SOURCE_SIZE / 2);
+    ck_assert_str_eq(row->values[1]->string, "name");
+    free(row);
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_mut_iter_next(rows));
+    ck_assert_int_eq(errno, ENODATA);
+
+    rbh_mut_iter_destroy(rows);
+}
+END_TEST
+
+START_TEST(rbr_no_group)
+{
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_COUNT,
+        },
+    };
+    const struct rbh_report report = {
+        .outputs = {
+            .items = outputs,
+            .count = 1,
+        },
+    };
+    struct rbh_mut_iterator *rows;
+    struct rbh_report_row *row;
+
+    rows = rbh_backend_report(&SOURCE, NULL, &report);
+    ck_assert_ptr_nonnull(rows);
+
+    row = rbh_mut_iter_next(rows);
+    ck_assert_ptr_nonnull(row);
+    assert_integer_eq(row->values[0], SOURCE_SIZE);
+    free(row);
+
+    /* Destroy the iterator before it is exhausted */
+    rbh_mut_iter_destroy(rows);
+}
+END_TEST
+
+START_TEST(rbr_sum_overflow)
+{
+    const struct rbh_report_output outputs[] = {
+        {
+            .accumulator = RBH_RA_SUM,
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_SIZE,
+            },
+        },
+    };
+    const struct rbh_report report = {
+        .outputs = {
+            .items = outputs,
+            .count = 1,
+        },
+    };
+
+    errno = 0;
+    ck_assert_ptr_null(rbh_backend_report(&HUGE_SOURCE, NULL, &report));
+    ck_assert_int_eq(errno, EOVERFLOW);
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("report");
+    tests = tcase_create("rbh_report_validate");
+    tcase_add_test(tests, rrv_valid);
+    tcase_add_test(tests, rrv_unsorted_boundaries);
+    tcase_add_test(tests, rrv_invalid_output);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_report_row_new");
+    tcase_add_test(tests, rrrn_basic);
+
+    suite_add_tcase(suite, tests);
+
+    tests = tcase_create("rbh_backend_report");
+    tcase_add_test(tests, rbr_per_uid);
+    tcase_add_test(tests, rbr_histogram);
+    tcase_add_test(tests, rbr_missing);
+    tcase_add_test(tests, rbr_no_group);
+    tcase_add_test(tests, rbr_sum_overflow);
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
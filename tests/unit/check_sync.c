@@ -0,0 +1,381 @@
+/* This file is part of the RobinHood Library
+ * Copyright (C) 2024 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "check-compat.h"
+#include "robinhood/backend.h"
+#include "robinhood/fsevent.h"
+#include "robinhood/statx.h"
+#include "robinhood/sync.h"
+
+/*----------------------------------------------------------------------------*
+ |                                test backends                               |
+ *----------------------------------------------------------------------------*/
+
+#define SOURCE_SIZE 10000
+
+struct source_iterator {
+    struct rbh_mut_iterator iterator;
+    size_t index;
+};
+
+static void *
+source_iter_next(void *iterator)
+{
+    struct source_iterator *source = iterator;
+    const struct rbh_statx statx = {
+        .stx_mask = RBH_STATX_TYPE,
+        .stx_mode = S_IFREG,
+    };
+    const struct rbh_id parent_id = {
+        .data = "parent",
+        .size = sizeof("parent"),
+    };
+    const struct rbh_id id = {
+        .data = (const char *)&source->index,
+        .size = sizeof(source->index),
+    };
+    struct rbh_fsentry *fsentry;
+
+    if (source->index == SOURCE_SIZE) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    fsentry = rbh_fsentry_new(&id, &parent_id, "name", &statx, NULL, NULL,
+                              NULL);
+    ck_assert_ptr_nonnull(fsentry);
+    source->index++;
+    return fsentry;
+}
+
+static const struct rbh_mut_iterator_operations SOURCE_ITER_OPS = {
+    .next = source_iter_next,
+    .destroy = free,
+};
+
+static struct rbh_mut_iterator *
+source_filter(void *backend, const struct rbh_filter *filter,
+              const struct rbh_filter_options *options)
+{
+    struct source_iterator *source;
+
+    source = calloc(1, sizeof(*source));
+    ck_assert_ptr_nonnull(source);
+
+    source->iterator.ops = &SOURCE_ITER_OPS;
+    return &source->iterator;
+}
+
+static const struct rbh_backend_operations SOURCE_OPS = {
+    .filter = source_filter,
+};
+
+static struct rbh_backend SOURCE = {
+    .id = UINT8_MAX,
+    .ops = &SOURCE_OPS,
+};
+
+/* Only ever called by the apply stage, no need for locking */
+static struct {
+    size_t upserts;
+    size_t links;
+    size_t ns_xattrs;
+    size_t calls;
+    size_t max_batch;
+    int error;
+} destination;
+
+static ssize_t
+destination_update(void *backend, struct rbh_iterator *fsevents)
+{
+    const struct rbh_fsevent *fsevent;
+    size_t count = 0;
+
+    if (destination.error) {
+        errno = destination.error;
+        return -1;
+    }
+
+    while ((fsevent = rbh_iter_next(fsevents)) != NULL) {
+        switch (fsevent->type) {
+        case RBH_FET_UPSERT:
+            ck_assert_ptr_nonnull(fsevent->upsert.statx);
+            ck_assert_ptr_null(fsevent->upsert.symlink);
+            destination.upserts++;
+            break;
+        case RBH_FET_LINK:
+            ck_assert_str_eq(fsevent->link.name, "name");
+            ck_assert_str_eq(fsevent->link.parent_id->data, "parent");
+            for (size_t i = 0; i < fsevent->xattrs.count; i++)
+                ck_assert(strcmp(fsevent->xattrs.pairs[i].key,
+                                 RBH_NS_XATTR_UNCHANGED));
+            destination.ns_xattrs += fsevent->xattrs.count;
+            destination.links++;
+            break;
+        default:
+            ck_abort();
+        }
+        count++;
+    }
+    ck_assert_int_eq(errno, ENODATA);
+
+    destination.calls++;
+    if (count > destination.max_batch)
+        destination.max_batch = count;
+    return count;
+}
+
+static const struct rbh_backend_operations DESTINATION_OPS = {
+    .update = destination_update,
+};
+
+static struct rbh_backend DESTINATION = {
+    .id = UINT8_MAX,
+    .ops = &DESTINATION_OPS,
+};
+
+/*----------------------------------------------------------------------------*
+ |                                  rbh_sync                                  |
+ *----------------------------------------------------------------------------*/
+
+START_TEST(rs_basic)
+{
+    const struct rbh_sync_options options = {
+        .convert_threads = 4,
+        .queue_size = 1,
+        .batch_size = 7,
+    };
+    struct rbh_sync_stats stats;
+    struct rbh_sync *sync;
+
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, &options);
+    ck_assert_ptr_nonnull(sync);
+
+    ck_assert_int_eq(rbh_sync_wait(sync), 2 * SOURCE_SIZE);
+    ck_assert_uint_eq(destination.upserts, SOURCE_SIZE);
+    ck_assert_uint_eq(destination.links, SOURCE_SIZE);
+    ck_assert_uint_le(destination.max_batch, options.batch_size);
+
+    rbh_sync_stats(sync, &stats);
+    ck_assert_uint_eq(stats.applied, 2 * SOURCE_SIZE);
+    ck_assert_uint_eq(stats.stages[RBH_SS_WALK].threads, 1);
+    ck_assert_uint_eq(stats.stages[RBH_SS_WALK].items, SOURCE_SIZE);
+    ck_assert_uint_eq(stats.stages[RBH_SS_ENRICH].threads, 0);
+    ck_assert_uint_eq(stats.stages[RBH_SS_ENRICH].items, 0);
+    ck_assert_uint_eq(stats.stages[RBH_SS_CONVERT].threads, 4);
+    ck_assert_uint_eq(stats.stages[RBH_SS_CONVERT].items, SOURCE_SIZE);
+    ck_assert_uint_eq(stats.stages[RBH_SS_APPLY].items, 2 * SOURCE_SIZE);
+
+    ck_assert_uint_eq(stats.queues[RBH_SS_WALK].capacity, 0);
+    ck_assert_uint_eq(stats.queues[RBH_SS_ENRICH].capacity, 0);
+    for (int i = RBH_SS_CONVERT; i <= RBH_SS_APPLY; i++) {
+        ck_assert_uint_ge(stats.queues[i].capacity, options.queue_size);
+        ck_assert_uint_eq(stats.queues[i].count, 0);
+        ck_assert_uint_gt(stats.queues[i].peak, 0);
+        ck_assert_uint_le(stats.queues[i].peak, stats.queues[i].capacity);
+    }
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+static int
+drop_parent(struct rbh_fsentry **fsentry, void *arg)
+{
+    struct rbh_fsentry *enriched;
+
+    __atomic_add_fetch((size_t *)arg, 1, __ATOMIC_RELAXED);
+
+    enriched = rbh_fsentry_new(&(*fsentry)->id, NULL, NULL,
+                               (*fsentry)->statx, NULL, NULL, NULL);
+    if (enriched == NULL)
+        return -1;
+
+    free(*fsentry);
+    *fsentry = enriched;
+    return 0;
+}
+
+START_TEST(rs_enrich)
+{
+    size_t enriched = 0;
+    const struct rbh_sync_options options = {
+        .enrich = drop_parent,
+        .enrich_arg = &enriched,
+        .enrich_threads = 3,
+    };
+    struct rbh_sync_stats stats;
+    struct rbh_sync *sync;
+
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, &options);
+    ck_assert_ptr_nonnull(sync);
+
+    ck_assert_int_eq(rbh_sync_wait(sync), SOURCE_SIZE);
+    ck_assert_uint_eq(enriched, SOURCE_SIZE);
+    ck_assert_uint_eq(destination.upserts, SOURCE_SIZE);
+    ck_assert_uint_eq(destination.links, 0);
+
+    rbh_sync_stats(sync, &stats);
+    ck_assert_uint_eq(stats.stages[RBH_SS_ENRICH].threads, 3);
+    ck_assert_uint_eq(stats.stages[RBH_SS_ENRICH].items, SOURCE_SIZE);
+    ck_assert_uint_gt(stats.queues[RBH_SS_ENRICH].capacity, 0);
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+/* Mark every fsentry as a scan would an unchanged directory */
+static int
+mark_unchanged(struct rbh_fsentry **fsentry, void *arg)
+{
+    static const struct rbh_value TRUE = {
+        .type = RBH_VT_BOOLEAN,
+        .boolean = true,
+    };
+    const struct rbh_value_pair pairs[] = {
+        { .key = "before", .value = &TRUE },
+        { .key = RBH_NS_XATTR_UNCHANGED, .value = &TRUE },
+        { .key = "after", .value = &TRUE },
+    };
+    const struct rbh_value_map ns_xattrs = {
+        .pairs = pairs,
+        .count = sizeof(pairs) / sizeof(*pairs),
+    };
+    struct rbh_fsentry *marked;
+
+    marked = rbh_fsentry_new(&(*fsentry)->id, &(*fsentry)->parent_id,
+                             (*fsentry)->name, (*fsentry)->statx, &ns_xattrs,
+                             NULL, NULL);
+    if (marked == NULL)
+        return -1;
+
+    free(*fsentry);
+    *fsentry = marked;
+    return 0;
+}
+
+START_TEST(rs_unchanged)
+{
+    const struct rbh_sync_options options = {
+        .enrich = mark_unchanged,
+    };
+    struct rbh_sync *sync;
+
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, &options);
+    ck_assert_ptr_nonnull(sync);
+
+    ck_assert_int_eq(rbh_sync_wait(sync), 2 * SOURCE_SIZE);
+    ck_assert_uint_eq(destination.links, SOURCE_SIZE);
+    /* The other namespace xattrs are kept */
+    ck_assert_uint_eq(destination.ns_xattrs, 2 * SOURCE_SIZE);
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+START_TEST(rs_update_error)
+{
+    struct rbh_sync *sync;
+
+    destination.error = EIO;
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, NULL);
+    ck_assert_ptr_nonnull(sync);
+
+    errno = 0;
+    ck_assert_int_eq(rbh_sync_wait(sync), -1);
+    ck_assert_int_eq(errno, EIO);
+    ck_assert_uint_eq(destination.calls, 0);
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+static int
+fail_enrich(struct rbh_fsentry **fsentry, void *arg)
+{
+    errno = EPERM;
+    return -1;
+}
+
+START_TEST(rs_enrich_error)
+{
+    const struct rbh_sync_options options = {
+        .enrich = fail_enrich,
+        .enrich_threads = 2,
+    };
+    struct rbh_sync *sync;
+
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, &options);
+    ck_assert_ptr_nonnull(sync);
+
+    errno = 0;
+    ck_assert_int_eq(rbh_sync_wait(sync), -1);
+    ck_assert_int_eq(errno, EPERM);
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+START_TEST(rs_destroy_running)
+{
+    const struct rbh_sync_options options = {
+        .queue_size = 1,
+    };
+    struct rbh_sync *sync;
+
+    sync = rbh_sync_new(&SOURCE, &DESTINATION, &options);
+    ck_assert_ptr_nonnull(sync);
+
+    rbh_sync_destroy(sync);
+}
+END_TEST
+
+static Suite *
+unit_suite(void)
+{
+    Suite *suite;
+    TCase *tests;
+
+    suite = suite_create("sync");
+    tests = tcase_create("rbh_sync");
+    tcase_add_test(tests, rs_basic);
+    tcase_add_test(tests, rs_enrich);
+    tcase_add_test(tests, rs_unchanged);
+    tcase_add_test(tests, rs_update_error);
+    tcase_add_test(tests, rs_enrich_error);
+    tcase_add_test(tests, rs_destroy_running);
+
+    suite_add_tcase(suite, tests);
+
+    return suite;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = unit_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}